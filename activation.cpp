@@ -4,6 +4,7 @@
 #include "item_updater.hpp"
 #include "msl_verify.hpp"
 #include "serialize.hpp"
+#include "utils.hpp"
 
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/post.hpp>
@@ -14,8 +15,16 @@
 #include <xyz/openbmc_project/Common/error.hpp>
 #include <xyz/openbmc_project/Software/Version/error.hpp>
 
+#include <filesystem>
+
 #ifdef WANT_SIGNATURE_VERIFY
 #include "image_verify.hpp"
+
+#include <sys/eventfd.h>
+#include <systemd/sd-bus.h>
+#include <unistd.h>
+
+#include <chrono>
 #endif
 
 extern boost::asio::io_context& getIOContext();
@@ -33,9 +42,12 @@ PHOSPHOR_LOG2_USING;
 using namespace phosphor::logging;
 using InternalFailure =
     sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure;
+using NotAllowed = sdbusplus::xyz::openbmc_project::Common::Error::NotAllowed;
+using Reason = xyz::openbmc_project::Common::NotAllowed::REASON;
 
 #ifdef WANT_SIGNATURE_VERIFY
 namespace control = sdbusplus::xyz::openbmc_project::Control::server;
+using VerifyResultProp = softwareServer::Verification::Result;
 #endif
 
 void Activation::subscribeToSystemdSignals()
@@ -82,6 +94,23 @@ void Activation::unsubscribeFromSystemdSignals()
 
 auto Activation::activation(Activations value) -> Activations
 {
+    auto result = setActivation(value);
+    parent.indexState(versionId);
+    return result;
+}
+
+auto Activation::setActivation(Activations value) -> Activations
+{
+    if ((value != softwareServer::Activation::Activations::Activating) &&
+        (softwareServer::Activation::activation() ==
+         softwareServer::Activation::Activations::Activating))
+    {
+        // The activation has ended, there is nothing left to resume
+        removeJournal(versionId);
+        std::lock_guard lock(journalMutex);
+        journal = {};
+    }
+
     if ((value != softwareServer::Activation::Activations::Active) &&
         (value != softwareServer::Activation::Activations::Activating))
     {
@@ -91,8 +120,15 @@ auto Activation::activation(Activations value) -> Activations
     if (value == softwareServer::Activation::Activations::Activating)
     {
 #ifdef WANT_SIGNATURE_VERIFY
-        fs::path uploadDir(IMG_UPLOAD_DIR);
-        if (!verifySignature(uploadDir / versionId, SIGNED_IMAGE_CONF_PATH))
+#ifdef PIPELINED_ACTIVATION
+        // BMC images are verified while they are written, see onVerified()
+        bool verifyFirst =
+            parent.versions.find(versionId)->second->purpose() ==
+            VersionPurpose::Host;
+#else
+        constexpr bool verifyFirst = true;
+#endif
+        if (verifyFirst && !checkSignature())
         {
             onVerifyFailed();
             // Stop the activation process, if fieldMode is enabled.
@@ -145,6 +181,13 @@ auto Activation::activation(Activations value) -> Activations
                 softwareServer::Activation::Activations::Failed);
         }
 
+        if (parent.isDowngrade(versionStr))
+        {
+            info("Activating version {VERSION}, which is older than the "
+                 "running BMC version.",
+                 "VERSION", versionStr);
+        }
+
         if (!activationProgress)
         {
             activationProgress =
@@ -153,18 +196,79 @@ auto Activation::activation(Activations value) -> Activations
 
         if (!activationBlocksTransition)
         {
-            activationBlocksTransition =
-                std::make_unique<ActivationBlocksTransition>(bus, path);
+            try
+            {
+                activationBlocksTransition =
+                    std::make_unique<ActivationBlocksTransition>(bus, path);
+            }
+            catch (const std::filesystem::filesystem_error& e)
+            {
+                // A reboot could interrupt the write
+                error("Failed to block reboots while activating {VERSIONID}: "
+                      "{ERROR}",
+                      "VERSIONID", versionId, "ERROR", e);
+                return softwareServer::Activation::activation(
+                    softwareServer::Activation::Activations::Failed);
+            }
+        }
+
+        if (!activationCancel)
+        {
+            activationCancel =
+                std::make_unique<ActivationCancel>(bus, path, *this);
         }
 
         activationProgress->progress(10);
 
+#ifdef PIPELINED_ACTIVATION
+        // Other versions are only deleted to make room for an image that
+        // passed verification, the write waits for it when it needs room.
+        writeDeferred = !parent.getEvictions(*this).empty();
+        if (!writeDeferred)
+        {
+            parent.freeSpace(*this);
+        }
+#else
         parent.freeSpace(*this);
+#endif
+
+#if defined UBIFS_LAYOUT || defined MMC_LAYOUT
+        {
+            // Record the activation so it can be resumed if the updater is
+            // restarted before it completes.
+            const auto& version = parent.versions.find(versionId)->second;
+            std::lock_guard lock(journalMutex);
+            journal.version = version->version();
+            journal.extendedVersion = version->extendedVersion();
+            journal.purpose = version->purpose();
+            journal.filePath = version->path();
+        }
+        saveJournal();
+#endif
 
         // Enable systemd signals
         Activation::subscribeToSystemdSignals();
 
+#ifdef PIPELINED_ACTIVATION
+        verifyPending = true;
+        startVerify();
+        if (verifier.joinable())
+        {
+            boostVerify();
+        }
+        else
+        {
+            // The result for the files is known, or could not be obtained
+            // in the background.
+            boost::asio::post(getIOContext(), [this]() { onVerified(); });
+        }
+        if (!writeDeferred)
+        {
+            flashWrite();
+        }
+#else
         flashWrite();
+#endif
 
 #if defined UBIFS_LAYOUT || defined MMC_LAYOUT
 
@@ -181,6 +285,7 @@ auto Activation::activation(Activations value) -> Activations
     {
         activationBlocksTransition.reset(nullptr);
         activationProgress.reset(nullptr);
+        activationCancel.reset(nullptr);
     }
     return softwareServer::Activation::activation(value);
 }
@@ -191,9 +296,11 @@ void Activation::onFlashWriteSuccess()
 
     activationBlocksTransition.reset(nullptr);
     activationProgress.reset(nullptr);
+    activationCancel.reset(nullptr);
 
     rwVolumeCreated = false;
     roVolumeCreated = false;
+    ubootWritten = false;
     ubootEnvVarsUpdated = false;
     Activation::unsubscribeFromSystemdSignals();
 
@@ -226,10 +333,158 @@ void Activation::onFlashWriteSuccess()
     }
 
     activation(softwareServer::Activation::Activations::Active);
+    parent.updateCatalogue();
+    parent.updateFlashHealth();
+}
+
+void Activation::cancel()
+{
+    if (softwareServer::Activation::activation() !=
+        softwareServer::Activation::Activations::Activating)
+    {
+        elog<NotAllowed>(Reason("The version is not activating"));
+    }
+
+    bool committing = roVolumeCreated;
+#ifdef PIPELINED_ACTIVATION
+    // Nothing is committed while the image is still being verified
+    committing = committing && !verifyPending;
+#endif
+    if (committing)
+    {
+        // The image is written and the U-Boot environment is being switched
+        // to it, there is nothing left to cancel safely.
+        elog<NotAllowed>(Reason("The image has already been written"));
+    }
+
+    info("Cancelling the activation of {VERSIONID}", "VERSIONID", versionId);
+
+    // Ignore the state changes of the services that are stopped
+    unsubscribeFromSystemdSignals();
+#ifdef PIPELINED_ACTIVATION
+    // The verification completes in the background, its result is kept
+    verifyPending = false;
+    if (!writeDeferred)
+    {
+        flashCancel();
+    }
+    writeDeferred = false;
+#else
+    flashCancel();
+#endif
+
+    rwVolumeCreated = false;
+    roVolumeCreated = false;
+    ubootWritten = false;
+    ubootEnvVarsUpdated = false;
+
+    // This runs in the Cancel method call of activationCancel, so keep the
+    // object until the call has returned.
+    boost::asio::post(getIOContext(),
+                      [cancelObject = std::shared_ptr<ActivationCancel>(
+                           std::move(activationCancel))]() {});
+
+    // Returning to Ready releases the reboot guard, and allows the version
+    // to be activated again.
+    softwareServer::Activation::requestedActivation(
+        softwareServer::Activation::RequestedActivations::None);
+    activation(softwareServer::Activation::Activations::Ready);
+}
+
+void Activation::resume(const ActivationJournal& saved)
+{
+    info("Resuming the interrupted activation of {VERSIONID}", "VERSIONID",
+         versionId);
+
+    rwVolumeCreated = saved.rwVolumeCreated;
+    roVolumeCreated = saved.roVolumeCreated;
+    ubootWritten = false;
+    ubootEnvVarsUpdated = saved.ubootEnvVarsUpdated;
+    {
+        std::lock_guard lock(journalMutex);
+        journal = saved;
+    }
+
+    softwareServer::Activation::requestedActivation(
+        softwareServer::Activation::RequestedActivations::Active);
+    activation(softwareServer::Activation::Activations::Activating);
+}
+
+#if defined UBIFS_LAYOUT || defined MMC_LAYOUT
+void Activation::resumeCommit(const ActivationJournal& saved)
+{
+    info("Committing the interrupted activation of {VERSIONID}", "VERSIONID",
+         versionId);
+
+    rwVolumeCreated = true;
+    roVolumeCreated = true;
+    // U-Boot is written again if the image is still there, it is only
+    // written once the volumes are so it may not have been.
+    std::error_code ec;
+    ubootWritten = !std::filesystem::is_directory(saved.filePath, ec);
+    ubootEnvVarsUpdated = false;
+    {
+        std::lock_guard lock(journalMutex);
+        journal = saved;
+    }
+
+    if (!activationProgress)
+    {
+        activationProgress = std::make_unique<ActivationProgress>(bus, path);
+    }
+    if (!activationBlocksTransition)
+    {
+        try
+        {
+            activationBlocksTransition =
+                std::make_unique<ActivationBlocksTransition>(bus, path);
+        }
+        catch (const std::filesystem::filesystem_error& e)
+        {
+            // Committing the priority is short, do it anyway
+            error("Failed to block reboots while committing {VERSIONID}: "
+                  "{ERROR}",
+                  "VERSIONID", versionId, "ERROR", e);
+        }
+    }
+    subscribeToSystemdSignals();
+
+    // The priority restored for the version may never have reached the
+    // U-Boot environment, set it again. The associations of an installed
+    // version are created again once it is committed.
+    redundancyPriority.reset(nullptr);
+    parent.removeAssociations(path);
+    softwareServer::Activation::requestedActivation(
+        softwareServer::Activation::RequestedActivations::Active);
+    softwareServer::Activation::activation(
+        softwareServer::Activation::Activations::Activating);
+    parent.indexState(versionId);
+    onVolumesCreated();
+}
+#endif
+
+void Activation::saveJournal()
+{
+    std::lock_guard lock(journalMutex);
+    journal.rwVolumeCreated = rwVolumeCreated;
+    journal.roVolumeCreated = roVolumeCreated;
+    journal.ubootEnvVarsUpdated = ubootEnvVarsUpdated;
+    storeJournal(versionId, journal);
+}
+
+void Activation::checkpointJournal(const std::string& image, uint64_t written)
+{
+    std::lock_guard lock(journalMutex);
+    journal.written[image] = written;
+    storeJournal(versionId, journal);
 }
 
 void Activation::deleteImageManagerObject()
 {
+#ifdef SINGLE_BINARY
+    // The image manager has no object of its own for the version
+    getHandoffQueue().release(versionId);
+#else
     // Call the Delete object for <versionID> inside image_manager
     auto method = this->bus.new_method_call(VERSION_BUSNAME, path.c_str(),
                                             "xyz.openbmc_project.Object.Delete",
@@ -244,6 +499,7 @@ void Activation::deleteImageManagerObject()
               "PATH", path, "ERROR", e);
         return;
     }
+#endif
 }
 
 auto Activation::requestedActivation(RequestedActivations value)
@@ -251,6 +507,7 @@ auto Activation::requestedActivation(RequestedActivations value)
 {
     rwVolumeCreated = false;
     roVolumeCreated = false;
+    ubootWritten = false;
     ubootEnvVarsUpdated = false;
 
     if ((value == softwareServer::Activation::RequestedActivations::Active) &&
@@ -269,6 +526,11 @@ auto Activation::requestedActivation(RequestedActivations value)
     return softwareServer::Activation::requestedActivation(value);
 }
 
+void ActivationCancel::cancel()
+{
+    parent.cancel();
+}
+
 uint8_t RedundancyPriority::priority(uint8_t value)
 {
     // Set the priority value so that the freePriority() function can order
@@ -304,18 +566,70 @@ void Activation::unitStateChange(sdbusplus::message::message& msg)
 
     onStateChanges(msg);
 
+    if ((softwareServer::Activation::activation() ==
+         softwareServer::Activation::Activations::Activating) &&
+        ((rwVolumeCreated != journal.rwVolumeCreated) ||
+         (roVolumeCreated != journal.roVolumeCreated) ||
+         (ubootEnvVarsUpdated != journal.ubootEnvVarsUpdated)))
+    {
+        saveJournal();
+    }
+
     return;
 }
 
+Activation::~Activation()
+{
+#ifdef MMC_LAYOUT
+    // The writer stops before its next write rather than finish the slot
+    flashWriteCancelled = true;
+#endif
+#ifdef WANT_SIGNATURE_VERIFY
+    if (verifier.joinable())
+    {
+        // At normal priority, so that the verifier gets to see the request
+        verifier.request_stop();
+        boostVerify();
+    }
+#endif
+}
+
 #ifdef WANT_SIGNATURE_VERIFY
 bool Activation::verifySignature(const fs::path& imageDir,
-                                 const fs::path& confDir)
+                                 const fs::path& confDir, std::stop_token stop)
 {
     using Signature = phosphor::software::image::Signature;
 
     Signature signature(imageDir, confDir);
 
-    return signature.verify();
+    return signature.verify(std::move(stop));
+}
+
+bool Activation::checkSignature()
+{
+    waitVerify();
+    if (verifiedUnchanged())
+    {
+        info("Using the verification of {VERSIONID} done in the background",
+             "VERSIONID", versionId);
+        return verified.passed;
+    }
+
+    setVerified(verifyFiles());
+    return verified.passed;
+}
+
+Activation::VerifyResult Activation::verifyFiles(std::stop_token stop)
+{
+    VerifyResult result;
+    auto files = getVerifyFileStates();
+    result.passed = verifySignature(fs::path(IMG_UPLOAD_DIR) / versionId,
+                                    SIGNED_IMAGE_CONF_PATH, std::move(stop));
+    if (getVerifyFileStates() == files)
+    {
+        result.files = std::move(files);
+    }
+    return result;
 }
 
 void Activation::onVerifyFailed()
@@ -323,62 +637,234 @@ void Activation::onVerifyFailed()
     error("Error occurred during image validation");
     report<InternalFailure>();
 }
-#endif
 
-void ActivationBlocksTransition::enableRebootGuard()
+void Activation::startVerify()
 {
-    info("BMC image activating - BMC reboots are disabled.");
+    if (verifier.joinable() || verifiedUnchanged())
+    {
+        return;
+    }
 
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    method.append("reboot-guard-enable.service", "replace");
-    bus.call_noreply(method);
+    if (!verification)
+    {
+        verification = std::make_unique<Verification>(bus, path);
+    }
+    verification->verified(VerifyResultProp::Pending);
+    verification->verifiedTime(0);
+
+    auto fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0)
+    {
+        // The activation verifies the images itself
+        error("Failed to create an eventfd to verify {VERSIONID}: {ERRNO}",
+              "VERSIONID", versionId, "ERRNO", errno);
+        return;
+    }
+
+    // The io_context is single threaded, so the verifier signals completion
+    // through an eventfd.
+    verifyDone = std::make_unique<boost::asio::posix::stream_descriptor>(
+        getIOContext(), fd);
+    verifyUrgent = false;
+    verifierTid = 0;
+    verifier = std::jthread([this, fd](std::stop_token stop) {
+        // Yield the CPU and the disk to everything else until the
+        // activation waits for the result, see boostVerify().
+        utils::setThreadPriority(0, true);
+        verifierTid = gettid();
+        if (verifyUrgent)
+        {
+            utils::setThreadPriority(0, false);
+        }
+
+        try
+        {
+            verifierResult = verifyFiles(stop);
+        }
+        catch (const std::exception& e)
+        {
+            error("Failed to verify {VERSIONID}: {ERROR}", "VERSIONID",
+                  versionId, "ERROR", e);
+            verifierResult = {};
+        }
+
+        uint64_t done = 1;
+        if (::write(fd, &done, sizeof(done)) < 0)
+        {
+            error("Failed to signal the verification of {VERSIONID}: "
+                  "{ERRNO}",
+                  "VERSIONID", versionId, "ERRNO", errno);
+        }
+    });
+
+    verifyDone->async_wait(
+        boost::asio::posix::stream_descriptor::wait_read,
+        [this](const boost::system::error_code& ec) {
+            if (ec || !verifier.joinable())
+            {
+                // The result was collected by waitVerify(), or the
+                // activation destroyed
+                return;
+            }
+            onVerifyDone();
+        });
 }
 
-void ActivationBlocksTransition::disableRebootGuard()
+void Activation::onVerifyDone()
 {
-    info("BMC activation has ended - BMC reboots are re-enabled.");
+    verifier.join();
+    verifyDone.reset();
+    setVerified(std::move(verifierResult));
+#ifdef PIPELINED_ACTIVATION
+    onVerified();
+#endif
+}
 
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    method.append("reboot-guard-disable.service", "replace");
-    bus.call_noreply(method);
+void Activation::waitVerify()
+{
+    if (!verifier.joinable())
+    {
+        return;
+    }
+    boostVerify();
+    verifier.join();
+    verifyDone.reset();
+    setVerified(std::move(verifierResult));
 }
 
-bool Activation::checkApplyTimeImmediate()
+void Activation::boostVerify()
 {
-    auto service = utils::getService(bus, applyTimeObjPath, applyTimeIntf);
-    if (service.empty())
+    verifyUrgent = true;
+    auto tid = verifierTid.load();
+    if (tid != 0)
     {
-        info("Error getting the service name for BMC image ApplyTime. "
-             "The BMC needs to be manually rebooted to complete the image "
-             "activation if needed immediately.");
+        utils::setThreadPriority(tid, false);
     }
-    else
+}
+
+void Activation::setVerified(VerifyResult&& result)
+{
+    verified = std::move(result);
+    if (!verification)
     {
+        verification = std::make_unique<Verification>(bus, path);
+    }
 
-        auto method = bus.new_method_call(service.c_str(), applyTimeObjPath,
-                                          dbusPropIntf, "Get");
-        method.append(applyTimeIntf, applyTimeProp);
+    if (!verified.files)
+    {
+        warning("The images of {VERSIONID} were modified while verified",
+                "VERSIONID", versionId);
+        verification->verified(VerifyResultProp::Pending);
+        verification->verifiedTime(0);
+        return;
+    }
 
-        try
-        {
-            auto reply = bus.call(method);
+    if (!verified.passed)
+    {
+        error("The images of {VERSIONID} failed verification", "VERSIONID",
+              versionId);
+    }
+    verification->verified(verified.passed ? VerifyResultProp::Passed
+                                            : VerifyResultProp::Failed);
+    verification->verifiedTime(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count());
+}
+
+image::FileStates Activation::getVerifyFileStates() const
+{
+    auto states = image::getFileStates(fs::path(IMG_UPLOAD_DIR) / versionId);
+    states.merge(image::getFileStates(SIGNED_IMAGE_CONF_PATH));
+    return states;
+}
+
+bool Activation::verifiedUnchanged() const
+{
+    return verified.files && *verified.files == getVerifyFileStates();
+}
+#endif
 
-            std::variant<std::string> result;
-            reply.read(result);
-            auto applyTime = std::get<std::string>(result);
-            if (applyTime == applyTimeImmediate)
+#ifdef PIPELINED_ACTIVATION
+void Activation::onVerified()
+{
+    if (!verifyPending)
+    {
+        return;
+    }
+    verifyPending = false;
+    if (softwareServer::Activation::activation() !=
+        softwareServer::Activation::Activations::Activating)
+    {
+        return;
+    }
+
+    if (!checkSignature())
+    {
+        onVerifyFailed();
+        if (parent.control::FieldMode::fieldModeEnabled())
+        {
+            // Nothing was committed for the version, drop what was written
+            // of it so the slot is never booted.
+            unsubscribeFromSystemdSignals();
+            if (!writeDeferred)
             {
-                return true;
+                flashCancel();
             }
+            writeDeferred = false;
+            rwVolumeCreated = false;
+            roVolumeCreated = false;
+            ubootWritten = false;
+            ubootEnvVarsUpdated = false;
+            activation(softwareServer::Activation::Activations::Failed);
+            return;
         }
-        catch (const sdbusplus::exception::exception& e)
-        {
-            error("Error in getting ApplyTime: {ERROR}", "ERROR", e);
-        }
     }
-    return false;
+
+    if (writeDeferred)
+    {
+        writeDeferred = false;
+        parent.freeSpace(*this);
+        flashWrite();
+        return;
+    }
+
+    // Commit the version if it finished writing first
+    onVolumesCreated();
+}
+#endif
+
+ActivationBlocksTransition::ActivationBlocksTransition(
+    sdbusplus::bus::bus& bus, const std::string& path) :
+    ActivationBlocksTransitionInherit(bus, path.c_str(),
+                                      action::emit_interface_added),
+    bus(bus),
+    guard(reboot_guard::runtimeUnitDir, [this]() { reloadUnits(); })
+{
+    info("BMC image activating - BMC reboots are disabled.");
+}
+
+ActivationBlocksTransition::~ActivationBlocksTransition()
+{
+    info("BMC activation has ended - BMC reboots are re-enabled.");
+}
+
+void ActivationBlocksTransition::reloadUnits()
+{
+    // Nothing waits for the reply, a failure is only logged
+    auto rc = sd_bus_call_method_async(
+        bus.get(), nullptr, SYSTEMD_BUSNAME, SYSTEMD_PATH, SYSTEMD_INTERFACE,
+        "Reload", nullptr, nullptr, nullptr);
+    if (rc < 0)
+    {
+        error("Failed to reload the systemd units: {RC}", "RC", rc);
+    }
+}
+
+bool Activation::checkApplyTimeImmediate()
+{
+    // ItemUpdater keeps the value up to date, there is no bus call here
+    return parent.isApplyTimeImmediate();
 }
 
 #ifdef HOST_BIOS_UPGRADE
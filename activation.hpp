@@ -3,17 +3,34 @@
 #include "config.h"
 
 #include "flash.hpp"
+#include "reboot_guard.hpp"
+#include "serialize.hpp"
 #include "utils.hpp"
+#include "xyz/openbmc_project/Software/ActivationCancel/server.hpp"
 #include "xyz/openbmc_project/Software/ActivationProgress/server.hpp"
 #include "xyz/openbmc_project/Software/RedundancyPriority/server.hpp"
+#include "xyz/openbmc_project/Software/Verification/server.hpp"
 
 #include <sdbusplus/server.hpp>
 #include <xyz/openbmc_project/Association/Definitions/server.hpp>
 #include <xyz/openbmc_project/Software/Activation/server.hpp>
 #include <xyz/openbmc_project/Software/ActivationBlocksTransition/server.hpp>
 
+#include <mutex>
+
 #ifdef WANT_SIGNATURE_VERIFY
 #include <filesystem>
+#include <optional>
+#endif
+
+#if defined MMC_LAYOUT || defined WANT_SIGNATURE_VERIFY
+#include "images.hpp"
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+#include <atomic>
+#include <stop_token>
+#include <thread>
 #endif
 
 namespace phosphor
@@ -39,6 +56,10 @@ using RedundancyPriorityInherit = sdbusplus::server::object::object<
     sdbusplus::xyz::openbmc_project::Software::server::RedundancyPriority>;
 using ActivationProgressInherit = sdbusplus::server::object::object<
     sdbusplus::xyz::openbmc_project::Software::server::ActivationProgress>;
+using ActivationCancelInherit = sdbusplus::server::object::object<
+    sdbusplus::xyz::openbmc_project::Software::server::ActivationCancel>;
+using VerificationInherit = sdbusplus::server::object::object<
+    sdbusplus::xyz::openbmc_project::Software::server::Verification>;
 
 constexpr auto applyTimeImmediate =
     "xyz.openbmc_project.Software.ApplyTime.RequestedApplyTimes.Immediate";
@@ -128,27 +149,19 @@ class ActivationBlocksTransition : public ActivationBlocksTransitionInherit
      *  @param[in] path   - The Dbus object path
      */
     ActivationBlocksTransition(sdbusplus::bus::bus& bus,
-                               const std::string& path) :
-        ActivationBlocksTransitionInherit(bus, path.c_str(),
-                                          action::emit_interface_added),
-        bus(bus)
-    {
-        enableRebootGuard();
-    }
+                               const std::string& path);
 
-    ~ActivationBlocksTransition()
-    {
-        disableRebootGuard();
-    }
+    ~ActivationBlocksTransition();
 
   private:
     sdbusplus::bus::bus& bus;
 
-    /** @brief Enables a Guard that blocks any BMC reboot commands */
-    void enableRebootGuard();
+    /** @brief Have systemd load the reboot guard, without waiting for it */
+    void reloadUnits();
 
-    /** @brief Disables any guard that was blocking the BMC reboot */
-    void disableRebootGuard();
+    /** @brief Blocks any BMC reboot commands, for the lifetime of the
+     * object */
+    reboot_guard::Guard guard;
 };
 
 class ActivationProgress : public ActivationProgressInherit
@@ -167,6 +180,55 @@ class ActivationProgress : public ActivationProgressInherit
     }
 };
 
+/** @class ActivationCancel
+ *  @brief OpenBMC ActivationCancel implementation.
+ *  @details A concrete implementation for
+ *  xyz.openbmc_project.Software.ActivationCancel DBus API, present while the
+ *  activation is in progress.
+ */
+class ActivationCancel : public ActivationCancelInherit
+{
+  public:
+    /** @brief Constructs ActivationCancel.
+     *
+     * @param[in] bus    - The Dbus bus object
+     * @param[in] path   - The Dbus object path
+     * @param[in] parent - Parent object.
+     */
+    ActivationCancel(sdbusplus::bus::bus& bus, const std::string& path,
+                     Activation& parent) :
+        ActivationCancelInherit(bus, path.c_str(),
+                                action::emit_interface_added),
+        parent(parent)
+    {}
+
+    /** @brief Cancel the activation */
+    void cancel() override;
+
+  private:
+    /** @brief Parent Object. */
+    Activation& parent;
+};
+
+/** @class Verification
+ *  @brief OpenBMC Verification implementation.
+ *  @details A concrete implementation for
+ *  xyz.openbmc_project.Software.Verification DBus API, present once the
+ *  verification of an uploaded image has started.
+ */
+class Verification : public VerificationInherit
+{
+  public:
+    /** @brief Constructs Verification.
+     *
+     * @param[in] bus    - The Dbus bus object
+     * @param[in] path   - The Dbus object path
+     */
+    Verification(sdbusplus::bus::bus& bus, const std::string& path) :
+        VerificationInherit(bus, path.c_str(), action::emit_interface_added)
+    {}
+};
+
 /** @class Activation
  *  @brief OpenBMC activation software management implementation.
  *  @details A concrete implementation for
@@ -207,6 +269,10 @@ class Activation : public ActivationInherit, public Flash
         emit_object_added();
     }
 
+    /** @brief Stops the verification and the flash write in progress
+     *         before they are joined */
+    ~Activation();
+
     /** @brief Overloaded Activation property setter function
      *
      * @param[in] value - One of Activation::Activations
@@ -230,6 +296,36 @@ class Activation : public ActivationInherit, public Flash
     /** @brief Overloaded write flash function */
     void flashWrite() override;
 
+    /** @brief Overloaded cancel flash write function */
+    void flashCancel() override;
+
+    /** @brief Cancel the activation in progress
+     *
+     * @details Stops the flash write, removes what was written and returns
+     *          the activation to Ready, which releases the reboot guard.
+     *
+     * @return Success or exception thrown, NotAllowed if there is no
+     *         activation in progress or it is past the point where it can
+     *         be undone.
+     */
+    void cancel();
+
+    /** @brief Resume an activation that was interrupted by a crash or a
+     *         power loss, skipping the steps that were completed.
+     *
+     * @param[in] saved - The journal of the interrupted activation.
+     */
+    void resume(const ActivationJournal& saved);
+
+#if defined UBIFS_LAYOUT || defined MMC_LAYOUT
+    /** @brief Commit a version whose images were found installed, but whose
+     *         activation was interrupted before its priority was set.
+     *
+     * @param[in] saved - The journal of the interrupted activation.
+     */
+    void resumeCommit(const ActivationJournal& saved);
+#endif
+
     /**
      * @brief Handle the success of the flashWrite() function
      *
@@ -299,6 +395,22 @@ class Activation : public ActivationInherit, public Flash
      **/
     void rebootBmc();
 
+    /** @brief Store the progress of the activation in its journal */
+    void saveJournal();
+
+    /** @brief Store the bytes of an image that are written and synced in
+     *         the journal, may be called from any thread.
+     *
+     * @param[in] image   - The image file name.
+     * @param[in] written - The bytes written and synced.
+     */
+    void checkpointJournal(const std::string& image, uint64_t written);
+
+#if defined UBIFS_LAYOUT || defined MMC_LAYOUT
+    /** @brief Continue the activation once the images are written */
+    void onVolumesCreated();
+#endif
+
     /** @brief Persistent sdbusplus DBus bus connection */
     sdbusplus::bus::bus& bus;
 
@@ -320,6 +432,9 @@ class Activation : public ActivationInherit, public Flash
     /** @brief Persistent ActivationProgress dbus object */
     std::unique_ptr<ActivationProgress> activationProgress;
 
+    /** @brief Persistent ActivationCancel dbus object */
+    std::unique_ptr<ActivationCancel> activationCancel;
+
     /** @brief Used to subscribe to dbus systemd signals **/
     sdbusplus::bus::match_t systemdSignals;
 
@@ -335,19 +450,156 @@ class Activation : public ActivationInherit, public Flash
      *         variables has completed. **/
     bool ubootEnvVarsUpdated = false;
 
+    /** @brief Tracks whether U-Boot has been written as part of the
+     *         activation process. It is written after the volumes, as it is
+     *         shared by both slots. **/
+    bool ubootWritten = false;
+
+    /** @brief The progress of the activation, as stored in its journal */
+    ActivationJournal journal;
+
+    /** @brief Serializes the updates of the journal */
+    std::mutex journalMutex;
+
+  private:
+    /** @brief Apply a change of the Activation property, activation() then
+     *         indexes the version by the resulting state */
+    Activations setActivation(Activations value);
+
+  public:
+#ifdef MMC_LAYOUT
+  private:
+    /** @brief Called on the main thread once the eMMC partitions are
+     *         written, starts the service that finishes the update. */
+    void onEmmcWriteDone();
+
+    /** @brief Readable once flashWriter has completed */
+    std::unique_ptr<boost::asio::posix::stream_descriptor> flashWriteDone;
+
+    /** @brief The error of the eMMC write, empty on success */
+    std::string flashWriteError;
+
+    /** @brief Set to stop flashWriter at the next write */
+    std::atomic<bool> flashWriteCancelled = false;
+
+    /** @brief Held while flashWriter writes the slot, so that no upload is
+     *         streamed to it meanwhile */
+    std::unique_ptr<image::SlotLock> slotLock;
+
+    /** @brief The thread that writes the eMMC partitions. Declared last so
+     *         that it is joined before the members it uses are destroyed. */
+    std::jthread flashWriter;
+#endif
+
 #ifdef WANT_SIGNATURE_VERIFY
+  public:
+    /** @brief Verify the signature of the images on a worker thread at low
+     *         priority, unless the result for the current files is known.
+     *         The activation reuses the result. */
+    void startVerify();
+
   private:
+    /** @brief The result of a verification */
+    struct VerifyResult
+    {
+        /** @brief Whether the signatures are valid */
+        bool passed = false;
+
+        /** @brief The state of the image and key files that were verified,
+         *         empty if they were modified while they were verified. */
+        std::optional<image::FileStates> files;
+    };
+
     /** @brief Verify signature of the images.
      *
      * @param[in] imageDir - The path of images to verify
      * @param[in] confDir - The path of configs for verification
+     * @param[in] stop - Stops the verification, which then fails
      *
      * @return true if verification successful and false otherwise
      */
-    bool verifySignature(const fs::path& imageDir, const fs::path& confDir);
+    bool verifySignature(const fs::path& imageDir, const fs::path& confDir,
+                         std::stop_token stop = {});
+
+    /** @brief Verify the images, or reuse the result of their last
+     *         verification if they are unchanged.
+     *
+     * @return true if verification successful and false otherwise
+     */
+    bool checkSignature();
+
+    /** @brief Verify the images and record the state of the files that
+     *         were verified. May be called from any thread.
+     *
+     * @param[in] stop - Stops the verification, which then fails
+     *
+     * @return The result of the verification
+     */
+    VerifyResult verifyFiles(std::stop_token stop = {});
 
     /** @brief Called when image verification fails. */
     void onVerifyFailed();
+
+    /** @brief Called on the main thread once verifier has completed,
+     *         publishes its result. */
+    void onVerifyDone();
+
+    /** @brief Wait for the verification in progress at normal priority, and
+     *         publish its result. */
+    void waitVerify();
+
+    /** @brief Restore the priority of the verification in progress, as the
+     *         activation now waits for it. */
+    void boostVerify();
+
+    /** @brief Publish the result of a verification */
+    void setVerified(VerifyResult&& result);
+
+    /** @brief Get the state of the files the verification depends on, the
+     *         images and the keys. May be called from any thread. */
+    image::FileStates getVerifyFileStates() const;
+
+    /** @brief Whether the last verification applies to the current files */
+    bool verifiedUnchanged() const;
+
+    /** @brief Persistent Verification dbus object */
+    std::unique_ptr<Verification> verification;
+
+    /** @brief The result of the last verification */
+    VerifyResult verified;
+
+    /** @brief The result of the verification of verifier */
+    VerifyResult verifierResult;
+
+    /** @brief Set once the activation waits for verifier */
+    std::atomic<bool> verifyUrgent = false;
+
+    /** @brief The thread id of verifier once it lowered its priority */
+    std::atomic<pid_t> verifierTid = 0;
+
+    /** @brief Readable once verifier has completed */
+    std::unique_ptr<boost::asio::posix::stream_descriptor> verifyDone;
+#endif
+
+#ifdef PIPELINED_ACTIVATION
+    /** @brief Called once the images are verified while they are written
+     *         to the inactive slot, commits the version or drops what was
+     *         written of it. */
+    void onVerified();
+
+    /** @brief Set while the activation waits for the verification, nothing
+     *         is committed for the version until it has passed. */
+    bool verifyPending = false;
+
+    /** @brief Set while the write waits for the verification, as it needs
+     *         the room of versions that are only deleted once it passed. */
+    bool writeDeferred = false;
+#endif
+
+#ifdef WANT_SIGNATURE_VERIFY
+    /** @brief The thread that verifies the images. Declared last so that it
+     *         is joined before the members it uses are destroyed. */
+    std::jthread verifier;
 #endif
 };
 
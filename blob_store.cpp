@@ -0,0 +1,357 @@
+#include "blob_store.hpp"
+
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <fstream>
+#include <memory>
+#include <system_error>
+#include <vector>
+
+namespace blob_store
+{
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+/** @brief The prefix of the files being written to the store */
+constexpr std::string_view tmpPrefix = ".tmp";
+
+/** @brief The size of the reads and writes */
+constexpr size_t bufferSize = 64 * 1024;
+
+[[noreturn]] void fail(int err, const std::string& what)
+{
+    throw std::system_error(err, std::generic_category(), what);
+}
+
+/** @brief Incremental SHA-256 digest */
+class Digest
+{
+  public:
+    Digest() : ctx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free)
+    {
+        if (!ctx || EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr) <= 0)
+        {
+            fail(ENOMEM, "EVP_DigestInit_ex");
+        }
+    }
+
+    void update(const char* data, size_t size)
+    {
+        EVP_DigestUpdate(ctx.get(), data, size);
+    }
+
+    /** @brief Get the digest in lowercase hex */
+    std::string hex()
+    {
+        std::array<unsigned char, EVP_MAX_MD_SIZE> md{};
+        unsigned int length = 0;
+        EVP_DigestFinal_ex(ctx.get(), md.data(), &length);
+
+        constexpr auto digits = "0123456789abcdef";
+        std::string value;
+        for (unsigned int i = 0; i < length; i++)
+        {
+            value += digits[md[i] >> 4];
+            value += digits[md[i] & 0xf];
+        }
+        return value;
+    }
+
+  private:
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)> ctx;
+};
+
+/** @brief Check that a name read from a record is a plain file name */
+bool plainName(const std::string& name)
+{
+    return !name.empty() && name.find('/') == std::string::npos &&
+           name != "." && name != ".." && !name.starts_with(tmpPrefix);
+}
+
+/** @brief Read the record of an archive.
+ *
+ * @return The digests of its files by name, empty if the record is missing
+ *         or invalid.
+ */
+std::map<std::string, std::string> readRecord(const fs::path& path)
+{
+    std::map<std::string, std::string> files;
+    std::ifstream record(path);
+    std::string digest;
+    std::string name;
+    while (record >> digest && std::getline(record >> std::ws, name))
+    {
+        if (!plainName(digest) || !plainName(name))
+        {
+            return {};
+        }
+        files[name] = digest;
+    }
+    return files;
+}
+
+/** @brief Get the regular files of a directory, except those being written.
+ *
+ * @return The files and their status.
+ */
+std::vector<std::pair<fs::path, struct stat>> listFiles(const fs::path& dir)
+{
+    std::vector<std::pair<fs::path, struct stat>> files;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(dir, ec))
+    {
+        struct stat st;
+        if (!entry.path().filename().string().starts_with(tmpPrefix) &&
+            lstat(entry.path().c_str(), &st) == 0 && S_ISREG(st.st_mode))
+        {
+            files.emplace_back(entry.path(), st);
+        }
+    }
+    return files;
+}
+
+} // namespace
+
+Store::Store(const fs::path& dir) :
+    objects(dir / "objects"), archives(dir / "archives")
+{
+    fs::create_directories(objects);
+    fs::create_directories(archives);
+
+    // Drop what an interrupted add() left
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(objects, ec))
+    {
+        if (entry.path().filename().string().starts_with(tmpPrefix))
+        {
+            fs::remove(entry.path(), ec);
+        }
+    }
+}
+
+std::string Store::add(const std::function<size_t(char*, size_t)>& read,
+                       const fs::path& dest)
+{
+    auto tmpPath = (objects / (std::string(tmpPrefix) + "XXXXXX")).string();
+    int fd = mkstemp(tmpPath.data());
+    if (fd < 0)
+    {
+        fail(errno, "mkstemp " + tmpPath);
+    }
+
+    Digest digest;
+    std::vector<char> buffer(bufferSize);
+    try
+    {
+        while (auto bytes = read(buffer.data(), buffer.size()))
+        {
+            digest.update(buffer.data(), bytes);
+            for (size_t done = 0; done < bytes;)
+            {
+                auto written = ::write(fd, buffer.data() + done, bytes - done);
+                if (written < 0 && errno != EINTR)
+                {
+                    fail(errno, "write " + tmpPath);
+                }
+                done += (written > 0) ? written : 0;
+            }
+        }
+    }
+    catch (...)
+    {
+        close(fd);
+        unlink(tmpPath.c_str());
+        throw;
+    }
+
+    // The blob is shared by the directories that link to it
+    fchmod(fd, 0444);
+    if (close(fd) < 0)
+    {
+        auto err = errno;
+        unlink(tmpPath.c_str());
+        fail(err, "close " + tmpPath);
+    }
+
+    auto name = digest.hex();
+    auto blob = objects / name;
+    if (access(blob.c_str(), F_OK) == 0)
+    {
+        // Known content, link to the blob already stored
+        unlink(tmpPath.c_str());
+    }
+    else if (rename(tmpPath.c_str(), blob.c_str()) < 0)
+    {
+        auto err = errno;
+        unlink(tmpPath.c_str());
+        fail(err, "rename " + blob.string());
+    }
+
+    if (link(blob.c_str(), dest.c_str()) < 0)
+    {
+        fail(errno, "link " + dest.string());
+    }
+    return name;
+}
+
+void Store::addArchive(const std::string& digest,
+                       const std::map<std::string, std::string>& files)
+{
+    if (!plainName(digest) || files.empty())
+    {
+        return;
+    }
+
+    auto tmpPath = archives / (std::string(tmpPrefix) + digest);
+    {
+        std::ofstream record(tmpPath, std::ios::trunc);
+        for (const auto& [name, blob] : files)
+        {
+            record << blob << " " << name << "\n";
+        }
+        record.close();
+        if (!record)
+        {
+            std::error_code ec;
+            fs::remove(tmpPath, ec);
+            return;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmpPath, archives / digest, ec);
+}
+
+bool Store::linkArchive(const std::string& digest, const fs::path& dir)
+{
+    if (!plainName(digest))
+    {
+        return false;
+    }
+
+    auto files = readRecord(archives / digest);
+    for (const auto& [name, blob] : files)
+    {
+        if (access((objects / blob).c_str(), F_OK) != 0)
+        {
+            files.clear();
+            break;
+        }
+    }
+    if (files.empty())
+    {
+        std::error_code ec;
+        fs::remove(archives / digest, ec);
+        return false;
+    }
+
+    std::vector<fs::path> linked;
+    for (const auto& [name, blob] : files)
+    {
+        auto dest = dir / name;
+        if (link((objects / blob).c_str(), dest.c_str()) < 0)
+        {
+            auto err = errno;
+            for (const auto& path : linked)
+            {
+                unlink(path.c_str());
+            }
+            fail(err, "link " + dest.string());
+        }
+        linked.push_back(dest);
+    }
+    return true;
+}
+
+uint64_t Store::collect()
+{
+    uint64_t freed = 0;
+    for (const auto& [path, st] : listFiles(objects))
+    {
+        // Only the store links to it
+        if (st.st_nlink <= 1 && unlink(path.c_str()) == 0)
+        {
+            freed += st.st_size;
+        }
+    }
+
+    for (const auto& [path, st] : listFiles(archives))
+    {
+        auto files = readRecord(path);
+        bool complete = !files.empty();
+        for (const auto& [name, blob] : files)
+        {
+            complete = complete && access((objects / blob).c_str(), F_OK) == 0;
+        }
+        if (!complete)
+        {
+            unlink(path.c_str());
+        }
+    }
+    return freed;
+}
+
+Usage Store::usage() const
+{
+    Usage usage;
+    for (const auto& [path, st] : listFiles(objects))
+    {
+        usage.blobs++;
+        usage.storedBytes += st.st_size;
+        if (st.st_nlink > 2)
+        {
+            usage.savedBytes +=
+                static_cast<uint64_t>(st.st_size) * (st.st_nlink - 2);
+        }
+    }
+    return usage;
+}
+
+std::string Store::archiveDigest(const fs::path& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fail(errno, "open " + path.string());
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return {};
+    }
+
+    Digest digest;
+    std::vector<char> buffer(bufferSize);
+    while (true)
+    {
+        auto bytes = ::read(fd, buffer.data(), buffer.size());
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes < 0)
+        {
+            auto err = errno;
+            close(fd);
+            fail(err, "read " + path.string());
+        }
+        if (bytes == 0)
+        {
+            break;
+        }
+        digest.update(buffer.data(), bytes);
+    }
+    close(fd);
+    return digest.hex();
+}
+
+} // namespace blob_store
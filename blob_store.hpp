@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <string>
+
+namespace blob_store
+{
+
+/** @brief The space used by a store */
+struct Usage
+{
+    /** @brief The number of blobs */
+    uint32_t blobs = 0;
+    /** @brief The bytes the blobs take */
+    uint64_t storedBytes = 0;
+    /** @brief The bytes copies would take in addition, for the blobs that
+     *         more than one directory links to */
+    uint64_t savedBytes = 0;
+};
+
+/** @class Store
+ *  @brief Content addressed store of the files extracted from archives.
+ *  @details Each file is stored once, as a blob named by its SHA-256
+ *           digest, and the directories the archives are extracted to hard
+ *           link to the blobs. A blob is referenced by as many directories
+ *           as its link count less one, and is removed by collect() once no
+ *           directory references it. The archives that can be read twice
+ *           are recorded by digest too, so that the files of a known archive
+ *           are linked without extracting it again.
+ *
+ *           The store must be on the filesystem of the directories.
+ */
+class Store
+{
+  public:
+    /** @brief Open a store, creating it if needed.
+     *
+     * @param[in] dir - The directory of the store.
+     *
+     * @throws std::filesystem::filesystem_error if it cannot be created.
+     */
+    explicit Store(const std::filesystem::path& dir);
+
+    /** @brief Store a file, and link it into a directory.
+     *
+     * @param[in] read - Reads the content of the file into a buffer, returns
+     *                   the bytes read, 0 at the end of the file.
+     * @param[in] dest - The path to link the blob to.
+     *
+     * @return The digest of the file.
+     *
+     * @throws std::system_error on I/O errors, or what read throws.
+     */
+    std::string add(const std::function<size_t(char*, size_t)>& read,
+                    const std::filesystem::path& dest);
+
+    /** @brief Record the files of an archive.
+     *
+     * @param[in] digest - The digest of the archive.
+     * @param[in] files  - The digests of its files, by name.
+     */
+    void addArchive(const std::string& digest,
+                    const std::map<std::string, std::string>& files);
+
+    /** @brief Link the files of a recorded archive into a directory.
+     *
+     * @param[in] digest - The digest of the archive.
+     * @param[in] dir    - The directory to link the files into.
+     *
+     * @return false if the archive is unknown or some of its blobs were
+     *         removed, nothing is linked then.
+     *
+     * @throws std::system_error if the files cannot be linked.
+     */
+    bool linkArchive(const std::string& digest,
+                     const std::filesystem::path& dir);
+
+    /** @brief Remove the blobs no directory links to, and the records of
+     *         the archives that had them.
+     *
+     * @return The bytes freed.
+     */
+    uint64_t collect();
+
+    /** @brief Get the space used by the store */
+    Usage usage() const;
+
+    /** @brief Get the digest of an archive, if it can be read twice.
+     *
+     * @param[in] path - The path of the archive.
+     *
+     * @return The SHA-256 digest in lowercase hex, empty if the archive is
+     *         not a regular file, e.g. a pipe.
+     *
+     * @throws std::system_error on I/O errors.
+     */
+    static std::string archiveDigest(const std::filesystem::path& path);
+
+  private:
+    /** @brief The directory of the blobs */
+    std::filesystem::path objects;
+
+    /** @brief The directory of the archive records */
+    std::filesystem::path archives;
+};
+
+} // namespace blob_store
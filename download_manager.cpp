@@ -2,9 +2,10 @@
 
 #include "download_manager.hpp"
 
+#include "process.hpp"
+#include "utils.hpp"
 #include "xyz/openbmc_project/Common/error.hpp"
 
-#include <sys/wait.h>
 #include <unistd.h>
 
 #include <phosphor-logging/elog-errors.hpp>
@@ -12,9 +13,11 @@
 #include <phosphor-logging/lg2.hpp>
 
 #include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <iostream>
 #include <string>
+#include <system_error>
 
 namespace phosphor
 {
@@ -28,6 +31,9 @@ PHOSPHOR_LOG2_USING;
 using namespace phosphor::logging;
 namespace fs = std::filesystem;
 
+/** @brief The time a TFTP download is given before it is killed */
+constexpr auto tftpTimeout = std::chrono::minutes(30);
+
 void Download::downloadViaTFTP(std::string fileName, std::string serverAddress)
 {
     using Argument = xyz::openbmc_project::Common::InvalidArgument;
@@ -68,51 +74,36 @@ void Download::downloadViaTFTP(std::string fileName, std::string serverAddress)
         return;
     }
 
-    pid_t pid = fork();
-
-    if (pid == 0)
+    // The download is reaped from the event loop, the method returns once
+    // tftp is started
+    auto localPath = std::string{IMG_UPLOAD_DIR} + '/' + fileName;
+    auto args = utils::internal::constructArgv(
+        "tftp", "-g", "-r", fileName.c_str(), serverAddress.c_str(), "-l",
+        localPath.c_str());
+    try
     {
-        pid_t nextPid = fork();
-        if (nextPid == 0)
-        {
-            // child process
-            execl("/usr/bin/tftp", "tftp", "-g", "-r", fileName.c_str(),
-                  serverAddress.c_str(), "-l",
-                  (std::string{IMG_UPLOAD_DIR} + '/' + fileName).c_str(),
-                  (char*)0);
-            // execl only returns on fail
-            error("Error ({ERRNO}) occurred during the TFTP call", "ERRNO",
-                  errno);
-            elog<InternalFailure>();
-        }
-        else if (nextPid < 0)
-        {
-            error("Error ({ERRNO}) occurred during fork", "ERRNO", errno);
-            elog<InternalFailure>();
-        }
-        // do nothing as parent if all is going well
-        // when parent exits, child will be reparented under init
-        // and then be reaped properly
-        exit(0);
+        process::runAsync(
+            loop, "/usr/bin/tftp", args.data(), {tftpTimeout},
+            [fileName](const process::Result& result) {
+                if (result.timedOut)
+                {
+                    error("TFTP download of {PATH} timed out", "PATH",
+                          fileName);
+                }
+                else if (!result.succeeded())
+                {
+                    error("Failed ({STATUS}) to download {PATH} via TFTP: "
+                          "{ERRORS}",
+                          "STATUS", result.exitCode, "PATH", fileName,
+                          "ERRORS", result.errors);
+                }
+            });
     }
-    else if (pid < 0)
+    catch (const std::system_error& e)
     {
-        error("Error ({ERRNO}) occurred during fork", "ERRNO", errno);
+        error("Error ({ERROR}) occurred during the TFTP call", "ERROR", e);
         elog<InternalFailure>();
     }
-    else
-    {
-        int status;
-        if (waitpid(pid, &status, 0) < 0)
-        {
-            error("Error ({ERRNO}) occurred during waitpid", "ERRNO", errno);
-        }
-        else if (WEXITSTATUS(status) != 0)
-        {
-
-            error("Failed ({STATUS}) to launch tftp", "STATUS", status);
-        }
-    }
 
     return;
 }
@@ -2,6 +2,8 @@
 
 #include "xyz/openbmc_project/Common/TFTP/server.hpp"
 
+#include <systemd/sd-event.h>
+
 #include <sdbusplus/bus.hpp>
 
 #include <string>
@@ -28,9 +30,12 @@ class Download : public DownloadInherit
      *
      * @param[in] bus       - The Dbus bus object
      * @param[in] objPath   - The Dbus object path
+     * @param[in] loop      - The sd-event loop the downloads are reaped from
      */
-    Download(sdbusplus::bus::bus& bus, const std::string& objPath) :
-        DownloadInherit(bus, (objPath).c_str()){};
+    Download(sdbusplus::bus::bus& bus, const std::string& objPath,
+             sd_event* loop) :
+        DownloadInherit(bus, (objPath).c_str()),
+        loop(loop){};
 
     /**
      * @brief Download the specified image via TFTP
@@ -40,6 +45,10 @@ class Download : public DownloadInherit
      **/
     void downloadViaTFTP(std::string fileName,
                          std::string serverAddress) override;
+
+  private:
+    /** @brief The sd-event loop the downloads are reaped from */
+    sd_event* loop;
 };
 
 } // namespace manager
@@ -2,23 +2,29 @@
 
 #include "download_manager.hpp"
 
+#include <systemd/sd-event.h>
+
 #include <sdbusplus/bus.hpp>
 
 int main()
 {
     auto bus = sdbusplus::bus::new_default();
 
+    sd_event* loop = nullptr;
+    sd_event_default(&loop);
+
     // Add sdbusplus ObjectManager.
     sdbusplus::server::manager::manager objManager(bus, SOFTWARE_OBJPATH);
 
-    phosphor::software::manager::Download manager(bus, SOFTWARE_OBJPATH);
+    phosphor::software::manager::Download manager(bus, SOFTWARE_OBJPATH,
+                                                  loop);
 
     bus.request_name(DOWNLOAD_BUSNAME);
 
-    while (true)
-    {
-        bus.process_discard();
-        bus.wait();
-    }
+    bus.attach_event(loop, SD_EVENT_PRIORITY_NORMAL);
+    sd_event_loop(loop);
+
+    sd_event_unref(loop);
+
     return 0;
 }
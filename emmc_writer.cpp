@@ -0,0 +1,725 @@
+#include "emmc_writer.hpp"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <system_error>
+#include <vector>
+
+namespace emmc_writer
+{
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+/** @brief The size of the writes, and of the write buffer */
+constexpr size_t writeSize = 1024 * 1024;
+
+/** @brief The bytes written between syncs that are reported as checkpoints */
+constexpr uint64_t checkpointSize = 16 * writeSize;
+
+/** @brief The alignment of the write buffer for O_DIRECT */
+constexpr size_t alignment = 4096;
+
+/** @brief The sector size of disk image files */
+constexpr uint32_t defaultSectorSize = 512;
+
+/** @brief GPT header fields, see the UEFI specification */
+constexpr auto gptSignature = "EFI PART";
+constexpr size_t gptMinHeaderSize = 92;
+constexpr size_t gptHeaderSizeOffset = 12;
+constexpr size_t gptHeaderCrcOffset = 16;
+constexpr size_t gptAlternateLbaOffset = 32;
+constexpr size_t gptEntriesLbaOffset = 72;
+constexpr size_t gptEntryCountOffset = 80;
+constexpr size_t gptEntrySizeOffset = 84;
+constexpr size_t gptEntriesCrcOffset = 88;
+
+/** @brief GPT partition entry fields */
+constexpr size_t gptEntryFirstLbaOffset = 32;
+constexpr size_t gptEntryLastLbaOffset = 40;
+constexpr size_t gptEntryNameOffset = 56;
+constexpr size_t gptEntryNameLength = 36;
+
+uint32_t getLe32(const char* p)
+{
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return le32toh(value);
+}
+
+uint64_t getLe64(const char* p)
+{
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return le64toh(value);
+}
+
+void putLe32(char* p, uint32_t value)
+{
+    value = htole32(value);
+    std::memcpy(p, &value, sizeof(value));
+}
+
+[[noreturn]] void fail(int err, const std::string& what)
+{
+    throw std::system_error(err, std::generic_category(), what);
+}
+
+/** @brief RAII wrapper for a file descriptor */
+class File
+{
+  public:
+    File() = delete;
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+    File(File&&) = delete;
+    File& operator=(File&&) = delete;
+
+    /** @brief Open a file, retrying without O_DIRECT if the file system does
+     *         not support it.
+     */
+    File(const std::string& path, int flags) : path(path)
+    {
+        fd = open(path.c_str(), flags | O_CLOEXEC);
+        if (fd < 0 && errno == EINVAL && (flags & O_DIRECT))
+        {
+            fd = open(path.c_str(), (flags & ~O_DIRECT) | O_CLOEXEC);
+        }
+        if (fd < 0)
+        {
+            fail(errno, "open " + path);
+        }
+    }
+
+    ~File()
+    {
+        close(fd);
+    }
+
+    bool isBlockDevice() const
+    {
+        struct stat st;
+        return fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+    }
+
+    uint32_t sectorSize() const
+    {
+        int size = 0;
+        if (isBlockDevice() && ioctl(fd, BLKSSZGET, &size) == 0 && size > 0)
+        {
+            return size;
+        }
+        return defaultSectorSize;
+    }
+
+    void read(char* buffer, size_t length, uint64_t offset) const
+    {
+        while (length > 0)
+        {
+            auto bytes = pread(fd, buffer, length, offset);
+            if (bytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes <= 0)
+            {
+                fail(bytes < 0 ? errno : EIO, "read " + path);
+            }
+            buffer += bytes;
+            length -= bytes;
+            offset += bytes;
+        }
+    }
+
+    void write(const char* buffer, size_t length, uint64_t offset) const
+    {
+        while (length > 0)
+        {
+            auto bytes = pwrite(fd, buffer, length, offset);
+            if (bytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes <= 0)
+            {
+                fail(bytes < 0 ? errno : EIO, "write " + path);
+            }
+            buffer += bytes;
+            length -= bytes;
+            offset += bytes;
+        }
+    }
+
+    /** @brief Discard a range, or punch a hole in a disk image file */
+    void discard(uint64_t offset, uint64_t length) const
+    {
+        if (length == 0)
+        {
+            return;
+        }
+
+        // Discard is advisory, ignore devices that do not support it
+        if (isBlockDevice())
+        {
+            uint64_t range[] = {offset, length};
+            ioctl(fd, BLKDISCARD, &range);
+        }
+        else
+        {
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                      length);
+        }
+    }
+
+    void sync() const
+    {
+        if (fsync(fd) != 0)
+        {
+            fail(errno, "sync " + path);
+        }
+    }
+
+  private:
+    const std::string path;
+    int fd = -1;
+};
+
+/** @brief A GPT header and its partition entry array */
+struct Gpt
+{
+    uint64_t headerLba = 0;
+    std::vector<char> header;
+    uint64_t entriesLba = 0;
+    std::vector<char> entries;
+    uint32_t entryCount = 0;
+    uint32_t entrySize = 0;
+};
+
+/** @brief Read and validate the GPT header at an LBA and its entries */
+Gpt readGpt(const File& file, uint32_t sectorSize, uint64_t lba,
+            const std::string& disk)
+{
+    Gpt gpt;
+    gpt.headerLba = lba;
+    gpt.header.resize(sectorSize);
+    file.read(gpt.header.data(), sectorSize, lba * sectorSize);
+
+    auto headerSize = getLe32(&gpt.header[gptHeaderSizeOffset]);
+    if (std::memcmp(gpt.header.data(), gptSignature, 8) != 0 ||
+        headerSize < gptMinHeaderSize || headerSize > sectorSize)
+    {
+        fail(EINVAL, "no GPT header on " + disk);
+    }
+
+    auto header = gpt.header;
+    putLe32(&header[gptHeaderCrcOffset], 0);
+    if (internal::crc32(header.data(), headerSize) !=
+        getLe32(&gpt.header[gptHeaderCrcOffset]))
+    {
+        fail(EINVAL, "bad GPT header checksum on " + disk);
+    }
+
+    gpt.entriesLba = getLe64(&gpt.header[gptEntriesLbaOffset]);
+    gpt.entryCount = getLe32(&gpt.header[gptEntryCountOffset]);
+    gpt.entrySize = getLe32(&gpt.header[gptEntrySizeOffset]);
+    if (gpt.entrySize < gptEntryNameOffset + gptEntryNameLength * 2 ||
+        gpt.entryCount > 1024)
+    {
+        fail(EINVAL, "bad GPT entries on " + disk);
+    }
+
+    gpt.entries.resize(static_cast<size_t>(gpt.entryCount) * gpt.entrySize);
+    file.read(gpt.entries.data(), gpt.entries.size(),
+              gpt.entriesLba * sectorSize);
+    if (internal::crc32(gpt.entries.data(), gpt.entries.size()) !=
+        getLe32(&gpt.header[gptEntriesCrcOffset]))
+    {
+        fail(EINVAL, "bad GPT entries checksum on " + disk);
+    }
+
+    return gpt;
+}
+
+/** @brief Get the name of a partition entry, only ASCII names are supported */
+std::string entryName(const char* entry)
+{
+    std::string name;
+    for (size_t i = 0; i < gptEntryNameLength; i++)
+    {
+        auto c = static_cast<uint8_t>(entry[gptEntryNameOffset + i * 2]) |
+                 (static_cast<uint8_t>(entry[gptEntryNameOffset + i * 2 + 1])
+                  << 8);
+        if (c == 0)
+        {
+            break;
+        }
+        name += (c < 0x80) ? static_cast<char>(c) : '?';
+    }
+    return name;
+}
+
+/** @brief Update the checksums of a GPT after its entries changed */
+void updateChecksums(Gpt& gpt)
+{
+    putLe32(&gpt.header[gptEntriesCrcOffset],
+            internal::crc32(gpt.entries.data(), gpt.entries.size()));
+    putLe32(&gpt.header[gptHeaderCrcOffset], 0);
+    putLe32(&gpt.header[gptHeaderCrcOffset],
+            internal::crc32(gpt.header.data(),
+                            getLe32(&gpt.header[gptHeaderSizeOffset])));
+}
+
+/** @brief The device node of a partition, e.g. /dev/mmcblk0p3 */
+std::string partitionNode(const std::string& disk, uint32_t number)
+{
+    auto separator = std::isdigit(static_cast<unsigned char>(disk.back()))
+                         ? "p"
+                         : "";
+    return disk + separator + std::to_string(number);
+}
+
+/** @brief Tell udev that a partition changed, so that it updates the
+ *         by-partlabel links, as partprobe did.
+ */
+void notifyChange(const std::string& disk, uint32_t number)
+{
+    auto node = fs::path(partitionNode(disk, number));
+    std::error_code ec;
+    if (!fs::is_block_file(node, ec))
+    {
+        return;
+    }
+    std::ofstream(fs::path("/sys/class/block") / node.filename() / "uevent")
+        << "change";
+}
+
+/** @brief Allocate an aligned buffer */
+std::unique_ptr<char, decltype(&std::free)> allocate(size_t size)
+{
+    auto buffer = static_cast<char*>(std::aligned_alloc(alignment, size));
+    if (buffer == nullptr)
+    {
+        fail(ENOMEM, "allocate");
+    }
+    return {buffer, &std::free};
+}
+
+} // namespace
+
+namespace internal
+{
+
+uint32_t crc32(const void* data, size_t size)
+{
+    static const auto table = [] {
+        std::array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < table.size(); i++)
+        {
+            auto c = i;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+            }
+            table[i] = c;
+        }
+        return table;
+    }();
+
+    uint32_t crc = 0xFFFFFFFF;
+    auto bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+} // namespace internal
+
+std::optional<Partition> findPartition(const std::string& disk,
+                                       const std::string& name)
+{
+    File file(disk, O_RDONLY);
+    auto sectorSize = file.sectorSize();
+    auto gpt = readGpt(file, sectorSize, 1, disk);
+
+    for (uint32_t i = 0; i < gpt.entryCount; i++)
+    {
+        const auto* entry =
+            &gpt.entries[static_cast<size_t>(i) * gpt.entrySize];
+        auto firstLba = getLe64(entry + gptEntryFirstLbaOffset);
+        auto lastLba = getLe64(entry + gptEntryLastLbaOffset);
+        if (firstLba == 0 || lastLba < firstLba || entryName(entry) != name)
+        {
+            continue;
+        }
+
+        Partition partition;
+        partition.number = i + 1;
+        partition.name = name;
+        partition.offset = firstLba * sectorSize;
+        partition.size = (lastLba - firstLba + 1) * sectorSize;
+        return partition;
+    }
+
+    return std::nullopt;
+}
+
+void setPartitionName(const std::string& disk, uint32_t number,
+                      const std::string& name)
+{
+    if (name.size() > gptEntryNameLength)
+    {
+        fail(EINVAL, "partition name " + name);
+    }
+
+    File file(disk, O_RDWR);
+    auto sectorSize = file.sectorSize();
+    auto primary = readGpt(file, sectorSize, 1, disk);
+    auto backup = readGpt(file, sectorSize,
+                          getLe64(&primary.header[gptAlternateLbaOffset]),
+                          disk);
+    if (number == 0 || number > primary.entryCount ||
+        number > backup.entryCount)
+    {
+        fail(EINVAL, "partition number " + std::to_string(number));
+    }
+
+    auto offset = static_cast<size_t>(number - 1) * primary.entrySize;
+    if (entryName(&primary.entries[offset]) == name &&
+        entryName(&backup.entries[offset]) == name)
+    {
+        return;
+    }
+
+    for (auto* gpt : {&backup, &primary})
+    {
+        auto* entry = &gpt->entries[offset];
+        std::memset(entry + gptEntryNameOffset, 0, gptEntryNameLength * 2);
+        for (size_t i = 0; i < name.size(); i++)
+        {
+            entry[gptEntryNameOffset + i * 2] = name[i];
+        }
+        updateChecksums(*gpt);
+
+        // Write the entries before the header that covers them, and the
+        // backup before the primary, so an interrupted update leaves one
+        // valid GPT.
+        file.write(gpt->entries.data(), gpt->entries.size(),
+                   gpt->entriesLba * sectorSize);
+        file.write(gpt->header.data(), gpt->header.size(),
+                   gpt->headerLba * sectorSize);
+        file.sync();
+    }
+}
+
+uint64_t writeImage(const std::string& disk, const Partition& partition,
+                    const std::string& image,
+                    const std::atomic<bool>* cancelled, uint64_t resume,
+                    const std::function<void(uint64_t)>& checkpoint)
+{
+    std::ifstream input(image, std::ios::binary);
+    if (!input)
+    {
+        fail(ENOENT, "open " + image);
+    }
+
+    auto source = [&input](char* data, size_t size) {
+        input.read(data, size);
+        if (input.bad())
+        {
+            fail(EIO, "read");
+        }
+        return static_cast<size_t>(input.gcount());
+    };
+    return writeImage(disk, partition, source, image, cancelled, resume,
+                      checkpoint);
+}
+
+uint64_t writeImage(const std::string& disk, const Partition& partition,
+                    const Source& source, const std::string& image,
+                    const std::atomic<bool>* cancelled, uint64_t resume,
+                    const std::function<void(uint64_t)>& checkpoint)
+{
+    // Write through the partition device when there is one, otherwise at
+    // the partition offset of the disk image file.
+    auto target = partitionNode(disk, partition.number);
+    uint64_t base = 0;
+    std::error_code ec;
+    if (!fs::is_block_file(target, ec))
+    {
+        target = disk;
+        base = partition.offset;
+    }
+
+    File output(target, O_RDWR | O_DIRECT);
+    auto sectorSize = output.sectorSize();
+
+    std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(
+        ZSTD_createDCtx(), &ZSTD_freeDCtx);
+    if (!dctx)
+    {
+        fail(ENOMEM, "zstd");
+    }
+
+    auto buffer = allocate(writeSize);
+    std::vector<char> in(ZSTD_DStreamInSize());
+    ZSTD_outBuffer out{buffer.get(), writeSize, 0};
+    uint64_t written = 0;
+    uint64_t synced = 0;
+
+    // The bytes decoded, and the size the first frame header declares
+    uint64_t decoded = 0;
+    auto expected = ZSTD_CONTENTSIZE_UNKNOWN;
+
+    // Check that the block before the resume point made it to the device
+    auto isWritten = [&](size_t length) {
+        auto readBack = allocate(writeSize);
+        output.read(readBack.get(), length, base + written);
+        return std::memcmp(readBack.get(), buffer.get(), length) == 0;
+    };
+
+    auto flush = [&]() {
+        if (cancelled != nullptr && *cancelled)
+        {
+            fail(ECANCELED, "write of " + image);
+        }
+
+        decoded += out.pos;
+
+        // O_DIRECT writes must be whole sectors, pad the last one
+        auto length = (out.pos + sectorSize - 1) / sectorSize * sectorSize;
+        std::memset(buffer.get() + out.pos, 0, length - out.pos);
+        if (written + length > partition.size)
+        {
+            fail(EFBIG, image + " does not fit partition " + partition.name);
+        }
+
+        if (written < resume)
+        {
+            // Skip what was written before an interruption, up to the last
+            // block that is verified to be intact.
+            if (written + length < resume || isWritten(length))
+            {
+                written += length;
+                synced = written;
+                out.pos = 0;
+                return;
+            }
+            resume = written;
+        }
+
+        output.write(buffer.get(), length, base + written);
+        written += length;
+        out.pos = 0;
+
+        if (checkpoint && written - synced >= checkpointSize)
+        {
+            output.sync();
+            synced = written;
+            checkpoint(written);
+        }
+    };
+
+    size_t ret = 0;
+    bool first = true;
+    while (auto bytes = source(in.data(), in.size()))
+    {
+        if (first)
+        {
+            expected = ZSTD_getFrameContentSize(in.data(), bytes);
+            first = false;
+        }
+
+        ZSTD_inBuffer chunk{in.data(), bytes, 0};
+        while (chunk.pos < chunk.size)
+        {
+            ret = ZSTD_decompressStream(dctx.get(), &out, &chunk);
+            if (ZSTD_isError(ret))
+            {
+                fail(EILSEQ, image + ": " + ZSTD_getErrorName(ret));
+            }
+            if (out.pos == out.size)
+            {
+                flush();
+            }
+        }
+    }
+
+    // Drain the output the decoder still holds, a frame is complete once
+    // the decoder returns 0.
+    while (ret != 0)
+    {
+        ZSTD_inBuffer empty{nullptr, 0, 0};
+        auto pos = out.pos;
+        ret = ZSTD_decompressStream(dctx.get(), &out, &empty);
+        if (ZSTD_isError(ret))
+        {
+            fail(EILSEQ, image + ": " + ZSTD_getErrorName(ret));
+        }
+        if (out.pos == out.size)
+        {
+            flush();
+        }
+        else if (ret != 0 && out.pos == pos)
+        {
+            fail(EILSEQ, image + " is truncated");
+        }
+    }
+    if (out.pos > 0)
+    {
+        flush();
+    }
+
+    // Never leave an empty or truncated partition behind an image that
+    // decoded to less than it should
+    if (decoded == 0)
+    {
+        fail(EILSEQ, image + " is empty");
+    }
+    if (expected != ZSTD_CONTENTSIZE_UNKNOWN &&
+        expected != ZSTD_CONTENTSIZE_ERROR && decoded < expected)
+    {
+        fail(EILSEQ, image + " decoded to " + std::to_string(decoded) +
+                         " of " + std::to_string(expected) + " bytes");
+    }
+
+    output.discard(base + written, partition.size - written);
+    output.sync();
+    if (checkpoint)
+    {
+        checkpoint(written);
+    }
+    return written;
+}
+
+std::string secondaryLabel(const std::string& disk)
+{
+    // Find the device mounted on /
+    std::ifstream mounts("/proc/mounts");
+    std::string line;
+    std::string root;
+    while (std::getline(mounts, line))
+    {
+        std::istringstream fields(line);
+        std::string device;
+        std::string mountPoint;
+        fields >> device >> mountPoint;
+        if (mountPoint == "/")
+        {
+            root = device;
+        }
+    }
+
+    std::error_code ec;
+    auto rootPath = fs::canonical(root, ec);
+    if (root.empty() || ec)
+    {
+        return {};
+    }
+
+    for (const auto& [label, other] : {std::pair{"a", "b"}, {"b", "a"}})
+    {
+        auto partition = findPartition(disk, std::string("rofs-") + label);
+        if (partition &&
+            fs::canonical(partitionNode(disk, partition->number), ec) ==
+                rootPath)
+        {
+            return other;
+        }
+    }
+    return {};
+}
+
+void update(const std::string& disk, const std::string& imageDir,
+            const std::string& label, const Options& options)
+{
+    struct Target
+    {
+        std::string image;
+        Partition partition;
+    };
+
+    std::vector<Target> targets;
+    for (const auto& [image, prefix] :
+         {std::pair{"image-kernel", "boot-"}, {"image-rofs", "rofs-"}})
+    {
+        auto name = prefix + label;
+        auto partition = findPartition(disk, name);
+        if (!partition)
+        {
+            fail(ENOENT, "no partition " + name + " on " + disk);
+        }
+        targets.push_back({imageDir + "/" + image, *partition});
+    }
+
+    auto write = [&](const Target& target) -> uint64_t {
+        auto name = fs::path(target.image).filename().string();
+        if (options.written.contains(name))
+        {
+            return 0;
+        }
+        auto resume = options.resume.find(name);
+        std::function<void(uint64_t)> checkpoint;
+        if (options.checkpoint)
+        {
+            checkpoint = [&options, name](uint64_t written) {
+                options.checkpoint(name, written);
+            };
+        }
+        return writeImage(disk, target.partition, target.image,
+                          options.cancelled,
+                          (resume == options.resume.end()) ? 0
+                                                           : resume->second,
+                          checkpoint);
+    };
+
+    if (options.concurrent)
+    {
+        std::vector<std::future<uint64_t>> writes;
+        for (const auto& target : targets)
+        {
+            writes.push_back(std::async(std::launch::async, write, target));
+        }
+        for (auto& pending : writes)
+        {
+            pending.get();
+        }
+    }
+    else
+    {
+        for (const auto& target : targets)
+        {
+            write(target);
+        }
+    }
+
+    // Make sure the labels are intact, and refresh the by-partlabel links
+    for (const auto& target : targets)
+    {
+        setPartitionName(disk, target.partition.number, target.partition.name);
+        notifyChange(disk, target.partition.number);
+    }
+}
+
+} // namespace emmc_writer
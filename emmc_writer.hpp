@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+
+namespace emmc_writer
+{
+
+/** @brief The eMMC user area that holds the boot and rofs partitions */
+constexpr auto defaultDisk = "/dev/mmcblk0";
+
+/** @brief A partition of a GPT partitioned disk */
+struct Partition
+{
+    /** @brief The partition number, starting at 1 */
+    uint32_t number = 0;
+    /** @brief The partition name, e.g. rofs-a */
+    std::string name;
+    /** @brief The offset of the partition on the disk, in bytes */
+    uint64_t offset = 0;
+    /** @brief The size of the partition, in bytes */
+    uint64_t size = 0;
+};
+
+/** @brief Find a partition by name in the GPT of a disk.
+ *
+ * @param[in] disk - The path of the disk, a block device or an image file.
+ * @param[in] name - The partition name.
+ *
+ * @return The partition, or nullopt if there is none with the name.
+ *
+ * @throws std::system_error on I/O errors or if the GPT is invalid.
+ */
+std::optional<Partition> findPartition(const std::string& disk,
+                                       const std::string& name);
+
+/** @brief Set the name of a partition in the primary and backup GPT.
+ *
+ * @details Nothing is written if the partition already has the name.
+ *
+ * @param[in] disk   - The path of the disk.
+ * @param[in] number - The partition number.
+ * @param[in] name   - The new name.
+ *
+ * @throws std::system_error on I/O errors or if the GPT is invalid.
+ */
+void setPartitionName(const std::string& disk, uint32_t number,
+                      const std::string& name);
+
+/** @brief Decompress a zstd image into a partition.
+ *
+ * @details The partition is written with large aligned writes, with
+ *          O_DIRECT when the device supports it, and the part of the
+ *          partition after the image is discarded. Partitions of a disk
+ *          image file are written at their offset in the file.
+ *
+ * @param[in] disk      - The path of the disk.
+ * @param[in] partition - The partition to write.
+ * @param[in] image     - The path of the zstd compressed image.
+ * @param[in] cancelled - If set, checked before each write to stop early.
+ * @param[in] resume    - The bytes of the image that were written and synced
+ *                        by an interrupted write. They are not written again,
+ *                        except for the last block if it does not match.
+ * @param[in] checkpoint - If set, called with the number of bytes that are
+ *                         written and synced, every few MiB and at the end.
+ *
+ * @return The number of bytes written, the image size rounded up to the
+ *         sector size.
+ *
+ * @throws std::system_error on I/O errors, if the image is corrupt, empty
+ *         or decodes to less than its frame header declares, if it does
+ *         not fit the partition or with ECANCELED if cancelled.
+ */
+uint64_t writeImage(const std::string& disk, const Partition& partition,
+                    const std::string& image,
+                    const std::atomic<bool>* cancelled = nullptr,
+                    uint64_t resume = 0,
+                    const std::function<void(uint64_t)>& checkpoint = {});
+
+/** @brief A source of compressed image data, filling the buffer passed with
+ *         up to size bytes and returning the number of bytes read, 0 at the
+ *         end of the image */
+using Source = std::function<size_t(char* buffer, size_t size)>;
+
+/** @brief Decompress a zstd image read from a source into a partition.
+ *
+ * @details As the writeImage() reading a file, for images that are not
+ *          stored as a file, e.g. streamed out of an archive.
+ *
+ * @param[in] disk      - The path of the disk.
+ * @param[in] partition - The partition to write.
+ * @param[in] source    - The source of the zstd compressed image.
+ * @param[in] image     - The name of the image, for errors.
+ * @param[in] cancelled - If set, checked before each write to stop early.
+ * @param[in] resume    - The bytes of the image already written and synced.
+ * @param[in] checkpoint - If set, called with the bytes written and synced.
+ *
+ * @return The number of bytes written.
+ *
+ * @throws std::system_error as writeImage(), or what source throws.
+ */
+uint64_t writeImage(const std::string& disk, const Partition& partition,
+                    const Source& source, const std::string& image,
+                    const std::atomic<bool>* cancelled = nullptr,
+                    uint64_t resume = 0,
+                    const std::function<void(uint64_t)>& checkpoint = {});
+
+/** @brief Get the label, a or b, of the partitions the BMC is not running
+ *         from.
+ *
+ * @param[in] disk - The path of the disk.
+ *
+ * @return The label, or an empty string if the running partition is unknown.
+ */
+std::string secondaryLabel(const std::string& disk);
+
+/** @brief Options of update() */
+struct Options
+{
+    /** @brief Write both partitions at the same time */
+    bool concurrent = false;
+    /** @brief If set, checked before each write to stop early */
+    const std::atomic<bool>* cancelled = nullptr;
+    /** @brief The bytes of each image that were written and synced by an
+     *         interrupted update, by image file name */
+    std::map<std::string, uint64_t> resume;
+    /** @brief If set, called with an image file name and the bytes of it
+     *         that are written and synced. With concurrent it is called
+     *         from several threads. */
+    std::function<void(const std::string&, uint64_t)> checkpoint;
+    /** @brief The image file names already on their partitions, e.g.
+     *         streamed there when uploaded, which are not written */
+    std::set<std::string> written;
+};
+
+/** @brief Write the kernel and read-only filesystem images of a version to
+ *         the boot-<label> and rofs-<label> partitions.
+ *
+ * @param[in] disk     - The path of the disk.
+ * @param[in] imageDir - The directory with the image-kernel and image-rofs
+ *                       files.
+ * @param[in] label    - The partition label, a or b.
+ * @param[in] options  - The options of the update.
+ *
+ * @throws std::system_error on errors, with ECANCELED if cancelled.
+ */
+void update(const std::string& disk, const std::string& imageDir,
+            const std::string& label, const Options& options);
+
+namespace internal
+{
+
+/** @brief Compute the CRC32 used by GPT */
+uint32_t crc32(const void* data, size_t size);
+
+} // namespace internal
+
+} // namespace emmc_writer
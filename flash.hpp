@@ -26,6 +26,12 @@ class Flash
      */
     virtual void flashWrite() = 0;
 
+    /**
+     * @brief Stops an in-progress flashWrite() at a safe point and removes
+     *        what it wrote
+     */
+    virtual void flashCancel() = 0;
+
     /**
      * @brief Takes action when the state of the activation service file changes
      */
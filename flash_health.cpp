@@ -0,0 +1,155 @@
+#include "flash_health.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <limits>
+#include <set>
+#include <sstream>
+
+namespace flash_health
+{
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+/** @brief Read a decimal or 0x prefixed hexadecimal number from a file
+ *
+ * @return The number, or 0 if the file is missing or malformed.
+ */
+uint32_t readNumber(const fs::path& path)
+{
+    std::ifstream file(path);
+    std::string value;
+    if (!(file >> value))
+    {
+        return 0;
+    }
+
+    try
+    {
+        auto number = std::stoull(value, nullptr, 0);
+        return static_cast<uint32_t>(
+            std::min<unsigned long long>(number,
+                                         std::numeric_limits<uint32_t>::max()));
+    }
+    catch (const std::exception&)
+    {
+        return 0;
+    }
+}
+
+/** @brief Read the first line of a file */
+std::string readLine(const fs::path& path)
+{
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+/** @brief Check if a name is a prefix followed by a device number */
+bool isDevice(const std::string& name, const std::string& prefix)
+{
+    return name.size() > prefix.size() && name.starts_with(prefix) &&
+           std::all_of(name.begin() + prefix.size(), name.end(),
+                       [](unsigned char c) { return std::isdigit(c); });
+}
+
+/** @brief Convert an EXT_CSD DEVICE_LIFE_TIME_EST value to the upper bound
+ *         of the percent of life time used. 0x01 is 0-10% up to 0x0A for
+ *         90-100%, and 0x0B means the estimated life time was exceeded.
+ */
+uint8_t lifeTimePercent(uint32_t estimate)
+{
+    constexpr uint32_t exceeded = 0x0B;
+    return static_cast<uint8_t>(std::min(estimate, exceeded) * 10);
+}
+
+} // namespace
+
+std::vector<DeviceHealth> collect(const fs::path& sysfs)
+{
+    std::vector<DeviceHealth> devices;
+    std::error_code ec;
+
+    std::set<uint32_t> ubiMtds;
+    for (const auto& entry :
+         fs::directory_iterator(sysfs / "class" / "ubi", ec))
+    {
+        auto name = entry.path().filename().string();
+        if (!isDevice(name, "ubi"))
+        {
+            // Skip the volumes, named ubiX_Y, and the ctrl node
+            continue;
+        }
+
+        DeviceHealth device;
+        device.name = name;
+        device.maxEraseCount = readNumber(entry.path() / "max_ec");
+        device.meanEraseCount = readNumber(entry.path() / "mean_ec");
+        device.badBlocks = readNumber(entry.path() / "bad_peb_count");
+
+        auto mtdNum = readNumber(entry.path() / "mtd_num");
+        auto mtd = sysfs / "class" / "mtd" / ("mtd" + std::to_string(mtdNum));
+        device.correctedBits = readNumber(mtd / "corrected_bits");
+        device.eccFailures = readNumber(mtd / "ecc_failures");
+        ubiMtds.insert(mtdNum);
+
+        devices.push_back(std::move(device));
+    }
+
+    for (const auto& entry :
+         fs::directory_iterator(sysfs / "class" / "mtd", ec))
+    {
+        // Skip the read-only nodes, named mtdXro
+        auto name = entry.path().filename().string();
+        if (!isDevice(name, "mtd") ||
+            ubiMtds.contains(std::stoul(name.substr(3))))
+        {
+            continue;
+        }
+
+        DeviceHealth device;
+        device.name = name;
+        device.badBlocks = readNumber(entry.path() / "bad_blocks");
+        device.correctedBits = readNumber(entry.path() / "corrected_bits");
+        device.eccFailures = readNumber(entry.path() / "ecc_failures");
+
+        devices.push_back(std::move(device));
+    }
+
+    for (const auto& entry : fs::directory_iterator(sysfs / "block", ec))
+    {
+        // Skip the boot and rpmb hardware partitions, named mmcblkXbootY
+        // and mmcblkXrpmb
+        auto name = entry.path().filename().string();
+        if (!isDevice(name, "mmcblk"))
+        {
+            continue;
+        }
+
+        DeviceHealth device;
+        device.name = name;
+
+        // life_time holds the estimates for the type A and type B memory
+        uint32_t lifeTimeA = 0;
+        uint32_t lifeTimeB = 0;
+        std::istringstream lifeTime(readLine(entry.path() / "device" /
+                                             "life_time"));
+        lifeTime >> std::hex >> lifeTimeA >> lifeTimeB;
+        device.lifeTimeUsed = lifeTimePercent(std::max(lifeTimeA, lifeTimeB));
+        device.preEolInfo = static_cast<uint8_t>(
+            readNumber(entry.path() / "device" / "pre_eol_info"));
+
+        devices.push_back(std::move(device));
+    }
+
+    std::sort(devices.begin(), devices.end(),
+              [](const auto& a, const auto& b) { return a.name < b.name; });
+    return devices;
+}
+
+} // namespace flash_health
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace flash_health
+{
+
+/** @brief Wear and health statistics of a flash device */
+struct DeviceHealth
+{
+    /** @brief The device name, e.g. ubi0, mtd5 or mmcblk0 */
+    std::string name;
+    /** @brief The highest eraseblock erase counter, for UBI devices */
+    uint32_t maxEraseCount = 0;
+    /** @brief The mean eraseblock erase counter, for UBI devices */
+    uint32_t meanEraseCount = 0;
+    /** @brief The number of bad eraseblocks, for MTD and UBI devices */
+    uint32_t badBlocks = 0;
+    /** @brief The number of bit flips corrected by ECC, for MTD devices */
+    uint32_t correctedBits = 0;
+    /** @brief The number of uncorrectable ECC errors, for MTD devices */
+    uint32_t eccFailures = 0;
+    /** @brief Upper bound of the percent of life time used, for eMMC */
+    uint8_t lifeTimeUsed = 0;
+    /** @brief EXT_CSD PRE_EOL_INFO, for eMMC */
+    uint8_t preEolInfo = 0;
+
+    /** @brief Whether the device is close to the end of its life */
+    bool nearEndOfLife() const
+    {
+        constexpr uint8_t preEolWarning = 2;
+        constexpr uint8_t lifeTimeWarning = 90;
+        return (preEolInfo >= preEolWarning) ||
+               (lifeTimeUsed >= lifeTimeWarning) || (eccFailures > 0);
+    }
+};
+
+/** @brief Read the health of the UBI, MTD and eMMC devices.
+ *
+ * @details An MTD device that has a UBI device attached is reported as part
+ *          of the UBI device.
+ *
+ * @param[in] sysfs - The sysfs mount point.
+ *
+ * @return The health of each device.
+ */
+std::vector<DeviceHealth> collect(const std::filesystem::path& sysfs = "/sys");
+
+} // namespace flash_health
@@ -0,0 +1,50 @@
+#include "handoff.hpp"
+
+#include <boost/asio/post.hpp>
+
+namespace phosphor
+{
+namespace software
+{
+namespace handoff
+{
+
+void Queue::push(Image image, Reply reply)
+{
+    pending.emplace_back(std::move(image), std::move(reply));
+    if (!draining)
+    {
+        // Hand over from the io_context, like the signal it replaces, so
+        // that the image manager is done with the image first.
+        draining = true;
+        boost::asio::post(io, [this]() { drain(); });
+    }
+}
+
+void Queue::release(const std::string& versionId)
+{
+    if (releaser)
+    {
+        releaser(versionId);
+    }
+}
+
+void Queue::drain()
+{
+    draining = false;
+    while (!pending.empty())
+    {
+        auto [image, reply] = std::move(pending.front());
+        pending.pop_front();
+
+        auto outcome = receiver ? receiver(image) : Outcome::rejected;
+        if (reply)
+        {
+            reply(image, outcome);
+        }
+    }
+}
+
+} // namespace handoff
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "config.h"
+
+#include <boost/asio/io_context.hpp>
+#include <xyz/openbmc_project/Software/Version/server.hpp>
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <utility>
+
+namespace phosphor
+{
+namespace software
+{
+namespace handoff
+{
+
+using VersionPurpose =
+    sdbusplus::xyz::openbmc_project::Software::server::Version::VersionPurpose;
+
+/** @brief An uploaded image, as the image manager describes it in its
+ *         Version object */
+struct Image
+{
+    /** @brief The D-Bus object path of the version */
+    std::string path;
+    /** @brief The version id */
+    std::string versionId;
+    /** @brief The version string */
+    std::string version;
+    /** @brief The purpose of the version */
+    VersionPurpose purpose = VersionPurpose::Unknown;
+    /** @brief The extended version string */
+    std::string extendedVersion;
+    /** @brief The directory the image was extracted to */
+    std::string filePath;
+};
+
+/** @brief What the item updater did with an uploaded image */
+enum class Outcome
+{
+    /** @brief It publishes the version and activates it on request */
+    accepted,
+    /** @brief There is a version with the same id already */
+    exists,
+    /** @brief It does not manage versions of this kind */
+    rejected
+};
+
+/** @class Queue
+ *  @brief Passes the uploaded images from the image manager to the item
+ *         updater when both run in one process on one io_context, in place
+ *         of the Version objects and InterfacesAdded signals on D-Bus.
+ */
+class Queue
+{
+  public:
+    /** @brief Takes an image on the item updater side */
+    using Receiver = std::function<Outcome(const Image&)>;
+    /** @brief Tells the image manager what became of an image */
+    using Reply = std::function<void(const Image&, Outcome)>;
+    /** @brief Releases an image on the image manager side */
+    using Releaser = std::function<void(const std::string&)>;
+
+    /** @brief Constructs Queue
+     *
+     * @param[in] io - The io_context both managers run on.
+     */
+    explicit Queue(boost::asio::io_context& io) : io(io)
+    {}
+
+    /** @brief Queue an image for the item updater.
+     *
+     * @param[in] image - The uploaded image.
+     * @param[in] reply - Called from the io_context with the outcome, the
+     *                    image is rejected while there is no receiver.
+     */
+    void push(Image image, Reply reply);
+
+    /** @brief Tell the image manager that the item updater no longer needs
+     *         an image, in place of deleting its Version object.
+     *
+     * @param[in] versionId - The version id of the image.
+     */
+    void release(const std::string& versionId);
+
+    /** @brief Set the function that takes the images */
+    void setReceiver(Receiver value)
+    {
+        receiver = std::move(value);
+    }
+
+    /** @brief Set the function that releases the images */
+    void setReleaser(Releaser value)
+    {
+        releaser = std::move(value);
+    }
+
+  private:
+    /** @brief Hand the queued images to the receiver */
+    void drain();
+
+    /** @brief The io_context the images are handed over on */
+    boost::asio::io_context& io;
+
+    /** @brief The images waiting for the receiver */
+    std::deque<std::pair<Image, Reply>> pending;
+
+    /** @brief Set while a drain() is posted */
+    bool draining = false;
+
+    /** @brief Takes the images */
+    Receiver receiver;
+
+    /** @brief Releases the images */
+    Releaser releaser;
+};
+
+} // namespace handoff
+} // namespace software
+} // namespace phosphor
+
+#ifdef SINGLE_BINARY
+/** @brief The queue between the image manager and the item updater, they
+ *         share in the single binary */
+extern phosphor::software::handoff::Queue& getHandoffQueue();
+#endif
@@ -0,0 +1,213 @@
+#include "image_compare.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <system_error>
+
+namespace image_compare
+{
+
+namespace
+{
+
+/** @brief The alignment of the chunks and buffers */
+constexpr size_t alignment = 4096;
+
+/** @brief RAII wrapper for a file descriptor */
+class File
+{
+  public:
+    File() = delete;
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+    File(File&&) = delete;
+    File& operator=(File&&) = delete;
+
+    File(const std::string& path, int flags) :
+        path(path), fd(open(path.c_str(), flags | O_CLOEXEC))
+    {
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                                    "open " + path);
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    ~File()
+    {
+        close(fd);
+    }
+
+    /** @brief Get the size of a regular file or block device */
+    uint64_t size() const
+    {
+        auto end = lseek(fd, 0, SEEK_END);
+        if (end < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                                    "seek " + path);
+        }
+        return end;
+    }
+
+    /** @brief Read exactly length bytes at offset */
+    void read(char* buffer, size_t length, uint64_t offset) const
+    {
+        while (length > 0)
+        {
+            auto bytes = pread(fd, buffer, length, offset);
+            if (bytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes <= 0)
+            {
+                throw std::system_error(bytes < 0 ? errno : EIO,
+                                        std::generic_category(),
+                                        "read " + path);
+            }
+            buffer += bytes;
+            length -= bytes;
+            offset += bytes;
+        }
+    }
+
+    /** @brief Write exactly length bytes at offset */
+    void write(const char* buffer, size_t length, uint64_t offset) const
+    {
+        while (length > 0)
+        {
+            auto bytes = pwrite(fd, buffer, length, offset);
+            if (bytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes <= 0)
+            {
+                throw std::system_error(bytes < 0 ? errno : EIO,
+                                        std::generic_category(),
+                                        "write " + path);
+            }
+            buffer += bytes;
+            length -= bytes;
+            offset += bytes;
+        }
+    }
+
+    /** @brief Flush the written data to the device */
+    void sync() const
+    {
+        if (fsync(fd) != 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                                    "sync " + path);
+        }
+    }
+
+  private:
+    const std::string path;
+    const int fd;
+};
+
+/** @brief Allocate an aligned buffer */
+std::unique_ptr<char, decltype(&std::free)> allocate(size_t size)
+{
+    auto buffer = static_cast<char*>(std::aligned_alloc(alignment, size));
+    if (buffer == nullptr)
+    {
+        throw std::system_error(ENOMEM, std::generic_category(), "allocate");
+    }
+    return {buffer, &std::free};
+}
+
+} // namespace
+
+Result compare(const std::string& device, const std::string& image,
+               bool allRanges, size_t chunkSize)
+{
+    if (chunkSize == 0 || chunkSize % alignment != 0)
+    {
+        throw std::system_error(EINVAL, std::generic_category(),
+                                "chunk size");
+    }
+
+    File deviceFile(device, O_RDONLY);
+    File imageFile(image, O_RDONLY);
+
+    auto imageSize = imageFile.size();
+    if (deviceFile.size() < imageSize)
+    {
+        throw std::system_error(ENOSPC, std::generic_category(),
+                                device + " is smaller than " + image);
+    }
+
+    auto deviceBuffer = allocate(chunkSize);
+    auto imageBuffer = allocate(chunkSize);
+
+    Result result;
+    for (uint64_t offset = 0; offset < imageSize; offset += chunkSize)
+    {
+        auto length = std::min<uint64_t>(chunkSize, imageSize - offset);
+        imageFile.read(imageBuffer.get(), length, offset);
+        deviceFile.read(deviceBuffer.get(), length, offset);
+        result.compared += length;
+
+        if (std::memcmp(imageBuffer.get(), deviceBuffer.get(), length) == 0)
+        {
+            continue;
+        }
+
+        result.identical = false;
+        if (!allRanges)
+        {
+            result.ranges.push_back({offset, imageSize - offset});
+            break;
+        }
+
+        // Extend the previous range if it ends at this chunk
+        if (!result.ranges.empty() &&
+            result.ranges.back().offset + result.ranges.back().length ==
+                offset)
+        {
+            result.ranges.back().length += length;
+        }
+        else
+        {
+            result.ranges.push_back({offset, length});
+        }
+    }
+
+    return result;
+}
+
+void write(const std::string& device, const std::string& image,
+           const std::vector<Range>& ranges)
+{
+    File deviceFile(device, O_WRONLY);
+    File imageFile(image, O_RDONLY);
+    auto buffer = allocate(defaultChunkSize);
+
+    for (const auto& range : ranges)
+    {
+        for (uint64_t done = 0; done < range.length;
+             done += defaultChunkSize)
+        {
+            auto length =
+                std::min<uint64_t>(defaultChunkSize, range.length - done);
+            imageFile.read(buffer.get(), length, range.offset + done);
+            deviceFile.write(buffer.get(), length, range.offset + done);
+        }
+    }
+
+    deviceFile.sync();
+}
+
+} // namespace image_compare
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace image_compare
+{
+
+/** @brief The default size of the chunks that are compared */
+constexpr size_t defaultChunkSize = 64 * 1024;
+
+/** @brief A byte range of a device */
+struct Range
+{
+    /** @brief The offset of the first byte */
+    uint64_t offset;
+    /** @brief The number of bytes */
+    uint64_t length;
+
+    bool operator==(const Range&) const = default;
+};
+
+/** @brief The outcome of comparing a device with an image */
+struct Result
+{
+    /** @brief Whether the device starts with the content of the image */
+    bool identical = true;
+    /** @brief The ranges of the device that must be rewritten from the image
+     *  to make it identical, ordered by offset */
+    std::vector<Range> ranges;
+    /** @brief The number of bytes of the image that were compared */
+    uint64_t compared = 0;
+};
+
+/** @brief Compare a device with an image written at its start.
+ *
+ * @details The device and image are read side by side in aligned chunks,
+ *          without copying either of them. Only the size of the image is
+ *          compared, the rest of the device is ignored.
+ *
+ * @param[in] device    - The path of the device.
+ * @param[in] image     - The path of the image.
+ * @param[in] allRanges - By default the comparison stops at the first
+ *                        differing chunk and a single range from it to the
+ *                        end of the image is returned. If true, the whole
+ *                        image is compared and each run of differing chunks
+ *                        is returned as a range.
+ * @param[in] chunkSize - The size of the chunks, a multiple of 4096.
+ *
+ * @return The result of the comparison.
+ *
+ * @throws std::system_error on I/O errors, including a device smaller than
+ *         the image.
+ */
+Result compare(const std::string& device, const std::string& image,
+               bool allRanges = false, size_t chunkSize = defaultChunkSize);
+
+/** @brief Write ranges of an image to a device.
+ *
+ * @param[in] device - The path of the device.
+ * @param[in] image  - The path of the image.
+ * @param[in] ranges - The ranges to write, as returned by compare().
+ *
+ * @throws std::system_error on I/O errors.
+ */
+void write(const std::string& device, const std::string& image,
+           const std::vector<Range>& ranges);
+
+} // namespace image_compare
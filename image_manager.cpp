@@ -2,24 +2,51 @@
 
 #include "image_manager.hpp"
 
+#include "images.hpp"
+#include "mapper.hpp"
+#include "process.hpp"
+#include "utils.hpp"
 #include "version.hpp"
 #include "watch.hpp"
 
+#ifdef STREAM_STAGING
+#include "emmc_writer.hpp"
+
+#include <openssl/evp.h>
+#endif
+
+#if defined STREAM_STAGING || defined IMAGE_STORE
+#include "key_value_file.hpp"
+#include "tar_stream.hpp"
+#endif
+
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <unistd.h>
 
 #include <elog-errors.hpp>
 #include <phosphor-logging/elog.hpp>
 #include <phosphor-logging/lg2.hpp>
+#include <sdbusplus/exception.hpp>
 #include <xyz/openbmc_project/Software/Image/error.hpp>
 
 #include <algorithm>
+#include <array>
 #include <cstring>
+#include <exception>
 #include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
 
 namespace phosphor
 {
@@ -36,20 +63,23 @@ using ManifestFail = Software::Image::ManifestFileFailure;
 using UnTarFail = Software::Image::UnTarFailure;
 using InternalFail = Software::Image::InternalFailure;
 using ImageFail = Software::Image::ImageFailure;
+using namespace phosphor::software::image;
+using namespace std::string_literals;
 namespace fs = std::filesystem;
 
 struct RemovablePath
 {
     fs::path path;
+    reclaimer::Reclaimer& reclaimer;
 
-    RemovablePath(const fs::path& path) : path(path)
+    RemovablePath(const fs::path& path, reclaimer::Reclaimer& reclaimer) :
+        path(path), reclaimer(reclaimer)
     {}
     ~RemovablePath()
     {
         if (!path.empty())
         {
-            std::error_code ec;
-            fs::remove_all(path, ec);
+            reclaimer.remove(path);
         }
     }
 };
@@ -57,70 +87,476 @@ struct RemovablePath
 namespace // anonymous
 {
 
+/** @brief The error the image being processed failed with, reported by the
+ *         Uploaded signal. Per thread, as the archives are extracted on a
+ *         worker. */
+thread_local std::exception_ptr imageError;
+
+/** @brief Report an error processing an image, and keep it as imageError.
+ *
+ * @param[in] metadata - The metadata of the error log entry.
+ */
+template <typename T, typename... Args>
+void fail(Args... metadata)
+{
+    report<T>(metadata...);
+    imageError = std::make_exception_ptr(T());
+}
+
+#ifndef SINGLE_BINARY
 std::vector<std::string> getSoftwareObjects(sdbusplus::bus::bus& bus)
 {
-    std::vector<std::string> paths;
-    auto method = bus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
-                                      MAPPER_INTERFACE, "GetSubTreePaths");
-    method.append(SOFTWARE_OBJPATH);
-    method.append(0); // Depth 0 to search all
-    method.append(std::vector<std::string>({VERSION_BUSNAME}));
-    auto reply = bus.call(method);
-    reply.read(paths);
-    return paths;
+    return mapper::getClient(bus).getSubTreePaths(SOFTWARE_OBJPATH,
+                                                  VERSION_BUSNAME);
+}
+#endif
+
+#ifdef STREAM_STAGING
+/** @brief Images that are written to the inactive flash slot as they are
+ *         read out of the archive, and the partitions they go to */
+const std::map<std::string, std::string> streamedImages = {
+    {"image-kernel", "boot-"}, {"image-rofs", "rofs-"}};
+
+/** @brief The digests recorded for a streamed image, the hash functions a
+ *         signature may use */
+constexpr std::array streamedDigests = {"sha256", "sha512"};
+
+/** @brief Write an image read out of an archive to its partition in the
+ *         inactive slot, and record the slot and digests of the image in
+ *         place of the image file, in the directory of the records.
+ *
+ * @param[in] dir    - The directory the archive is extracted to.
+ * @param[in] entry  - The archive entry of the image.
+ * @param[in] reader - The archive reader, at the content of the image.
+ * @param[in] slot   - The inactive slot, locked for the write.
+ * @param[in] label  - The label of the inactive slot.
+ *
+ * @throws std::exception on errors.
+ */
+void streamImage(const fs::path& dir, const tar_stream::Entry& entry,
+                 tar_stream::Reader& reader, const SlotLock& slot,
+                 const std::string& label)
+{
+    auto name = streamedImages.at(entry.name) + label;
+    auto partition = emmc_writer::findPartition(emmc_writer::defaultDisk,
+                                                name);
+    if (!partition)
+    {
+        throw std::runtime_error("no partition " + name);
+    }
+
+    using EVP_MD_CTX_Ptr =
+        std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)>;
+    std::vector<EVP_MD_CTX_Ptr> digests;
+    for (const auto& digest : streamedDigests)
+    {
+        digests.emplace_back(EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
+        if (!digests.back() ||
+            EVP_DigestInit_ex(digests.back().get(),
+                              EVP_get_digestbyname(digest), nullptr) <= 0)
+        {
+            throw std::runtime_error("EVP_DigestInit_ex");
+        }
+    }
+
+    // The signature is over the compressed image, hash it as it is read
+    auto source = [&](char* buffer, size_t size) {
+        auto bytes = reader.read(buffer, size);
+        for (auto& ctx : digests)
+        {
+            EVP_DigestUpdate(ctx.get(), buffer, bytes);
+        }
+        return bytes;
+    };
+    emmc_writer::writeImage(emmc_writer::defaultDisk, *partition, source,
+                            entry.name);
+
+    auto record = streamedRecord(dir / entry.name);
+    fs::create_directories(record.parent_path());
+    fs::permissions(streamedDir, fs::perms::owner_all);
+    std::ofstream marker(record);
+    marker << "Label=" << label << "\n";
+    marker << "Generation=" << slot.generation() << "\n";
+    marker << "Size=" << entry.size << "\n";
+    for (auto& ctx : digests)
+    {
+        std::array<unsigned char, EVP_MAX_MD_SIZE> md{};
+        unsigned int length = 0;
+        EVP_DigestFinal_ex(ctx.get(), md.data(), &length);
+        marker << OBJ_nid2sn(EVP_MD_CTX_type(ctx.get())) << "=";
+        for (unsigned int i = 0; i < length; i++)
+        {
+            constexpr auto hex = "0123456789abcdef";
+            marker << hex[md[i] >> 4] << hex[md[i] & 0xf];
+        }
+        marker << "\n";
+    }
+    marker.close();
+    if (!marker)
+    {
+        throw std::runtime_error("write " + entry.name + streamedSuffix);
+    }
+
+    info("Streamed {IMAGE} to partition {PARTITION}", "IMAGE", entry.name,
+         "PARTITION", name);
 }
 
+/** @brief Lock the inactive slot to stream images to it, and record that
+ *         the version installed there is overwritten.
+ *
+ * @param[in] label - The label of the inactive slot.
+ *
+ * @return The lock, or nullptr if an activation is writing the slot.
+ *
+ * @throws std::exception on errors.
+ */
+std::unique_ptr<SlotLock> takeSlot(const std::string& label)
+{
+    std::unique_ptr<SlotLock> slot;
+    try
+    {
+        slot = std::make_unique<SlotLock>(label);
+    }
+    catch (const std::system_error& e)
+    {
+        if (e.code().value() != EWOULDBLOCK)
+        {
+            throw;
+        }
+        info("An activation is writing the {LABEL} slot, the images are "
+             "extracted instead",
+             "LABEL", label);
+        return nullptr;
+    }
+
+    // The installed version has to be uploaded again to be activated
+    auto installed =
+        Version::getBMCVersions(BMC_ROFS_PREFIX + label + OS_RELEASE_FILE)
+            .first;
+    slot->bump(installed.empty() ? "" : Version::getId(installed));
+    return slot;
+}
+#endif
+
+#if defined STREAM_STAGING || defined IMAGE_STORE
+/** @brief Read the MANIFEST an archive starts with, and write it to the
+ *         extract directory if it is the one of a BMC image of this machine.
+ *
+ * @param[in] reader - The archive reader, at the start of the archive.
+ * @param[in] dir    - The directory the archive is extracted to.
+ *
+ * @return Whether the archive holds a BMC image of this machine.
+ *
+ * @throws std::exception on errors.
+ */
+bool readBmcManifest(tar_stream::Reader& reader, const fs::path& dir)
+{
+    // Directory entries, such as the "./" of tar -C dir ., come first
+    tar_stream::Entry entry;
+    bool found = false;
+    while ((found = reader.next(entry)) && entry.type == '5')
+    {}
+    if (!found || !entry.isFile() || entry.name != MANIFEST_FILE_NAME ||
+        entry.size > KeyValueFile::maxSize)
+    {
+        return false;
+    }
+    std::string manifest(entry.size, '\0');
+    reader.read(manifest.data(), manifest.size());
+
+    constexpr std::array<std::string_view, 2> keys = {"purpose",
+                                                      "MachineName"};
+    std::array<std::string_view, 2> values;
+    KeyValueFile::parse(manifest, keys, values);
+    auto purpose = sdbusplus::message::convert_from_string<
+        Version::VersionPurpose>(std::string(values[0]));
+    if (purpose != Version::VersionPurpose::BMC ||
+        values[1] != Version::getBMCMachine(OS_RELEASE_FILE))
+    {
+        return false;
+    }
+
+    std::ofstream output(dir / MANIFEST_FILE_NAME, std::ios::binary);
+    output << manifest;
+    output.close();
+    if (!output)
+    {
+        throw std::runtime_error("write " MANIFEST_FILE_NAME);
+    }
+    return true;
+}
+#endif
+
 } // namespace
 
+Manager::Manager(sdbusplus::bus::bus& bus, sd_event* loop) :
+    bus(bus), trash(bus, SOFTWARE_OBJPATH),
+    reclaimer(fs::path(IMG_UPLOAD_DIR) / ".trash", loop,
+              std::bind(&Manager::onReclaimed, this))
+#ifdef IMAGE_STORE
+    ,
+    store(fs::path(IMG_UPLOAD_DIR) / ".blobs"),
+    imageStore(bus, SOFTWARE_OBJPATH)
+#endif
+{
+#ifdef SINGLE_BINARY
+    getHandoffQueue().setReleaser(
+        std::bind(&Manager::release, this, std::placeholders::_1));
+#endif
+    eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (eventFd < 0)
+    {
+        throw std::runtime_error("eventfd failed, errno="s +
+                                 std::strerror(errno));
+    }
+    auto rc = sd_event_add_io(loop, &eventSource, eventFd, EPOLLIN,
+                              onExtracted, this);
+    if (rc < 0)
+    {
+        close(eventFd);
+        throw std::runtime_error("sd_event_add_io failed, rc="s +
+                                 std::to_string(rc));
+    }
+
+#ifdef IMAGE_STORE
+    updateStore();
+#endif
+}
+
+Manager::~Manager()
+{
+    if (extractor.joinable())
+    {
+        extractor.join();
+    }
+    sd_event_source_unref(eventSource);
+    close(eventFd);
+}
+
 int Manager::processImage(const std::string& tarFilePath)
 {
     if (!fs::is_regular_file(tarFilePath))
     {
         error("Tarball {PATH} does not exist", "PATH", tarFilePath);
-        report<ManifestFileFailure>(ManifestFail::PATH(tarFilePath.c_str()));
+        fail<ManifestFileFailure>(ManifestFail::PATH(tarFilePath.c_str()));
         return -1;
     }
-    RemovablePath tarPathRemove(tarFilePath);
+
+    extract(tarFilePath, [this, tarFilePath](const std::string& dir) {
+        RemovablePath tarPathRemove(tarFilePath, reclaimer);
+        std::string objPath;
+        if (!dir.empty())
+        {
+            processArchive(tarFilePath, dir, objPath);
+        }
+#ifdef IMAGE_STORE
+        updateStore();
+#endif
+    });
+    return 0;
+}
+
+void Manager::extract(const std::string& tarFilePath, Extracted done)
+{
+    extractions.push_back({tarFilePath, std::move(done)});
+    extractNext();
+}
+
+void Manager::extractNext()
+{
+    while (!extractor.joinable() && !extractions.empty())
+    {
+        extractDir = createExtractDir();
+        if (!extractDir.empty())
+        {
+            extractor = std::jthread([this,
+                                      tarFilePath =
+                                          extractions.front().tarFilePath,
+                                      dir = extractDir]() {
+                imageError = nullptr;
+                extractRc = extractArchive(tarFilePath, dir);
+                extractError = imageError;
+                uint64_t done = 1;
+                if (::write(eventFd, &done, sizeof(done)) < 0)
+                {
+                    error("Failed to notify the event loop: {ERRNO}",
+                          "ERRNO", errno);
+                }
+            });
+            return;
+        }
+
+        auto extraction = std::move(extractions.front());
+        extractions.pop_front();
+        extraction.done({});
+    }
+}
+
+int Manager::onExtracted(sd_event_source* /* source */, int fd,
+                         uint32_t /* revents */, void* userdata)
+{
+    auto manager = static_cast<Manager*>(userdata);
+    uint64_t count = 0;
+    if (::read(fd, &count, sizeof(count)) < 0 ||
+        !manager->extractor.joinable())
+    {
+        return 0;
+    }
+    manager->extractor.join();
+
+    auto extraction = std::move(manager->extractions.front());
+    manager->extractions.pop_front();
+    auto dir = manager->extractDir;
+    imageError = manager->extractError;
+    if (manager->extractRc < 0)
+    {
+        manager->reclaimer.remove(dir);
+#ifdef STREAM_STAGING
+        removeStreamedRecords(dir);
+#endif
+        dir.clear();
+    }
+    extraction.done(dir);
+    manager->extractNext();
+    return 0;
+}
+
+std::string Manager::createExtractDir()
+{
     fs::path tmpDirPath(std::string{IMG_UPLOAD_DIR});
     tmpDirPath /= "imageXXXXXX";
     auto tmpDir = tmpDirPath.string();
 
-    // Create a tmp dir to extract tarball.
     if (!mkdtemp(tmpDir.data()))
     {
         error("Error ({ERRNO}) occurred during mkdtemp", "ERRNO", errno);
-        report<InternalFailure>(InternalFail::FAIL("mkdtemp"));
-        return -1;
+        fail<InternalFailure>(InternalFail::FAIL("mkdtemp"));
+        return {};
     }
+#ifdef STREAM_STAGING
+    // The name may have been used before, by an upload that failed
+    removeStreamedRecords(tmpDir);
+#endif
+    return tmpDir;
+}
 
-    tmpDirPath = tmpDir;
-    RemovablePath tmpDirToRemove(tmpDirPath);
-    fs::path manifestPath = tmpDirPath;
-    manifestPath /= MANIFEST_FILE_NAME;
-
-    // Untar tarball into the tmp dir
-    auto rc = unTar(tarFilePath, tmpDirPath.string());
+int Manager::extractArchive(const std::string& tarFilePath,
+                            const std::string& extractDirPath)
+{
+#if defined STREAM_STAGING || defined IMAGE_STORE
+    auto rc = streamTar(tarFilePath, extractDirPath);
+#else
+    auto rc = unTar(tarFilePath, extractDirPath);
+#endif
     if (rc < 0)
     {
         error("Error ({RC}) occurred during untar", "RC", rc);
-        return -1;
     }
+    return rc;
+}
+
+void Manager::uploadImage(int fd, Uploaded done)
+{
+    imageError = nullptr;
+
+    // Read the archive through /proc, from a copy of the descriptor that tar
+    // inherits, as the message owns the descriptor.
+    auto archiveFd = fcntl(fd, F_DUPFD, 3);
+    if (archiveFd < 0)
+    {
+        error("Error ({ERRNO}) occurred during dup", "ERRNO", errno);
+        fail<InternalFailure>(InternalFail::FAIL("dup"));
+        std::rethrow_exception(imageError);
+    }
+
+    auto tarFilePath = "/proc/self/fd/" + std::to_string(archiveFd);
+    extract(tarFilePath, [this, archiveFd, tarFilePath,
+                          done = std::move(done)](const std::string& dir) {
+        std::string objPath;
+        int rc = -1;
+        if (!dir.empty())
+        {
+            try
+            {
+                rc = processArchive(tarFilePath, dir, objPath);
+            }
+            catch (const std::exception& e)
+            {
+                error("Failed to process {PATH}: {ERROR}", "PATH",
+                      tarFilePath, "ERROR", e);
+                imageError = nullptr;
+            }
+        }
+        close(archiveFd);
+#ifdef IMAGE_STORE
+        updateStore();
+#endif
+        if (rc < 0 && !imageError)
+        {
+            fail<InternalFailure>(InternalFail::FAIL("upload"));
+        }
+        done(objPath, rc < 0 ? imageError : nullptr);
+    });
+}
+
+uint64_t ImageUpload::upload(sdbusplus::message::unix_fd image)
+{
+    auto id = ++lastId;
+    manager.uploadImage(image.fd, [this, id](const std::string& objPath,
+                                             std::exception_ptr failure) {
+        std::string name;
+        if (failure)
+        {
+            try
+            {
+                std::rethrow_exception(failure);
+            }
+            catch (const sdbusplus::exception::exception& e)
+            {
+                name = e.name();
+            }
+            catch (...)
+            {
+                name = InternalFailure().name();
+            }
+        }
+        uploaded(id,
+                 sdbusplus::message::object_path(objPath.empty() ? "/"
+                                                                 : objPath),
+                 name);
+    });
+    return id;
+}
+
+int Manager::processArchive(const std::string& tarFilePath,
+                            const std::string& extractDirPath,
+                            std::string& objPath)
+{
+    fs::path tmpDirPath(extractDirPath);
+    RemovablePath tmpDirToRemove(tmpDirPath, reclaimer);
+    fs::path manifestPath = tmpDirPath;
+    manifestPath /= MANIFEST_FILE_NAME;
 
     // Verify the manifest file
     if (!fs::is_regular_file(manifestPath))
     {
         error("No manifest file {PATH}", "PATH", tarFilePath);
-        report<ManifestFileFailure>(ManifestFail::PATH(tarFilePath.c_str()));
+        fail<ManifestFileFailure>(ManifestFail::PATH(tarFilePath.c_str()));
         return -1;
     }
 
+    // Read all the manifest values used below with a single pass
+    auto [version, machineStr, purposeString, extendedVersion] =
+        Version::getValues(manifestPath.string(),
+                           {"version", "MachineName", "purpose",
+                            "ExtendedVersion"});
+
     // Get version
-    auto version = Version::getValue(manifestPath.string(), "version");
     if (version.empty())
     {
         error("Unable to read version from manifest file {PATH}", "PATH",
               tarFilePath);
-        report<ManifestFileFailure>(ManifestFail::PATH(tarFilePath.c_str()));
+        fail<ManifestFileFailure>(ManifestFail::PATH(tarFilePath.c_str()));
         return -1;
     }
 
@@ -131,14 +567,12 @@ int Manager::processImage(const std::string& tarFilePath)
         auto path = OS_RELEASE_FILE;
         error("Failed to read machine name from osRelease: {PATH}", "PATH",
               path);
-        report<ImageFailure>(ImageFail::FAIL("Failed to read machine name"),
-                             ImageFail::PATH(path));
+        fail<ImageFailure>(ImageFail::FAIL("Failed to read machine name"),
+                           ImageFail::PATH(path));
         return -1;
     }
 
-    // Get machine name for image to be upgraded
-    std::string machineStr =
-        Version::getValue(manifestPath.string(), "MachineName");
+    // Check machine name for image to be upgraded
     if (!machineStr.empty())
     {
         if (machineStr != currMachine)
@@ -146,7 +580,7 @@ int Manager::processImage(const std::string& tarFilePath)
             error(
                 "BMC upgrade: Machine name doesn't match: {CURRENT_MACHINE} vs {NEW_MACHINE}",
                 "CURRENT_MACHINE", currMachine, "NEW_MACHINE", machineStr);
-            report<ImageFailure>(
+            fail<ImageFailure>(
                 ImageFail::FAIL("Machine name does not match"),
                 ImageFail::PATH(manifestPath.string().c_str()));
             return -1;
@@ -160,13 +594,12 @@ int Manager::processImage(const std::string& tarFilePath)
             ImageFail::PATH(manifestPath.string().c_str()));
     }
 
-    // Get purpose
-    auto purposeString = Version::getValue(manifestPath.string(), "purpose");
+    // Check purpose
     if (purposeString.empty())
     {
         error("Unable to read purpose from manifest file {PATH}", "PATH",
               tarFilePath);
-        report<ManifestFileFailure>(ManifestFail::PATH(tarFilePath.c_str()));
+        fail<ManifestFileFailure>(ManifestFail::PATH(tarFilePath.c_str()));
         return -1;
     }
 
@@ -182,29 +615,51 @@ int Manager::processImage(const std::string& tarFilePath)
     }
     auto purpose = convertedPurpose.value_or(Version::VersionPurpose::Unknown);
 
-    // Get ExtendedVersion
-    std::string extendedVersion =
-        Version::getValue(manifestPath.string(), "ExtendedVersion");
-
     // Compute id
     auto id = Version::getId(version);
 
+    auto existing = versions.find(id);
+    if (existing != versions.end() && existing->second->version() != version)
+    {
+        error(
+            "Version id {VERSIONID} of {VERSION} collides with version {EXISTING}",
+            "VERSIONID", id, "VERSION", version, "EXISTING",
+            existing->second->version());
+        fail<ImageFailure>(ImageFail::FAIL("Version id collision"),
+                           ImageFail::PATH(tarFilePath.c_str()));
+        return -1;
+    }
+
     fs::path imageDirPath = std::string{IMG_UPLOAD_DIR};
     imageDirPath /= id;
 
-    if (fs::exists(imageDirPath))
-    {
-        fs::remove_all(imageDirPath);
-    }
+    reclaimer.remove(imageDirPath);
 
     // Rename the temp dir to image dir
     fs::rename(tmpDirPath, imageDirPath);
+#ifdef STREAM_STAGING
+    moveStreamedRecords(tmpDirPath, imageDirPath);
+#endif
 
     // Clear the path, so it does not attemp to remove a non-existing path
     tmpDirToRemove.path.clear();
 
-    auto objPath = std::string{SOFTWARE_OBJPATH} + '/' + id;
+    objPath = std::string{SOFTWARE_OBJPATH} + '/' + id;
 
+#ifdef SINGLE_BINARY
+    // The item updater publishes the Version object of the image for both
+    // services, see onHandedOff().
+    if (versions.find(id) == versions.end())
+    {
+        getHandoffQueue().push(
+            {objPath, id, version, purpose, extendedVersion,
+             imageDirPath.string()},
+            [this](const handoff::Image& image, handoff::Outcome outcome) {
+                onHandedOff(image, outcome);
+            });
+        return 0;
+    }
+#else
     // This service only manages the uploaded versions, and there could be
     // active versions on D-Bus that is not managed by this service.
     // So check D-Bus if there is an existing version.
@@ -213,25 +668,30 @@ int Manager::processImage(const std::string& tarFilePath)
         std::find(allSoftwareObjs.begin(), allSoftwareObjs.end(), objPath);
     if (versions.find(id) == versions.end() && it == allSoftwareObjs.end())
     {
-        // Create Version object
-        auto versionPtr = std::make_unique<Version>(
-            bus, objPath, version, purpose, extendedVersion,
-            imageDirPath.string(),
-            std::bind(&Manager::erase, this, std::placeholders::_1));
-        versionPtr->deleteObject =
-            std::make_unique<phosphor::software::manager::Delete>(bus, objPath,
-                                                                  *versionPtr);
-        versions.insert(std::make_pair(id, std::move(versionPtr)));
-    }
-    else
-    {
-        info("Software Object with the same version ({VERSION}) already exists",
-             "VERSION", id);
-        fs::remove_all(imageDirPath);
+        createVersion({objPath, id, version, purpose, extendedVersion,
+                       imageDirPath.string()});
+        return 0;
     }
+#endif
+
+    info("Software Object with the same version ({VERSION}) already exists",
+         "VERSION", id);
+    reclaimer.remove(imageDirPath);
     return 0;
 }
 
+void Manager::createVersion(const handoff::Image& image)
+{
+    auto versionPtr = std::make_unique<Version>(
+        bus, image.path, image.version, image.purpose, image.extendedVersion,
+        image.filePath,
+        std::bind(&Manager::erase, this, std::placeholders::_1));
+    versionPtr->deleteObject =
+        std::make_unique<phosphor::software::manager::Delete>(bus, image.path,
+                                                              *versionPtr);
+    versions.insert(std::make_pair(image.versionId, std::move(versionPtr)));
+}
+
 void Manager::erase(std::string entryId)
 {
     auto it = versions.find(entryId);
@@ -248,14 +708,85 @@ void Manager::erase(std::string entryId)
         return;
     }
 
-    // Delete image dir
-    fs::path imageDirPath = (*(it->second)).path();
-    if (fs::exists(imageDirPath))
+    // Delete image dir, the store is reclaimed once it is gone
+    reclaimer.remove((*(it->second)).path());
+    this->versions.erase(entryId);
+}
+
+#ifdef SINGLE_BINARY
+void Manager::onHandedOff(const handoff::Image& image,
+                          handoff::Outcome outcome)
+{
+    switch (outcome)
+    {
+        case handoff::Outcome::accepted:
+            handedOff[image.versionId] = image.filePath;
+            break;
+        case handoff::Outcome::exists:
+        {
+            info("Software Object with the same version ({VERSION}) already "
+                 "exists",
+                 "VERSION", image.versionId);
+            reclaimer.remove(image.filePath);
+            break;
+        }
+        case handoff::Outcome::rejected:
+            // Nothing in the item updater manages it, publish it as this
+            // service does on its own.
+            createVersion(image);
+            break;
+    }
+}
+
+void Manager::release(const std::string& versionId)
+{
+    auto it = handedOff.find(versionId);
+    if (it == handedOff.end())
     {
-        fs::remove_all(imageDirPath);
+        return;
     }
-    this->versions.erase(entryId);
+
+    reclaimer.remove(it->second);
+    handedOff.erase(it);
 }
+#endif
+
+void Manager::onReclaimed()
+{
+    auto pending = reclaimer.pendingBytes();
+    trash.pendingBytes(pending);
+    trash.freedBytes(reclaimer.freedBytes());
+#ifdef IMAGE_STORE
+    // The blobs are only unlinked once the image dirs are deleted
+    if (pending == 0)
+    {
+        updateStore();
+    }
+#endif
+}
+
+#ifdef IMAGE_STORE
+void Manager::updateStore()
+{
+    // The blobs of a tarball being extracted are not linked yet, the store
+    // is updated once it is extracted.
+    if (extractor.joinable())
+    {
+        return;
+    }
+
+    auto freed = store.collect();
+    if (freed > 0)
+    {
+        info("Freed {SIZE} bytes of the image store", "SIZE", freed);
+    }
+
+    auto usage = store.usage();
+    imageStore.blobs(usage.blobs);
+    imageStore.storedBytes(usage.storedBytes);
+    imageStore.savedBytes(usage.savedBytes);
+}
+#endif
 
 int Manager::unTar(const std::string& tarFilePath,
                    const std::string& extractDirPath)
@@ -263,51 +794,183 @@ int Manager::unTar(const std::string& tarFilePath,
     if (tarFilePath.empty())
     {
         error("TarFilePath is empty");
-        report<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
+        fail<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
         return -1;
     }
     if (extractDirPath.empty())
     {
         error("ExtractDirPath is empty");
-        report<UnTarFailure>(UnTarFail::PATH(extractDirPath.c_str()));
+        fail<UnTarFailure>(UnTarFail::PATH(extractDirPath.c_str()));
         return -1;
     }
 
     info("Untaring {PATH} to {EXTRACTIONDIR}", "PATH", tarFilePath,
          "EXTRACTIONDIR", extractDirPath);
-    int status = 0;
-    pid_t pid = fork();
+    auto args = utils::internal::constructArgv(
+        "tar", "-xf", tarFilePath.c_str(), "-C", extractDirPath.c_str());
+    try
+    {
+        auto result = process::run("/bin/tar", args.data());
+        if (!result.succeeded())
+        {
+            error("Failed ({STATUS}, signal {SIGNAL}) to untar file {PATH}: "
+                  "{ERRORS}",
+                  "STATUS", result.exitCode, "SIGNAL", result.signal, "PATH",
+                  tarFilePath, "ERRORS", result.errors);
+            fail<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
+            return -1;
+        }
+    }
+    catch (const std::system_error& e)
+    {
+        error("Failed ({ERROR}) to execute untar on {PATH}", "ERROR", e,
+              "PATH", tarFilePath);
+        fail<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
+        return -1;
+    }
+
+    return 0;
+}
+
+#if defined STREAM_STAGING || defined IMAGE_STORE
+int Manager::streamTar(const std::string& tarFilePath,
+                       const std::string& extractDirPath)
+{
+    fs::path dir(extractDirPath);
 
-    if (pid == 0)
+#ifdef IMAGE_STORE
+    // A tarball uploaded again is not extracted again. An upload read from a
+    // pipe can only be read once, so it is not recorded.
+    std::string digest;
+    try
+    {
+        digest = blob_store::Store::archiveDigest(tarFilePath);
+        if (!digest.empty() && store.linkArchive(digest, dir))
+        {
+            info("Linked the files of {PATH} from the image store", "PATH",
+                 tarFilePath);
+            return 0;
+        }
+    }
+    catch (const std::exception& e)
     {
-        // child process
-        execl("/bin/tar", "tar", "-xf", tarFilePath.c_str(), "-C",
-              extractDirPath.c_str(), (char*)0);
-        // execl only returns on fail
-        error("Failed to execute untar on {PATH}", "PATH", tarFilePath);
-        report<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
+        error("Failed to untar file {PATH}: {ERROR}", "PATH", tarFilePath,
+              "ERROR", e);
+        fail<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
         return -1;
     }
-    else if (pid > 0)
+    std::map<std::string, std::string> files;
+#endif
+
+#ifdef STREAM_STAGING
+    std::unique_ptr<SlotLock> slot;
+    std::string label;
+    bool labelRead = false;
+    bool streamed = false;
+
+    auto streamBmcImage = [&](const tar_stream::Entry& entry,
+                              tar_stream::Reader& reader) {
+        if (!streamedImages.contains(entry.name))
+        {
+            return false;
+        }
+
+        // The slot is held until the whole archive is read
+        if (!labelRead)
+        {
+            label = emmc_writer::secondaryLabel(emmc_writer::defaultDisk);
+            labelRead = true;
+            if (!label.empty())
+            {
+                slot = takeSlot(label);
+            }
+        }
+        if (!slot)
+        {
+            return false;
+        }
+
+        streamImage(dir, entry, reader, *slot, label);
+        streamed = true;
+        return true;
+    };
+#endif
+
+    auto stream = [&](const tar_stream::Entry& entry,
+                      tar_stream::Reader& reader) {
+#ifdef STREAM_STAGING
+        if (streamBmcImage(entry, reader))
+        {
+            return true;
+        }
+#endif
+#ifdef IMAGE_STORE
+        files[entry.name] = store.add(
+            [&reader](char* buffer, size_t size) {
+                return reader.read(buffer, size);
+            },
+            dir / entry.name);
+        return true;
+#else
+        return false;
+#endif
+    };
+
+    try
     {
-        waitpid(pid, &status, 0);
-        if (WEXITSTATUS(status))
+        // Only the BMC images of this machine are streamed or stored. tar
+        // extracts any other image, which may hold subdirectories and links.
+        // A pipe cannot be read again, what is read is kept until then.
+        tar_stream::Reader reader(tarFilePath);
+        bool seekable = fs::is_regular_file(tarFilePath);
+        reader.keep(!seekable);
+        if (!readBmcManifest(reader, dir))
         {
-            error("Failed ({STATUS}) to untar file {PATH}", "STATUS", status,
-                  "PATH", tarFilePath);
-            report<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
-            return -1;
+            if (seekable)
+            {
+                return unTar(tarFilePath, extractDirPath);
+            }
+
+            auto spoolPath = dir / ".archive.tar";
+            std::ofstream spool(spoolPath, std::ios::binary);
+            reader.copyArchive(spool);
+            spool.close();
+            if (!spool)
+            {
+                throw std::runtime_error("write " + spoolPath.string());
+            }
+            auto rc = unTar(spoolPath.string(), extractDirPath);
+            fs::remove(spoolPath);
+            return rc;
         }
+        reader.keep(false);
+
+        info("Streaming {PATH} to {EXTRACTIONDIR}", "PATH", tarFilePath,
+             "EXTRACTIONDIR", extractDirPath);
+        tar_stream::extract(reader, extractDirPath, stream);
     }
-    else
+    catch (const std::exception& e)
     {
-        error("fork() failed: {ERRNO}", "ERRNO", errno);
-        report<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
+        error("Failed to untar file {PATH}: {ERROR}", "PATH", tarFilePath,
+              "ERROR", e);
+        fail<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
         return -1;
     }
 
+#ifdef IMAGE_STORE
+#ifdef STREAM_STAGING
+    // The streamed images are in the flash slot, not in the store
+    if (streamed)
+    {
+        return 0;
+    }
+#endif
+    store.addArchive(digest, files);
+#endif
+
     return 0;
 }
+#endif
 
 } // namespace manager
 } // namespace software
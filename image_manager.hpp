@@ -1,9 +1,26 @@
 #pragma once
+#include "config.h"
+
+#include "handoff.hpp"
+#include "reclaimer.hpp"
 #include "version.hpp"
+#include "xyz/openbmc_project/Software/ImageUpload/server.hpp"
+#include "xyz/openbmc_project/Software/Trash/server.hpp"
+
+#ifdef IMAGE_STORE
+#include "blob_store.hpp"
+#include "xyz/openbmc_project/Software/ImageStore/server.hpp"
+#endif
 
 #include <sdbusplus/server.hpp>
 
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
 #include <string>
+#include <thread>
 
 namespace phosphor
 {
@@ -12,6 +29,14 @@ namespace software
 namespace manager
 {
 
+using TrashInherit = sdbusplus::server::object::object<
+    sdbusplus::xyz::openbmc_project::Software::server::Trash>;
+
+#ifdef IMAGE_STORE
+using ImageStoreInherit = sdbusplus::server::object::object<
+    sdbusplus::xyz::openbmc_project::Software::server::ImageStore>;
+#endif
+
 /** @class Manager
  *  @brief Contains a map of Version dbus objects.
  *  @details The software image manager class that contains the Version dbus
@@ -22,9 +47,13 @@ class Manager
   public:
     /** @brief Constructs Manager Class
      *
-     * @param[in] bus - The Dbus bus object
+     * @param[in] bus  - The Dbus bus object
+     * @param[in] loop - The sd-event loop the deleted files are reported on
      */
-    Manager(sdbusplus::bus::bus& bus) : bus(bus){};
+    Manager(sdbusplus::bus::bus& bus, sd_event* loop);
+
+    /** @brief Waits for the archive being extracted */
+    ~Manager();
 
     /**
      * @brief Verify and untar the tarball. Verify the manifest file.
@@ -35,6 +64,24 @@ class Manager
      */
     int processImage(const std::string& tarballFilePath);
 
+    /** @brief Called on the event loop once an uploaded tarball is
+     *         processed, with the path of the Version object of the image,
+     *         or the Software.Image error it failed with */
+    using Uploaded = std::function<void(const std::string& objPath,
+                                        std::exception_ptr failure)>;
+
+    /**
+     * @brief Read a tarball from a file descriptor on a worker thread as it
+     *        is extracted, then process it as processImage() does.
+     *
+     * @param[in] fd   - The file descriptor of the tarball, duplicated.
+     * @param[in] done - Called once it is processed.
+     *
+     * @throws The Software.Image error, if the descriptor cannot be
+     *         duplicated.
+     */
+    void uploadImage(int fd, Uploaded done);
+
     /**
      * @brief Erase specified entry d-bus object
      *        and deletes the image file.
@@ -43,6 +90,16 @@ class Manager
      */
     void erase(std::string entryId);
 
+#ifdef SINGLE_BINARY
+    /**
+     * @brief Delete the image dir of a version the item updater no longer
+     *        needs, in place of deleting its d-bus object.
+     *
+     * @param[in] versionId - unique identifier of the version
+     */
+    void release(const std::string& versionId);
+#endif
+
   private:
     /** @brief Persistent map of Version dbus objects and their
      * version id */
@@ -51,6 +108,117 @@ class Manager
     /** @brief Persistent sdbusplus DBus bus connection. */
     sdbusplus::bus::bus& bus;
 
+    /** @brief Publishes the space the deleted files will free */
+    TrashInherit trash;
+
+    /** @brief Deletes the image dirs and tarballs in the background */
+    reclaimer::Reclaimer reclaimer;
+
+    /**
+     * @brief Called as the deleted files are freed, publish the space they
+     *        free, and reclaim the store once they are gone.
+     */
+    void onReclaimed();
+
+#ifdef IMAGE_STORE
+    /** @brief The store the files of the images are extracted to */
+    blob_store::Store store;
+
+    /** @brief Publishes the space the store uses */
+    ImageStoreInherit imageStore;
+
+    /**
+     * @brief Remove the files of the store no image dir links to anymore,
+     *        and publish the space it uses.
+     */
+    void updateStore();
+#endif
+
+    /**
+     * @brief Verify the manifest of an extracted tarball and create the
+     *        version object of the image.
+     *
+     * @param[in]  tarballFilePath - Tarball path.
+     * @param[in]  extractDirPath  - The dir the tarball was extracted to,
+     *                               renamed to the image dir or removed.
+     * @param[out] objPath         - The path of the Version object.
+     * @param[out] result          - 0 if successful.
+     */
+    int processArchive(const std::string& tarballFilePath,
+                       const std::string& extractDirPath,
+                       std::string& objPath);
+
+    /** @brief Called on the event loop once an archive is extracted, with
+     *         the dir it was extracted to, empty if it failed */
+    using Extracted = std::function<void(const std::string&)>;
+
+    /** @brief An archive waiting to be extracted */
+    struct Extraction
+    {
+        std::string tarFilePath;
+        Extracted done;
+    };
+
+    /**
+     * @brief Extract a tarball on a worker thread, once the tarballs queued
+     *        before it are.
+     *
+     * @details Streamed images are written to flash while they are read, so
+     *          the tarball is extracted off the event loop.
+     *
+     * @param[in] tarballFilePath - Tarball path, read once sequentially.
+     * @param[in] done            - Called once it is extracted.
+     */
+    void extract(const std::string& tarballFilePath, Extracted done);
+
+    /** @brief Start extracting the next queued tarball, unless one is being
+     *         extracted */
+    void extractNext();
+
+    /** @brief Called by sd-event once the worker has extracted a tarball */
+    static int onExtracted(sd_event_source* source, int fd, uint32_t revents,
+                           void* userdata);
+
+    /**
+     * @brief Create a tmp dir to extract a tarball to.
+     *
+     * @return The path of the dir, empty on failure.
+     */
+    std::string createExtractDir();
+
+    /**
+     * @brief Extract a tarball, streaming or storing its images when
+     *        configured to.
+     *
+     * @param[in]  tarballFilePath - Tarball path, read once sequentially.
+     * @param[in]  extractDirPath  - Dir path to extract tarball ball to.
+     * @param[out] result          - 0 if successful.
+     */
+    int extractArchive(const std::string& tarballFilePath,
+                       const std::string& extractDirPath);
+
+    /**
+     * @brief Create and populate the version and filepath interfaces of an
+     *        uploaded image.
+     *
+     * @param[in] image - The uploaded image.
+     */
+    void createVersion(const handoff::Image& image);
+
+#ifdef SINGLE_BINARY
+    /**
+     * @brief Called once the item updater took or refused an image.
+     *
+     * @param[in] image   - The uploaded image.
+     * @param[in] outcome - What the item updater did with it.
+     */
+    void onHandedOff(const handoff::Image& image, handoff::Outcome outcome);
+
+    /** @brief The image dirs of the versions the item updater took, by
+     * version id */
+    std::map<std::string, std::string> handedOff;
+#endif
+
     /**
      * @brief Untar the tarball.
      *
@@ -60,6 +228,93 @@ class Manager
      */
     static int unTar(const std::string& tarballFilePath,
                      const std::string& extractDirPath);
+
+    /** @brief The tarballs waiting to be extracted, the first one is being
+     *         extracted */
+    std::deque<Extraction> extractions;
+
+    /** @brief The dir the first tarball is extracted to */
+    std::string extractDir;
+
+    /** @brief The result of extractArchive() for the first tarball */
+    int extractRc = 0;
+
+    /** @brief The error extractArchive() reported for the first tarball */
+    std::exception_ptr extractError;
+
+    /** @brief The eventfd the worker notifies the event loop through */
+    int eventFd = -1;
+
+    /** @brief The sd-event source of eventFd */
+    sd_event_source* eventSource = nullptr;
+
+#if defined STREAM_STAGING || defined IMAGE_STORE
+    /**
+     * @brief Untar the tarball, writing the BMC images to the inactive flash
+     *        slot as they are read, and the other files to the store,
+     *        instead of extracting them.
+     *
+     * @details Keeps the extracted images out of RAM on BMCs with a small
+     *          tmpfs. The images are verified when the version is activated,
+     *          from the digests recorded while they were written. The files
+     *          of a tarball the store has seen before are linked from the
+     *          store without extracting the tarball again. Only a tarball
+     *          that starts with the MANIFEST of a BMC image of this machine
+     *          is streamed, any other is extracted by unTar().
+     *
+     * @param[in]  tarballFilePath - Tarball path.
+     * @param[in]  extractDirPath  - Dir path to extract tarball ball to.
+     * @param[out] result          - 0 if successful.
+     */
+    int streamTar(const std::string& tarballFilePath,
+                  const std::string& extractDirPath);
+#endif
+
+    /** @brief The thread extracting the first tarball, declared last so that
+     *         it is joined before the members it uses are destroyed */
+    std::jthread extractor;
+};
+
+using ImageUploadInherit = sdbusplus::server::object::object<
+    sdbusplus::xyz::openbmc_project::Software::server::ImageUpload>;
+
+/** @class ImageUpload
+ *  @brief OpenBMC ImageUpload implementation.
+ *  @details A concrete implementation for
+ *  xyz.openbmc_project.Software.ImageUpload DBus API, next to the upload
+ *  directory the Manager watches.
+ */
+class ImageUpload : public ImageUploadInherit
+{
+  public:
+    /** @brief Constructs ImageUpload
+     *
+     * @param[in] bus     - The Dbus bus object
+     * @param[in] objPath - The Dbus object path
+     * @param[in] manager - The Manager processing the images
+     */
+    ImageUpload(sdbusplus::bus::bus& bus, const std::string& objPath,
+                Manager& manager) :
+        ImageUploadInherit(bus, objPath.c_str()),
+        manager(manager)
+    {}
+
+    /**
+     * @brief Queue the tarball read from a file descriptor, the Uploaded
+     *        signal is emitted once it is processed.
+     *
+     * @param[in] image - The file descriptor of the tarball.
+     *
+     * @return The id of the upload in the Uploaded signal.
+     */
+    uint64_t upload(sdbusplus::message::unix_fd image) override;
+
+  private:
+    /** @brief The Manager processing the images */
+    Manager& manager;
+
+    /** @brief The id of the last upload */
+    uint64_t lastId = 0;
 };
 
 } // namespace manager
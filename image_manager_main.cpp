@@ -22,7 +22,9 @@ int main()
 
     try
     {
-        phosphor::software::manager::Manager imageManager(bus);
+        phosphor::software::manager::Manager imageManager(bus, loop);
+        phosphor::software::manager::ImageUpload imageUpload(
+            bus, SOFTWARE_OBJPATH, imageManager);
         phosphor::software::manager::Watch watch(
             loop, std::bind(std::mem_fn(&Manager::processImage), &imageManager,
                             std::placeholders::_1));
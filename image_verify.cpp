@@ -15,8 +15,13 @@
 #include <phosphor-logging/lg2.hpp>
 #include <xyz/openbmc_project/Common/error.hpp>
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cctype>
+#include <charconv>
 #include <fstream>
+#include <iterator>
 #include <set>
 
 namespace phosphor
@@ -34,6 +39,10 @@ using InternalFailure =
 
 constexpr auto keyTypeTag = "KeyType";
 constexpr auto hashFunctionTag = "HashType";
+constexpr auto keyIdTag = "KeyId";
+
+/** @brief The bytes of an image hashed between checks for a stop request */
+constexpr size_t hashChunkSize = 1024 * 1024;
 
 Signature::Signature(const fs::path& imageDirPath,
                      const fs::path& signedConfPath) :
@@ -42,8 +51,14 @@ Signature::Signature(const fs::path& imageDirPath,
 {
     fs::path file(imageDirPath / MANIFEST_FILE_NAME);
 
-    keyType = Version::getValue(file, keyTypeTag);
-    hashType = Version::getValue(file, hashFunctionTag);
+    auto [key, hash, id] =
+        Version::getValues(file, {keyTypeTag, hashFunctionTag, keyIdTag});
+    keyType = std::move(key);
+    hashType = std::move(hash);
+    std::transform(id.begin(), id.end(), id.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    keyId = std::move(id);
+    rofsVerity = verity::fromManifest(file);
 }
 
 AvailableKeyTypes Signature::getAvailableKeyTypesFromSystem() const
@@ -123,8 +138,9 @@ bool Signature::verifyFullImage()
     return ret;
 }
 
-bool Signature::verify()
+bool Signature::verify(std::stop_token stop)
 {
+    this->stop = std::move(stop);
     try
     {
         bool valid;
@@ -242,6 +258,38 @@ bool Signature::systemLevelVerify()
     fs::path manifestFileSig(manifestFile);
     manifestFileSig.replace_extension(SIGNATURE_FILE_EXT);
 
+    // Images that name the id of their key are verified with that key only,
+    // older images try the key type named by the manifest first and then
+    // every other key.
+    std::vector<Key_t> candidates;
+    if (!keyId.empty())
+    {
+        for (const auto& key : keyTypes)
+        {
+            if (getKeyId(getKeyHashFileNames(key).second) == keyId)
+            {
+                candidates.push_back(key);
+                break;
+            }
+        }
+        if (candidates.empty())
+        {
+            error("No system key has the key id {KEYID} of the image",
+                  "KEYID", keyId);
+            return false;
+        }
+    }
+    else
+    {
+        if (keyTypes.contains(keyType))
+        {
+            candidates.push_back(keyType);
+        }
+        std::copy_if(keyTypes.begin(), keyTypes.end(),
+                     std::back_inserter(candidates),
+                     [this](const Key_t& key) { return key != keyType; });
+    }
+
     auto valid = false;
 
     // Verify the file signature with available key types
@@ -249,7 +297,7 @@ bool Signature::systemLevelVerify()
     // For any internal failure during the key/hash pair specific
     // validation, should continue the validation with next
     // available Key/hash pair.
-    for (const auto& keyType : keyTypes)
+    for (const auto& keyType : candidates)
     {
         auto keyHashPair = getKeyHashFileNames(keyType);
 
@@ -285,7 +333,7 @@ bool Signature::verifyFile(const fs::path& file, const fs::path& sigFile,
 {
 
     // Check existence of the files in the system.
-    if (!(fs::exists(file) && fs::exists(sigFile)))
+    if (!(imageExists(file) && fs::exists(sigFile)))
     {
         error("Failed to find the Data or signature file {PATH}.", "PATH",
               file);
@@ -319,6 +367,11 @@ bool Signature::verifyFile(const fs::path& file, const fs::path& sigFile,
         elog<InternalFailure>();
     }
 
+    if (imageStreamed(file))
+    {
+        return verifyStreamed(file, sigFile, pKeyPtr.get(), hashStruct);
+    }
+
     auto result = EVP_DigestVerifyInit(rsaVerifyCtx.get(), nullptr, hashStruct,
                                        nullptr, pKeyPtr.get());
 
@@ -329,16 +382,27 @@ bool Signature::verifyFile(const fs::path& file, const fs::path& sigFile,
         elog<InternalFailure>();
     }
 
-    // Hash the data file and update the verification context
+    // Hash the data file and update the verification context, a chunk at a
+    // time so that a stop request is noticed
     auto size = fs::file_size(file);
     auto dataPtr = mapFile(file, size);
-
-    result = EVP_DigestVerifyUpdate(rsaVerifyCtx.get(), dataPtr(), size);
-    if (result <= 0)
+    auto data = static_cast<const char*>(dataPtr());
+    for (size_t offset = 0; offset < size; offset += hashChunkSize)
     {
-        error("Error ({RC}) occurred during EVP_DigestVerifyUpdate", "RC",
-              ERR_get_error());
-        elog<InternalFailure>();
+        if (stop.stop_requested())
+        {
+            info("Stopped the verification of {PATH}", "PATH", file);
+            return false;
+        }
+
+        result = EVP_DigestVerifyUpdate(rsaVerifyCtx.get(), data + offset,
+                                        std::min(hashChunkSize, size - offset));
+        if (result <= 0)
+        {
+            error("Error ({RC}) occurred during EVP_DigestVerifyUpdate", "RC",
+                  ERR_get_error());
+            elog<InternalFailure>();
+        }
     }
 
     // Verify the data with signature.
@@ -366,6 +430,114 @@ bool Signature::verifyFile(const fs::path& file, const fs::path& sigFile,
     return true;
 }
 
+bool Signature::verifyStreamed(const fs::path& file, const fs::path& sigFile,
+                               EVP_PKEY* publicKey, const EVP_MD* hashFunc)
+{
+    // The image is on flash already, its digest was computed while it was
+    // written, so verify the signature against that digest.
+    auto marker = streamedRecord(file);
+    auto hashName = OBJ_nid2sn(EVP_MD_type(hashFunc));
+    auto hex = Version::getValue(marker.string(), hashName);
+
+    std::vector<unsigned char> digest;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2)
+    {
+        unsigned char byte = 0;
+        auto [end, ec] = std::from_chars(hex.data() + i, hex.data() + i + 2,
+                                         byte, 16);
+        if (ec != std::errc() || end != hex.data() + i + 2)
+        {
+            digest.clear();
+            break;
+        }
+        digest.push_back(byte);
+    }
+    if (digest.empty() ||
+        digest.size() != static_cast<size_t>(EVP_MD_size(hashFunc)))
+    {
+        error("No {HASH} digest of the streamed image {PATH}", "HASH",
+              hashName, "PATH", file);
+        return false;
+    }
+
+    EVP_PKEY_CTX_Ptr verifyCtx(EVP_PKEY_CTX_new(publicKey, nullptr),
+                               ::EVP_PKEY_CTX_free);
+    if (!verifyCtx || EVP_PKEY_verify_init(verifyCtx.get()) <= 0 ||
+        EVP_PKEY_CTX_set_rsa_padding(verifyCtx.get(), RSA_PKCS1_PADDING) <=
+            0 ||
+        EVP_PKEY_CTX_set_signature_md(verifyCtx.get(), hashFunc) <= 0)
+    {
+        error("Error ({RC}) occurred during EVP_PKEY_verify_init", "RC",
+              ERR_get_error());
+        elog<InternalFailure>();
+    }
+
+    auto size = fs::file_size(sigFile);
+    auto signature = mapFile(sigFile, size);
+
+    auto result = EVP_PKEY_verify(
+        verifyCtx.get(), reinterpret_cast<unsigned char*>(signature()), size,
+        digest.data(), digest.size());
+    if (result < 0)
+    {
+        error("Error ({RC}) occurred during EVP_PKEY_verify", "RC",
+              ERR_get_error());
+        elog<InternalFailure>();
+    }
+    if (result == 0)
+    {
+        error("EVP_PKEY_verify:Signature validation failed on {PATH}", "PATH",
+              sigFile);
+        return false;
+    }
+    return true;
+}
+
+std::string Signature::getKeyId(const fs::path& publicKey)
+{
+    std::ifstream file(publicKey);
+    std::string pem((std::istreambuf_iterator<char>(file)),
+                    std::istreambuf_iterator<char>());
+
+    BIO_MEM_Ptr keyBio(BIO_new_mem_buf(pem.data(), pem.size()), &::BIO_free);
+    if (keyBio.get() == nullptr)
+    {
+        return {};
+    }
+    EVP_PKEY_Ptr key(PEM_read_bio_PUBKEY(keyBio.get(), nullptr, nullptr,
+                                         nullptr),
+                     ::EVP_PKEY_free);
+    if (!key)
+    {
+        return {};
+    }
+
+    unsigned char* der = nullptr;
+    auto length = i2d_PUBKEY(key.get(), &der);
+    if (length <= 0)
+    {
+        return {};
+    }
+    std::array<unsigned char, EVP_MAX_MD_SIZE> digest{};
+    unsigned int digestLength = 0;
+    auto result = EVP_Digest(der, length, digest.data(), &digestLength,
+                             EVP_sha256(), nullptr);
+    OPENSSL_free(der);
+    if (result <= 0)
+    {
+        return {};
+    }
+
+    std::string id;
+    for (unsigned int i = 0; i < digestLength; i++)
+    {
+        constexpr auto digits = "0123456789abcdef";
+        id += digits[digest[i] >> 4];
+        id += digits[digest[i] & 0xf];
+    }
+    return id;
+}
+
 inline RSA* Signature::createPublicRSA(const fs::path& publicKey)
 {
     RSA* rsa = nullptr;
@@ -408,13 +580,33 @@ bool Signature::checkAndVerifyImage(const std::string& filePath,
         fs::path file(filePath);
         file /= bmcImage;
 
-        if (!fs::exists(file))
+        if (!imageExists(file))
         {
             valid = false;
             break;
         }
         fileFound = true;
 
+#ifdef ROFS_VERITY
+        if (bmcImage == "image-rofs" && rofsVerity && !imageStreamed(file))
+        {
+            // The signed manifest carries the root hash of the image, the
+            // kernel verifies each block against it as it is read.
+#ifndef MMC_LAYOUT
+            if (!verity::checkRootHash(file, *rofsVerity))
+            {
+                error("The verity hash tree of {PATH} does not match the "
+                      "manifest",
+                      "PATH", file);
+                return false;
+            }
+#endif
+            // On eMMC the image is compressed, its tree is checked once it
+            // is written to the partition.
+            continue;
+        }
+#endif
+
         fs::path sigFile(file);
         sigFile += SIGNATURE_FILE_EXT;
 
@@ -1,5 +1,6 @@
 #pragma once
 #include "openssl_alloc.hpp"
+#include "verity.hpp"
 
 #include <openssl/evp.h>
 #include <openssl/pem.h>
@@ -8,7 +9,9 @@
 #include <unistd.h>
 
 #include <filesystem>
+#include <optional>
 #include <set>
+#include <stop_token>
 #include <string>
 #include <vector>
 
@@ -32,6 +35,8 @@ using BIO_MEM_Ptr = std::unique_ptr<BIO, decltype(&::BIO_free)>;
 using EVP_PKEY_Ptr = std::unique_ptr<EVP_PKEY, decltype(&::EVP_PKEY_free)>;
 using EVP_MD_CTX_Ptr =
     std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)>;
+using EVP_PKEY_CTX_Ptr =
+    std::unique_ptr<EVP_PKEY_CTX, decltype(&::EVP_PKEY_CTX_free)>;
 
 /** @struct CustomFd
  *
@@ -140,10 +145,26 @@ class Signature
      *        validation using the image specific public key and the
      *        hash function.
      *
+     *        @param[in] stop - Checked between the chunks of the images
+     *                          hashed, the verification fails once a stop
+     *                          is requested.
+     *
      *        @return true if signature verification was successful,
      *                     false if not
      */
-    bool verify();
+    bool verify(std::stop_token stop = {});
+
+    /**
+     * @brief Compute the key id of a public key, the SHA-256 digest of its
+     *        DER encoding, as printed by
+     *        openssl pkey -pubin -outform DER | sha256sum.
+     *
+     * @param[in] publicKey - The path of the PEM public key.
+     *
+     * @return The key id in lowercase hexadecimal, or an empty string if
+     *         the key cannot be read.
+     */
+    static std::string getKeyId(const fs::path& publicKey);
 
   private:
     /**
@@ -184,6 +205,19 @@ class Signature
     bool verifyFile(const fs::path& file, const fs::path& signature,
                     const fs::path& publicKey, const std::string& hashFunc);
 
+    /**
+     * @brief Verify the signature of an image streamed to flash, using the
+     *        digest recorded when it was streamed
+     *
+     * @param[in]  - Image file path
+     * @param[in]  - Signature file path
+     * @param[in]  - Public key
+     * @param[in]  - Hash function
+     * @return true if signature verification was successful, false if not
+     */
+    bool verifyStreamed(const fs::path& file, const fs::path& signature,
+                        EVP_PKEY* publicKey, const EVP_MD* hashFunc);
+
     /**
      * @brief Create RSA object from the public key
      * @param[in]  - publickey
@@ -218,6 +252,19 @@ class Signature
     /** @brief Hash type defined in mainfest file */
     Hash_t hashType;
 
+    /** @brief Id of the system key that signed the image, defined in the
+     *         manifest file. Empty for images that predate it. */
+    std::string keyId;
+
+    /** @brief The dm-verity parameters of the rofs image, defined in the
+     *         manifest file. When set and built with rofs-verity, the rofs
+     *         image is bound to the signed manifest by its verity root hash
+     *         instead of being hashed. */
+    std::optional<verity::Params> rofsVerity;
+
+    /** @brief Set to stop the verification in progress */
+    std::stop_token stop;
+
     /** @brief Check and Verify the required image files
      *
      * @param[in] filePath - BMC tarball file path
@@ -2,9 +2,21 @@
 
 #include "images.hpp"
 
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
 #include <iterator>
 #include <sstream>
 #include <string>
+#include <system_error>
+#include <utility>
 #include <vector>
 
 namespace phosphor
@@ -23,6 +35,285 @@ std::vector<std::string> getOptionalImages()
     return optionalImages;
 }
 
+bool imageStreamed([[maybe_unused]] const std::filesystem::path& file,
+                   [[maybe_unused]] const std::filesystem::path& dir)
+{
+#ifdef STREAM_STAGING
+    // The record is kept apart from the image directory, so that no archive
+    // extracted there can supply one.
+    std::error_code ec;
+    return !std::filesystem::exists(file, ec) &&
+           std::filesystem::is_directory(file.parent_path(), ec) &&
+           std::filesystem::is_regular_file(streamedRecord(file, dir), ec);
+#else
+    return false;
+#endif
+}
+
+std::filesystem::path streamedRecord(const std::filesystem::path& file,
+                                     const std::filesystem::path& dir)
+{
+    auto record = dir / file.parent_path().filename() / file.filename();
+    record += streamedSuffix;
+    return record;
+}
+
+void moveStreamedRecords(const std::filesystem::path& from,
+                         const std::filesystem::path& to,
+                         const std::filesystem::path& dir)
+{
+    std::error_code ec;
+    std::filesystem::remove_all(dir / to.filename(), ec);
+    std::filesystem::rename(dir / from.filename(), dir / to.filename(), ec);
+}
+
+void removeStreamedRecords(const std::filesystem::path& imageDir,
+                           const std::filesystem::path& dir)
+{
+    std::error_code ec;
+    std::filesystem::remove_all(dir / imageDir.filename(), ec);
+}
+
+bool imageExists(const std::filesystem::path& file)
+{
+    std::error_code ec;
+    return std::filesystem::exists(file, ec) || imageStreamed(file);
+}
+
+FileStates getFileStates(const std::filesystem::path& dir)
+{
+    FileStates states;
+    std::error_code ec;
+    for (std::filesystem::recursive_directory_iterator it(dir, ec), end;
+         !ec && it != end; it.increment(ec))
+    {
+        // The change time is updated by any write, and cannot be set back
+        struct stat st;
+        if (stat(it->path().c_str(), &st) == 0 && S_ISREG(st.st_mode))
+        {
+            states[it->path().string()] = {
+                st.st_size,
+                st.st_ctim.tv_sec * 1'000'000'000LL + st.st_ctim.tv_nsec,
+                st.st_ino};
+        }
+    }
+    return states;
+}
+
+namespace
+{
+
+[[noreturn]] void fail(int err, const std::string& what)
+{
+    throw std::system_error(err, std::generic_category(), what);
+}
+
+/** @brief Copy a file between descriptors, in the kernel if it can.
+ *
+ * @return 0, or the errno of the failure.
+ */
+int copyFile(int in, int out, off_t size)
+{
+    // copy_file_range() may not work across the filesystems, nothing is
+    // copied then and the data is read through a buffer instead.
+    off_t copied = 0;
+    while (copied < size)
+    {
+        auto bytes =
+            copy_file_range(in, nullptr, out, nullptr, size - copied, 0);
+        if (bytes > 0)
+        {
+            copied += bytes;
+            continue;
+        }
+        if (bytes < 0 && copied == 0 &&
+            (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+             errno == EINVAL))
+        {
+            break;
+        }
+        return bytes < 0 ? errno : EIO;
+    }
+    if (copied == size)
+    {
+        return 0;
+    }
+
+    std::array<char, 64 * 1024> buffer;
+    while (true)
+    {
+        auto bytes = read(in, buffer.data(), buffer.size());
+        if (bytes == 0)
+        {
+            return 0;
+        }
+        if (bytes < 0 || write(out, buffer.data(), bytes) != bytes)
+        {
+            return errno ? errno : EIO;
+        }
+    }
+}
+
+} // namespace
+
+void moveImage(const std::filesystem::path& from,
+               const std::filesystem::path& to)
+{
+    if (rename(from.c_str(), to.c_str()) == 0)
+    {
+        return;
+    }
+    if (errno != EXDEV)
+    {
+        fail(errno, "rename " + from.string());
+    }
+
+    // Copy next to the destination, so that it is replaced at once
+    auto tmpPath = to;
+    tmpPath += ".tmp";
+    auto in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        fail(errno, "open " + from.string());
+    }
+    struct stat st;
+    if (fstat(in, &st) < 0)
+    {
+        auto err = errno;
+        close(in);
+        fail(err, "stat " + from.string());
+    }
+    auto out = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    st.st_mode & 0777);
+    if (out < 0)
+    {
+        auto err = errno;
+        close(in);
+        fail(err, "open " + tmpPath.string());
+    }
+
+    errno = 0;
+    auto err = copyFile(in, out, st.st_size);
+    close(in);
+    if (close(out) < 0 && err == 0)
+    {
+        err = errno;
+    }
+    if (err == 0 && rename(tmpPath.c_str(), to.c_str()) < 0)
+    {
+        err = errno;
+    }
+    if (err != 0)
+    {
+        unlink(tmpPath.c_str());
+        fail(err, "copy " + from.string());
+    }
+
+    // Release the source right away, rather than with its directory
+    unlink(from.c_str());
+}
+
+namespace
+{
+
+/** @brief Read the generation and overwritten version of a slot state */
+std::pair<uint64_t, std::string> readSlot(const std::filesystem::path& path)
+{
+    uint64_t generation = 0;
+    std::string overwritten;
+    std::ifstream state(path);
+    std::string line;
+    while (std::getline(state, line))
+    {
+        if (line.starts_with("Generation="))
+        {
+            generation = std::strtoull(line.c_str() + 11, nullptr, 10);
+        }
+        else if (line.starts_with("Overwritten="))
+        {
+            overwritten = line.substr(12);
+        }
+    }
+    return {generation, overwritten};
+}
+
+} // namespace
+
+SlotLock::SlotLock(const std::string& label,
+                   const std::filesystem::path& dir) :
+    statePath(dir / label)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+
+    // The state is replaced as a whole, so the lock is on a file of its own
+    auto lockPath = statePath;
+    lockPath += ".lock";
+    fd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        fail(errno, "open " + lockPath.string());
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        auto err = errno;
+        close(fd);
+        fail(err, "lock slot " + label);
+    }
+
+    current = readSlot(statePath).first;
+}
+
+SlotLock::~SlotLock()
+{
+    close(fd);
+}
+
+uint64_t SlotLock::bump(const std::string& overwritten)
+{
+    auto tmpPath = statePath;
+    tmpPath += ".tmp";
+    {
+        std::ofstream state(tmpPath, std::ios::trunc);
+        state << "Generation=" << current + 1 << "\n";
+        if (!overwritten.empty())
+        {
+            state << "Overwritten=" << overwritten << "\n";
+        }
+        state.close();
+        if (!state)
+        {
+            fail(EIO, "write " + tmpPath.string());
+        }
+    }
+    if (rename(tmpPath.c_str(), statePath.c_str()) < 0)
+    {
+        fail(errno, "rename " + tmpPath.string());
+    }
+    return ++current;
+}
+
+std::vector<std::string>
+    getOverwrittenVersions(const std::filesystem::path& dir)
+{
+    std::vector<std::string> versions;
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it(dir, ec), end;
+         !ec && it != end; it.increment(ec))
+    {
+        if (it->path().has_extension())
+        {
+            continue;
+        }
+        auto overwritten = readSlot(it->path()).second;
+        if (!overwritten.empty())
+        {
+            versions.push_back(std::move(overwritten));
+        }
+    }
+    return versions;
+}
+
 } // namespace image
 } // namespace software
 } // namespace phosphor
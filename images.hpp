@@ -1,6 +1,14 @@
+#pragma once
+
 #include "config.h"
 
+#include <sys/types.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
 #include <string>
+#include <tuple>
 #include <vector>
 
 namespace phosphor
@@ -16,8 +24,162 @@ const std::vector<std::string> bmcImages = {"image-kernel", "image-rofs",
 // BMC flash image file name list for full flash image (image-bmc)
 const std::string bmcFullImages = {"image-bmc"};
 
+// Suffix of the record of an image that was written to the inactive flash
+// slot while it was uploaded, the record holds the label and generation of
+// the slot and the digests of the image.
+const std::string streamedSuffix = ".streamed";
+
+// The directory of the records of streamed images, by image directory name.
+// Only the image manager writes there, out of reach of the archives that are
+// extracted to the image directories.
+const std::filesystem::path streamedDir =
+    std::filesystem::path(IMG_UPLOAD_DIR) / ".streamed";
+
 std::vector<std::string> getOptionalImages();
 
+/** @brief Check if an image of an uploaded version is present, as a file or
+ *         as an image streamed to flash.
+ *
+ * @param[in] file - The path of the image file.
+ */
+bool imageExists(const std::filesystem::path& file);
+
+/** @brief Check if an image of an uploaded version was streamed to flash.
+ *
+ * @param[in] file - The path of the image file.
+ * @param[in] dir  - The directory of the records of streamed images.
+ */
+bool imageStreamed(const std::filesystem::path& file,
+                   const std::filesystem::path& dir = streamedDir);
+
+/** @brief Get the path of the record of an image streamed to flash.
+ *
+ * @param[in] file - The path of the image file.
+ * @param[in] dir  - The directory of the records of streamed images.
+ *
+ * @return The path of the record, which may not exist.
+ */
+std::filesystem::path
+    streamedRecord(const std::filesystem::path& file,
+                   const std::filesystem::path& dir = streamedDir);
+
+/** @brief Move the records of the images streamed for an image directory
+ *         along with the directory, replacing those of the destination.
+ *
+ * @param[in] from - The image directory.
+ * @param[in] to   - The path the image directory is moved to.
+ * @param[in] dir  - The directory of the records of streamed images.
+ */
+void moveStreamedRecords(const std::filesystem::path& from,
+                         const std::filesystem::path& to,
+                         const std::filesystem::path& dir = streamedDir);
+
+/** @brief Remove the records of the images streamed for an image directory.
+ *
+ * @param[in] imageDir - The image directory.
+ * @param[in] dir      - The directory of the records of streamed images.
+ */
+void removeStreamedRecords(const std::filesystem::path& imageDir,
+                           const std::filesystem::path& dir = streamedDir);
+
+// The size, change time in nanoseconds and inode of files, by path.
+using FileStates = std::map<std::string, std::tuple<off_t, int64_t, ino_t>>;
+
+/** @brief Get the state of the regular files under a directory, to tell
+ *         later whether any of them was modified or replaced.
+ *
+ * @param[in] dir - The directory.
+ *
+ * @return The states of the files, empty if dir does not exist.
+ */
+FileStates getFileStates(const std::filesystem::path& dir);
+
+/** @brief Move an image file, replacing the destination.
+ *
+ * @details Renamed when both are on the same filesystem, so that the image
+ *          never takes twice its size. Copied with copy_file_range()
+ *          otherwise, and the source is removed once it is copied.
+ *
+ * @param[in] from - The path of the image file.
+ * @param[in] to   - The path to move it to.
+ *
+ * @throws std::system_error if it cannot be moved.
+ */
+void moveImage(const std::filesystem::path& from,
+               const std::filesystem::path& to);
+
+/** @class SlotLock
+ *  @brief An exclusive lock on a flash slot, and the generation of what was
+ *         written to it.
+ *  @details The image manager holds the lock while it streams images to the
+ *           slot, and the item updater while an activation writes it. The
+ *           lock is released with the process that holds it. Each write of
+ *           the slot bumps its generation, so an image streamed to the slot
+ *           is only used while the slot still holds it.
+ */
+class SlotLock
+{
+  public:
+    SlotLock() = delete;
+    SlotLock(const SlotLock&) = delete;
+    SlotLock& operator=(const SlotLock&) = delete;
+    SlotLock(SlotLock&&) = delete;
+    SlotLock& operator=(SlotLock&&) = delete;
+
+    /** @brief Lock a slot, without waiting for it
+     *
+     * @param[in] label - The label of the slot.
+     * @param[in] dir   - The directory of the slot states.
+     *
+     * @throws std::system_error, with EWOULDBLOCK if the slot is locked.
+     */
+    explicit SlotLock(const std::string& label,
+                      const std::filesystem::path& dir = slotsDir);
+
+    ~SlotLock();
+
+    /** @brief The generation of what the slot holds */
+    uint64_t generation() const
+    {
+        return current;
+    }
+
+    /** @brief Record a write of the slot, the images streamed to it before
+     *         are no longer there.
+     *
+     * @param[in] overwritten - The installed version the write replaces,
+     *                          empty if it was not installed.
+     *
+     * @return The new generation.
+     *
+     * @throws std::system_error if the state cannot be stored.
+     */
+    uint64_t bump(const std::string& overwritten = {});
+
+    /** @brief The directory of the slot states, not watched for uploads */
+    static inline const std::filesystem::path slotsDir =
+        std::filesystem::path(IMG_UPLOAD_DIR) / ".slots";
+
+  private:
+    /** @brief The path of the state of the slot */
+    std::filesystem::path statePath;
+
+    /** @brief The locked file */
+    int fd = -1;
+
+    /** @brief The generation of what the slot holds */
+    uint64_t current = 0;
+};
+
+/** @brief Get the installed versions streamed images were written over.
+ *
+ * @param[in] dir - The directory of the slot states.
+ *
+ * @return The version ids, they have to be uploaded again to be activated.
+ */
+std::vector<std::string> getOverwrittenVersions(
+    const std::filesystem::path& dir = SlotLock::slotsDir);
+
 } // namespace image
 } // namespace software
 } // namespace phosphor
@@ -3,23 +3,31 @@
 #include "item_updater.hpp"
 
 #include "images.hpp"
+#include "mapper.hpp"
 #include "serialize.hpp"
 #include "version.hpp"
 #include "xyz/openbmc_project/Software/ExtendedVersion/server.hpp"
 #include "xyz/openbmc_project/Software/Version/server.hpp"
 
+#include <sys/stat.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
 #include <phosphor-logging/elog-errors.hpp>
 #include <phosphor-logging/elog.hpp>
 #include <phosphor-logging/lg2.hpp>
 #include <xyz/openbmc_project/Common/error.hpp>
 #include <xyz/openbmc_project/Software/Image/error.hpp>
 
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
-#include <queue>
+#include <limits>
 #include <set>
 #include <string>
 
+extern boost::asio::io_context& getIOContext();
+
 namespace phosphor
 {
 namespace software
@@ -38,12 +46,48 @@ using namespace phosphor::software::image;
 namespace fs = std::filesystem;
 using NotAllowed = sdbusplus::xyz::openbmc_project::Common::Error::NotAllowed;
 
+namespace
+{
+
+/** @brief Check if a directory under MEDIA_DIR holds a BMC image */
+bool isBMCImageDir(const fs::path& dir)
+{
+    return dir.native().starts_with(BMC_ROFS_PREFIX);
+}
+
+/** @brief Get the modification time and size of the os-release of the image
+ *         mounted on a directory.
+ *
+ * @param[in]  mountDir - The directory the image is mounted on.
+ * @param[out] modified - The modification time, in ns.
+ * @param[out] size     - The size of the file.
+ *
+ * @return true if the os-release is a regular file.
+ */
+bool statRelease(const fs::path& mountDir, int64_t& modified, uint64_t& size)
+{
+    fs::path releaseFile(OS_RELEASE_FILE);
+    auto osRelease = mountDir / releaseFile.relative_path();
+
+    struct stat st;
+    if (stat(osRelease.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return false;
+    }
+
+    modified = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+               st.st_mtim.tv_nsec;
+    size = st.st_size;
+    return true;
+}
+
+} // namespace
+
 void ItemUpdater::createActivation(sdbusplus::message::message& msg)
 {
 
     using SVersion = server::Version;
     using VersionPurpose = SVersion::VersionPurpose;
-    using VersionClass = phosphor::software::manager::Version;
 
     sdbusplus::message::object_path objPath;
     auto purpose = VersionPurpose::Unknown;
@@ -63,16 +107,8 @@ void ItemUpdater::createActivation(sdbusplus::message::message& msg)
             {
                 if (property.first == "Purpose")
                 {
-                    auto value = SVersion::convertVersionPurposeFromString(
+                    purpose = SVersion::convertVersionPurposeFromString(
                         std::get<std::string>(property.second));
-                    if (value == VersionPurpose::BMC ||
-#ifdef HOST_BIOS_UPGRADE
-                        value == VersionPurpose::Host ||
-#endif
-                        value == VersionPurpose::System)
-                    {
-                        purpose = value;
-                    }
                 }
                 else if (property.first == "Version")
                 {
@@ -101,8 +137,7 @@ void ItemUpdater::createActivation(sdbusplus::message::message& msg)
             }
         }
     }
-    if (version.empty() || filePath.empty() ||
-        purpose == VersionPurpose::Unknown)
+    if (version.empty() || filePath.empty())
     {
         return;
     }
@@ -115,49 +150,248 @@ void ItemUpdater::createActivation(sdbusplus::message::message& msg)
         return;
     }
 
-    auto versionId = path.substr(pos + 1);
+    receiveImage(
+        {path, path.substr(pos + 1), version, purpose, extendedVersion,
+         filePath});
+}
+
+handoff::Outcome ItemUpdater::receiveImage(const handoff::Image& image)
+{
+    if (image.version.empty() || image.filePath.empty() ||
+        (image.purpose != VersionPurpose::BMC &&
+#ifdef HOST_BIOS_UPGRADE
+         image.purpose != VersionPurpose::Host &&
+#endif
+         image.purpose != VersionPurpose::System))
+    {
+        return handoff::Outcome::rejected;
+    }
 
-    if (activations.find(versionId) == activations.end())
+    const auto& versionId = image.versionId;
+    auto existing = versions.find(versionId);
+    if (existing != versions.end() &&
+        existing->second->version() != image.version)
     {
-        // Determine the Activation state by processing the given image dir.
-        auto activationState = server::Activation::Activations::Invalid;
-        ItemUpdater::ActivationStatus result;
-        if (purpose == VersionPurpose::BMC || purpose == VersionPurpose::System)
-            result = ItemUpdater::validateSquashFSImage(filePath);
-        else
-            result = ItemUpdater::ActivationStatus::ready;
+        error(
+            "Version id {VERSIONID} of {VERSION} collides with version {EXISTING}",
+            "VERSIONID", versionId, "VERSION", image.version, "EXISTING",
+            existing->second->version());
+        return handoff::Outcome::exists;
+    }
+
+    if (activations.find(versionId) != activations.end())
+    {
+        return handoff::Outcome::exists;
+    }
+
+    addActivation(image.path, versionId, image.version, image.purpose,
+                  image.extendedVersion, image.filePath);
+#ifdef STREAM_STAGING
+    // The images of the upload may have been streamed over an installed
+    // version
+    invalidateOverwritten();
+#endif
+#ifdef WANT_SIGNATURE_VERIFY
+    auto& activation = activations.find(versionId)->second;
+    if (activation->activation() == server::Activation::Activations::Ready)
+    {
+        // Verify the images ahead of the activation request, so it does not
+        // wait for it and failures show up early.
+        activation->startVerify();
+    }
+#endif
+    return handoff::Outcome::accepted;
+}
+
+void ItemUpdater::addActivation(const std::string& path,
+                                const std::string& versionId,
+                                const std::string& version,
+                                VersionPurpose purpose,
+                                const std::string& extendedVersion,
+                                const std::string& filePath)
+{
+    using VersionClass = phosphor::software::manager::Version;
+
+    // Determine the Activation state by processing the given image dir.
+    auto activationState = server::Activation::Activations::Invalid;
+    ItemUpdater::ActivationStatus result;
+    if (purpose == VersionPurpose::BMC || purpose == VersionPurpose::System)
+        result = ItemUpdater::validateSquashFSImage(filePath);
+    else
+        result = ItemUpdater::ActivationStatus::ready;
+
+    AssociationList associations = {};
+
+    if (result == ItemUpdater::ActivationStatus::ready)
+    {
+        activationState = server::Activation::Activations::Ready;
+        // Create an association to the BMC inventory item
+        associations.emplace_back(
+            std::make_tuple(ACTIVATION_FWD_ASSOCIATION,
+                            ACTIVATION_REV_ASSOCIATION, bmcInventoryPath));
+    }
 
-        AssociationList associations = {};
+    std::string id(versionId);
+    activations.insert(std::make_pair(
+        versionId, std::make_unique<Activation>(bus, path, *this, id,
+                                                activationState,
+                                                associations)));
+    indexState(versionId);
+
+    auto versionPtr = std::make_unique<VersionClass>(
+        bus, path, version, purpose, extendedVersion, filePath,
+        std::bind(&ItemUpdater::erase, this, std::placeholders::_1));
+    versionPtr->deleteObject =
+        std::make_unique<phosphor::software::manager::Delete>(bus, path,
+                                                              *versionPtr);
+    addVersion(versionId, std::move(versionPtr));
+}
 
-        if (result == ItemUpdater::ActivationStatus::ready)
+void ItemUpdater::resumeActivations()
+{
+    for (const auto& versionId : listJournals())
+    {
+        ActivationJournal journal;
+        if (!restoreJournal(versionId, journal))
         {
-            activationState = server::Activation::Activations::Ready;
-            // Create an association to the BMC inventory item
-            associations.emplace_back(
-                std::make_tuple(ACTIVATION_FWD_ASSOCIATION,
-                                ACTIVATION_REV_ASSOCIATION, bmcInventoryPath));
+            continue;
         }
 
-        activations.insert(std::make_pair(
-            versionId,
-            std::make_unique<Activation>(bus, path, *this, versionId,
-                                         activationState, associations)));
+        if (activations.find(versionId) != activations.end())
+        {
+            // The image was written completely, and found installed
+            if (journal.ubootEnvVarsUpdated || versionId == functionalVersionId)
+            {
+                info("Activation of {VERSIONID} was interrupted after it was "
+                     "committed",
+                     "VERSIONID", versionId);
+                removeJournal(versionId);
+                continue;
+            }
 
-        auto versionPtr = std::make_unique<VersionClass>(
-            bus, path, version, purpose, extendedVersion, filePath,
-            std::bind(&ItemUpdater::erase, this, std::placeholders::_1));
-        versionPtr->deleteObject =
-            std::make_unique<phosphor::software::manager::Delete>(bus, path,
-                                                                  *versionPtr);
-        versions.insert(std::make_pair(versionId, std::move(versionPtr)));
+#if defined UBIFS_LAYOUT || defined MMC_LAYOUT
+            // Set the priority once the updater is on the bus, the journal
+            // is removed once it is committed.
+            boost::asio::post(getIOContext(), [this, versionId, journal]() {
+                auto activation = activations.find(versionId);
+                if (activation != activations.end())
+                {
+                    activation->second->resumeCommit(journal);
+                }
+            });
+#endif
+            continue;
+        }
+
+        std::error_code ec;
+        if (!journal.filePath.empty() &&
+            fs::is_directory(journal.filePath, ec))
+        {
+            auto path = std::string{SOFTWARE_OBJPATH} + '/' + versionId;
+            addActivation(path, versionId, journal.version, journal.purpose,
+                          journal.extendedVersion, journal.filePath);
+            if (activations.find(versionId)->second->activation() ==
+                server::Activation::Activations::Ready)
+            {
+                // Resume once the updater is on the bus
+                boost::asio::post(getIOContext(), [this, versionId, journal]() {
+                    auto activation = activations.find(versionId);
+                    if (activation != activations.end())
+                    {
+                        activation->second->resume(journal);
+                    }
+                });
+                continue;
+            }
+        }
+
+        // The uploaded image is gone, e.g. after a power loss, remove what
+        // was written of it.
+        warning("Rolling back the interrupted activation of {VERSIONID}",
+                "VERSIONID", versionId);
+        auto activation = activations.find(versionId);
+        if (activation != activations.end())
+        {
+            removeAssociations(activation->second->path);
+            activations.erase(activation);
+            removeVersion(versionId);
+            indexState(versionId);
+        }
+        helper.removeVersion(versionId);
+        removePersistDataDirectory(versionId);
     }
-    return;
 }
 
-void ItemUpdater::processBMCImage()
+void ItemUpdater::subscribeApplyTime()
 {
-    using VersionClass = phosphor::software::manager::Version;
+    // A match is not replaced from its own callback
+    boost::asio::post(getIOContext(), [this]() {
+        applyTime.clear();
+        applyTimeMatch.reset();
+        applyTimeOwnerMatch.reset();
+
+        auto service =
+            utils::getService(bus, applyTimeObjPath, applyTimeIntf);
+        if (service.empty())
+        {
+            info("No service provides the BMC image ApplyTime yet. The BMC "
+                 "needs to be manually rebooted to complete the image "
+                 "activation if needed immediately.");
+            applyTimeOwnerMatch = std::make_unique<sdbusplus::bus::match_t>(
+                bus,
+                MatchRules::interfacesAdded() +
+                    MatchRules::argNpath(0, applyTimeObjPath),
+                [this](sdbusplus::message::message&) {
+                    subscribeApplyTime();
+                });
+            return;
+        }
+
+        // Subscribe before reading, so that no change is missed
+        applyTimeMatch = std::make_unique<sdbusplus::bus::match_t>(
+            bus,
+            MatchRules::propertiesChanged(applyTimeObjPath, applyTimeIntf) +
+                MatchRules::sender(service),
+            std::bind(std::mem_fn(&ItemUpdater::onApplyTimeChanged), this,
+                      std::placeholders::_1));
+        applyTimeOwnerMatch = std::make_unique<sdbusplus::bus::match_t>(
+            bus, MatchRules::nameOwnerChanged(service),
+            [this](sdbusplus::message::message&) { subscribeApplyTime(); });
+
+        auto method = bus.new_method_call(service.c_str(), applyTimeObjPath,
+                                          dbusPropIntf, "Get");
+        method.append(applyTimeIntf, applyTimeProp);
+        try
+        {
+            auto reply = bus.call(method);
+            std::variant<std::string> result;
+            reply.read(result);
+            applyTime = std::get<std::string>(result);
+        }
+        catch (const sdbusplus::exception::exception& e)
+        {
+            error("Error in getting ApplyTime: {ERROR}", "ERROR", e);
+        }
+    });
+}
+
+void ItemUpdater::onApplyTimeChanged(sdbusplus::message::message& msg)
+{
+    std::string interface;
+    std::map<std::string, std::variant<std::string>> properties;
+    msg.read(interface, properties);
+
+    auto property = properties.find(applyTimeProp);
+    if (property != properties.end())
+    {
+        applyTime = std::get<std::string>(property->second);
+        info("BMC image ApplyTime is now {APPLYTIME}", "APPLYTIME",
+             applyTime);
+    }
+}
 
+void ItemUpdater::processBMCImage()
+{
     // Check MEDIA_DIR and create if it does not exist
     try
     {
@@ -175,16 +409,31 @@ void ItemUpdater::processBMCImage()
     // Read os-release from /etc/ to get the functional BMC version
     auto functionalVersion = VersionClass::getBMCVersion(OS_RELEASE_FILE);
 
+    // The priorities restored below are saved again as the objects are
+    // created, write the catalogue once when done instead.
+    deferCatalogue = true;
+    if (!restoreBMCImages(functionalVersion))
+    {
+        scanBMCImages(functionalVersion);
+        deferCatalogue = false;
+        updateCatalogue();
+    }
+    deferCatalogue = false;
+
+    mirrorUbootToAlt();
+    return;
+}
+
+void ItemUpdater::scanBMCImages(const std::string& functionalVersion)
+{
     // Read os-release from folders under /media/ to get
     // BMC Software Versions.
     for (const auto& iter : fs::directory_iterator(MEDIA_DIR))
     {
-        auto activationState = server::Activation::Activations::Active;
         static const auto BMC_RO_PREFIX_LEN = strlen(BMC_ROFS_PREFIX);
 
         // Check if the BMC_RO_PREFIXis the prefix of the iter.path
-        if (0 ==
-            iter.path().native().compare(0, BMC_RO_PREFIX_LEN, BMC_ROFS_PREFIX))
+        if (isBMCImageDir(iter.path()))
         {
             // Get the version to calculate the id
             fs::path releaseFile(OS_RELEASE_FILE);
@@ -203,7 +452,10 @@ void ItemUpdater::processBMCImage()
 
                 continue;
             }
-            auto version = VersionClass::getBMCVersion(osRelease);
+            // Read os-release from /etc/ to get the BMC version and extended
+            // version
+            auto [version, extendedVersion] =
+                VersionClass::getBMCVersions(osRelease);
             if (version.empty())
             {
                 error("Failed to read version from osRelease: {PATH}", "PATH",
@@ -222,91 +474,48 @@ void ItemUpdater::processBMCImage()
             // Check if the id has already been added. This can happen if the
             // BMC partitions / devices were manually flashed with the same
             // image.
-            if (versions.find(id) != versions.end())
+            auto existing = versions.find(id);
+            if (existing != versions.end())
             {
+                if (existing->second->version() != version)
+                {
+                    error(
+                        "Version id {VERSIONID} of {VERSION} collides with version {EXISTING}",
+                        "VERSIONID", id, "VERSION", version, "EXISTING",
+                        existing->second->version());
+                }
                 continue;
             }
 
             auto purpose = server::Version::VersionPurpose::BMC;
             restorePurpose(id, purpose);
 
-            // Read os-release from /etc/ to get the BMC extended version
-            std::string extendedVersion =
-                VersionClass::getBMCExtendedVersion(osRelease);
-
-            auto path = fs::path(SOFTWARE_OBJPATH) / id;
-
-            // Create functional association if this is the functional
-            // version
-            if (version.compare(functionalVersion) == 0)
-            {
-                createFunctionalAssociation(path);
-            }
-
-            AssociationList associations = {};
-
-            if (activationState == server::Activation::Activations::Active)
-            {
-                // Create an association to the BMC inventory item
-                associations.emplace_back(std::make_tuple(
-                    ACTIVATION_FWD_ASSOCIATION, ACTIVATION_REV_ASSOCIATION,
-                    bmcInventoryPath));
-
-                // Create an active association since this image is active
-                createActiveAssociation(path);
-            }
-
-            // All updateable firmware components must expose the updateable
-            // association.
-            createUpdateableAssociation(path);
-
-            // Create Version instance for this version.
-            auto versionPtr = std::make_unique<VersionClass>(
-                bus, path, version, purpose, extendedVersion, "",
-                std::bind(&ItemUpdater::erase, this, std::placeholders::_1));
-            auto isVersionFunctional = versionPtr->isFunctional();
-            if (!isVersionFunctional)
-            {
-                versionPtr->deleteObject =
-                    std::make_unique<phosphor::software::manager::Delete>(
-                        bus, path, *versionPtr);
-            }
-            versions.insert(std::make_pair(id, std::move(versionPtr)));
+            auto isFunctional = (version.compare(functionalVersion) == 0);
 
-            // Create Activation instance for this version.
-            activations.insert(std::make_pair(
-                id, std::make_unique<Activation>(
-                        bus, path, *this, id, activationState, associations)));
-
-            // If Active, create RedundancyPriority instance for this
-            // version.
-            if (activationState == server::Activation::Activations::Active)
+            uint8_t priority = std::numeric_limits<uint8_t>::max();
+            if (!restorePriority(id, priority))
             {
-                uint8_t priority = std::numeric_limits<uint8_t>::max();
-                if (!restorePriority(id, priority))
+                if (isFunctional)
                 {
-                    if (isVersionFunctional)
-                    {
-                        priority = 0;
-                    }
-                    else
-                    {
-                        error(
-                            "Unable to restore priority from file for {VERSIONID}",
-                            "VERSIONID", id);
-                    }
+                    priority = 0;
+                }
+                else
+                {
+                    error(
+                        "Unable to restore priority from file for {VERSIONID}",
+                        "VERSIONID", id);
                 }
-                activations.find(id)->second->redundancyPriority =
-                    std::make_unique<RedundancyPriority>(
-                        bus, path, *(activations.find(id)->second), priority,
-                        false);
             }
+
+            createBMCVersion(id, version, extendedVersion, purpose, priority,
+                             isFunctional);
+            mountDirs[id] = iter.path().string();
         }
     }
 
     // If there are no bmc versions mounted under MEDIA_DIR, then read the
-    // /etc/os-release and create rofs-<versionId> under MEDIA_DIR, then call
-    // again processBMCImage() to create the D-Bus interface for it.
+    // /etc/os-release and create rofs-<versionId> under MEDIA_DIR, then scan
+    // again to create the D-Bus interface for it.
     if (activations.size() == 0)
     {
         auto version = VersionClass::getBMCVersion(OS_RELEASE_FILE);
@@ -320,16 +529,273 @@ void ItemUpdater::processBMCImage()
             }
             auto versionFilePath = BMC_ROFS_PREFIX + id + OS_RELEASE_FILE;
             fs::create_directory_symlink(OS_RELEASE_FILE, versionFilePath);
-            ItemUpdater::processBMCImage();
+            scanBMCImages(functionalVersion);
         }
         catch (const std::exception& e)
         {
             error("Exception during processing: {ERROR}", "ERROR", e);
         }
     }
+}
 
-    mirrorUbootToAlt();
-    return;
+bool ItemUpdater::restoreBMCImages(const std::string& functionalVersion)
+{
+    Catalogue catalogue;
+    if (!restoreCatalogue(catalogue) || catalogue.empty())
+    {
+        return false;
+    }
+
+    // The catalogue must list exactly the images mounted under MEDIA_DIR,
+    // and their os-release must not have changed since it was written.
+    std::set<std::string> mounted;
+    for (const auto& iter : fs::directory_iterator(MEDIA_DIR))
+    {
+        if (isBMCImageDir(iter.path()))
+        {
+            mounted.insert(iter.path().string());
+        }
+    }
+
+    std::set<std::string> recorded;
+    for (const auto& entry : catalogue)
+    {
+        int64_t modified = 0;
+        uint64_t size = 0;
+        if (!statRelease(entry.mountDir, modified, size) ||
+            modified != entry.releaseModified || size != entry.releaseSize)
+        {
+            info("Image in {PATH} changed since the version catalogue was "
+                 "written, scanning all images",
+                 "PATH", entry.mountDir);
+            return false;
+        }
+        recorded.insert(entry.mountDir);
+    }
+
+    if (mounted != recorded)
+    {
+        info("Images in {PATH} do not match the version catalogue, scanning "
+             "all images",
+             "PATH", MEDIA_DIR);
+        return false;
+    }
+
+    for (const auto& entry : catalogue)
+    {
+        if (versions.contains(entry.versionId))
+        {
+            continue;
+        }
+
+        // The priority is restored as a scan does, so that it agrees with
+        // the one the bootloader uses.
+        auto priority = entry.priority;
+        if (restorePriority(entry.versionId, priority) &&
+            priority != entry.priority)
+        {
+            warning("Priority {PRIORITY} of {VERSIONID} differs from the "
+                    "version catalogue",
+                    "PRIORITY", priority, "VERSIONID", entry.versionId);
+        }
+        createBMCVersion(entry.versionId, entry.version,
+                         entry.extendedVersion, entry.purpose, priority,
+                         entry.version == functionalVersion);
+        mountDirs[entry.versionId] = entry.mountDir;
+    }
+
+    // Check the content of each os-release once the event loop runs, so that
+    // the D-Bus objects are available without parsing them first.
+    boost::asio::post(getIOContext(),
+                      [this, catalogue = std::move(catalogue)]() {
+                          validateCatalogue(catalogue);
+                      });
+
+    return true;
+}
+
+void ItemUpdater::validateCatalogue(const Catalogue& catalogue)
+{
+    fs::path releaseFile(OS_RELEASE_FILE);
+    for (const auto& entry : catalogue)
+    {
+        auto osRelease = fs::path(entry.mountDir) / releaseFile.relative_path();
+        auto [version, extendedVersion] =
+            VersionClass::getBMCVersions(osRelease);
+        if ((version == entry.version) &&
+            (extendedVersion == entry.extendedVersion))
+        {
+            continue;
+        }
+
+        warning("{PATH} does not match the version catalogue, scanning all "
+                "images",
+                "PATH", osRelease);
+
+        // Replace the versions created from the catalogue with the ones found
+        // by a full scan.
+        for (const auto& restored : catalogue)
+        {
+            auto path = fs::path(SOFTWARE_OBJPATH) / restored.versionId;
+            removeAssociations(path);
+            activations.erase(restored.versionId);
+            removeVersion(restored.versionId);
+            indexState(restored.versionId);
+        }
+        functionalVersionId.clear();
+        removeCatalogue();
+
+        deferCatalogue = true;
+        scanBMCImages(VersionClass::getBMCVersion(OS_RELEASE_FILE));
+        deferCatalogue = false;
+        updateCatalogue();
+        return;
+    }
+}
+
+void ItemUpdater::createBMCVersion(const std::string& id,
+                                   const std::string& version,
+                                   const std::string& extendedVersion,
+                                   VersionPurpose purpose, uint8_t priority,
+                                   bool isFunctional)
+{
+    auto path = fs::path(SOFTWARE_OBJPATH) / id;
+
+    // Create functional association if this is the functional
+    // version
+    if (isFunctional)
+    {
+        createFunctionalAssociation(path);
+        functionalVersionId = id;
+    }
+
+    // Create an association to the BMC inventory item
+    AssociationList associations = {};
+    associations.emplace_back(std::make_tuple(ACTIVATION_FWD_ASSOCIATION,
+                                              ACTIVATION_REV_ASSOCIATION,
+                                              bmcInventoryPath));
+
+    // Create an active association since this image is active
+    createActiveAssociation(path);
+
+    // All updateable firmware components must expose the updateable
+    // association.
+    createUpdateableAssociation(path);
+
+    // Create Version instance for this version.
+    auto versionPtr = std::make_unique<VersionClass>(
+        bus, path, version, purpose, extendedVersion, "",
+        std::bind(&ItemUpdater::erase, this, std::placeholders::_1));
+    if (!isFunctional)
+    {
+        versionPtr->deleteObject =
+            std::make_unique<phosphor::software::manager::Delete>(
+                bus, path, *versionPtr);
+    }
+    addVersion(id, std::move(versionPtr));
+
+    // Create Activation instance for this version.
+    auto activation = std::make_unique<Activation>(
+        bus, path, *this, id, server::Activation::Activations::Active,
+        associations);
+
+    // Create RedundancyPriority instance for this version.
+    activation->redundancyPriority = std::make_unique<RedundancyPriority>(
+        bus, path, *activation, priority, false);
+    activations.insert(std::make_pair(id, std::move(activation)));
+    indexState(id);
+}
+
+void ItemUpdater::updateFlashHealth()
+{
+    std::map<std::string, flash_health::DeviceHealth> devices;
+    for (auto& device : flash_health::collect())
+    {
+        auto name = device.name;
+        devices.emplace(std::move(name), std::move(device));
+    }
+
+    std::erase_if(flashHealthObjects, [&devices](const auto& object) {
+        return !devices.contains(object.first);
+    });
+
+    for (const auto& [name, device] : devices)
+    {
+        auto& object = flashHealthObjects[name];
+        auto created = !object;
+        if (created)
+        {
+            auto path = std::string(SOFTWARE_OBJPATH) + "/flash/" + name;
+            object = std::make_unique<FlashHealthInherit>(bus, path.c_str(),
+                                                          true);
+        }
+
+        object->maxEraseCount(device.maxEraseCount);
+        object->meanEraseCount(device.meanEraseCount);
+        object->badBlocks(device.badBlocks);
+        object->correctedBits(device.correctedBits);
+        object->eccFailures(device.eccFailures);
+        object->lifeTimeUsed(device.lifeTimeUsed);
+        object->preEOLInfo(device.preEolInfo);
+
+        if (created)
+        {
+            object->emit_object_added();
+        }
+
+        if (device.nearEndOfLife())
+        {
+            warning(
+                "Flash device {DEVICE} is near the end of its life: life time used {LIFETIME}%, pre-EOL {PREEOL}, {ECCFAILURES} ECC failures",
+                "DEVICE", name, "LIFETIME", device.lifeTimeUsed, "PREEOL",
+                device.preEolInfo, "ECCFAILURES", device.eccFailures);
+        }
+    }
+}
+
+void ItemUpdater::updateCatalogue()
+{
+    if (deferCatalogue)
+    {
+        return;
+    }
+
+    Catalogue catalogue;
+    for (const auto& [id, activation] : activations)
+    {
+        if ((activation->activation() !=
+             server::Activation::Activations::Active) ||
+            !activation->redundancyPriority)
+        {
+            continue;
+        }
+        auto version = versions.find(id);
+        if (version == versions.end())
+        {
+            continue;
+        }
+
+        CatalogueEntry entry;
+        auto mountDir = mountDirs.find(id);
+        entry.mountDir = (mountDir != mountDirs.end()) ? mountDir->second
+                                                       : BMC_ROFS_PREFIX + id;
+        if (!statRelease(entry.mountDir, entry.releaseModified,
+                         entry.releaseSize))
+        {
+            // The image is not mounted yet, for example because it was
+            // written to the alternate flash and is mounted on the next boot.
+            // Leaving it out makes the next start scan all images.
+            continue;
+        }
+        entry.versionId = id;
+        entry.version = version->second->version();
+        entry.extendedVersion = version->second->extendedVersion();
+        entry.purpose = version->second->purpose();
+        entry.priority = activation->redundancyPriority->priority();
+        catalogue.push_back(std::move(entry));
+    }
+
+    storeCatalogue(catalogue);
 }
 
 void ItemUpdater::erase(std::string entryId)
@@ -364,6 +830,7 @@ void ItemUpdater::erase(std::string entryId)
     {
         removeAssociations(iteratorActivations->second->path);
         this->activations.erase(entryId);
+        indexState(entryId);
     }
     ItemUpdater::resetUbootEnvVars();
 
@@ -374,7 +841,7 @@ void ItemUpdater::erase(std::string entryId)
         removePersistDataDirectory(entryId);
 
         // Removing entry in versions map
-        this->versions.erase(entryId);
+        removeVersion(entryId);
     }
     else
     {
@@ -388,6 +855,11 @@ void ItemUpdater::erase(std::string entryId)
     }
 
     helper.clearEntry(entryId);
+#ifdef SINGLE_BINARY
+    // The object was the image manager's too, drop the uploaded image
+    getHandoffQueue().release(entryId);
+#endif
+    updateCatalogue();
 
     return;
 }
@@ -404,10 +876,38 @@ void ItemUpdater::deleteAll()
         }
     }
 
-    for (const auto& deletableIt : deletableVersions)
+    if (deletableVersions.empty())
+    {
+        helper.cleanup();
+        return;
+    }
+
+    // As erase() does, point the BMC to a remaining image before any image
+    // is deleted, but only once for all of them.
+    for (const auto& versionId : deletableVersions)
+    {
+        auto it = activations.find(versionId);
+        if (it != activations.end())
+        {
+            removeAssociations(it->second->path);
+            activations.erase(it);
+            indexState(versionId);
+        }
+    }
+    ItemUpdater::resetUbootEnvVars();
+
+    helper.removeVersions(deletableVersions);
+    for (const auto& versionId : deletableVersions)
     {
-        ItemUpdater::erase(deletableIt);
+        removePersistDataDirectory(versionId);
+        removeVersion(versionId);
+#ifdef SINGLE_BINARY
+        // The object was the image manager's too, drop the uploaded image
+        getHandoffQueue().release(versionId);
+#endif
     }
+    helper.clearEntries(deletableVersions);
+    updateCatalogue();
 
     helper.cleanup();
 }
@@ -440,6 +940,7 @@ void ItemUpdater::savePriority(const std::string& versionId, uint8_t value)
 {
     storePriority(versionId, value);
     helper.setEntry(versionId, value);
+    updateCatalogue();
 }
 
 void ItemUpdater::freePriority(uint8_t value, const std::string& versionId)
@@ -556,23 +1057,10 @@ void ItemUpdater::restoreFieldModeStatus()
 
 void ItemUpdater::setBMCInventoryPath()
 {
-    auto depth = 0;
-    auto mapperCall = bus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
-                                          MAPPER_INTERFACE, "GetSubTreePaths");
-
-    mapperCall.append(INVENTORY_PATH);
-    mapperCall.append(depth);
-    std::vector<std::string> filter = {BMC_INVENTORY_INTERFACE};
-    mapperCall.append(filter);
-
     try
     {
-        auto response = bus.call(mapperCall);
-
-        using ObjectPaths = std::vector<std::string>;
-        ObjectPaths result;
-        response.read(result);
-
+        auto result = mapper::getClient(bus).getSubTreePaths(
+            INVENTORY_PATH, BMC_INVENTORY_INTERFACE);
         if (!result.empty())
         {
             bmcInventoryPath = result.front();
@@ -649,18 +1137,33 @@ void ItemUpdater::resetUbootEnvVars()
     decltype(activations.begin()->second->redundancyPriority.get()->priority())
         lowestPriority = std::numeric_limits<uint8_t>::max();
     decltype(activations.begin()->second->versionId) lowestPriorityVersion;
-    for (const auto& intf : activations)
+
+    // Newest version first, so that it wins a tie on priority
+    for (auto it = versionIndex.rbegin(); it != versionIndex.rend(); ++it)
     {
-        if (!intf.second->redundancyPriority.get())
+        auto intf = activations.find(it->second);
+        if (intf == activations.end() ||
+            !intf->second->redundancyPriority.get())
         {
             // Skip this version if the redundancyPriority is not initialized.
             continue;
         }
 
-        if (intf.second->redundancyPriority.get()->priority() <= lowestPriority)
+        auto priority = intf->second->redundancyPriority.get()->priority();
+        if (lowestPriorityVersion.empty() || priority < lowestPriority)
+        {
+            lowestPriority = priority;
+            lowestPriorityVersion = intf->second->versionId;
+        }
+    }
+
+    if (lowestPriorityVersion.empty())
+    {
+        // No priority is set yet, boot the newest version
+        lowestPriorityVersion = newestInstalledVersion();
+        if (lowestPriorityVersion.empty())
         {
-            lowestPriority = intf.second->redundancyPriority.get()->priority();
-            lowestPriorityVersion = intf.second->versionId;
+            return;
         }
     }
 
@@ -670,11 +1173,19 @@ void ItemUpdater::resetUbootEnvVars()
 
 void ItemUpdater::freeSpace(Activation& caller)
 {
-    //  Versions with the highest priority in front
-    std::priority_queue<std::pair<int, std::string>,
-                        std::vector<std::pair<int, std::string>>,
-                        std::less<std::pair<int, std::string>>>
-        versionsPQ;
+    // Warn about worn devices before an image is written to them
+    updateFlashHealth();
+
+    for (const auto& versionId : getEvictions(caller))
+    {
+        erase(versionId);
+    }
+}
+
+std::vector<std::string> ItemUpdater::getEvictions(const Activation& caller)
+{
+    // Candidates for removal as (priority, version id) pairs
+    std::vector<std::pair<int, std::string>> candidates;
 
     std::size_t count = 0;
     for (const auto& iter : activations)
@@ -685,13 +1196,14 @@ void ItemUpdater::freeSpace(Activation& caller)
              server::Activation::Activations::Failed))
         {
             count++;
-            // Don't put the functional version on the queue since we can't
-            // remove the "running" BMC version.
+            // Don't add the functional version to the candidates since we
+            // can't remove the "running" BMC version.
             // If ACTIVE_BMC_MAX_ALLOWED <= 1, there is only one active BMC,
             // so remove functional version as well.
             // Don't delete the the Activation object that called this function.
-            if ((versions.find(iter.second->versionId)
-                     ->second->isFunctional() &&
+            auto version = versions.find(iter.second->versionId);
+            if ((version != versions.end() &&
+                 version->second->isFunctional() &&
                  ACTIVE_BMC_MAX_ALLOWED > 1) ||
                 (iter.second->versionId == caller.versionId))
             {
@@ -708,18 +1220,117 @@ void ItemUpdater::freeSpace(Activation& caller)
                 priority = iter.second->redundancyPriority.get()->priority();
             }
 
-            versionsPQ.push(std::make_pair(priority, iter.second->versionId));
+            candidates.emplace_back(priority, iter.second->versionId);
         }
     }
 
+    // Versions with the highest priority in front, and the oldest version
+    // first among versions with the same priority.
+    std::sort(candidates.begin(), candidates.end(),
+              [this](const auto& a, const auto& b) {
+                  if (a.first != b.first)
+                  {
+                      return a.first > b.first;
+                  }
+                  auto versionA = versions.find(a.second);
+                  auto versionB = versions.find(b.second);
+                  if (versionA == versions.end() || versionB == versions.end())
+                  {
+                      // Versions without an object go first
+                      return versionA == versions.end() &&
+                             versionB != versions.end();
+                  }
+                  return versionA->second->parsed() <
+                         versionB->second->parsed();
+              });
+
     // If the number of BMC versions is over ACTIVE_BMC_MAX_ALLOWED -1,
     // remove the highest priority one(s).
-    while ((count >= ACTIVE_BMC_MAX_ALLOWED) && (!versionsPQ.empty()))
+    std::vector<std::string> evictions;
+    for (const auto& candidate : candidates)
     {
-        erase(versionsPQ.top().second);
-        versionsPQ.pop();
+        if (count < ACTIVE_BMC_MAX_ALLOWED)
+        {
+            break;
+        }
+        evictions.push_back(candidate.second);
         count--;
     }
+    return evictions;
+}
+
+void ItemUpdater::addVersion(const std::string& versionId,
+                             std::unique_ptr<VersionClass> version)
+{
+    versionIndex.emplace(version->parsed(), versionId);
+    versions.insert(std::make_pair(versionId, std::move(version)));
+    indexState(versionId);
+}
+
+void ItemUpdater::removeVersion(const std::string& versionId)
+{
+    auto it = versions.find(versionId);
+    if (it == versions.end())
+    {
+        return;
+    }
+
+    versionIndex.erase(std::make_pair(it->second->parsed(), versionId));
+    stateIndex.erase(versionId);
+    versions.erase(it);
+    mountDirs.erase(versionId);
+}
+
+void ItemUpdater::indexState(const std::string& versionId)
+{
+    auto version = versions.find(versionId);
+    auto activation = activations.find(versionId);
+    if (version == versions.end() || activation == activations.end())
+    {
+        stateIndex.erase(versionId);
+        return;
+    }
+    stateIndex.set(versionId, activation->second->activation(),
+                   version->second->parsed());
+}
+
+std::string ItemUpdater::newestInstalledVersion() const
+{
+    return stateIndex.newest(server::Activation::Activations::Active);
+}
+
+std::string ItemUpdater::oldestNonFunctionalVersion() const
+{
+    return stateIndex.oldest(server::Activation::Activations::Active,
+                             functionalVersionId);
+}
+
+bool ItemUpdater::isDowngrade(const std::string& version) const
+{
+    auto functional = versions.find(functionalVersionId);
+    if (functional == versions.end())
+    {
+        return false;
+    }
+    return ParsedVersion(version) < functional->second->parsed();
+}
+
+std::vector<sdbusplus::message::object_path>
+    ItemUpdater::listVersions(bool descending)
+{
+    std::vector<sdbusplus::message::object_path> paths;
+    paths.reserve(versionIndex.size());
+
+    for (const auto& [parsed, versionId] : versionIndex)
+    {
+        paths.emplace_back(std::string{SOFTWARE_OBJPATH} + '/' + versionId);
+    }
+
+    if (descending)
+    {
+        std::reverse(paths.begin(), paths.end());
+    }
+    return paths;
 }
 
 void ItemUpdater::mirrorUbootToAlt()
@@ -736,6 +1347,10 @@ bool ItemUpdater::checkImage(const std::string& filePath,
     {
         fs::path file(filePath);
         file /= bmcImage;
+        if (imageStreamed(file))
+        {
+            continue;
+        }
         std::ifstream efile(file.c_str());
         if (efile.good() != 1)
         {
@@ -747,6 +1362,32 @@ bool ItemUpdater::checkImage(const std::string& filePath,
     return valid;
 }
 
+#ifdef STREAM_STAGING
+void ItemUpdater::invalidateOverwritten()
+{
+    for (const auto& versionId : getOverwrittenVersions())
+    {
+        auto activation = activations.find(versionId);
+        auto version = versions.find(versionId);
+        if (activation == activations.end() || version == versions.end() ||
+            version->second->isFunctional() ||
+            activation->second->activation() !=
+                server::Activation::Activations::Active)
+        {
+            continue;
+        }
+
+        warning("An upload was streamed over {VERSIONID}, it has to be "
+                "uploaded again to be activated",
+                "VERSIONID", versionId);
+        removeAssociations(activation->second->path);
+        activation->second->activation(
+            server::Activation::Activations::Invalid);
+        updateCatalogue();
+    }
+}
+#endif
+
 #ifdef HOST_BIOS_UPGRADE
 void ItemUpdater::createBIOSObject()
 {
@@ -1,16 +1,25 @@
 #pragma once
 
 #include "activation.hpp"
+#include "flash_health.hpp"
+#include "handoff.hpp"
 #include "item_updater_helper.hpp"
+#include "serialize.hpp"
 #include "version.hpp"
 #include "xyz/openbmc_project/Collection/DeleteAll/server.hpp"
+#include "xyz/openbmc_project/Software/FlashHealth/server.hpp"
+#include "xyz/openbmc_project/Software/VersionIndex/server.hpp"
 
 #include <sdbusplus/server.hpp>
 #include <xyz/openbmc_project/Association/Definitions/server.hpp>
 #include <xyz/openbmc_project/Common/FactoryReset/server.hpp>
 #include <xyz/openbmc_project/Control/FieldMode/server.hpp>
 
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace phosphor
@@ -24,10 +33,17 @@ using ItemUpdaterInherit = sdbusplus::server::object::object<
     sdbusplus::xyz::openbmc_project::Common::server::FactoryReset,
     sdbusplus::xyz::openbmc_project::Control::server::FieldMode,
     sdbusplus::xyz::openbmc_project::Association::server::Definitions,
-    sdbusplus::xyz::openbmc_project::Collection::server::DeleteAll>;
+    sdbusplus::xyz::openbmc_project::Collection::server::DeleteAll,
+    sdbusplus::xyz::openbmc_project::Software::server::VersionIndex>;
+
+using FlashHealthInherit = sdbusplus::server::object::object<
+    sdbusplus::xyz::openbmc_project::Software::server::FlashHealth>;
 
 namespace MatchRules = sdbusplus::bus::match::rules;
 using VersionClass = phosphor::software::manager::Version;
+using ParsedVersion = phosphor::software::manager::ParsedVersion;
+template <typename State>
+using StateIndex = phosphor::software::manager::StateIndex<State>;
 using AssociationList =
     std::vector<std::tuple<std::string, std::string, std::string>>;
 
@@ -52,15 +68,26 @@ class ItemUpdater : public ItemUpdaterInherit
      * @param[in] bus    - The D-Bus bus object
      */
     ItemUpdater(sdbusplus::bus::bus& bus, const std::string& path) :
-        ItemUpdaterInherit(bus, path.c_str(), false), bus(bus), helper(bus),
+        ItemUpdaterInherit(bus, path.c_str(), false), bus(bus), helper(bus)
+#ifndef SINGLE_BINARY
+        ,
         versionMatch(bus,
                      MatchRules::interfacesAdded() +
                          MatchRules::path("/xyz/openbmc_project/software"),
                      std::bind(std::mem_fn(&ItemUpdater::createActivation),
                                this, std::placeholders::_1))
+#endif
     {
+#ifdef SINGLE_BINARY
+        getHandoffQueue().setReceiver(std::bind(
+            std::mem_fn(&ItemUpdater::receiveImage), this,
+            std::placeholders::_1));
+#endif
         setBMCInventoryPath();
         processBMCImage();
+        resumeActivations();
+        subscribeApplyTime();
+        updateFlashHealth();
         restoreFieldModeStatus();
 #ifdef HOST_BIOS_UPGRADE
         createBIOSObject();
@@ -89,9 +116,26 @@ class ItemUpdater : public ItemUpdaterInherit
 
     /**
      * @brief Create and populate the active BMC Version.
+     *
+     * @details The versions are restored from the catalogue when it matches
+     *          the images mounted under MEDIA_DIR, and MEDIA_DIR is only
+     *          scanned otherwise.
      */
     void processBMCImage();
 
+    /**
+     * @brief Rewrite the catalogue of installed versions from the active
+     *        versions. Called whenever a version becomes active, changes
+     *        priority or is erased.
+     */
+    void updateCatalogue();
+
+    /**
+     * @brief Read the wear and health statistics of the flash devices and
+     *        publish them on D-Bus.
+     */
+    void updateFlashHealth();
+
     /**
      * @brief Erase specified entry D-Bus object
      *        if Action property is not set to Active
@@ -102,6 +146,10 @@ class ItemUpdater : public ItemUpdaterInherit
 
     /**
      * @brief Deletes all versions except for the current one
+     *
+     * @details Unlike erase() for each version, the boot selection and the
+     *          environment are updated once for all of them, and the images
+     *          are removed in one batch.
      */
     void deleteAll();
 
@@ -139,7 +187,8 @@ class ItemUpdater : public ItemUpdaterInherit
     /**
      * @brief Updates the uboot variables to point to BMC version with lowest
      *        priority, so that the system boots from this version on the
-     *        next boot.
+     *        next boot. The newest version wins a tie, and is picked if no
+     *        version has a priority yet.
      */
     void resetUbootEnvVars();
 
@@ -154,6 +203,15 @@ class ItemUpdater : public ItemUpdaterInherit
      */
     void freeSpace(Activation& caller);
 
+    /** @brief Get the BMC versions freeSpace() would delete, in the order
+     *         it would delete them.
+     *
+     * @param[in] caller - The Activation object that is to be activated.
+     *
+     * @return The version ids, empty if there is room for the version.
+     */
+    std::vector<std::string> getEvictions(const Activation& caller);
+
     /** @brief Creates a updateable association to the
      *  "running" BMC software image
      *
@@ -161,6 +219,53 @@ class ItemUpdater : public ItemUpdaterInherit
      */
     void createUpdateableAssociation(const std::string& path);
 
+    /** @brief Get the newest version that is installed on the BMC.
+     *
+     * @return The version id, or an empty string if none is installed.
+     */
+    std::string newestInstalledVersion() const;
+
+    /** @brief Get the oldest version that is installed on the BMC, other
+     *         than the running one.
+     *
+     * @return The version id, or an empty string if there is none.
+     */
+    std::string oldestNonFunctionalVersion() const;
+
+    /** @brief Index a version by the state of its activation, called as
+     *         the state, the activation or the version changes.
+     *
+     * @param[in] versionId - The version id.
+     */
+    void indexState(const std::string& versionId);
+
+    /** @brief Determine if a version is older than the running version.
+     *
+     * @param[in] version - The version string to check.
+     *
+     * @return true if the version sorts before the functional version.
+     */
+    bool isDowngrade(const std::string& version) const;
+
+    /** @brief Determine if the configured image apply time is immediate,
+     *         from the value cached by subscribeApplyTime().
+     *
+     * @return false if the apply time is not known.
+     */
+    bool isApplyTimeImmediate() const
+    {
+        return applyTime == applyTimeImmediate;
+    }
+
+    /** @brief List the version objects sorted by version string.
+     *
+     * @param[in] descending - If true, list the newest version first.
+     *
+     * @return The object paths of the versions.
+     */
+    std::vector<sdbusplus::message::object_path>
+        listVersions(bool descending) override;
+
     /** @brief Persistent map of Version D-Bus objects and their
      * version id */
     std::map<std::string, std::unique_ptr<VersionClass>> versions;
@@ -176,6 +281,36 @@ class ItemUpdater : public ItemUpdaterInherit
      */
     void createActivation(sdbusplus::message::message& msg);
 
+    /** @brief Take an image uploaded to the image manager.
+     *  @details Creates an Activation D-Bus object, unless the image is not
+     *           a kind this service manages or its version exists.
+     *
+     * @param[in] image - The uploaded image.
+     *
+     * @return What became of the image.
+     */
+    handoff::Outcome receiveImage(const handoff::Image& image);
+
+    /** @brief Create the Activation and Version D-Bus objects of an uploaded
+     *         image.
+     *
+     * @param[in] path            - The D-Bus object path.
+     * @param[in] versionId       - The version id.
+     * @param[in] version         - The version string.
+     * @param[in] purpose         - The purpose of the version.
+     * @param[in] extendedVersion - The extended version string.
+     * @param[in] filePath        - The directory of the uploaded image.
+     */
+    void addActivation(const std::string& path, const std::string& versionId,
+                       const std::string& version, VersionPurpose purpose,
+                       const std::string& extendedVersion,
+                       const std::string& filePath);
+
+    /** @brief Resume the activations that were interrupted by a restart of
+     *         the updater, or roll them back if their image is gone.
+     */
+    void resumeActivations();
+
     /**
      * @brief Validates the presence of SquashFS image in the image dir.
      *
@@ -228,12 +363,119 @@ class ItemUpdater : public ItemUpdaterInherit
      * version id */
     std::map<std::string, std::unique_ptr<Activation>> activations;
 
+    /** @brief The ids of the entries in the versions map, ordered from the
+     * oldest to the newest version string */
+    std::set<std::pair<ParsedVersion, std::string>> versionIndex;
+
+    /** @brief The ids of the versions that have an activation, by the state
+     * of the activation */
+    StateIndex<sdbusplus::xyz::openbmc_project::Software::server::Activation::
+                   Activations>
+        stateIndex;
+
+    /** @brief The id of the running BMC version */
+    std::string functionalVersionId;
+
+    /** @brief Adds a version to the versions map and to the version index.
+     *
+     * @param[in] versionId - The version id.
+     * @param[in] version   - The Version D-Bus object.
+     */
+    void addVersion(const std::string& versionId,
+                    std::unique_ptr<VersionClass> version);
+
+    /** @brief Removes a version from the versions map and from the version
+     *  index.
+     *
+     * @param[in] versionId - The version id.
+     */
+    void removeVersion(const std::string& versionId);
+
+    /** @brief The directory under MEDIA_DIR each installed version was
+     * found on */
+    std::map<std::string, std::string> mountDirs;
+
+    /** @brief The FlashHealth D-Bus objects, by device name */
+    std::map<std::string, std::unique_ptr<FlashHealthInherit>>
+        flashHealthObjects;
+
+    /** @brief Whether updateCatalogue() is deferred while the versions are
+     * created at startup */
+    bool deferCatalogue = false;
+
+    /** @brief Read the os-release of each image mounted under MEDIA_DIR and
+     *  create its D-Bus objects.
+     *
+     * @param[in] functionalVersion - The version of the running BMC.
+     */
+    void scanBMCImages(const std::string& functionalVersion);
+
+    /** @brief Create the D-Bus objects of the installed versions from the
+     *  catalogue, if it is consistent with the images under MEDIA_DIR.
+     *
+     * @details Only the list of images and the modification time and size of
+     *          their os-release are checked here, the content is checked by
+     *          validateCatalogue() once the event loop runs.
+     *
+     * @param[in] functionalVersion - The version of the running BMC.
+     *
+     * @return true if the versions were restored from the catalogue.
+     */
+    bool restoreBMCImages(const std::string& functionalVersion);
+
+    /** @brief Check the versions restored from the catalogue against their
+     *  os-release, and replace them with a full scan on mismatch.
+     *
+     * @param[in] catalogue - The catalogue the versions were restored from.
+     */
+    void validateCatalogue(const Catalogue& catalogue);
+
+    /** @brief Create the D-Bus objects of an installed BMC version.
+     *
+     * @param[in] id              - The version id.
+     * @param[in] version         - The version string.
+     * @param[in] extendedVersion - The extended version string.
+     * @param[in] purpose         - The purpose of the version.
+     * @param[in] priority        - The redundancy priority of the version.
+     * @param[in] isFunctional    - Whether this is the running version.
+     */
+    void createBMCVersion(const std::string& id, const std::string& version,
+                          const std::string& extendedVersion,
+                          VersionPurpose purpose, uint8_t priority,
+                          bool isFunctional);
+
+#ifndef SINGLE_BINARY
     /** @brief sdbusplus signal match for Software.Version */
     sdbusplus::bus::match_t versionMatch;
+#endif
 
     /** @brief This entry's associations */
     AssociationList assocs = {};
 
+    /** @brief The RequestedApplyTime last read or signalled, empty if it is
+     *  not known */
+    std::string applyTime;
+
+    /** @brief sdbusplus signal match for the RequestedApplyTime changes */
+    std::unique_ptr<sdbusplus::bus::match_t> applyTimeMatch;
+
+    /** @brief sdbusplus signal match for the owner changes of the ApplyTime
+     *  service, or for the ApplyTime object to be added if it has none */
+    std::unique_ptr<sdbusplus::bus::match_t> applyTimeOwnerMatch;
+
+    /** @brief Read RequestedApplyTime, and subscribe to its changes and to
+     *  the owner changes of its service, which subscribe again.
+     *  @details Runs from the event loop, so that the updater does not wait
+     *           for the service at startup.
+     */
+    void subscribeApplyTime();
+
+    /** @brief Callback function for the RequestedApplyTime match.
+     *
+     * @param[in]  msg       - Data associated with subscribed signal
+     */
+    void onApplyTimeChanged(sdbusplus::message::message& msg);
+
     /** @brief Clears read only partition for
      * given Activation D-Bus object.
      *
@@ -257,6 +499,14 @@ class ItemUpdater : public ItemUpdaterInherit
     bool checkImage(const std::string& filePath,
                     const std::vector<std::string>& imageList);
 
+#ifdef STREAM_STAGING
+    /** @brief Invalidate the installed versions images were streamed over.
+     *  @details Their partitions no longer hold them, and their image files
+     *           are gone, so they have to be uploaded again.
+     */
+    void invalidateOverwritten();
+#endif
+
 #ifdef HOST_BIOS_UPGRADE
     /** @brief Create the BIOS object without knowing the version.
      *
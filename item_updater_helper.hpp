@@ -3,6 +3,7 @@
 #include <sdbusplus/bus.hpp>
 
 #include <string>
+#include <vector>
 
 namespace phosphor
 {
@@ -42,6 +43,13 @@ class Helper
      */
     void clearEntry(const std::string& entryId);
 
+    /** @brief Clear the images with the entry ids in one update of the
+     *         environment
+     *
+     * @param[in] entryIds - The image entry ids
+     */
+    void clearEntries(const std::vector<std::string>& entryIds);
+
     /** @brief Clean up all the unused images */
     void cleanup();
 
@@ -54,6 +62,12 @@ class Helper
      */
     void removeVersion(const std::string& versionId);
 
+    /** @brief Remove the images with the version ids at once
+     *
+     * @param[in] versionIds - The version ids of the images
+     */
+    void removeVersions(const std::vector<std::string>& versionIds);
+
     /** @brief Update version id in uboot env
      *
      * @param[in] versionId - The version id of the image
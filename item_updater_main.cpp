@@ -2,6 +2,20 @@
 
 #include "item_updater.hpp"
 
+#ifdef SINGLE_BINARY
+#include "handoff.hpp"
+#include "image_manager.hpp"
+#include "watch.hpp"
+
+#include <systemd/sd-event.h>
+#include <unistd.h>
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <phosphor-logging/lg2.hpp>
+
+#include <functional>
+#endif
+
 #include <boost/asio/io_context.hpp>
 #include <sdbusplus/asio/connection.hpp>
 #include <sdbusplus/bus.hpp>
@@ -13,6 +27,14 @@ boost::asio::io_context& getIOContext()
     return io;
 }
 
+#ifdef SINGLE_BINARY
+phosphor::software::handoff::Queue& getHandoffQueue()
+{
+    static phosphor::software::handoff::Queue queue(getIOContext());
+    return queue;
+}
+#endif
+
 int main()
 {
     sdbusplus::asio::connection bus(getIOContext());
@@ -20,11 +42,54 @@ int main()
     // Add sdbusplus ObjectManager.
     sdbusplus::server::manager::manager objManager(bus, SOFTWARE_OBJPATH);
 
+#ifdef SINGLE_BINARY
+    // The image manager shares the connection, it takes its bus name too
+    // so that the D-Bus API is the same as with two services.
+    using phosphor::software::manager::Manager;
+    sd_event* loop = nullptr;
+    sd_event_default(&loop);
+    Manager imageManager(bus, loop);
+    phosphor::software::manager::ImageUpload imageUpload(bus, SOFTWARE_OBJPATH,
+                                                         imageManager);
+#endif
+
     phosphor::software::updater::ItemUpdater updater(bus, SOFTWARE_OBJPATH);
 
     bus.request_name(BUSNAME_UPDATER);
 
+#ifdef SINGLE_BINARY
+    bus.request_name(VERSION_BUSNAME);
+
+    // The upload directory watch and the reclaimer are sd-event sources,
+    // dispatch them from the io_context.
+    phosphor::software::manager::Watch watch(
+        loop, std::bind(std::mem_fn(&Manager::processImage), &imageManager,
+                        std::placeholders::_1));
+    boost::asio::posix::stream_descriptor events(getIOContext(),
+                                                 dup(sd_event_get_fd(loop)));
+    std::function<void()> waitEvents = [&]() {
+        events.async_wait(
+            boost::asio::posix::stream_descriptor::wait_read,
+            [&](const boost::system::error_code& ec) {
+                if (ec)
+                {
+                    lg2::error("Error waiting for sd-event: {ERROR}", "ERROR",
+                               ec.message());
+                    return;
+                }
+                while (sd_event_run(loop, 0) > 0)
+                {}
+                waitEvents();
+            });
+    };
+    waitEvents();
+#endif
+
     getIOContext().run();
 
+#ifdef SINGLE_BINARY
+    sd_event_unref(loop);
+#endif
+
     return 0;
 }
@@ -0,0 +1,127 @@
+#include "key_value_file.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <phosphor-logging/lg2.hpp>
+
+#include <cerrno>
+
+namespace phosphor
+{
+namespace software
+{
+namespace manager
+{
+
+PHOSPHOR_LOG2_USING;
+
+KeyValueFile::KeyValueFile(const std::string& path)
+{
+    auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    while (size < buffer.size())
+    {
+        auto bytes = read(fd, buffer.data() + size, buffer.size() - size);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error("Error ({ERRNO}) reading {PATH}", "ERRNO", errno, "PATH",
+                  path);
+            close(fd);
+            size = 0;
+            return;
+        }
+        if (bytes == 0)
+        {
+            break;
+        }
+        size += bytes;
+    }
+
+    if (size == buffer.size())
+    {
+        // Drop the trailing partial line rather than return a truncated
+        // value for it.
+        auto lastLine = content().rfind('\n');
+        size = (lastLine == std::string_view::npos) ? 0 : lastLine + 1;
+        warning("{PATH} is larger than {SIZE} bytes, ignoring the rest",
+                "PATH", path, "SIZE", maxSize);
+    }
+
+    close(fd);
+    readOk = true;
+}
+
+std::string_view KeyValueFile::get(std::string_view key) const
+{
+    std::string_view value{};
+    parse(content(), std::span(&key, 1), std::span(&value, 1));
+    return value;
+}
+
+std::string_view KeyValueFile::unquote(std::string_view value)
+{
+    if (value.size() >= 2 && (value.front() == '"' || value.front() == '\'') &&
+        value.back() == value.front())
+    {
+        return value.substr(1, value.size() - 2);
+    }
+    return value;
+}
+
+size_t KeyValueFile::parse(std::string_view content,
+                           std::span<const std::string_view> keys,
+                           std::span<std::string_view> values)
+{
+    size_t found = 0;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        values[i] = {};
+    }
+
+    while (!content.empty() && found < keys.size())
+    {
+        auto end = content.find('\n');
+        auto line = content.substr(0, end);
+        content.remove_prefix(
+            (end == std::string_view::npos) ? content.size() : end + 1);
+
+        if (!line.empty() && line.back() == '\r')
+        {
+            // If the file has CRLF line terminators, e.g. is created on
+            // Windows, the line will contain \r at the end, remove it.
+            line.remove_suffix(1);
+        }
+
+        auto separator = line.find('=');
+        if (separator == std::string_view::npos)
+        {
+            continue;
+        }
+        auto key = line.substr(0, separator);
+
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            if (values[i].data() == nullptr && keys[i] == key)
+            {
+                values[i] = line.substr(separator + 1);
+                ++found;
+                break;
+            }
+        }
+    }
+
+    return found;
+}
+
+} // namespace manager
+} // namespace software
+} // namespace phosphor
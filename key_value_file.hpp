@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace phosphor
+{
+namespace software
+{
+namespace manager
+{
+
+/** @class KeyValueFile
+ *  @brief Reader for KEY=VALUE files such as os-release and MANIFEST.
+ *  @details The file is read once into a fixed size buffer and the values
+ *           are returned as views into that buffer, so looking up any number
+ *           of keys does not allocate. Lines may end with LF or CRLF. Values are
+ *           returned as they appear in the file, use unquote() for formats
+ *           such as os-release that allow quoted values.
+ */
+class KeyValueFile
+{
+  public:
+    /** @brief The largest file size that is read, the rest is ignored. */
+    static constexpr size_t maxSize = 8192;
+
+    KeyValueFile() = delete;
+    KeyValueFile(const KeyValueFile&) = delete;
+    KeyValueFile& operator=(const KeyValueFile&) = delete;
+    KeyValueFile(KeyValueFile&&) = delete;
+    KeyValueFile& operator=(KeyValueFile&&) = delete;
+    ~KeyValueFile() = default;
+
+    /** @brief Read the file
+     *
+     * @param[in] path - The path of the file to read.
+     */
+    explicit KeyValueFile(const std::string& path);
+
+    /** @brief Check if the file was read successfully. */
+    bool good() const
+    {
+        return readOk;
+    }
+
+    /** @brief Look up the values of several keys in one pass.
+     *
+     * @param[in]  keys   - The keys to look up.
+     * @param[out] values - The value of keys[i] is stored in values[i], or
+     *                      an empty view if the key is not present. Must be
+     *                      at least as large as keys.
+     *
+     * @return The number of keys that were found.
+     */
+    size_t get(std::span<const std::string_view> keys,
+               std::span<std::string_view> values) const
+    {
+        return parse(content(), keys, values);
+    }
+
+    /** @brief Look up the value of a key.
+     *
+     * @param[in] key - The key to look up.
+     *
+     * @return The value, or an empty view if the key is not present.
+     */
+    std::string_view get(std::string_view key) const;
+
+    /** @brief The content that was read from the file. */
+    std::string_view content() const
+    {
+        return std::string_view(buffer.data(), size);
+    }
+
+    /** @brief Look up the values of several keys in KEY=VALUE content.
+     *
+     * @details If a key appears more than once the first value is used.
+     *
+     * @param[in]  content - The content to parse.
+     * @param[in]  keys    - The keys to look up.
+     * @param[out] values  - The value of keys[i] is stored in values[i], as a
+     *                       view into content, or an empty view if the key is
+     *                       not present. Must be at least as large as keys.
+     *
+     * @return The number of keys that were found.
+     */
+    static size_t parse(std::string_view content,
+                        std::span<const std::string_view> keys,
+                        std::span<std::string_view> values);
+
+    /** @brief Remove one pair of matching single or double quotes.
+     *
+     * @param[in] value - The value as read from the file.
+     *
+     * @return The value without the surrounding quotes, if any.
+     */
+    static std::string_view unquote(std::string_view value);
+
+  private:
+    /** @brief The file content */
+    std::array<char, maxSize> buffer;
+
+    /** @brief The number of bytes of the buffer holding file content */
+    size_t size = 0;
+
+    /** @brief Whether the file was read successfully */
+    bool readOk = false;
+};
+
+} // namespace manager
+} // namespace software
+} // namespace phosphor
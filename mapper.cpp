@@ -0,0 +1,320 @@
+#include "config.h"
+
+#include "mapper.hpp"
+
+#include <phosphor-logging/lg2.hpp>
+#include <sdbusplus/exception.hpp>
+#include <sdbusplus/message.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <tuple>
+
+namespace mapper
+{
+
+PHOSPHOR_LOG2_USING;
+namespace MatchRules = sdbusplus::bus::match::rules;
+
+namespace
+{
+
+/** @brief The number of lookups the shared client caches */
+constexpr size_t sharedCapacity = 32;
+
+/** @brief The reply of GetObject, the services and their interfaces */
+using Services = std::vector<std::pair<std::string, std::vector<std::string>>>;
+
+sdbusplus::message::message newGetObject(sdbusplus::bus::bus& bus,
+                                         const std::string& path,
+                                         const std::string& interface)
+{
+    auto method = bus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
+                                      MAPPER_INTERFACE, "GetObject");
+    method.append(path);
+    method.append(std::vector<std::string>({interface}));
+    return method;
+}
+
+/** @brief An asynchronous lookup waiting for the mapper */
+struct Request
+{
+    Client* client;
+    std::string path;
+    std::string interface;
+    Client::Callback callback;
+};
+
+} // namespace
+
+std::string Cache::find(const std::string& path, const std::string& interface)
+{
+    auto it = index.find({path, interface});
+    if (it == index.end())
+    {
+        counters.misses++;
+        return {};
+    }
+
+    counters.hits++;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->second;
+}
+
+void Cache::insert(const std::string& path, const std::string& interface,
+                   const std::string& service)
+{
+    Key key{path, interface};
+    auto it = index.find(key);
+    if (it != index.end())
+    {
+        it->second->second = service;
+        entries.splice(entries.begin(), entries, it->second);
+        return;
+    }
+
+    if (capacity == 0)
+    {
+        return;
+    }
+    if (index.size() >= capacity)
+    {
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+    entries.emplace_front(key, service);
+    index.emplace(std::move(key), entries.begin());
+}
+
+void Cache::eraseService(const std::string& service)
+{
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+        if (it->second == service)
+        {
+            index.erase(it->first);
+            it = entries.erase(it);
+            counters.invalidations++;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void Cache::eraseInterfaces(const std::string& path,
+                            const std::vector<std::string>& interfaces)
+{
+    for (const auto& interface : interfaces)
+    {
+        auto it = index.find({path, interface});
+        if (it != index.end())
+        {
+            entries.erase(it->second);
+            index.erase(it);
+            counters.invalidations++;
+        }
+    }
+}
+
+bool Cache::hasService(const std::string& service) const
+{
+    return std::any_of(entries.begin(), entries.end(),
+                       [&service](const auto& entry) {
+                           return entry.second == service;
+                       });
+}
+
+bool Cache::hasPath(const std::string& path) const
+{
+    return std::any_of(entries.begin(), entries.end(),
+                       [&path](const auto& entry) {
+                           return entry.first.first == path;
+                       });
+}
+
+Client::Client(sdbusplus::bus::bus& bus, size_t capacity) :
+    bus(bus), cache(capacity)
+{}
+
+void Client::insert(const std::string& path, const std::string& interface,
+                    const std::string& service)
+{
+    cache.insert(path, interface, service);
+
+    // The watches are only dropped here, never from their own callback
+    std::erase_if(serviceWatches, [this](const auto& watch) {
+        return !cache.hasService(watch.first);
+    });
+    std::erase_if(pathWatches, [this](const auto& watch) {
+        return !cache.hasPath(watch.first);
+    });
+
+    if (cache.hasService(service) && !serviceWatches.contains(service))
+    {
+        serviceWatches.emplace(
+            std::piecewise_construct, std::forward_as_tuple(service),
+            std::forward_as_tuple(
+                bus, MatchRules::nameOwnerChanged(service),
+                [this](sdbusplus::message::message& msg) {
+                    std::string name;
+                    std::string oldOwner;
+                    std::string newOwner;
+                    msg.read(name, oldOwner, newOwner);
+                    if (!oldOwner.empty())
+                    {
+                        cache.eraseService(name);
+                    }
+                }));
+    }
+    if (cache.hasPath(path) && !pathWatches.contains(path))
+    {
+        pathWatches.emplace(
+            std::piecewise_construct, std::forward_as_tuple(path),
+            std::forward_as_tuple(
+                bus, MatchRules::interfacesRemoved(path),
+                [this](sdbusplus::message::message& msg) {
+                    sdbusplus::message::object_path objPath;
+                    std::vector<std::string> interfaces;
+                    msg.read(objPath, interfaces);
+                    cache.eraseInterfaces(objPath.str, interfaces);
+                }));
+    }
+}
+
+std::string Client::getService(const std::string& path,
+                               const std::string& interface)
+{
+    auto service = cache.find(path, interface);
+    if (!service.empty())
+    {
+        return service;
+    }
+
+    auto stats = cache.stats();
+    debug("Mapper lookup of {PATH} {INTERFACE} is not cached ({HITS} hits, "
+          "{MISSES} misses, {INVALIDATIONS} invalidations, {ENTRIES} "
+          "entries)",
+          "PATH", path, "INTERFACE", interface, "HITS", stats.hits, "MISSES",
+          stats.misses, "INVALIDATIONS", stats.invalidations, "ENTRIES",
+          stats.entries);
+
+    Services response;
+    try
+    {
+        auto reply = bus.call(newGetObject(bus, path, interface));
+        reply.read(response);
+        if (response.empty())
+        {
+            error(
+                "Empty response from mapper for getting service name: {PATH} {INTERFACE}",
+                "PATH", path, "INTERFACE", interface);
+            return std::string{};
+        }
+    }
+    catch (const sdbusplus::exception::exception& e)
+    {
+        error("Error in mapper method call for ({PATH}, {INTERFACE}: {ERROR}",
+              "ERROR", e, "PATH", path, "INTERFACE", interface);
+        return std::string{};
+    }
+
+    insert(path, interface, response[0].first);
+    return response[0].first;
+}
+
+void Client::getServiceAsync(const std::string& path,
+                             const std::string& interface, Callback callback)
+{
+    auto service = cache.find(path, interface);
+    if (!service.empty())
+    {
+        callback(service);
+        return;
+    }
+
+    auto request = std::make_unique<Request>(
+        Request{this, path, interface, std::move(callback)});
+    try
+    {
+        auto method = newGetObject(bus, path, interface);
+        auto rc = sd_bus_call_async(bus.get(), nullptr, method.get(), onReply,
+                                    request.get(), 0);
+        if (rc >= 0)
+        {
+            // Owned by the pending call until onReply()
+            request.release();
+            return;
+        }
+        error("Error in mapper method call for ({PATH}, {INTERFACE}: {RC}",
+              "RC", rc, "PATH", path, "INTERFACE", interface);
+    }
+    catch (const sdbusplus::exception::exception& e)
+    {
+        error("Error in mapper method call for ({PATH}, {INTERFACE}: {ERROR}",
+              "ERROR", e, "PATH", path, "INTERFACE", interface);
+    }
+    request->callback({});
+}
+
+int Client::onReply(sd_bus_message* m, void* userdata,
+                    sd_bus_error* /* error */)
+{
+    std::unique_ptr<Request> request(static_cast<Request*>(userdata));
+    sdbusplus::message::message reply(m);
+
+    std::string service;
+    try
+    {
+        if (reply.is_method_error())
+        {
+            error("Error in mapper method call for ({PATH}, {INTERFACE})",
+                  "PATH", request->path, "INTERFACE", request->interface);
+        }
+        else
+        {
+            Services response;
+            reply.read(response);
+            if (!response.empty())
+            {
+                service = response[0].first;
+                request->client->insert(request->path, request->interface,
+                                        service);
+            }
+        }
+    }
+    catch (const sdbusplus::exception::exception& e)
+    {
+        error("Error in mapper method call for ({PATH}, {INTERFACE}: {ERROR}",
+              "ERROR", e, "PATH", request->path, "INTERFACE",
+              request->interface);
+    }
+
+    request->callback(service);
+    return 0;
+}
+
+std::vector<std::string> Client::getSubTreePaths(const std::string& subtree,
+                                                 const std::string& interface)
+{
+    std::vector<std::string> paths;
+    auto method = bus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
+                                      MAPPER_INTERFACE, "GetSubTreePaths");
+    method.append(subtree);
+    method.append(0); // Depth 0 to search all
+    method.append(std::vector<std::string>({interface}));
+
+    auto reply = bus.call(method);
+    reply.read(paths);
+    return paths;
+}
+
+Client& getClient(sdbusplus::bus::bus& bus)
+{
+    // Never destroyed, the bus may be gone by the time statics are
+    static auto client = new Client(bus, sharedCapacity);
+    return *client;
+}
+
+} // namespace mapper
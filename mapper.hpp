@@ -0,0 +1,186 @@
+#pragma once
+
+#include <sdbusplus/bus.hpp>
+#include <sdbusplus/bus/match.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mapper
+{
+
+/** @brief The lookups of a cache, for diagnostics */
+struct Stats
+{
+    /** @brief The lookups answered from the cache */
+    uint64_t hits = 0;
+    /** @brief The lookups that asked the mapper */
+    uint64_t misses = 0;
+    /** @brief The entries dropped as their service or object went away */
+    uint64_t invalidations = 0;
+    /** @brief The entries in the cache */
+    size_t entries = 0;
+};
+
+/** @class Cache
+ *  @brief Least recently used cache of the services implementing an
+ *         interface on an object path.
+ */
+class Cache
+{
+  public:
+    /** @brief Constructs Cache
+     *
+     * @param[in] capacity - The number of entries kept.
+     */
+    explicit Cache(size_t capacity) : capacity(capacity)
+    {}
+
+    /** @brief Look up the service of an object interface, and count the hit
+     *         or the miss.
+     *
+     * @return The service, empty if it is not cached.
+     */
+    std::string find(const std::string& path, const std::string& interface);
+
+    /** @brief Record the service of an object interface, dropping the least
+     *         recently used entry if the cache is full. */
+    void insert(const std::string& path, const std::string& interface,
+                const std::string& service);
+
+    /** @brief Drop the entries of a service, once it lost its name */
+    void eraseService(const std::string& service);
+
+    /** @brief Drop the entries of interfaces removed from an object */
+    void eraseInterfaces(const std::string& path,
+                         const std::vector<std::string>& interfaces);
+
+    /** @brief Whether an entry has the service */
+    bool hasService(const std::string& service) const;
+
+    /** @brief Whether an entry has the object path */
+    bool hasPath(const std::string& path) const;
+
+    /** @brief Get the lookups of the cache */
+    Stats stats() const
+    {
+        auto copy = counters;
+        copy.entries = index.size();
+        return copy;
+    }
+
+  private:
+    using Key = std::pair<std::string, std::string>;
+    using Entry = std::pair<Key, std::string>;
+
+    /** @brief The number of entries kept */
+    size_t capacity;
+
+    /** @brief The entries, the most recently used first */
+    std::list<Entry> entries;
+
+    /** @brief The entries by object path and interface */
+    std::map<Key, std::list<Entry>::iterator> index;
+
+    /** @brief The lookups of the cache */
+    Stats counters;
+};
+
+/** @class Client
+ *  @brief Looks up the services of object interfaces from the mapper,
+ *         through a cache.
+ *  @details The cache entries are dropped when their service loses its bus
+ *           name, or when their interface is removed from the object. Only
+ *           the signals of the cached services and objects are matched.
+ */
+class Client
+{
+  public:
+    Client() = delete;
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+    Client(Client&&) = delete;
+    Client& operator=(Client&&) = delete;
+
+    /** @brief Constructs Client
+     *
+     * @param[in] bus      - The D-Bus bus object
+     * @param[in] capacity - The number of lookups cached.
+     */
+    Client(sdbusplus::bus::bus& bus, size_t capacity);
+
+    /** @brief Called with the service of a lookup, empty if not found */
+    using Callback = std::function<void(const std::string&)>;
+
+    /** @brief Get the service of an object interface, waiting for the mapper
+     *         on a miss.
+     *
+     * @return The service, empty if not found.
+     */
+    std::string getService(const std::string& path,
+                           const std::string& interface);
+
+    /** @brief Get the service of an object interface without waiting.
+     *
+     * @details A hit is called back before returning, a miss once the
+     *          mapper replies from the event loop.
+     *
+     * @param[in] callback - Called with the service, empty if not found.
+     */
+    void getServiceAsync(const std::string& path,
+                         const std::string& interface, Callback callback);
+
+    /** @brief Get the lookups of the cache */
+    Stats stats() const
+    {
+        return cache.stats();
+    }
+
+    /** @brief Get the paths of the objects implementing an interface under
+     *         a subtree. Not cached, the objects come and go.
+     *
+     * @return The paths.
+     *
+     * @throws sdbusplus::exception::exception on D-Bus errors.
+     */
+    std::vector<std::string> getSubTreePaths(const std::string& subtree,
+                                             const std::string& interface);
+
+  private:
+    /** @brief Called by sd-bus with the reply of an asynchronous lookup */
+    static int onReply(sd_bus_message* m, void* userdata,
+                       sd_bus_error* error);
+
+    /** @brief Cache the service of an object interface, watch the service
+     *         and the object, and stop watching those no entry has anymore */
+    void insert(const std::string& path, const std::string& interface,
+                const std::string& service);
+
+    /** @brief Persistent sdbusplus D-Bus bus connection. */
+    sdbusplus::bus::bus& bus;
+
+    /** @brief The services looked up */
+    Cache cache;
+
+    /** @brief sdbusplus signal matches for the cached services losing their
+     *         names, by service */
+    std::map<std::string, sdbusplus::bus::match_t> serviceWatches;
+
+    /** @brief sdbusplus signal matches for the interfaces removed from the
+     *         cached objects, by object path */
+    std::map<std::string, sdbusplus::bus::match_t> pathWatches;
+};
+
+/** @brief Get the client shared by the process.
+ *
+ * @param[in] bus - The D-Bus bus object, used by the first call only.
+ */
+Client& getClient(sdbusplus::bus::bus& bus);
+
+} // namespace mapper
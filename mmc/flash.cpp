@@ -3,6 +3,25 @@
 #include "flash.hpp"
 
 #include "activation.hpp"
+#include "emmc_writer.hpp"
+#include "image_compare.hpp"
+#include "images.hpp"
+#include "verity.hpp"
+#include "version.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <phosphor-logging/lg2.hpp>
+
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+extern boost::asio::io_context& getIOContext();
 
 namespace phosphor
 {
@@ -11,10 +30,259 @@ namespace software
 namespace updater
 {
 
+PHOSPHOR_LOG2_USING;
+namespace fs = std::filesystem;
 namespace softwareServer = sdbusplus::xyz::openbmc_project::Software::server;
+using namespace phosphor::software::image;
+using phosphor::software::manager::Version;
+
+namespace
+{
+
+/** @brief The eMMC hardware partition that holds U-Boot */
+constexpr auto bootPartition = "mmcblk0boot0";
+
+/** @brief The eMMC user area that holds the boot and rofs partitions */
+constexpr auto userArea = emmc_writer::defaultDisk;
+
+/** @brief The images written to the partitions of a slot */
+constexpr std::array partitionImages = {"image-kernel", "image-rofs"};
+
+#ifdef MMC_PARALLEL_WRITE
+constexpr bool parallelWrite = true;
+#else
+constexpr bool parallelWrite = false;
+#endif
+
+/** @brief Write the U-Boot image of a version to the eMMC boot partition,
+ *         rewriting only the part that differs.
+ *
+ * @param[in] versionId - The version id.
+ *
+ * @return true if U-Boot is up to date.
+ */
+bool updateUboot(const std::string& versionId)
+{
+    auto image = fs::path(IMG_UPLOAD_DIR) / versionId / "image-u-boot";
+    auto device = fs::path("/dev") / bootPartition;
+    auto forceRo = fs::path("/sys/block") / bootPartition / "force_ro";
+
+    try
+    {
+        auto result = image_compare::compare(device, image);
+        if (result.identical)
+        {
+            info("U-Boot of {VERSIONID} is already on {DEVICE}", "VERSIONID",
+                 versionId, "DEVICE", device);
+            return true;
+        }
+
+        std::ofstream(forceRo) << "0";
+        image_compare::write(device, image, result.ranges);
+        std::ofstream(forceRo) << "1";
+
+        info("Wrote U-Boot of {VERSIONID} to {DEVICE} from offset {OFFSET}",
+             "VERSIONID", versionId, "DEVICE", device, "OFFSET",
+             result.ranges.front().offset);
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        std::ofstream(forceRo) << "1";
+        error("Failed to write U-Boot of {VERSIONID}: {ERROR}", "VERSIONID",
+              versionId, "ERROR", e);
+        return false;
+    }
+}
+
+/** @brief Check the dm-verity hash tree of a written rofs partition against
+ *         the root hash of the signed manifest.
+ *
+ * @param[in] label  - The label of the partition.
+ * @param[in] params - The verity parameters from the manifest.
+ *
+ * @throws std::exception if the tree does not match.
+ */
+void checkRofsVerity(const std::string& label, const verity::Params& params)
+{
+    auto name = "rofs-" + label;
+    auto partition = emmc_writer::findPartition(userArea, name);
+    if (!partition ||
+        !verity::checkRootHash(userArea, params, partition->offset))
+    {
+        throw std::runtime_error("The verity hash tree of " + name +
+                                 " does not match the manifest");
+    }
+}
+
+} // namespace
 
 void Activation::flashWrite()
 {
+    if (roVolumeCreated)
+    {
+        // Resumed after the partitions were written, continue once the
+        // caller has set the activation to Activating.
+        boost::asio::post(getIOContext(), [this]() { onVolumesCreated(); });
+        return;
+    }
+
+    std::string label;
+    try
+    {
+        label = emmc_writer::secondaryLabel(userArea);
+        slotLock = std::make_unique<SlotLock>(label);
+    }
+    catch (const std::exception& e)
+    {
+        error("Failed to take the inactive slot of {DISK}: {ERROR}", "DISK",
+              userArea, "ERROR", e);
+        label.clear();
+    }
+    auto fd = label.empty() ? -1 : eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0)
+    {
+        error("Unable to write {VERSIONID} to {DISK}", "VERSIONID", versionId,
+              "DISK", userArea);
+        slotLock.reset();
+        boost::asio::post(getIOContext(), [this]() {
+            activation(softwareServer::Activation::Activations::Failed);
+        });
+        return;
+    }
+
+    emmc_writer::Options options;
+    auto imageDir = fs::path(IMG_UPLOAD_DIR) / versionId;
+    for (const auto& image : partitionImages)
+    {
+        // Images streamed to the partitions when uploaded are there already,
+        // as long as nothing was written to the slot since.
+        if (!imageStreamed(imageDir / image))
+        {
+            continue;
+        }
+        auto marker = streamedRecord(imageDir / image).string();
+        auto [markerLabel, generation] =
+            Version::getValues(marker, {"Label", "Generation"});
+        if (markerLabel != label ||
+            generation != std::to_string(slotLock->generation()))
+        {
+            error("{IMAGE} of {VERSIONID} is no longer in the {LABEL} slot",
+                  "IMAGE", image, "VERSIONID", versionId, "LABEL", label);
+            ::close(fd);
+            slotLock.reset();
+            boost::asio::post(getIOContext(), [this]() {
+                activation(softwareServer::Activation::Activations::Failed);
+            });
+            return;
+        }
+        options.written.insert(image);
+    }
+
+    // Whatever was streamed to the slot before is overwritten from here on,
+    // the partitions are invalid until this write completes.
+    if (options.written.size() < partitionImages.size())
+    {
+        try
+        {
+            slotLock->bump();
+        }
+        catch (const std::exception& e)
+        {
+            error("Failed to record the write of the {LABEL} slot: {ERROR}",
+                  "LABEL", label, "ERROR", e);
+            ::close(fd);
+            slotLock.reset();
+            boost::asio::post(getIOContext(), [this]() {
+                activation(softwareServer::Activation::Activations::Failed);
+            });
+            return;
+        }
+    }
+    options.concurrent = parallelWrite;
+    options.cancelled = &flashWriteCancelled;
+    options.checkpoint = [this](const std::string& image, uint64_t written) {
+        checkpointJournal(image, written);
+    };
+    {
+        // Continue an interrupted write of the same partitions
+        std::lock_guard lock(journalMutex);
+        if (journal.label == label)
+        {
+            options.resume = journal.written;
+        }
+        else
+        {
+            journal.label = label;
+            journal.written.clear();
+        }
+    }
+    saveJournal();
+
+    // Decompress and write the partitions on a worker thread, so that the
+    // updater keeps serving D-Bus requests. The io_context is single
+    // threaded, so the worker signals completion through an eventfd.
+    flashWriteDone = std::make_unique<boost::asio::posix::stream_descriptor>(
+        getIOContext(), fd);
+    flashWriteError.clear();
+    auto rofsVerity =
+        verity::fromManifest((imageDir / MANIFEST_FILE_NAME).string());
+    flashWriter = std::jthread([this, fd, imageDir = imageDir.string(), label,
+                                options = std::move(options), rofsVerity]() {
+        try
+        {
+            emmc_writer::update(userArea, imageDir, label, options);
+            if (rofsVerity)
+            {
+                checkRofsVerity(label, *rofsVerity);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            flashWriteError = e.what();
+        }
+        uint64_t done = 1;
+        if (::write(fd, &done, sizeof(done)) < 0)
+        {
+            flashWriteError = "Failed to signal completion";
+        }
+    });
+
+    info("Writing {VERSIONID} to the {LABEL} partitions of {DISK}",
+         "VERSIONID", versionId, "LABEL", label, "DISK", userArea);
+    flashWriteDone->async_wait(
+        boost::asio::posix::stream_descriptor::wait_read,
+        [this](const boost::system::error_code& ec) {
+            if (ec || !flashWriter.joinable())
+            {
+                // The write was cancelled, or the activation destroyed
+                return;
+            }
+            flashWriter.join();
+            flashWriteDone.reset();
+            onEmmcWriteDone();
+        });
+}
+
+void Activation::onEmmcWriteDone()
+{
+    slotLock.reset();
+
+    if (!flashWriteError.empty())
+    {
+        error("Failed to write {VERSIONID}: {ERROR}", "VERSIONID", versionId,
+              "ERROR", flashWriteError);
+        activation(softwareServer::Activation::Activations::Failed);
+        return;
+    }
+
+    if (activation() != softwareServer::Activation::Activations::Activating)
+    {
+        return;
+    }
+
+    activationProgress->progress(50);
+
     auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
                                       SYSTEMD_INTERFACE, "StartUnit");
     auto serviceFile = "obmc-flash-mmc@" + versionId + ".service";
@@ -22,6 +290,34 @@ void Activation::flashWrite()
     bus.call_noreply(method);
 }
 
+void Activation::flashCancel()
+{
+    if (flashWriter.joinable())
+    {
+        // The writer stops before its next write, so this waits for at most
+        // one buffer to be written.
+        flashWriteCancelled = true;
+        flashWriter.join();
+        flashWriteDone.reset();
+        flashWriteCancelled = false;
+    }
+    slotLock.reset();
+
+    auto serviceFile = "obmc-flash-mmc@" + versionId + ".service";
+    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
+                                      SYSTEMD_INTERFACE, "StopUnit");
+    method.append(serviceFile, "replace");
+    bus.call_noreply(method);
+
+    // Invalidate the partially written partitions, the remove service is
+    // ordered after the write service so it starts once that has stopped.
+    auto removeServiceFile = "obmc-flash-mmc-remove@" + versionId + ".service";
+    method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
+                                 SYSTEMD_INTERFACE, "StartUnit");
+    method.append(removeServiceFile, "replace");
+    bus.call_noreply(method);
+}
+
 void Activation::onStateChanges(sdbusplus::message::message& msg)
 {
     uint32_t newStateID{};
@@ -55,29 +351,64 @@ void Activation::onStateChanges(sdbusplus::message::message& msg)
         }
         else if (roVolumeCreated)
         {
-            if (!ubootEnvVarsUpdated)
-            {
-                activationProgress->progress(90);
-
-                // Set the priority which triggers the service that updates the
-                // environment variables.
-                if (!Activation::redundancyPriority)
-                {
-                    Activation::redundancyPriority =
-                        std::make_unique<RedundancyPriority>(bus, path, *this,
-                                                             0);
-                }
-            }
-            else // Environment variables were updated
-            {
-                Activation::onFlashWriteSuccess();
-            }
+            onVolumesCreated();
         }
     }
 
     return;
 }
 
+void Activation::onVolumesCreated()
+{
+    if (softwareServer::Activation::activation() !=
+        softwareServer::Activation::Activations::Activating)
+    {
+        return;
+    }
+
+    if (!roVolumeCreated)
+    {
+        return;
+    }
+
+#ifdef PIPELINED_ACTIVATION
+    if (verifyPending)
+    {
+        // Committed once the verification has passed
+        return;
+    }
+#endif
+
+    if (!ubootWritten)
+    {
+        // U-Boot is shared by both versions, so it is only written once the
+        // partitions are.
+        if (!updateUboot(versionId))
+        {
+            activation(softwareServer::Activation::Activations::Failed);
+            return;
+        }
+        ubootWritten = true;
+    }
+
+    if (!ubootEnvVarsUpdated)
+    {
+        activationProgress->progress(90);
+
+        // Set the priority which triggers the service that updates the
+        // environment variables.
+        if (!Activation::redundancyPriority)
+        {
+            Activation::redundancyPriority =
+                std::make_unique<RedundancyPriority>(bus, path, *this, 0);
+        }
+    }
+    else // Environment variables were updated
+    {
+        Activation::onFlashWriteSuccess();
+    }
+}
+
 } // namespace updater
 } // namespace software
 } // namespace phosphor
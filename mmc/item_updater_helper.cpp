@@ -23,6 +23,11 @@ void Helper::clearEntry(const std::string& /* entryId */)
     // Empty
 }
 
+void Helper::clearEntries(const std::vector<std::string>& /* entryIds */)
+{
+    // Empty
+}
+
 void Helper::cleanup()
 {
     // Empty
@@ -48,6 +53,27 @@ void Helper::removeVersion(const std::string& versionId)
     std::this_thread::sleep_for(removeWait);
 }
 
+void Helper::removeVersions(const std::vector<std::string>& versionIds)
+{
+    if (versionIds.empty())
+    {
+        return;
+    }
+
+    for (const auto& versionId : versionIds)
+    {
+        auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
+                                          SYSTEMD_INTERFACE, "StartUnit");
+        auto serviceFile = "obmc-flash-mmc-remove@" + versionId + ".service";
+        method.append(serviceFile, "replace");
+        bus.call_noreply(method);
+    }
+
+    // The services run at the same time, wait for them once.
+    constexpr auto removeWait = std::chrono::seconds(3);
+    std::this_thread::sleep_for(removeWait);
+}
+
 void Helper::updateUbootVersionId(const std::string& versionId)
 {
     auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
@@ -0,0 +1,257 @@
+#include "mtd_mirror.hpp"
+
+#include <fcntl.h>
+#include <mtd/mtd-user.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <system_error>
+#include <vector>
+
+namespace mtd_mirror
+{
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+/** @brief RAII wrapper for a device file descriptor and its geometry */
+class Device
+{
+  public:
+    Device() = delete;
+    Device(const Device&) = delete;
+    Device& operator=(const Device&) = delete;
+    Device(Device&&) = delete;
+    Device& operator=(Device&&) = delete;
+
+    /** @brief Open a device and read its geometry
+     *
+     * @param[in] path  - The path of the device.
+     * @param[in] flags - The open flags.
+     */
+    Device(const std::string& path, int flags) :
+        path(path), fd(open(path.c_str(), flags | O_CLOEXEC))
+    {
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(),
+                                    "open " + path);
+        }
+
+        mtd_info_user info{};
+        if (ioctl(fd, MEMGETINFO, &info) == 0)
+        {
+            isMtd = true;
+            size = info.size;
+            eraseSize = info.erasesize;
+            return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            auto err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category(),
+                                    "stat " + path);
+        }
+        size = st.st_size;
+    }
+
+    ~Device()
+    {
+        close(fd);
+    }
+
+    /** @brief Read exactly length bytes at offset */
+    void read(char* buffer, size_t length, uint64_t offset) const
+    {
+        while (length > 0)
+        {
+            auto bytes = pread(fd, buffer, length, offset);
+            if (bytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes <= 0)
+            {
+                throw std::system_error(bytes < 0 ? errno : EIO,
+                                        std::generic_category(),
+                                        "read " + path);
+            }
+            buffer += bytes;
+            length -= bytes;
+            offset += bytes;
+        }
+    }
+
+    /** @brief Erase the erase block at offset and write length bytes */
+    void rewrite(const char* buffer, size_t length, uint64_t offset) const
+    {
+        if (isMtd)
+        {
+            erase_info_user erase{};
+            erase.start = offset;
+            erase.length = eraseSize;
+            if (ioctl(fd, MEMERASE, &erase) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(),
+                                        "erase " + path);
+            }
+        }
+
+        while (length > 0)
+        {
+            auto bytes = pwrite(fd, buffer, length, offset);
+            if (bytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes <= 0)
+            {
+                throw std::system_error(bytes < 0 ? errno : EIO,
+                                        std::generic_category(),
+                                        "write " + path);
+            }
+            buffer += bytes;
+            length -= bytes;
+            offset += bytes;
+        }
+    }
+
+    const std::string path;
+    const int fd;
+    bool isMtd = false;
+    uint64_t size = 0;
+    uint32_t eraseSize = defaultEraseSize;
+};
+
+/** @brief The erase block size used to compare two devices */
+uint32_t blockSize(const Device& source, const Device& destination)
+{
+    // Rewrites must cover whole erase blocks of the destination
+    return destination.isMtd ? destination.eraseSize
+                             : std::max(source.eraseSize,
+                                        destination.eraseSize);
+}
+
+/** @brief Find the first differing block at or after offset */
+std::optional<uint64_t> findDifference(const Device& source,
+                                       const Device& destination,
+                                       uint64_t offset, std::vector<char>& a,
+                                       std::vector<char>& b)
+{
+    auto size = std::min(source.size, destination.size);
+    auto eraseSize = a.size();
+    for (; offset < size; offset += eraseSize)
+    {
+        auto length = std::min<uint64_t>(eraseSize, size - offset);
+        source.read(a.data(), length, offset);
+        destination.read(b.data(), length, offset);
+        if (std::memcmp(a.data(), b.data(), length) != 0)
+        {
+            return offset;
+        }
+    }
+    return std::nullopt;
+}
+
+} // namespace
+
+std::string findMtd(const fs::path& sysfs, const std::string& name)
+{
+    std::error_code ec;
+    for (const auto& entry :
+         fs::directory_iterator(sysfs / "class" / "mtd", ec))
+    {
+        auto device = entry.path().filename().string();
+        if (device.ends_with("ro"))
+        {
+            continue;
+        }
+
+        std::ifstream nameFile(entry.path() / "name");
+        std::string mtdName;
+        std::getline(nameFile, mtdName);
+        if (mtdName == name)
+        {
+            return "/dev/" + device;
+        }
+    }
+    return {};
+}
+
+std::optional<uint64_t> findDifference(const std::string& source,
+                                       const std::string& destination)
+{
+    Device src(source, O_RDONLY);
+    Device dst(destination, O_RDONLY);
+    std::vector<char> a(blockSize(src, dst));
+    std::vector<char> b(a.size());
+    return findDifference(src, dst, 0, a, b);
+}
+
+Result mirror(const std::string& source, const std::string& destination,
+              const Progress& progress)
+{
+    Device src(source, O_RDONLY);
+    Device dst(destination, O_RDWR);
+
+    auto eraseSize = blockSize(src, dst);
+    auto size = std::min(src.size, dst.size);
+    std::vector<char> a(eraseSize);
+    std::vector<char> b(eraseSize);
+
+    Result result;
+    result.blocks = (size + eraseSize - 1) / eraseSize;
+
+    auto offset = findDifference(src, dst, 0, a, b);
+    while (offset)
+    {
+        // The buffers hold the differing block
+        auto length = std::min<uint64_t>(eraseSize, size - *offset);
+        dst.rewrite(a.data(), length, *offset);
+        ++result.rewritten;
+
+        if (progress)
+        {
+            progress(*offset / eraseSize + 1, result.blocks);
+        }
+
+        offset = findDifference(src, dst, *offset + eraseSize, a, b);
+    }
+
+    if (progress)
+    {
+        progress(result.blocks, result.blocks);
+    }
+
+    return result;
+}
+
+std::string stamp(const std::string& source, const std::string& destination)
+{
+    Device src(source, O_RDONLY);
+    Device dst(destination, O_RDONLY);
+
+    std::string result;
+    for (const auto* device : {&src, &dst})
+    {
+        if (!result.empty())
+        {
+            result += ' ';
+        }
+        result += device->path + ':' + std::to_string(device->size) + ':' +
+                  std::to_string(device->eraseSize);
+    }
+    return result;
+}
+
+} // namespace mtd_mirror
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+
+namespace mtd_mirror
+{
+
+/** @brief The erase block size assumed for devices that are not MTDs */
+constexpr uint32_t defaultEraseSize = 64 * 1024;
+
+/** @brief Progress callback, called with the number of erase blocks done
+ *         and the total number of erase blocks.
+ */
+using Progress = std::function<void(size_t done, size_t total)>;
+
+/** @brief The outcome of a mirror operation */
+struct Result
+{
+    /** @brief The number of erase blocks compared */
+    size_t blocks = 0;
+    /** @brief The number of erase blocks that were erased and rewritten */
+    size_t rewritten = 0;
+};
+
+/** @brief Find the device node of an MTD partition.
+ *
+ * @param[in] sysfs - The sysfs mount point.
+ * @param[in] name  - The MTD partition name, e.g. u-boot.
+ *
+ * @return The device node, e.g. /dev/mtd0, or an empty string if there is no
+ *         partition with the name.
+ */
+std::string findMtd(const std::filesystem::path& sysfs,
+                    const std::string& name);
+
+/** @brief Find the first erase block that differs between two devices.
+ *
+ * @details The comparison stops at the first difference. Devices of
+ *          different sizes are compared over the size of the smaller one.
+ *
+ * @param[in] source      - The path of the source device.
+ * @param[in] destination - The path of the destination device.
+ *
+ * @return The offset of the first differing erase block, or nullopt if the
+ *         devices are identical.
+ */
+std::optional<uint64_t> findDifference(const std::string& source,
+                                       const std::string& destination);
+
+/** @brief Make the destination device a copy of the source device.
+ *
+ * @details Only the erase blocks that differ are erased and rewritten, and
+ *          the blocks before the first difference are only read once. On MTD
+ *          devices each rewritten block is erased with MEMERASE first.
+ *
+ * @param[in] source      - The path of the source device.
+ * @param[in] destination - The path of the destination device.
+ * @param[in] progress    - Called after each erase block.
+ *
+ * @return The number of erase blocks compared and rewritten.
+ *
+ * @throws std::system_error on I/O errors.
+ */
+Result mirror(const std::string& source, const std::string& destination,
+              const Progress& progress = {});
+
+/** @brief Compute a stamp of a pair of devices.
+ *
+ * @details The stamp only covers the path and geometry of each device, so it
+ *          is computed without reading the devices. It is recorded after a
+ *          mirror, and the writers of either device remove the record, so a
+ *          matching record means that the devices have not been written
+ *          since the last mirror.
+ *
+ * @param[in] source      - The path of the source device.
+ * @param[in] destination - The path of the destination device.
+ *
+ * @return The stamp.
+ *
+ * @throws std::system_error if a device cannot be opened.
+ */
+std::string stamp(const std::string& source, const std::string& destination);
+
+} // namespace mtd_mirror
@@ -0,0 +1,127 @@
+#include "config.h"
+
+#include "mtd_mirror.hpp"
+#include "utils.hpp"
+
+#include <systemd/sd-daemon.h>
+
+#include <phosphor-logging/lg2.hpp>
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+PHOSPHOR_LOG2_USING;
+namespace fs = std::filesystem;
+
+namespace
+{
+
+/** @brief Read the stamp of the last successful mirror */
+std::string readStamp()
+{
+    std::ifstream file(UBOOT_MIRROR_STAMP);
+    std::string stamp;
+    std::getline(file, stamp);
+    return stamp;
+}
+
+/** @brief Persist the stamp of a successful mirror */
+void writeStamp(const std::string& stamp)
+{
+    auto path = fs::path(UBOOT_MIRROR_STAMP);
+    auto tmpPath = path;
+    tmpPath += ".tmp";
+
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    {
+        std::ofstream file(tmpPath);
+        file << stamp << "\n";
+        if (!file)
+        {
+            warning("Failed to write {PATH}", "PATH", tmpPath);
+            return;
+        }
+    }
+    fs::rename(tmpPath, path, ec);
+    if (ec)
+    {
+        warning("Failed to write {PATH}: {ERROR}", "PATH", path, "ERROR",
+                ec.message());
+    }
+}
+
+/** @brief Mirror a device, reporting the progress to systemd */
+mtd_mirror::Result mirror(const std::string& name, const std::string& source,
+                          const std::string& destination)
+{
+    auto result = mtd_mirror::mirror(
+        source, destination, [&name](size_t done, size_t total) {
+            sd_notifyf(0, "STATUS=Mirroring %s: %zu/%zu erase blocks",
+                       name.c_str(), done, total);
+        });
+
+    info("Mirrored {NAME} from {SOURCE} to {DESTINATION}: rewrote "
+         "{REWRITTEN} of {BLOCKS} erase blocks",
+         "NAME", name, "SOURCE", source, "DESTINATION", destination,
+         "REWRITTEN", result.rewritten, "BLOCKS", result.blocks);
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    auto force = (argc > 1) && (std::string(argv[1]) == "--force");
+
+    auto uboot = mtd_mirror::findMtd("/sys", "u-boot");
+    auto altUboot = mtd_mirror::findMtd("/sys", "alt-u-boot");
+    if (uboot.empty() || altUboot.empty())
+    {
+        info("No alternate U-Boot partition to mirror to");
+        return 0;
+    }
+
+    try
+    {
+        // Writers of U-Boot remove the recorded stamp, so the chips are only
+        // read when they may have changed since the last mirror.
+        auto current = mtd_mirror::stamp(uboot, altUboot);
+        if (!force && current == readStamp())
+        {
+            info("U-Boot is unchanged since the last mirror");
+            return 0;
+        }
+
+        auto result = mirror("U-Boot", uboot, altUboot);
+        if (result.rewritten > 0)
+        {
+            auto env = mtd_mirror::findMtd("/sys", "u-boot-env");
+            auto altEnv = mtd_mirror::findMtd("/sys", "alt-u-boot-env");
+            if (!env.empty() && !altEnv.empty())
+            {
+                mirror("U-Boot environment", env, altEnv);
+            }
+
+            // The alternate chip boots as the primary, point its environment
+            // at its own volumes.
+            if (utils::execute("/usr/bin/obmc-flash-bmc", "copyenvtoalt") !=
+                0)
+            {
+                error("Failed to update the alternate U-Boot environment");
+                return 1;
+            }
+        }
+
+        writeStamp(current);
+    }
+    catch (const std::exception& e)
+    {
+        error("Failed to mirror U-Boot to the alternate chip: {ERROR}",
+              "ERROR", e);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,397 @@
+#include "process.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <phosphor-logging/lg2.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <csignal>
+#include <memory>
+#include <string>
+#include <system_error>
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+extern char** environ;
+
+namespace process
+{
+
+PHOSPHOR_LOG2_USING;
+
+namespace
+{
+
+/** @brief The bytes read from a pipe at a time */
+constexpr size_t readSize = 4096;
+
+/** @class Child
+ *  @brief A spawned child process, its pidfd and the pipes of its stdout
+ *         and stderr.
+ *  @details The child is killed and reaped if it is still running when the
+ *           object goes away.
+ */
+class Child
+{
+  public:
+    Child() = delete;
+    Child(const Child&) = delete;
+    Child& operator=(const Child&) = delete;
+    Child(Child&&) = delete;
+    Child& operator=(Child&&) = delete;
+
+    /** @brief Spawns the child
+     *
+     * @throws std::system_error if it cannot be spawned.
+     */
+    Child(const char* path, char* const* args, const Options& options);
+
+    ~Child();
+
+    /** @brief Read what the child wrote so far, without blocking
+     *
+     * @return Whether the pipes are still open.
+     */
+    bool readOutput()
+    {
+        outOpen = outOpen && drain(outFd, result.output);
+        errOpen = errOpen && drain(errFd, result.errors);
+        return outOpen || errOpen;
+    }
+
+    /** @brief Kill the child, it is still to be reaped */
+    void kill()
+    {
+        if (!reaped)
+        {
+            syscall(SYS_pidfd_send_signal, pidFd, SIGKILL, nullptr, 0);
+        }
+    }
+
+    /** @brief Wait for the child to end, once its pidfd is readable */
+    void reap();
+
+    /** @brief Wait for the child to end, reading its output and killing it
+     *         once it runs out of time */
+    void wait();
+
+    /** @brief The pidfd, readable once the child ended */
+    int pidFd = -1;
+    /** @brief The read ends of the pipes of stdout and stderr */
+    int outFd = -1;
+    int errFd = -1;
+
+    /** @brief Whether the pipes are still open */
+    bool outOpen = true;
+    bool errOpen = true;
+
+    /** @brief How the child ended, and what it wrote */
+    Result result;
+
+  private:
+    /** @brief Read a pipe into a buffer until it would block
+     *
+     * @return false at the end of the pipe.
+     */
+    bool drain(int fd, std::string& buffer);
+
+    /** @brief The bytes of stdout and of stderr kept */
+    size_t limit;
+
+    /** @brief The time the child is given by wait(), zero for no limit */
+    std::chrono::milliseconds timeout;
+
+    /** @brief Whether the child was reaped */
+    bool reaped = false;
+};
+
+void closePipe(int (&fds)[2])
+{
+    for (auto& fd : fds)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+}
+
+Child::Child(const char* path, char* const* args, const Options& options) :
+    limit(options.outputLimit), timeout(options.timeout)
+{
+    int outPipe[2] = {-1, -1};
+    int errPipe[2] = {-1, -1};
+    if (pipe2(outPipe, O_CLOEXEC) < 0 || pipe2(errPipe, O_CLOEXEC) < 0)
+    {
+        auto err = errno;
+        closePipe(outPipe);
+        closePipe(errPipe);
+        throw std::system_error(err, std::generic_category(), "pipe2");
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+                                     O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, outPipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, errPipe[1], STDERR_FILENO);
+
+    // The daemon may block or handle signals the child expects by default
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t all;
+    sigset_t none;
+    sigfillset(&all);
+    sigemptyset(&none);
+    posix_spawnattr_setsigdefault(&attr, &all);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid = -1;
+    auto rc = posix_spawn(&pid, path, &actions, &attr, args, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(outPipe[1]);
+    close(errPipe[1]);
+    outFd = outPipe[0];
+    errFd = errPipe[0];
+    if (rc != 0)
+    {
+        close(outFd);
+        close(errFd);
+        throw std::system_error(rc, std::generic_category(), path);
+    }
+
+    pidFd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidFd < 0)
+    {
+        auto err = errno;
+        ::kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        close(outFd);
+        close(errFd);
+        throw std::system_error(err, std::generic_category(), "pidfd_open");
+    }
+
+    fcntl(outFd, F_SETFL, fcntl(outFd, F_GETFL) | O_NONBLOCK);
+    fcntl(errFd, F_SETFL, fcntl(errFd, F_GETFL) | O_NONBLOCK);
+}
+
+Child::~Child()
+{
+    if (!reaped)
+    {
+        kill();
+        reap();
+    }
+    close(pidFd);
+    close(outFd);
+    close(errFd);
+}
+
+bool Child::drain(int fd, std::string& buffer)
+{
+    std::array<char, readSize> data;
+    while (true)
+    {
+        auto size = ::read(fd, data.data(), data.size());
+        if (size > 0)
+        {
+            auto kept = std::min(static_cast<size_t>(size),
+                                 limit - std::min(limit, buffer.size()));
+            buffer.append(data.data(), kept);
+            continue;
+        }
+        if (size < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return size < 0 && errno == EAGAIN;
+    }
+}
+
+void Child::reap()
+{
+    siginfo_t info{};
+    while (waitid(static_cast<idtype_t>(P_PIDFD), pidFd, &info, WEXITED) < 0)
+    {
+        if (errno != EINTR)
+        {
+            error("Error ({ERRNO}) during waitid.", "ERRNO", errno);
+            reaped = true;
+            return;
+        }
+    }
+    reaped = true;
+
+    if (info.si_code == CLD_EXITED)
+    {
+        result.exitCode = info.si_status;
+    }
+    else
+    {
+        result.signal = info.si_status;
+    }
+}
+
+void Child::wait()
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true)
+    {
+        std::array<pollfd, 3> fds = {{{pidFd, POLLIN, 0},
+                                      {outOpen ? outFd : -1, POLLIN, 0},
+                                      {errOpen ? errFd : -1, POLLIN, 0}}};
+        int left = -1;
+        if (timeout.count() > 0 && !result.timedOut)
+        {
+            left = std::max<int>(
+                0, std::chrono::ceil<std::chrono::milliseconds>(
+                       deadline - std::chrono::steady_clock::now())
+                       .count());
+        }
+
+        auto rc = poll(fds.data(), fds.size(), left);
+        if (rc < 0 && errno != EINTR)
+        {
+            error("Error ({ERRNO}) during poll.", "ERRNO", errno);
+            kill();
+            break;
+        }
+        if (rc == 0)
+        {
+            result.timedOut = true;
+            kill();
+            continue;
+        }
+
+        readOutput();
+        if (fds[0].revents)
+        {
+            break;
+        }
+    }
+
+    reap();
+}
+
+/** @brief A child process reaped from the event loop */
+struct Watch
+{
+    Watch(const char* path, char* const* args, const Options& options,
+          Callback callback) :
+        child(path, args, options),
+        callback(std::move(callback))
+    {}
+
+    ~Watch()
+    {
+        for (auto source : {exited, output, errors, timer})
+        {
+            sd_event_source_unref(source);
+        }
+    }
+
+    Child child;
+    Callback callback;
+    sd_event_source* exited = nullptr;
+    sd_event_source* output = nullptr;
+    sd_event_source* errors = nullptr;
+    sd_event_source* timer = nullptr;
+};
+
+int onExited(sd_event_source* /* source */, int /* fd */,
+             uint32_t /* revents */, void* userdata)
+{
+    std::unique_ptr<Watch> watch(static_cast<Watch*>(userdata));
+    watch->child.readOutput();
+    watch->child.reap();
+    watch->callback(watch->child.result);
+    return 0;
+}
+
+int onOutput(sd_event_source* source, int /* fd */, uint32_t /* revents */,
+             void* userdata)
+{
+    auto watch = static_cast<Watch*>(userdata);
+    watch->child.readOutput();
+    if (source == watch->output && !watch->child.outOpen)
+    {
+        sd_event_source_set_enabled(source, SD_EVENT_OFF);
+    }
+    if (source == watch->errors && !watch->child.errOpen)
+    {
+        sd_event_source_set_enabled(source, SD_EVENT_OFF);
+    }
+    return 0;
+}
+
+int onTimeout(sd_event_source* /* source */, uint64_t /* usec */,
+              void* userdata)
+{
+    auto watch = static_cast<Watch*>(userdata);
+    watch->child.result.timedOut = true;
+    watch->child.kill();
+    return 0;
+}
+
+} // namespace
+
+Result run(const char* path, char* const* args, const Options& options)
+{
+    Child child(path, args, options);
+    child.wait();
+    return child.result;
+}
+
+void runAsync(sd_event* loop, const char* path, char* const* args,
+              const Options& options, Callback callback)
+{
+    auto watch =
+        std::make_unique<Watch>(path, args, options, std::move(callback));
+    auto& child = watch->child;
+
+    auto rc = sd_event_add_io(loop, &watch->output, child.outFd, EPOLLIN,
+                              onOutput, watch.get());
+    if (rc >= 0)
+    {
+        rc = sd_event_add_io(loop, &watch->errors, child.errFd, EPOLLIN,
+                             onOutput, watch.get());
+    }
+    if (rc >= 0 && options.timeout.count() > 0)
+    {
+        auto usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                        options.timeout)
+                        .count();
+        rc = sd_event_add_time_relative(loop, &watch->timer, CLOCK_MONOTONIC,
+                                        usec, 0, onTimeout, watch.get());
+    }
+    if (rc >= 0)
+    {
+        rc = sd_event_add_io(loop, &watch->exited, child.pidFd, EPOLLIN,
+                             onExited, watch.get());
+    }
+    if (rc < 0)
+    {
+        // The child is killed and reaped with the watch
+        throw std::system_error(-rc, std::generic_category(),
+                                "sd_event_add_io");
+    }
+
+    // Owned by the event loop until onExited()
+    watch.release();
+}
+
+} // namespace process
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <systemd/sd-event.h>
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <string>
+
+namespace process
+{
+
+/** @brief How a child process is run */
+struct Options
+{
+    /** @brief The time the child is given before it is killed, zero for no
+     *         limit */
+    std::chrono::milliseconds timeout{0};
+    /** @brief The bytes of stdout and of stderr kept, the rest is read and
+     *         discarded */
+    size_t outputLimit = 4096;
+};
+
+/** @brief How a child process ended, and what it wrote */
+struct Result
+{
+    /** @brief The exit status, -1 if it was killed by a signal */
+    int exitCode = -1;
+    /** @brief The signal that killed it, 0 if it exited */
+    int signal = 0;
+    /** @brief Whether it was killed as it ran out of time */
+    bool timedOut = false;
+    /** @brief The start of what it wrote to stdout */
+    std::string output;
+    /** @brief The start of what it wrote to stderr */
+    std::string errors;
+
+    /** @brief Whether it exited with status 0 */
+    bool succeeded() const
+    {
+        return exitCode == 0;
+    }
+};
+
+/** @brief Called from the event loop once a child process is reaped */
+using Callback = std::function<void(const Result&)>;
+
+/** @brief Run a program and wait for it to end.
+ *
+ * @details The child is spawned with posix_spawn(), so it never runs any of
+ *          the code of the caller, and is waited for through a pidfd. Its
+ *          stdin is /dev/null.
+ *
+ * @param[in] path    - Fully qualified name of the executable to run
+ * @param[in] args    - The null terminated arguments, the name first
+ * @param[in] options - The timeout and output limit
+ *
+ * @return How the child ended.
+ *
+ * @throws std::system_error if it cannot be spawned.
+ */
+Result run(const char* path, char* const* args, const Options& options = {});
+
+/** @brief Run a program without waiting for it.
+ *
+ * @details As run(), but the child is reaped from the event loop, which
+ *          keeps it alive until then.
+ *
+ * @param[in] loop     - The sd-event loop to reap the child from.
+ * @param[in] path     - Fully qualified name of the executable to run
+ * @param[in] args     - The null terminated arguments, the name first
+ * @param[in] options  - The timeout and output limit
+ * @param[in] callback - Called with how the child ended.
+ *
+ * @throws std::system_error if it cannot be spawned.
+ */
+void runAsync(sd_event* loop, const char* path, char* const* args,
+              const Options& options, Callback callback);
+
+} // namespace process
@@ -0,0 +1,120 @@
+#include "reboot_guard.hpp"
+
+#include <phosphor-logging/lg2.hpp>
+
+#include <array>
+#include <fstream>
+#include <map>
+#include <string>
+#include <system_error>
+
+namespace reboot_guard
+{
+
+PHOSPHOR_LOG2_USING;
+namespace fs = std::filesystem;
+
+namespace
+{
+
+/** @brief The targets the guard refuses to start */
+constexpr std::array targets = {"reboot.target", "poweroff.target",
+                                "halt.target"};
+
+/** @brief The name of the drop-in */
+constexpr auto dropIn = "reboot-guard.conf";
+
+/** @brief The number of guards holding each directory */
+std::map<std::string, unsigned> holders;
+
+/** @brief Remove the drop-ins.
+ *
+ * @return Whether any was removed.
+ */
+bool removeDropIns(const fs::path& dir)
+{
+    bool removed = false;
+    for (const auto& target : targets)
+    {
+        std::error_code ec;
+        removed |= fs::remove(dir / (std::string(target) + ".d") / dropIn, ec);
+        if (ec)
+        {
+            error("Failed to remove the reboot guard of {TARGET}: {ERROR}",
+                  "TARGET", target, "ERROR", ec.message());
+        }
+    }
+    return removed;
+}
+
+/** @brief Write the drop-ins, each replacing the previous one at once.
+ *
+ * @throws std::filesystem::filesystem_error on errors.
+ */
+void writeDropIns(const fs::path& dir)
+{
+    for (const auto& target : targets)
+    {
+        auto targetDir = dir / (std::string(target) + ".d");
+        fs::create_directories(targetDir);
+
+        auto path = targetDir / dropIn;
+        auto tmpPath = path;
+        tmpPath += ".tmp";
+        std::ofstream file(tmpPath);
+        file << "[Unit]\nRefuseManualStart=yes\n";
+        file.close();
+        if (!file)
+        {
+            std::error_code ec;
+            fs::remove(tmpPath, ec);
+            throw fs::filesystem_error(
+                "write", tmpPath,
+                std::make_error_code(std::errc::io_error));
+        }
+        fs::rename(tmpPath, path);
+    }
+}
+
+} // namespace
+
+Guard::Guard(const fs::path& dir, Reload reload) :
+    dir(dir), reload(std::move(reload))
+{
+    auto& count = holders[dir.string()];
+    if (count == 0)
+    {
+        try
+        {
+            writeDropIns(dir);
+        }
+        catch (const fs::filesystem_error&)
+        {
+            removeDropIns(dir);
+            throw;
+        }
+        if (this->reload)
+        {
+            this->reload();
+        }
+    }
+    count++;
+}
+
+Guard::~Guard()
+{
+    auto& count = holders[dir.string()];
+    if (--count > 0)
+    {
+        return;
+    }
+    holders.erase(dir.string());
+
+    // The drop-ins are gone already if force-reboot.service lifted them
+    if (removeDropIns(dir) && reload)
+    {
+        reload();
+    }
+}
+
+} // namespace reboot_guard
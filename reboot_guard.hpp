@@ -0,0 +1,53 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+
+namespace reboot_guard
+{
+
+/** @brief The directory of the runtime systemd unit drop-ins */
+constexpr auto runtimeUnitDir = "/run/systemd/system";
+
+/** @class Guard
+ *  @brief Blocks BMC reboots for its lifetime.
+ *  @details Writes a drop-in that refuses to start reboot.target,
+ *           poweroff.target and halt.target, and removes it once the last
+ *           guard is gone. The drop-ins are the ones obmc-flash-bmc writes,
+ *           so force-reboot.service still lifts them.
+ */
+class Guard
+{
+  public:
+    /** @brief Called once the drop-ins changed, to have systemd load them.
+     *         It must not throw. */
+    using Reload = std::function<void()>;
+
+    Guard() = delete;
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+    Guard(Guard&&) = delete;
+    Guard& operator=(Guard&&) = delete;
+
+    /** @brief Block the reboots.
+     *
+     * @param[in] dir    - The directory of the runtime unit drop-ins.
+     * @param[in] reload - Called once the drop-ins are written.
+     *
+     * @throws std::filesystem::filesystem_error if the drop-ins cannot be
+     *         written, none is left behind then.
+     */
+    Guard(const std::filesystem::path& dir, Reload reload);
+
+    /** @brief Allow the reboots again, unless another guard blocks them */
+    ~Guard();
+
+  private:
+    /** @brief The directory of the runtime unit drop-ins */
+    std::filesystem::path dir;
+
+    /** @brief Called once the drop-ins changed */
+    Reload reload;
+};
+
+} // namespace reboot_guard
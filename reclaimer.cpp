@@ -0,0 +1,316 @@
+#include "reclaimer.hpp"
+
+#include "utils.hpp"
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <phosphor-logging/lg2.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace reclaimer
+{
+
+PHOSPHOR_LOG2_USING;
+namespace fs = std::filesystem;
+using namespace std::string_literals;
+
+namespace
+{
+
+/** @brief The bytes a file is truncated by at a time */
+constexpr off_t chunkSize = 4 * 1024 * 1024;
+
+/** @brief Get the bytes a file frees once deleted.
+ *
+ * @return 0 if other paths link to it, or it cannot be read.
+ */
+uint64_t freeableBytes(const fs::path& path)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_nlink > 1)
+    {
+        return 0;
+    }
+    return st.st_size;
+}
+
+/** @brief Get the bytes the files under a path free once deleted */
+uint64_t measure(const fs::path& path, const std::stop_token& stop)
+{
+    std::error_code ec;
+    if (!fs::is_directory(fs::symlink_status(path, ec)))
+    {
+        return freeableBytes(path);
+    }
+
+    uint64_t bytes = 0;
+    for (auto it = fs::recursive_directory_iterator(path, ec);
+         !ec && it != fs::recursive_directory_iterator() &&
+         !stop.stop_requested();
+         it.increment(ec))
+    {
+        bytes += freeableBytes(it->path());
+    }
+    return bytes;
+}
+
+} // namespace
+
+Reclaimer::Reclaimer(const fs::path& trash, sd_event* loop,
+                     Callback progress) :
+    trash(trash),
+    progress(std::move(progress))
+{
+    std::error_code ec;
+    fs::create_directories(trash, ec);
+    if (ec)
+    {
+        throw std::runtime_error("failed to create " + trash.string() + ": " +
+                                 ec.message());
+    }
+
+    eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (eventFd < 0)
+    {
+        auto error = errno;
+        throw std::runtime_error("eventfd failed, errno="s +
+                                 std::strerror(error));
+    }
+
+    auto rc = sd_event_add_io(loop, &eventSource, eventFd, EPOLLIN,
+                              onNotified, this);
+    if (rc < 0)
+    {
+        close(eventFd);
+        throw std::runtime_error("failed to add to event loop, rc="s +
+                                 std::strerror(-rc));
+    }
+
+    worker = std::jthread([this](std::stop_token stop) { run(stop); });
+}
+
+Reclaimer::~Reclaimer()
+{
+    // The worker notifies through the event source, stop it first
+    worker.request_stop();
+    worker.join();
+
+    sd_event_source_unref(eventSource);
+    close(eventFd);
+}
+
+void Reclaimer::remove(const fs::path& path)
+{
+    std::error_code ec;
+    if (!fs::exists(fs::symlink_status(path, ec)))
+    {
+        return;
+    }
+
+    auto bytes = measure(path, {});
+
+    // Each path gets a directory of its own, so that names do not collide
+    // with what is in the trash already. It is moved and counted under the
+    // lock the worker lists the trash with, so that it is counted before
+    // it can be deleted.
+    auto dir = (trash / "XXXXXX").string();
+    std::unique_lock lock(mutex);
+    if (!mkdtemp(dir.data()) ||
+        ::rename(path.c_str(), (fs::path(dir) / path.filename()).c_str()) < 0)
+    {
+        auto err = errno;
+        lock.unlock();
+        warning("Failed to move {PATH} to the trash, deleting it now: "
+                "{ERRNO}",
+                "PATH", path.string(), "ERRNO", err);
+        fs::remove_all(path, ec);
+        if (!dir.ends_with("XXXXXX"))
+        {
+            fs::remove(dir, ec);
+        }
+        freed += bytes;
+        notify();
+        return;
+    }
+    pending += bytes;
+    queued = true;
+    lock.unlock();
+
+    wakeup.notify_one();
+    notify();
+}
+
+void Reclaimer::run(std::stop_token stop)
+{
+    // Deleting is never urgent, yield to everything else
+    utils::setThreadPriority(0, true);
+
+    bool measured = false;
+    while (!stop.stop_requested())
+    {
+        std::vector<fs::path> entries;
+        std::error_code ec;
+        {
+            std::unique_lock lock(mutex);
+            if (!wakeup.wait(lock, stop, [this]() { return queued; }))
+            {
+                return;
+            }
+            queued = false;
+
+            for (const auto& entry : fs::directory_iterator(trash, ec))
+            {
+                entries.push_back(entry.path());
+            }
+
+            // What was left in the trash on the last stop, remove() counts
+            // the rest
+            if (!ec && !measured)
+            {
+                pending = measure(trash, stop);
+                measured = true;
+            }
+        }
+        if (ec)
+        {
+            error("Failed to list {PATH}: {ERROR}", "PATH", trash.string(),
+                  "ERROR", ec.message());
+            continue;
+        }
+        notify();
+
+        for (const auto& entry : entries)
+        {
+            if (!removeTree(entry, stop))
+            {
+                return;
+            }
+        }
+
+        {
+            // Drop what was miscounted, such as files linked to since
+            std::lock_guard lock(mutex);
+            if (!queued)
+            {
+                pending = 0;
+            }
+        }
+        notify();
+    }
+}
+
+bool Reclaimer::removeTree(const fs::path& path, const std::stop_token& stop)
+{
+    std::error_code ec;
+    if (fs::is_directory(fs::symlink_status(path, ec)))
+    {
+        std::vector<fs::path> children;
+        for (const auto& entry : fs::directory_iterator(path, ec))
+        {
+            children.push_back(entry.path());
+        }
+        for (const auto& child : children)
+        {
+            if (!removeTree(child, stop))
+            {
+                return false;
+            }
+        }
+        if (::rmdir(path.c_str()) < 0)
+        {
+            error("Failed to delete {PATH}: {ERRNO}", "PATH", path.string(),
+                  "ERRNO", errno);
+        }
+        return !stop.stop_requested();
+    }
+
+    return removeFile(path, stop);
+}
+
+bool Reclaimer::removeFile(const fs::path& path, const std::stop_token& stop)
+{
+    // A file other paths link to, such as a blob of the image store, is
+    // only unlinked, its content stays.
+    auto size = freeableBytes(path);
+    if (size > static_cast<uint64_t>(chunkSize))
+    {
+        auto fd = open(path.c_str(), O_WRONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd >= 0)
+        {
+            auto length = static_cast<off_t>(size);
+            while (length > 0)
+            {
+                if (stop.stop_requested())
+                {
+                    close(fd);
+                    return false;
+                }
+
+                auto next = length > chunkSize ? length - chunkSize : 0;
+                if (ftruncate(fd, next) < 0)
+                {
+                    break;
+                }
+                auto bytes = static_cast<uint64_t>(length - next);
+                freed += bytes;
+                pending -= std::min<uint64_t>(pending, bytes);
+                size -= bytes;
+                length = next;
+                notify();
+            }
+            close(fd);
+        }
+    }
+
+    if (::unlink(path.c_str()) < 0 && errno != ENOENT)
+    {
+        error("Failed to delete {PATH}: {ERRNO}", "PATH", path.string(),
+              "ERRNO", errno);
+        return !stop.stop_requested();
+    }
+    if (size > 0)
+    {
+        freed += size;
+        pending -= std::min<uint64_t>(pending, size);
+    }
+    return !stop.stop_requested();
+}
+
+void Reclaimer::notify()
+{
+    uint64_t count = 1;
+    if (::write(eventFd, &count, sizeof(count)) < 0)
+    {
+        error("Failed to notify the event loop: {ERRNO}", "ERRNO", errno);
+    }
+}
+
+int Reclaimer::onNotified(sd_event_source* /* source */, int fd,
+                          uint32_t /* revents */, void* userdata)
+{
+    uint64_t count = 0;
+    if (::read(fd, &count, sizeof(count)) < 0)
+    {
+        return 0;
+    }
+
+    auto reclaimer = static_cast<Reclaimer*>(userdata);
+    if (reclaimer->progress)
+    {
+        reclaimer->progress();
+    }
+    return 0;
+}
+
+} // namespace reclaimer
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <systemd/sd-event.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+
+namespace reclaimer
+{
+
+/** @class Reclaimer
+ *  @brief Deletes files and directories in the background.
+ *  @details A path is moved to a trash directory at once, then deleted by a
+ *           worker thread at idle priority. Large files are truncated a
+ *           chunk at a time before they are unlinked, so that no single
+ *           call frees much more than a chunk. What is left in the trash
+ *           when the process stops is deleted on the next start.
+ *
+ *           The trash must be on the filesystem of the paths removed.
+ */
+class Reclaimer
+{
+  public:
+    /** @brief Called from the event loop as the trash is deleted */
+    using Callback = std::function<void()>;
+
+    Reclaimer() = delete;
+    Reclaimer(const Reclaimer&) = delete;
+    Reclaimer& operator=(const Reclaimer&) = delete;
+    Reclaimer(Reclaimer&&) = delete;
+    Reclaimer& operator=(Reclaimer&&) = delete;
+
+    /** @brief Constructs Reclaimer, and starts deleting what is left in the
+     *         trash.
+     *
+     * @param[in] trash    - The trash directory, created if needed.
+     * @param[in] loop     - The sd-event loop to call back from.
+     * @param[in] progress - Called once the bytes pending or freed change.
+     *
+     * @throws std::runtime_error if the trash cannot be set up.
+     */
+    Reclaimer(const std::filesystem::path& trash, sd_event* loop,
+              Callback progress);
+
+    /** @brief Stops deleting, the rest is deleted on the next start */
+    ~Reclaimer();
+
+    /** @brief Delete a file or directory in the background.
+     *
+     * @details Counted in pendingBytes() at once. Deleted synchronously if it
+     *          cannot be moved to the trash.
+     *
+     * @param[in] path - The path to delete, ignored if it does not exist.
+     */
+    void remove(const std::filesystem::path& path);
+
+    /** @brief Get the bytes that will be freed once the files in the trash
+     *         are deleted */
+    uint64_t pendingBytes() const
+    {
+        return pending;
+    }
+
+    /** @brief Get the bytes freed since the start */
+    uint64_t freedBytes() const
+    {
+        return freed;
+    }
+
+  private:
+    /** @brief Delete the trash until stopped */
+    void run(std::stop_token stop);
+
+    /** @brief Delete a file or directory tree in the trash.
+     *
+     * @return false if stopped before it was deleted.
+     */
+    bool removeTree(const std::filesystem::path& path,
+                    const std::stop_token& stop);
+
+    /** @brief Delete a file a chunk at a time.
+     *
+     * @return false if stopped before it was deleted.
+     */
+    bool removeFile(const std::filesystem::path& path,
+                    const std::stop_token& stop);
+
+    /** @brief Tell the event loop that the bytes pending or freed changed */
+    void notify();
+
+    /** @brief Called by sd-event once notified */
+    static int onNotified(sd_event_source* source, int fd, uint32_t revents,
+                          void* userdata);
+
+    /** @brief The trash directory */
+    std::filesystem::path trash;
+
+    /** @brief Called once the bytes pending or freed change */
+    Callback progress;
+
+    /** @brief The eventfd the worker notifies the event loop through */
+    int eventFd = -1;
+
+    /** @brief The sd-event source of eventFd */
+    sd_event_source* eventSource = nullptr;
+
+    /** @brief The bytes the trash will free */
+    std::atomic<uint64_t> pending = 0;
+
+    /** @brief The bytes freed since the start */
+    std::atomic<uint64_t> freed = 0;
+
+    /** @brief Protects queued, and the trash while it is listed */
+    std::mutex mutex;
+
+    /** @brief Signals the worker when queued is set */
+    std::condition_variable_any wakeup;
+
+    /** @brief Set when there is something new in the trash */
+    bool queued = true;
+
+    /** @brief The worker thread, declared last so that it stops first */
+    std::jthread worker;
+};
+
+} // namespace reclaimer
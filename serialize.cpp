@@ -2,7 +2,13 @@
 
 #include "serialize.hpp"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <cereal/archives/json.hpp>
+#include <cereal/types/map.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
 #include <phosphor-logging/lg2.hpp>
 #include <sdbusplus/server.hpp>
 
@@ -21,6 +27,163 @@ namespace fs = std::filesystem;
 
 const std::string priorityName = "priority";
 const std::string purposeName = "purpose";
+const std::string catalogueName = "catalogue";
+const std::string catalogueFormatName = "format";
+const std::string journalName = "journal";
+
+// Increment when CatalogueEntry changes, older catalogues are then discarded
+// and rebuilt from a full scan.
+constexpr uint32_t catalogueFormat = 1;
+
+namespace
+{
+
+/** @brief Flush a file to the disk, so that it is not renamed into place
+ *         before its content reaches the disk */
+void syncFile(const fs::path& path)
+{
+    auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+} // namespace
+
+void storeCatalogue(const Catalogue& catalogue, const fs::path& dir)
+{
+    auto path = dir / catalogueName;
+    auto tmpPath = dir / (catalogueName + ".tmp");
+
+    try
+    {
+        fs::create_directories(dir);
+        {
+            std::ofstream os(tmpPath.c_str());
+            cereal::JSONOutputArchive oarchive(os);
+            oarchive(cereal::make_nvp(catalogueFormatName, catalogueFormat),
+                     cereal::make_nvp(catalogueName, catalogue));
+        }
+        syncFile(tmpPath);
+        fs::rename(tmpPath, path);
+    }
+    catch (const std::exception& e)
+    {
+        error("Failed to store the version catalogue: {ERROR}", "ERROR", e);
+        std::error_code ec;
+        fs::remove(tmpPath, ec);
+        fs::remove(path, ec);
+    }
+}
+
+bool restoreCatalogue(Catalogue& catalogue, const fs::path& dir)
+{
+    auto path = dir / catalogueName;
+    if (fs::exists(path))
+    {
+        std::ifstream is(path.c_str(), std::ios::in);
+        try
+        {
+            uint32_t format = 0;
+            cereal::JSONInputArchive iarchive(is);
+            iarchive(cereal::make_nvp(catalogueFormatName, format));
+            if (format == catalogueFormat)
+            {
+                iarchive(cereal::make_nvp(catalogueName, catalogue));
+                return true;
+            }
+            info("Discarding version catalogue format {FORMAT}", "FORMAT",
+                 format);
+        }
+        catch (const std::exception& e)
+        {
+            warning("Discarding corrupt version catalogue: {ERROR}", "ERROR",
+                    e);
+        }
+        fs::remove_all(path);
+    }
+
+    return false;
+}
+
+void removeCatalogue(const fs::path& dir)
+{
+    std::error_code ec;
+    fs::remove(dir / catalogueName, ec);
+}
+
+void storeJournal(const std::string& versionId,
+                  const ActivationJournal& journal)
+{
+    auto path = fs::path(PERSIST_DIR) / versionId / journalName;
+    auto tmpPath = fs::path(PERSIST_DIR) / versionId / (journalName + ".tmp");
+
+    try
+    {
+        fs::create_directories(path.parent_path());
+        {
+            std::ofstream os(tmpPath.c_str());
+            cereal::JSONOutputArchive oarchive(os);
+            oarchive(cereal::make_nvp(journalName, journal));
+        }
+
+        syncFile(tmpPath);
+        fs::rename(tmpPath, path);
+    }
+    catch (const std::exception& e)
+    {
+        error("Failed to store the activation journal of {VERSIONID}: {ERROR}",
+              "VERSIONID", versionId, "ERROR", e);
+        std::error_code ec;
+        fs::remove(tmpPath, ec);
+    }
+}
+
+bool restoreJournal(const std::string& versionId, ActivationJournal& journal)
+{
+    auto path = fs::path(PERSIST_DIR) / versionId / journalName;
+    if (fs::exists(path))
+    {
+        std::ifstream is(path.c_str(), std::ios::in);
+        try
+        {
+            cereal::JSONInputArchive iarchive(is);
+            iarchive(cereal::make_nvp(journalName, journal));
+            return true;
+        }
+        catch (cereal::Exception& e)
+        {
+            warning("Discarding corrupt activation journal of {VERSIONID}: "
+                    "{ERROR}",
+                    "VERSIONID", versionId, "ERROR", e);
+            fs::remove_all(path);
+        }
+    }
+
+    return false;
+}
+
+void removeJournal(const std::string& versionId)
+{
+    std::error_code ec;
+    fs::remove(fs::path(PERSIST_DIR) / versionId / journalName, ec);
+}
+
+std::vector<std::string> listJournals()
+{
+    std::vector<std::string> versionIds;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(PERSIST_DIR, ec))
+    {
+        if (fs::exists(entry.path() / journalName, ec))
+        {
+            versionIds.push_back(entry.path().filename());
+        }
+    }
+    return versionIds;
+}
 
 void storePriority(const std::string& versionId, uint8_t priority)
 {
@@ -4,7 +4,13 @@
 
 #include "version.hpp"
 
+#include <cereal/cereal.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
 #include <string>
+#include <vector>
 
 namespace phosphor
 {
@@ -16,6 +22,128 @@ namespace updater
 using VersionPurpose =
     sdbusplus::xyz::openbmc_project::Software::server::Version::VersionPurpose;
 
+/** @struct CatalogueEntry
+ *  @brief An installed BMC version as recorded in the catalogue.
+ */
+struct CatalogueEntry
+{
+    /** @brief The version id */
+    std::string versionId;
+    /** @brief The version string */
+    std::string version;
+    /** @brief The extended version string */
+    std::string extendedVersion;
+    /** @brief The purpose of the version */
+    VersionPurpose purpose = VersionPurpose::BMC;
+    /** @brief The redundancy priority of the version */
+    uint8_t priority = 0;
+    /** @brief The directory under MEDIA_DIR the version is mounted on */
+    std::string mountDir;
+    /** @brief Modification time of the version's os-release, in ns */
+    int64_t releaseModified = 0;
+    /** @brief Size of the version's os-release */
+    uint64_t releaseSize = 0;
+
+    template <class Archive>
+    void serialize(Archive& archive)
+    {
+        archive(CEREAL_NVP(versionId), CEREAL_NVP(version),
+                CEREAL_NVP(extendedVersion), CEREAL_NVP(purpose),
+                CEREAL_NVP(priority), CEREAL_NVP(mountDir),
+                CEREAL_NVP(releaseModified), CEREAL_NVP(releaseSize));
+    }
+};
+
+using Catalogue = std::vector<CatalogueEntry>;
+
+/** @brief Serialization function - replaces the catalogue of installed
+ *         versions. The file is synced to a temporary path and renamed
+ *         over the old one so a reader never sees a partial catalogue,
+ *         even after a power loss.
+ *  @param[in] catalogue - The installed versions.
+ *  @param[in] dir - The directory of the catalogue.
+ **/
+void storeCatalogue(const Catalogue& catalogue,
+                    const std::filesystem::path& dir = PERSIST_DIR);
+
+/** @brief Serialization function - restores the catalogue of installed
+ *         versions.
+ *  @param[out] catalogue - The installed versions.
+ *  @param[in] dir - The directory of the catalogue.
+ *  @return true if restore was successful, false if not
+ **/
+bool restoreCatalogue(Catalogue& catalogue,
+                      const std::filesystem::path& dir = PERSIST_DIR);
+
+/** @brief Removes the catalogue of installed versions, if it exists.
+ *  @param[in] dir - The directory of the catalogue.
+ **/
+void removeCatalogue(const std::filesystem::path& dir = PERSIST_DIR);
+
+/** @struct ActivationJournal
+ *  @brief The progress of an activation, kept so that an activation that is
+ *         interrupted by a crash or a power loss can be resumed or rolled
+ *         back.
+ */
+struct ActivationJournal
+{
+    /** @brief The version string */
+    std::string version;
+    /** @brief The extended version string */
+    std::string extendedVersion;
+    /** @brief The purpose of the version */
+    VersionPurpose purpose = VersionPurpose::BMC;
+    /** @brief The directory of the uploaded image */
+    std::string filePath;
+    /** @brief The partition label being written, for layouts that have one */
+    std::string label;
+    /** @brief The read-write volume has been created */
+    bool rwVolumeCreated = false;
+    /** @brief The read-only volumes have been written */
+    bool roVolumeCreated = false;
+    /** @brief The U-Boot environment variables have been updated */
+    bool ubootEnvVarsUpdated = false;
+    /** @brief The bytes of each image that are written and synced, by image
+     *         file name, for layouts that write the images in-process */
+    std::map<std::string, uint64_t> written;
+
+    template <class Archive>
+    void serialize(Archive& archive)
+    {
+        archive(CEREAL_NVP(version), CEREAL_NVP(extendedVersion),
+                CEREAL_NVP(purpose), CEREAL_NVP(filePath), CEREAL_NVP(label),
+                CEREAL_NVP(rwVolumeCreated), CEREAL_NVP(roVolumeCreated),
+                CEREAL_NVP(ubootEnvVarsUpdated), CEREAL_NVP(written));
+    }
+};
+
+/** @brief Serialization function - replaces the activation journal of a
+ *         version. The file is synced and renamed over the old one, so it
+ *         survives a power loss.
+ *  @param[in] versionId - The version being activated.
+ *  @param[in] journal - The progress of the activation.
+ **/
+void storeJournal(const std::string& versionId,
+                  const ActivationJournal& journal);
+
+/** @brief Serialization function - restores the activation journal of a
+ *         version.
+ *  @param[in] versionId - The version that was being activated.
+ *  @param[out] journal - The progress of the activation.
+ *  @return true if restore was successful, false if not
+ **/
+bool restoreJournal(const std::string& versionId, ActivationJournal& journal);
+
+/** @brief Removes the activation journal of a version, if it exists.
+ *  @param[in] versionId - The version that was being activated.
+ **/
+void removeJournal(const std::string& versionId);
+
+/** @brief Get the versions that have an activation journal.
+ *  @return The version ids.
+ **/
+std::vector<std::string> listJournals();
+
 /** @brief Serialization function - stores priority information to file
  *  @param[in] versionId - The version for which to store information.
  *  @param[in] priority - RedundancyPriority value for that version.
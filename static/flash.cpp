@@ -31,13 +31,20 @@ void Activation::flashWrite()
     fs::path uploadDir(IMG_UPLOAD_DIR);
     fs::path toPath(PATH_INITRAMFS);
 
+    // The images are moved rather than copied, the upload directory is
+    // deleted once the activation completes. Both are usually in RAM, a
+    // copy of image-bmc would take the size of the flash twice.
     for (const auto& bmcImage : parent.imageUpdateList)
     {
-        fs::copy_file(uploadDir / versionId / bmcImage, toPath / bmcImage,
-                      fs::copy_options::overwrite_existing);
+        moveImage(uploadDir / versionId / bmcImage, toPath / bmcImage);
     }
 }
 
+void Activation::flashCancel()
+{
+    // Empty, the images are copied before flashWrite() returns
+}
+
 void Activation::onStateChanges(sdbusplus::message::message& /*msg*/)
 {
     // Empty
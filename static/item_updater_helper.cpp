@@ -19,6 +19,11 @@ void Helper::clearEntry(const std::string& /* entryId */)
     // Empty
 }
 
+void Helper::clearEntries(const std::vector<std::string>& /* entryIds */)
+{
+    // Empty
+}
+
 void Helper::cleanup()
 {
     // Empty
@@ -36,6 +41,11 @@ void Helper::removeVersion(const std::string& /* versionId */)
     // Empty
 }
 
+void Helper::removeVersions(const std::vector<std::string>& /* versionIds */)
+{
+    // Empty
+}
+
 void Helper::updateUbootVersionId(const std::string& /* versionId */)
 {
     // Empty
@@ -2,13 +2,16 @@
 
 #include "sync_manager.hpp"
 
+#include "process.hpp"
+#include "utils.hpp"
+
 #include <sys/inotify.h>
-#include <sys/wait.h>
-#include <unistd.h>
 
 #include <phosphor-logging/lg2.hpp>
 
 #include <filesystem>
+#include <system_error>
+#include <vector>
 
 namespace phosphor
 {
@@ -22,19 +25,44 @@ namespace fs = std::filesystem;
 
 int Sync::processEntry(int mask, const fs::path& entryPath)
 {
-    int status{};
-    pid_t pid = fork();
+    pending.emplace_back(mask, entryPath);
+    syncNext();
+    return 0;
+}
 
-    if (pid == 0)
+void Sync::syncNext()
+{
+    while (!running && !pending.empty())
     {
+        auto mask = pending.front().first;
+        auto entryPath = std::move(pending.front().second);
+        pending.pop_front();
+
         fs::path dst(ALT_RWFS);
         dst /= entryPath.relative_path();
 
         // rsync needs an additional --delete argument to handle file deletions
         // so need to differentiate between the different file events.
+        std::vector<char*> args;
         if (mask & IN_CLOSE_WRITE)
         {
-            if (!(fs::exists(dst)))
+            args = utils::internal::constructArgv("rsync", "-a",
+                                                  entryPath.c_str(),
+                                                  dst.c_str());
+        }
+        else if (mask & IN_DELETE)
+        {
+            args = utils::internal::constructArgv(
+                "rsync", "-a", "--delete", entryPath.c_str(), dst.c_str());
+        }
+        else
+        {
+            continue;
+        }
+
+        try
+        {
+            if ((mask & IN_CLOSE_WRITE) && !fs::exists(dst))
             {
                 if (fs::is_directory(entryPath))
                 {
@@ -49,35 +77,27 @@ int Sync::processEntry(int mask, const fs::path& entryPath)
                 }
             }
 
-            execl("/usr/bin/rsync", "rsync", "-a", entryPath.c_str(),
-                  dst.c_str(), nullptr);
-            // execl only returns on fail
-            error("Error ({ERRNO}) occurred during the rsync call on {PATH}",
-                  "ERRNO", errno, "PATH", entryPath);
-            return -1;
+            process::runAsync(
+                loop, "/usr/bin/rsync", args.data(), {},
+                [this, entryPath](const process::Result& result) {
+                    if (!result.succeeded())
+                    {
+                        error(
+                            "Error ({STATUS}) occurred during the rsync call on {PATH}: {ERRORS}",
+                            "STATUS", result.exitCode, "PATH", entryPath,
+                            "ERRORS", result.errors);
+                    }
+                    running = false;
+                    syncNext();
+                });
+            running = true;
         }
-        else if (mask & IN_DELETE)
+        catch (const std::system_error& e)
         {
-            execl("/usr/bin/rsync", "rsync", "-a", "--delete",
-                  entryPath.c_str(), dst.c_str(), nullptr);
-            // execl only returns on fail
-            error(
-                "Error ({ERRNO}) occurred during the rsync delete call on {PATH}",
-                "ERRNO", errno, "PATH", entryPath);
-            return -1;
+            error("Error ({ERROR}) occurred during the rsync call on {PATH}",
+                  "ERROR", e, "PATH", entryPath);
         }
     }
-    else if (pid > 0)
-    {
-        waitpid(pid, &status, 0);
-    }
-    else
-    {
-        error("Error ({ERRNO}) occurred during fork", "ERRNO", errno);
-        return -1;
-    }
-
-    return 0;
 }
 
 } // namespace manager
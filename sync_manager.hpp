@@ -1,6 +1,10 @@
 #pragma once
 
+#include <systemd/sd-event.h>
+
+#include <deque>
 #include <filesystem>
+#include <utility>
 
 namespace phosphor
 {
@@ -19,20 +23,45 @@ namespace fs = std::filesystem;
 class Sync
 {
   public:
-    Sync() = default;
+    Sync() = delete;
     Sync(const Sync&) = delete;
     Sync& operator=(const Sync&) = delete;
-    Sync(Sync&&) = default;
-    Sync& operator=(Sync&&) = default;
+    Sync(Sync&&) = delete;
+    Sync& operator=(Sync&&) = delete;
     ~Sync() = default;
 
+    /**
+     * @brief Constructs Sync
+     * @param[in] loop - The sd-event loop the rsync processes are reaped
+     *                   from.
+     */
+    explicit Sync(sd_event* loop) : loop(loop)
+    {}
+
     /**
      * @brief Process requested file or directory.
+     * @details The entries are synced one at a time, in the order of their
+     *          events, without waiting for rsync.
      * @param[in] mask - The inotify mask.
      * @param[in] entryPath - The file or directory to process.
      * @param[out] result - 0 if successful.
      */
     int processEntry(int mask, const fs::path& entryPath);
+
+  private:
+    /** @brief Start syncing the next pending entry, if rsync is not running
+     */
+    void syncNext();
+
+    /** @brief The sd-event loop the rsync processes are reaped from */
+    sd_event* loop;
+
+    /** @brief The inotify masks and paths of the entries waiting for rsync
+     */
+    std::deque<std::pair<int, fs::path>> pending;
+
+    /** @brief Whether rsync is running */
+    bool running = false;
 };
 
 } // namespace manager
@@ -22,7 +22,7 @@ int main()
 
     try
     {
-        phosphor::software::manager::Sync syncManager;
+        phosphor::software::manager::Sync syncManager(loop);
 
         using namespace phosphor::software::manager;
         phosphor::software::manager::SyncWatch watch(
@@ -0,0 +1,327 @@
+#include "tar_stream.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace tar_stream
+{
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+/** @brief The size of a tar block */
+constexpr size_t blockSize = 512;
+
+/** @brief ustar header fields */
+constexpr size_t nameOffset = 0;
+constexpr size_t nameLength = 100;
+constexpr size_t sizeOffset = 124;
+constexpr size_t sizeLength = 12;
+constexpr size_t checksumOffset = 148;
+constexpr size_t checksumLength = 8;
+constexpr size_t typeOffset = 156;
+constexpr size_t magicOffset = 257;
+constexpr size_t prefixOffset = 345;
+constexpr size_t prefixLength = 155;
+
+/** @brief The largest GNU long name or pax header that is read */
+constexpr uint64_t maxExtensionSize = 64 * 1024;
+
+using Block = std::array<char, blockSize>;
+
+[[noreturn]] void fail(int err, const std::string& what)
+{
+    throw std::system_error(err, std::generic_category(), what);
+}
+
+/** @brief Get a NUL terminated string field */
+std::string field(const Block& block, size_t offset, size_t length)
+{
+    auto begin = block.data() + offset;
+    return std::string(begin, std::find(begin, begin + length, '\0'));
+}
+
+/** @brief Parse a numeric field, octal or GNU base-256 */
+uint64_t number(const Block& block, size_t offset, size_t length)
+{
+    auto begin = reinterpret_cast<const uint8_t*>(block.data() + offset);
+    uint64_t value = 0;
+
+    if (begin[0] & 0x80)
+    {
+        value = begin[0] & 0x7F;
+        for (size_t i = 1; i < length; i++)
+        {
+            if (value > (UINT64_MAX >> 8))
+            {
+                fail(EOVERFLOW, "tar number");
+            }
+            value = (value << 8) | begin[i];
+        }
+        return value;
+    }
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (begin[i] == ' ' && value == 0)
+        {
+            continue;
+        }
+        if (begin[i] < '0' || begin[i] > '7')
+        {
+            break;
+        }
+        value = (value << 3) | (begin[i] - '0');
+    }
+    return value;
+}
+
+/** @brief Check the header checksum, computed with the checksum field as
+ *         spaces */
+bool checksumValid(const Block& block)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < blockSize; i++)
+    {
+        bool inChecksum = i >= checksumOffset &&
+                          i < checksumOffset + checksumLength;
+        sum += inChecksum ? ' ' : static_cast<uint8_t>(block[i]);
+    }
+    return sum == number(block, checksumOffset, checksumLength);
+}
+
+/** @brief Get the path record of a pax extended header, records are
+ *         "<length> <key>=<value>\n" */
+std::string paxPath(std::string_view records)
+{
+    while (!records.empty())
+    {
+        auto space = records.find(' ');
+        if (space == std::string_view::npos)
+        {
+            break;
+        }
+        std::string digits(records.substr(0, space));
+        auto length = std::strtoull(digits.c_str(), nullptr, 10);
+        if (length <= space || length > records.size())
+        {
+            break;
+        }
+        auto record = records.substr(space + 1, length - space - 2);
+        if (record.starts_with("path="))
+        {
+            return std::string(record.substr(5));
+        }
+        records.remove_prefix(length);
+    }
+    return {};
+}
+
+} // namespace
+
+Reader::Reader(const std::string& path) : archive(path, std::ios::binary)
+{
+    if (!archive)
+    {
+        fail(ENOENT, "open " + path);
+    }
+}
+
+size_t Reader::read(char* buffer, size_t size)
+{
+    auto length = static_cast<size_t>(std::min<uint64_t>(size, remaining));
+    if (length == 0)
+    {
+        return 0;
+    }
+    if (readArchive(buffer, length) != length)
+    {
+        fail(EIO, "truncated tar archive");
+    }
+    remaining -= length;
+    return length;
+}
+
+size_t Reader::readArchive(char* buffer, size_t size)
+{
+    archive.read(buffer, size);
+    auto bytes = static_cast<size_t>(archive.gcount());
+    if (keeping)
+    {
+        kept.append(buffer, bytes);
+    }
+    return bytes;
+}
+
+void Reader::keep(bool on)
+{
+    keeping = on;
+    kept.clear();
+}
+
+void Reader::copyArchive(std::ostream& output)
+{
+    output.write(kept.data(), kept.size());
+    kept.clear();
+    keeping = false;
+
+    std::vector<char> buffer(64 * 1024);
+    while (true)
+    {
+        auto bytes = readArchive(buffer.data(), buffer.size());
+        output.write(buffer.data(), bytes);
+        if (bytes < buffer.size())
+        {
+            break;
+        }
+    }
+    if (archive.bad())
+    {
+        fail(EIO, "read tar archive");
+    }
+}
+
+void Reader::skip()
+{
+    // Read rather than seek over it, the archive may be a pipe
+    remaining += padding;
+    padding = 0;
+    Block discard;
+    while (read(discard.data(), discard.size()) != 0)
+    {}
+}
+
+bool Reader::next(Entry& entry)
+{
+    std::string longName;
+    while (true)
+    {
+        skip();
+
+        Block block;
+        auto bytes = readArchive(block.data(), block.size());
+        if (bytes == 0 && archive.eof())
+        {
+            // Archives written without end blocks
+            return false;
+        }
+        if (bytes != blockSize)
+        {
+            fail(EIO, "truncated tar archive");
+        }
+        if (std::all_of(block.begin(), block.end(),
+                        [](char c) { return c == '\0'; }))
+        {
+            return false;
+        }
+        if (!checksumValid(block))
+        {
+            fail(EILSEQ, "bad tar header checksum");
+        }
+
+        entry.type = block[typeOffset];
+        entry.size = number(block, sizeOffset, sizeLength);
+        remaining = entry.size;
+        padding = (blockSize - entry.size % blockSize) % blockSize;
+
+        if (entry.type == 'L' || entry.type == 'x')
+        {
+            // A GNU long name, or pax header, for the next entry
+            if (entry.size > maxExtensionSize)
+            {
+                fail(EOVERFLOW, "tar extended header");
+            }
+            std::vector<char> content(entry.size);
+            read(content.data(), content.size());
+            std::string_view view(content.data(), content.size());
+            auto name = (entry.type == 'L')
+                            ? std::string(view.substr(0, view.find('\0')))
+                            : paxPath(view);
+            if (!name.empty())
+            {
+                longName = name;
+            }
+            continue;
+        }
+        if (entry.type == 'g')
+        {
+            // pax global header
+            continue;
+        }
+
+        if (!longName.empty())
+        {
+            entry.name = longName;
+        }
+        else
+        {
+            entry.name = field(block, nameOffset, nameLength);
+            if (std::memcmp(&block[magicOffset], "ustar", 5) == 0)
+            {
+                auto prefix = field(block, prefixOffset, prefixLength);
+                if (!prefix.empty())
+                {
+                    entry.name = prefix + "/" + entry.name;
+                }
+            }
+        }
+        while (entry.name.starts_with("./"))
+        {
+            entry.name.erase(0, 2);
+        }
+        return true;
+    }
+}
+
+void extract(const std::string& archive, const std::string& dir,
+             const std::function<bool(const Entry&, Reader&)>& stream)
+{
+    Reader reader(archive);
+    extract(reader, dir, stream);
+}
+
+void extract(Reader& reader, const std::string& dir,
+             const std::function<bool(const Entry&, Reader&)>& stream)
+{
+    Entry entry;
+    std::vector<char> buffer(64 * 1024);
+
+    while (reader.next(entry))
+    {
+        if (!entry.isFile())
+        {
+            continue;
+        }
+        if (entry.name.empty() || entry.name.find('/') != std::string::npos ||
+            entry.name == "..")
+        {
+            fail(EINVAL, "unsupported tar entry " + entry.name);
+        }
+        if (stream && stream(entry, reader))
+        {
+            continue;
+        }
+
+        auto path = fs::path(dir) / entry.name;
+        std::ofstream output(path, std::ios::binary | std::ios::trunc);
+        while (auto bytes = reader.read(buffer.data(), buffer.size()))
+        {
+            output.write(buffer.data(), bytes);
+        }
+        output.close();
+        if (!output)
+        {
+            fail(EIO, "write " + path.string());
+        }
+    }
+}
+
+} // namespace tar_stream
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <ostream>
+#include <string>
+
+namespace tar_stream
+{
+
+/** @brief An entry of a tar archive */
+struct Entry
+{
+    /** @brief The path of the entry, without a leading "./" */
+    std::string name;
+    /** @brief The size of the entry content */
+    uint64_t size = 0;
+    /** @brief The ustar type flag, '0' for a regular file */
+    char type = '0';
+
+    /** @brief Check if the entry is a regular file */
+    bool isFile() const
+    {
+        return type == '0' || type == '\0';
+    }
+};
+
+/** @class Reader
+ *  @brief Sequential reader of ustar, GNU and pax tar archives.
+ *  @details Entries are read in archive order without extracting them, so
+ *           the content of an entry can be streamed to its destination.
+ *           GNU long names and pax path records are supported, other
+ *           extensions are skipped.
+ */
+class Reader
+{
+  public:
+    Reader() = delete;
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+    Reader(Reader&&) = delete;
+    Reader& operator=(Reader&&) = delete;
+    ~Reader() = default;
+
+    /** @brief Open an archive
+     *
+     * @param[in] path - The path of the archive, which is read once from
+     *                   start to end, so it may be a pipe.
+     *
+     * @throws std::system_error if the archive cannot be opened.
+     */
+    explicit Reader(const std::string& path);
+
+    /** @brief Move to the next entry, skipping what is left of the current
+     *         one.
+     *
+     * @param[out] entry - The next entry.
+     *
+     * @return false at the end of the archive.
+     *
+     * @throws std::system_error if the archive is truncated or corrupt.
+     */
+    bool next(Entry& entry);
+
+    /** @brief Read content of the current entry
+     *
+     * @param[out] buffer - The buffer to read into.
+     * @param[in]  size   - The size of the buffer.
+     *
+     * @return The number of bytes read, 0 at the end of the entry.
+     *
+     * @throws std::system_error if the archive is truncated.
+     */
+    size_t read(char* buffer, size_t size);
+
+    /** @brief Keep a copy of what is read from the archive, or stop keeping
+     *         it, so that a pipe can still be handed over as a whole.
+     *
+     * @param[in] on - Whether to keep what is read from now on.
+     */
+    void keep(bool on);
+
+    /** @brief Copy the archive from where keep() was turned on to its end.
+     *
+     * @param[out] output - The stream to copy to.
+     *
+     * @throws std::system_error if the archive cannot be read.
+     */
+    void copyArchive(std::ostream& output);
+
+  private:
+    /** @brief Skip the rest of the current entry and its padding */
+    void skip();
+
+    /** @brief Read from the archive, keeping a copy if asked to
+     *
+     * @return The number of bytes read.
+     */
+    size_t readArchive(char* buffer, size_t size);
+
+    /** @brief The archive */
+    std::ifstream archive;
+
+    /** @brief Whether what is read is kept */
+    bool keeping = false;
+
+    /** @brief What was read since keep() was turned on */
+    std::string kept;
+
+    /** @brief The bytes of the current entry not read yet */
+    uint64_t remaining = 0;
+
+    /** @brief The padding after the current entry */
+    uint64_t padding = 0;
+};
+
+/** @brief Extract the regular files of an archive into a directory.
+ *
+ * @details The files may be consumed by a callback instead of being written
+ *          to the directory. Directory entries are skipped, and entries in
+ *          subdirectories are rejected as the images are flat archives.
+ *
+ * @param[in] archive - The path of the archive.
+ * @param[in] dir     - The directory to extract to.
+ * @param[in] stream  - Called for each regular file with the reader
+ *                      positioned at its content. Returns true if it
+ *                      consumed the file, so it is not extracted.
+ *
+ * @throws std::system_error on errors, or what stream throws.
+ */
+void extract(const std::string& archive, const std::string& dir,
+             const std::function<bool(const Entry&, Reader&)>& stream);
+
+/** @brief Extract the regular files left in an archive, as extract() does.
+ *
+ * @param[in] reader - The archive, the entries it already moved past are
+ *                     not extracted.
+ * @param[in] dir    - The directory to extract to.
+ * @param[in] stream - As for extract().
+ *
+ * @throws std::system_error on errors, or what stream throws.
+ */
+void extract(Reader& reader, const std::string& dir,
+             const std::function<bool(const Entry&, Reader&)>& stream);
+
+} // namespace tar_stream
@@ -0,0 +1,96 @@
+#include "config.h"
+
+#include "key_value_file.hpp"
+#include "version.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace phosphor::software::manager;
+
+namespace
+{
+
+/** @brief Run a function repeatedly and print the mean time per call.
+ *
+ * @param[in] name       - The name of the benchmark.
+ * @param[in] iterations - The number of calls to time.
+ * @param[in] func       - The function to benchmark, returning a size that is
+ *                         accumulated so the calls are not optimized out.
+ */
+template <typename Func>
+void run(const char* name, size_t iterations, Func&& func)
+{
+    size_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++)
+    {
+        sink += func(i);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+    std::printf("%-40s %10.1f ns/op (%zu)\n", name,
+                static_cast<double>(ns) / iterations, sink);
+}
+
+} // namespace
+
+int main()
+{
+    constexpr size_t iterations = 200000;
+
+    std::vector<std::string> versions;
+    for (size_t i = 0; i < 64; i++)
+    {
+        versions.push_back("2.12.0-dev-" + std::to_string(i) + "-g0123abcd");
+    }
+
+    run("Version::getId", iterations, [&](size_t i) {
+        return Version::getId(versions[i % versions.size()]).size();
+    });
+    run("Version::getId (32 digits)", iterations, [&](size_t i) {
+        return Version::getId(versions[i % versions.size()], 32).size();
+    });
+    run("Version::getId (128 digits)", iterations, [&](size_t i) {
+        return Version::getId(versions[i % versions.size()], 128).size();
+    });
+
+    std::string release = "NAME=\"Phosphor OpenBMC\"\n"
+                          "ID=openbmc-phosphor\n"
+                          "PRETTY_NAME=\"Phosphor OpenBMC 2.12.0\"\n"
+                          "VERSION=\"2.12.0-dev\"\n"
+                          "VERSION_ID=2.12.0-dev-1234-g0123abcd\n"
+                          "EXTENDED_VERSION=\"extended\"\n"
+                          "OPENBMC_TARGET_MACHINE=\"romulus\"\n";
+    auto releasePath = std::filesystem::temp_directory_path() /
+                       "phosphor-bmc-code-mgmt-benchmark-os-release";
+    std::ofstream(releasePath) << release;
+
+    const std::string_view keys[] = {"VERSION_ID", "EXTENDED_VERSION",
+                                     "OPENBMC_TARGET_MACHINE"};
+    run("KeyValueFile::parse (3 keys)", iterations, [&](size_t) {
+        std::string_view values[std::size(keys)];
+        return KeyValueFile::parse(release, keys, values);
+    });
+    run("Version::getBMCVersion", iterations / 10, [&](size_t) {
+        return Version::getBMCVersion(releasePath).size();
+    });
+    run("Version::getValues (3 keys)", iterations / 10, [&](size_t) {
+        auto [version, extended, machine] = Version::getValues(
+            releasePath,
+            {"VERSION_ID", "EXTENDED_VERSION", "OPENBMC_TARGET_MACHINE"});
+        return version.size() + extended.size() + machine.size();
+    });
+
+    std::filesystem::remove(releasePath);
+
+    return 0;
+}
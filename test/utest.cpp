@@ -1,17 +1,53 @@
+#include "config.h"
+
+#include "blob_store.hpp"
+#ifdef HAVE_ZSTD
+#include "emmc_writer.hpp"
+#endif
+#include "flash_health.hpp"
+#include "handoff.hpp"
+#include "image_compare.hpp"
 #include "image_verify.hpp"
+#include "images.hpp"
+#include "key_value_file.hpp"
+#include "mapper.hpp"
+#include "mtd_mirror.hpp"
+#include "process.hpp"
+#include "reboot_guard.hpp"
+#include "reclaimer.hpp"
+#include "serialize.hpp"
+#include "tar_stream.hpp"
 #include "utils.hpp"
+#include "verity.hpp"
 #include "version.hpp"
 
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <stdlib.h>
+#include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
 #include <sstream>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <vector>
 
+#include <boost/asio/io_context.hpp>
+
 #include <gtest/gtest.h>
 
 using namespace phosphor::software::manager;
@@ -110,19 +146,20 @@ TEST_F(VersionTest, TestGetVersionWithoutQuotes)
 TEST_F(VersionTest, TestGetId)
 {
     auto version = "test-id";
-    unsigned char digest[SHA512_DIGEST_LENGTH];
-    SHA512_CTX ctx;
-    SHA512_Init(&ctx);
-    SHA512_Update(&ctx, version, strlen(version));
-    SHA512_Final(digest, &ctx);
-    char mdString[SHA512_DIGEST_LENGTH * 2 + 1];
-    for (int i = 0; i < SHA512_DIGEST_LENGTH; i++)
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestSize = 0;
+    EVP_Digest(version, strlen(version), digest, &digestSize, EVP_sha512(),
+               nullptr);
+    char mdString[EVP_MAX_MD_SIZE * 2 + 1];
+    for (unsigned int i = 0; i < digestSize; i++)
     {
         snprintf(&mdString[i * 2], 3, "%02x", (unsigned int)digest[i]);
     }
     std::string hexId = std::string(mdString);
-    hexId = hexId.substr(0, 8);
-    EXPECT_EQ(Version::getId(version), hexId);
+    EXPECT_EQ(Version::getId(version), hexId.substr(0, VERSION_ID_LENGTH));
+    EXPECT_EQ(Version::getId(version, 8), hexId.substr(0, 8));
+    EXPECT_EQ(Version::getId(version, 16), hexId.substr(0, 16));
+    EXPECT_EQ(Version::getId(version, 1024), hexId);
 }
 
 TEST_F(VersionTest, TestGetExtendedVersion)
@@ -140,6 +177,262 @@ TEST_F(VersionTest, TestGetExtendedVersion)
     EXPECT_EQ(Version::getBMCExtendedVersion(releasePath), ExtendedVersion);
 }
 
+/** @brief Make sure getValues() reads several keys from one file */
+TEST_F(VersionTest, TestGetValues)
+{
+    auto manifestFilePath = _directory + "/" + "MANIFEST";
+
+    std::ofstream file;
+    file.open(manifestFilePath, std::ofstream::out);
+    ASSERT_TRUE(file.is_open());
+
+    file << "purpose=BMC\r\n";
+    file << "version=\"test-version\"\n";
+    file << "MachineName='test-machine'\n";
+    file << "version=ignored\n";
+    file << "KeyType=";
+    file.close();
+
+    auto [version, purpose, machine, keyType, missing] =
+        Version::getValues(manifestFilePath, {"version", "purpose",
+                                              "MachineName", "KeyType",
+                                              "HashType"});
+    EXPECT_EQ(version, "\"test-version\"");
+    EXPECT_EQ(purpose, "BMC");
+    EXPECT_EQ(machine, "'test-machine'");
+    EXPECT_EQ(keyType, "");
+    EXPECT_EQ(missing, "");
+
+    auto [none] = Version::getValues(_directory + "/missing", {"version"});
+    EXPECT_EQ(none, "");
+}
+
+/** @brief Make sure a quoted MANIFEST version keeps the id it always had */
+TEST_F(VersionTest, TestQuotedManifestVersionId)
+{
+    auto manifestFilePath = _directory + "/" + "MANIFEST";
+
+    std::ofstream file;
+    file.open(manifestFilePath, std::ofstream::out);
+    ASSERT_TRUE(file.is_open());
+
+    file << "version=\"2.7.0-dev\"\n";
+    file.close();
+
+    auto version = Version::getValue(manifestFilePath, "version");
+    EXPECT_EQ(version, "\"2.7.0-dev\"");
+    EXPECT_EQ(Version::getId(version), Version::getId("\"2.7.0-dev\""));
+    EXPECT_NE(Version::getId(version), Version::getId("2.7.0-dev"));
+}
+
+/** @brief Make sure unquote() only removes one pair of matching quotes */
+TEST(KeyValueFileTest, TestUnquote)
+{
+    EXPECT_EQ(KeyValueFile::unquote("\"1.0\""), "1.0");
+    EXPECT_EQ(KeyValueFile::unquote("'1.0'"), "1.0");
+    EXPECT_EQ(KeyValueFile::unquote("\"\"1.0\"\""), "\"1.0\"");
+    EXPECT_EQ(KeyValueFile::unquote("\"1.0'"), "\"1.0'");
+    EXPECT_EQ(KeyValueFile::unquote("\""), "\"");
+    EXPECT_EQ(KeyValueFile::unquote("1.0"), "1.0");
+}
+
+namespace
+{
+
+/** @brief Straightforward line by line lookup to check the parser against */
+std::string referenceValue(const std::string& content, const std::string& key)
+{
+    std::istringstream stream(content);
+    std::string line;
+    while (std::getline(stream, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (line.compare(0, key.size() + 1, key + "=") == 0)
+        {
+            return line.substr(key.size() + 1);
+        }
+    }
+    return {};
+}
+
+} // namespace
+
+/** @brief Compare the parser against the reference on random content */
+TEST(KeyValueFileTest, TestRandomContent)
+{
+    const std::string_view keys[] = {"version", "purpose", "VERSION_ID",
+                                     "KeyType", "a", ""};
+    const std::string pieces[] = {"version", "purpose", "VERSION_ID",
+                                  "KeyType", "a", "=", "\"", "'", "\r",
+                                  "\n", "\r\n", " ", "x", "1.2"};
+    std::mt19937 gen(0x5eed);
+    std::uniform_int_distribution<size_t> pieceDist(0, std::size(pieces) - 1);
+    std::uniform_int_distribution<size_t> lengthDist(0, 64);
+
+    for (size_t round = 0; round < 2000; round++)
+    {
+        std::string content;
+        auto length = lengthDist(gen);
+        for (size_t i = 0; i < length; i++)
+        {
+            content += pieces[pieceDist(gen)];
+        }
+
+        std::string_view values[std::size(keys)];
+        auto found = KeyValueFile::parse(content, keys, values);
+
+        size_t expectedFound = 0;
+        for (size_t i = 0; i < std::size(keys); i++)
+        {
+            auto key = std::string(keys[i]);
+            EXPECT_EQ(values[i], referenceValue(content, key))
+                << "content: " << content << " key: " << key;
+            if (content.starts_with(key + "=") ||
+                content.find("\n" + key + "=") != std::string::npos)
+            {
+                ++expectedFound;
+            }
+            if (values[i].data() != nullptr)
+            {
+                // Values are views into the content
+                EXPECT_GE(values[i].data(), content.data());
+                EXPECT_LE(values[i].data() + values[i].size(),
+                          content.data() + content.size());
+            }
+        }
+        EXPECT_EQ(found, expectedFound) << "content: " << content;
+    }
+}
+
+/** @brief Make sure files larger than the buffer drop the partial line */
+TEST_F(VersionTest, TestKeyValueFileTooLarge)
+{
+    auto releasePath = _directory + "/" + "os-release";
+
+    std::ofstream file;
+    file.open(releasePath, std::ofstream::out);
+    ASSERT_TRUE(file.is_open());
+
+    file << "VERSION_ID=1.0\n";
+    file << "PADDING=" << std::string(KeyValueFile::maxSize, 'x') << "\n";
+    file << "EXTENDED_VERSION=ignored\n";
+    file.close();
+
+    KeyValueFile release(releasePath);
+    EXPECT_TRUE(release.good());
+    EXPECT_EQ(release.get("VERSION_ID"), "1.0");
+    EXPECT_EQ(release.get("PADDING"), "");
+    EXPECT_EQ(release.get("EXTENDED_VERSION"), "");
+}
+
+/** @brief Make sure parsed versions are ordered by their components */
+TEST(ParsedVersionTest, TestOrdering)
+{
+    EXPECT_LT(ParsedVersion("2.9.1"), ParsedVersion("2.10.0"));
+    EXPECT_LT(ParsedVersion("v1.99.10-19"), ParsedVersion("v1.99.10-20"));
+    EXPECT_LT(ParsedVersion("2.11.0"), ParsedVersion("2.11.0-dev-12-gabcdef"));
+    EXPECT_LT(ParsedVersion("1.0-rc"), ParsedVersion("1.0.1"));
+    EXPECT_GT(ParsedVersion("fw1020.10-8"), ParsedVersion("fw1020.9-12"));
+    EXPECT_EQ(ParsedVersion("1.02"), ParsedVersion("1.2"));
+    EXPECT_EQ(ParsedVersion("1.2"), ParsedVersion("1-2"));
+    EXPECT_LT(ParsedVersion("99999999999999999999"),
+              ParsedVersion("100000000000000000000"));
+}
+
+/** @brief Make sure the versions are found by state, newest or oldest */
+TEST(StateIndexTest, TestQueries)
+{
+    enum class State
+    {
+        Ready,
+        Active
+    };
+    StateIndex<State> index;
+    index.set("a", State::Active, ParsedVersion("2.9.0"));
+    index.set("b", State::Active, ParsedVersion("2.10.0"));
+    index.set("c", State::Active, ParsedVersion("2.8.0"));
+    index.set("d", State::Ready, ParsedVersion("3.0.0"));
+
+    EXPECT_EQ(index.newest(State::Active), "b");
+    EXPECT_EQ(index.oldest(State::Active), "c");
+
+    // The running version is skipped
+    EXPECT_EQ(index.oldest(State::Active, "c"), "a");
+    EXPECT_EQ(index.newest(State::Ready), "d");
+
+    // A version moves with its state
+    index.set("d", State::Active, ParsedVersion("3.0.0"));
+    EXPECT_EQ(index.newest(State::Active), "d");
+    EXPECT_EQ(index.newest(State::Ready), "");
+
+    index.erase("c");
+    index.erase("unknown");
+    EXPECT_EQ(index.oldest(State::Active), "a");
+    index.erase("a");
+    index.erase("b");
+    EXPECT_EQ(index.oldest(State::Active, "d"), "");
+}
+
+/** @brief Write an image with a dm-verity superblock and hash tree after
+ *         its data, as veritysetup format --hash-offset does.
+ *
+ * @return The root hash.
+ */
+static std::string makeVerityImage(const std::string& path, size_t blocks)
+{
+    constexpr size_t blockSize = 4096;
+    const std::string salt(32, 's');
+
+    auto sha256 = [&salt](const std::string& block) {
+        std::array<unsigned char, EVP_MAX_MD_SIZE> digest{};
+        unsigned int length = 0;
+        auto ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+        EVP_DigestUpdate(ctx, salt.data(), salt.size());
+        EVP_DigestUpdate(ctx, block.data(), block.size());
+        EVP_DigestFinal_ex(ctx, digest.data(), &length);
+        EVP_MD_CTX_free(ctx);
+        return std::string(reinterpret_cast<char*>(digest.data()), length);
+    };
+
+    std::string data;
+    std::string hashes(blockSize, '\0');
+    for (size_t i = 0; i < blocks; i++)
+    {
+        std::string block(blockSize, static_cast<char>('a' + i));
+        hashes.replace(i * 32, 32, sha256(block));
+        data += block;
+    }
+
+    auto put = [](std::string& s, size_t offset, auto value) {
+        std::memcpy(s.data() + offset, &value, sizeof(value));
+    };
+    std::string superblock(blockSize, '\0');
+    superblock.replace(0, 8, std::string("verity\0\0", 8));
+    put(superblock, 8, uint32_t{1});
+    put(superblock, 12, uint32_t{1});
+    superblock.replace(32, 6, "sha256");
+    put(superblock, 64, uint32_t{blockSize});
+    put(superblock, 68, uint32_t{blockSize});
+    put(superblock, 72, uint64_t{blocks});
+    put(superblock, 80, uint16_t{32});
+    superblock.replace(88, salt.size(), salt);
+
+    std::ofstream(path, std::ios::binary) << data << superblock << hashes;
+
+    std::string root;
+    for (auto c : sha256(hashes))
+    {
+        constexpr auto digits = "0123456789abcdef";
+        root += digits[static_cast<uint8_t>(c) >> 4];
+        root += digits[static_cast<uint8_t>(c) & 0xf];
+    }
+    return root;
+}
+
 class SignatureTest : public testing::Test
 {
     static constexpr auto opensslCmd = "openssl dgst -sha256 -sign ";
@@ -254,6 +547,15 @@ TEST_F(SignatureTest, TestSignatureVerify)
     EXPECT_TRUE(signature->verify());
 }
 
+/** @brief Test that a stop request fails the verification */
+TEST_F(SignatureTest, TestSignatureVerifyStopped)
+{
+    std::stop_source stop;
+    EXPECT_TRUE(signature->verify(stop.get_token()));
+    stop.request_stop();
+    EXPECT_FALSE(signature->verify(stop.get_token()));
+}
+
 /** @brief Test failure scenario with corrupted signature file*/
 TEST_F(SignatureTest, TestCorruptSignatureFile)
 {
@@ -289,6 +591,840 @@ TEST_F(SignatureTest, TestNoConfigFileInSystem)
     EXPECT_FALSE(signature->verify());
 }
 
+/** @brief Test that the key id matches the fingerprint printed by openssl */
+TEST_F(SignatureTest, TestGetKeyId)
+{
+    auto pubkeyFile = extractPath.string() + "/" + "publickey";
+    auto idFile = extractPath.string() + "/" + "keyid";
+    command("openssl pkey -pubin -in " + pubkeyFile +
+            " -outform DER | openssl dgst -sha256 -r | cut -d ' ' -f 1 > " +
+            idFile);
+    std::string expected;
+    std::ifstream(idFile) >> expected;
+
+    EXPECT_EQ(Signature::getKeyId(pubkeyFile), expected);
+    EXPECT_EQ(Signature::getKeyId(extractPath / "MANIFEST"), "");
+}
+
+/** @brief Test that an image naming its key id is verified with that key
+ *         only */
+TEST_F(SignatureTest, TestKeyIdSelectsKey)
+{
+    // Another key on the system, tried first by name but skipped by id
+    auto otherPath = signedConfPath / "AAA";
+    command("mkdir " + otherPath.string());
+    command("openssl genrsa -out " + otherPath.string() + "/private.pem 2048");
+    command("openssl rsa -in " + otherPath.string() +
+            "/private.pem -pubout -out " + otherPath.string() + "/publickey");
+    command("echo \"HashType=RSA-SHA256\" > " + otherPath.string() +
+            "/hashfunc");
+
+    auto manifestFile = extractPath.string() + "/" + "MANIFEST";
+    auto sign = [&]() {
+        command("openssl dgst -sha256 -sign " + extractPath.string() +
+                "/private.pem -out " + manifestFile + ".sig " + manifestFile);
+    };
+
+    auto keyId = Signature::getKeyId(signedConfOpenBMCPath / "publickey");
+    ASSERT_FALSE(keyId.empty());
+    command("echo \"KeyId=" + keyId + "\" >> " + manifestFile);
+    sign();
+    EXPECT_TRUE(Signature(extractPath, signedConfPath).verify());
+
+    // An id that matches no system key is not tried against the others
+    command("sed -i 's/^KeyId=.*/KeyId=" + std::string(64, '0') + "/' " +
+            manifestFile);
+    sign();
+    EXPECT_FALSE(Signature(extractPath, signedConfPath).verify());
+
+    // Images without an id still try every key
+    command("sed -i '/^KeyId=/d' " + manifestFile);
+    sign();
+    EXPECT_TRUE(Signature(extractPath, signedConfPath).verify());
+}
+
+/** @brief Test that a rofs with a dm-verity root hash in the manifest is
+ *         verified by its hash tree instead of its signature */
+TEST_F(SignatureTest, TestVerityRofs)
+{
+    std::string rofsFile = extractPath.string() + "/" + "image-rofs";
+    std::string manifestFile = extractPath.string() + "/" + "MANIFEST";
+    auto root = makeVerityImage(rofsFile, 3);
+    command("echo \"RofsVerityRootHash=" + root + "\" >> " + manifestFile);
+    command("echo \"RofsVerityHashOffset=12288\" >> " + manifestFile);
+    command("openssl dgst -sha256 -sign " + extractPath.string() +
+            "/private.pem -out " + manifestFile + ".sig " + manifestFile);
+    command("echo \"dummy data\" > " + rofsFile + ".sig ");
+
+    Signature veritySignature(extractPath, signedConfPath);
+#ifndef ROFS_VERITY
+    // Unless the boot checks the data with dm-verity, the rofs keeps its
+    // signature check
+    EXPECT_FALSE(veritySignature.verify());
+#else
+    EXPECT_TRUE(veritySignature.verify());
+#endif
+
+#if defined ROFS_VERITY && !defined MMC_LAYOUT
+    // The hash tree must match the signed root hash
+    std::fstream rofs(rofsFile, std::ios::in | std::ios::out);
+    rofs.seekp(12288 + 4096);
+    rofs << "tampered";
+    rofs.close();
+    EXPECT_FALSE(Signature(extractPath, signedConfPath).verify());
+#endif
+}
+
+/** @brief Make sure only the top of a dm-verity hash tree is needed to bind
+ *         an image to its root hash */
+TEST_F(VersionTest, TestVerity)
+{
+    auto imagePath = _directory + "/" + "image-rofs";
+    auto manifestPath = _directory + "/" + "MANIFEST";
+
+    auto root = makeVerityImage(imagePath, 3);
+    std::ofstream(manifestPath)
+        << "version=test\n"
+        << verity::rootHashKey << "=" << root << "\n"
+        << verity::hashOffsetKey << "=12288\n";
+
+    auto params = verity::fromManifest(manifestPath);
+    ASSERT_TRUE(params);
+    EXPECT_EQ(params->rootHash, root);
+    EXPECT_EQ(params->hashOffset, 12288);
+    EXPECT_TRUE(verity::checkRootHash(imagePath, *params));
+
+    // The data is verified by the kernel when it is read, not here
+    std::fstream(imagePath, std::ios::in | std::ios::out) << "changed";
+    EXPECT_TRUE(verity::checkRootHash(imagePath, *params));
+
+    // The image may be at an offset, as in a partition of a disk
+    auto diskPath = _directory + "/" + "disk";
+    std::ofstream(diskPath, std::ios::binary)
+        << std::string(8192, '\0') << std::ifstream(imagePath).rdbuf();
+    EXPECT_TRUE(verity::checkRootHash(diskPath, *params, 8192));
+
+    auto wrong = *params;
+    wrong.rootHash[0] = (wrong.rootHash[0] == '0') ? '1' : '0';
+    EXPECT_FALSE(verity::checkRootHash(imagePath, wrong));
+
+    // The filesystem must end before the tree
+    wrong = *params;
+    wrong.hashOffset = 8192;
+    EXPECT_FALSE(verity::checkRootHash(imagePath, wrong));
+
+    std::fstream tree(imagePath, std::ios::in | std::ios::out);
+    tree.seekp(12288 + 4096 + 32);
+    tree << "tampered";
+    tree.close();
+    EXPECT_FALSE(verity::checkRootHash(imagePath, *params));
+
+    std::ofstream(manifestPath) << verity::rootHashKey << "=xyz\n"
+                                << verity::hashOffsetKey << "=12288\n";
+    EXPECT_FALSE(verity::fromManifest(manifestPath));
+}
+
+/** @brief Make sure the kernel rejects blocks that do not match the tree of
+ *         an image opened with dm-verity */
+TEST_F(VersionTest, TestVerityLoopDevice)
+{
+    if (getuid() != 0 || !fs::exists("/usr/sbin/veritysetup") ||
+        !fs::exists("/dev/mapper/control"))
+    {
+        GTEST_SKIP() << "Needs root, veritysetup and device mapper";
+    }
+
+    auto imagePath = _directory + "/" + "image-rofs";
+    auto root = makeVerityImage(imagePath, 3);
+    verity::Params params{root, 12288};
+
+    auto attach = [&imagePath]() {
+        std::string loop;
+        auto pipe = popen(("losetup -f --show " + imagePath).c_str(), "r");
+        char buffer[64]{};
+        if (pipe != nullptr && fgets(buffer, sizeof(buffer), pipe) != nullptr)
+        {
+            loop = buffer;
+            loop.erase(loop.find_last_not_of('\n') + 1);
+        }
+        if (pipe != nullptr)
+        {
+            pclose(pipe);
+        }
+        return loop;
+    };
+    auto readAll = [](const std::string& device) {
+        std::ifstream input(device, std::ios::binary);
+        std::string content((std::istreambuf_iterator<char>(input)),
+                            std::istreambuf_iterator<char>());
+        return !input.bad() && content.size() == 3 * 4096;
+    };
+
+    auto loop = attach();
+    ASSERT_FALSE(loop.empty());
+    auto device = verity::open(loop, "utest-verity", params);
+    ASSERT_FALSE(device.empty());
+    EXPECT_TRUE(readAll(device));
+    EXPECT_TRUE(verity::close("utest-verity"));
+    EXPECT_EQ(std::system(("losetup -d " + loop).c_str()), 0);
+
+    std::fstream(imagePath, std::ios::in | std::ios::out) << "changed";
+    loop = attach();
+    ASSERT_FALSE(loop.empty());
+    device = verity::open(loop, "utest-verity", params);
+    ASSERT_FALSE(device.empty());
+    EXPECT_FALSE(readAll(device));
+    EXPECT_TRUE(verity::close("utest-verity"));
+    EXPECT_EQ(std::system(("losetup -d " + loop).c_str()), 0);
+}
+
+class FlashHealthTest : public testing::Test
+{
+  protected:
+    virtual void SetUp()
+    {
+        char sysfsDir[] = "./flashHealthXXXXXX";
+        _directory = mkdtemp(sysfsDir);
+
+        if (_directory.empty())
+        {
+            throw std::bad_alloc();
+        }
+    }
+
+    virtual void TearDown()
+    {
+        fs::remove_all(_directory);
+    }
+
+    std::string _directory;
+};
+
+/** @brief Make sure the flash statistics are read from sysfs */
+TEST_F(FlashHealthTest, TestCollect)
+{
+    auto sysfs = fs::path(_directory) / "sys";
+    auto write = [](const fs::path& path, const std::string& value) {
+        fs::create_directories(path.parent_path());
+        std::ofstream(path) << value << "\n";
+    };
+
+    write(sysfs / "class/ubi/ubi0/max_ec", "120");
+    write(sysfs / "class/ubi/ubi0/mean_ec", "40");
+    write(sysfs / "class/ubi/ubi0/bad_peb_count", "1");
+    write(sysfs / "class/ubi/ubi0/mtd_num", "4");
+    write(sysfs / "class/ubi/ubi0_0/name", "rofs-12345678");
+    write(sysfs / "class/ubi/ubi1/max_ec", "20");
+    write(sysfs / "class/ubi/ubi1/mtd_num", "9");
+    write(sysfs / "class/ubi/ubi1_3/name", "rofs-abcdef01");
+    write(sysfs / "class/mtd/mtd4/corrected_bits", "7");
+    write(sysfs / "class/mtd/mtd4/ecc_failures", "0");
+    write(sysfs / "class/mtd/mtd4ro/corrected_bits", "7");
+    write(sysfs / "class/mtd/mtd9/corrected_bits", "0");
+    write(sysfs / "class/mtd/mtd0/bad_blocks", "2");
+    write(sysfs / "block/mmcblk0/device/life_time", "0x02 0x05");
+    write(sysfs / "block/mmcblk0/device/pre_eol_info", "0x01");
+    write(sysfs / "block/mmcblk0boot0/device/life_time", "0x0B 0x0B");
+
+    auto devices = flash_health::collect(sysfs);
+    ASSERT_EQ(devices.size(), 4);
+
+    EXPECT_EQ(devices[0].name, "mmcblk0");
+    EXPECT_EQ(devices[0].lifeTimeUsed, 50);
+    EXPECT_EQ(devices[0].preEolInfo, 1);
+    EXPECT_EQ(devices[1].name, "mtd0");
+    EXPECT_EQ(devices[1].badBlocks, 2);
+    EXPECT_EQ(devices[2].name, "ubi0");
+    EXPECT_EQ(devices[2].maxEraseCount, 120);
+    EXPECT_EQ(devices[2].meanEraseCount, 40);
+    EXPECT_EQ(devices[2].badBlocks, 1);
+    EXPECT_EQ(devices[2].correctedBits, 7);
+    EXPECT_EQ(devices[3].name, "ubi1");
+    EXPECT_EQ(devices[3].maxEraseCount, 20);
+
+    EXPECT_FALSE(devices[2].nearEndOfLife());
+}
+
+/** @brief Make sure only the differing erase blocks are rewritten */
+TEST_F(VersionTest, TestMtdMirror)
+{
+    constexpr auto blockSize = mtd_mirror::defaultEraseSize;
+    auto sourcePath = _directory + "/" + "u-boot";
+    auto destinationPath = _directory + "/" + "alt-u-boot";
+
+    std::string source(blockSize * 5 + 100, '\0');
+    for (size_t i = 0; i < source.size(); i++)
+    {
+        source[i] = static_cast<char>(i * 7);
+    }
+    auto destination = source;
+    destination[blockSize + 10] ^= 1;
+    destination[blockSize * 3] ^= 1;
+    destination[blockSize * 5 + 99] ^= 1;
+    std::ofstream(sourcePath) << source;
+    std::ofstream(destinationPath) << destination;
+
+    auto before = mtd_mirror::stamp(sourcePath, destinationPath);
+    EXPECT_EQ(mtd_mirror::findDifference(sourcePath, destinationPath),
+              blockSize);
+
+    size_t progressCalls = 0;
+    auto result = mtd_mirror::mirror(sourcePath, destinationPath,
+                                     [&](size_t done, size_t total) {
+                                         EXPECT_LE(done, total);
+                                         ++progressCalls;
+                                     });
+    EXPECT_EQ(result.blocks, 6);
+    EXPECT_EQ(result.rewritten, 3);
+    EXPECT_EQ(progressCalls, 4);
+
+    std::ifstream file(destinationPath);
+    std::string mirrored((std::istreambuf_iterator<char>(file)),
+                         std::istreambuf_iterator<char>());
+    EXPECT_EQ(mirrored, source);
+    EXPECT_EQ(mtd_mirror::findDifference(sourcePath, destinationPath),
+              std::nullopt);
+    EXPECT_EQ(mtd_mirror::mirror(sourcePath, destinationPath).rewritten, 0);
+
+    // The stamp only depends on the devices, not on their content
+    EXPECT_EQ(mtd_mirror::stamp(sourcePath, destinationPath), before);
+    EXPECT_NE(mtd_mirror::stamp(destinationPath, sourcePath), before);
+    std::ofstream(destinationPath, std::ios::app) << "grown";
+    EXPECT_NE(mtd_mirror::stamp(sourcePath, destinationPath), before);
+}
+
+/** @brief Make sure the image comparison finds the ranges to rewrite */
+TEST_F(VersionTest, TestImageCompare)
+{
+    constexpr auto chunkSize = image_compare::defaultChunkSize;
+    auto devicePath = _directory + "/" + "mmcblk0boot0";
+    auto imagePath = _directory + "/" + "image-u-boot";
+
+    std::string image(chunkSize * 4 + 10, 'u');
+    auto device = image + std::string(chunkSize, '\0');
+    device[chunkSize + 1] = 'x';
+    device[chunkSize * 2 + 1] = 'x';
+    device[chunkSize * 4 + 9] = 'x';
+    std::ofstream(imagePath) << image;
+    std::ofstream(devicePath) << device;
+
+    using image_compare::Range;
+    auto first = image_compare::compare(devicePath, imagePath);
+    EXPECT_FALSE(first.identical);
+    EXPECT_EQ(first.ranges,
+              (std::vector<Range>{{chunkSize, image.size() - chunkSize}}));
+    EXPECT_EQ(first.compared, chunkSize * 2);
+
+    auto all = image_compare::compare(devicePath, imagePath, true);
+    EXPECT_FALSE(all.identical);
+    EXPECT_EQ(all.ranges, (std::vector<Range>{{chunkSize, chunkSize * 2},
+                                              {chunkSize * 4, 10}}));
+    EXPECT_EQ(all.compared, image.size());
+
+    image_compare::write(devicePath, imagePath, all.ranges);
+    auto after = image_compare::compare(devicePath, imagePath, true);
+    EXPECT_TRUE(after.identical);
+    EXPECT_TRUE(after.ranges.empty());
+    EXPECT_EQ(fs::file_size(devicePath), device.size());
+
+    // The device must be able to hold the image
+    fs::resize_file(devicePath, chunkSize);
+    EXPECT_THROW(image_compare::compare(devicePath, imagePath),
+                 std::system_error);
+}
+
+#ifdef HAVE_ZSTD
+TEST_F(VersionTest, TestEmmcWriter)
+{
+    constexpr uint32_t sector = 512;
+    constexpr uint32_t entryCount = 4;
+    constexpr uint32_t entrySize = 128;
+    constexpr uint64_t lastLba = 8041;
+    auto diskPath = _directory + "/" + "mmcblk0";
+    auto imagePath = _directory + "/" + "image-rofs";
+
+    auto put = [](std::string& s, size_t offset, auto value) {
+        std::memcpy(s.data() + offset, &value, sizeof(value));
+    };
+
+    // A disk with boot-a at LBA 8-15 and rofs-a at LBA 16-8039
+    std::string entries(entryCount * entrySize, '\0');
+    auto addEntry = [&](size_t index, uint64_t first, uint64_t last,
+                        const std::string& name) {
+        auto offset = index * entrySize;
+        entries[offset] = 1; // Any non-zero type GUID
+        put(entries, offset + 32, first);
+        put(entries, offset + 40, last);
+        for (size_t i = 0; i < name.size(); i++)
+        {
+            entries[offset + 56 + i * 2] = name[i];
+        }
+    };
+    addEntry(0, 8, 15, "boot-a");
+    addEntry(1, 16, lastLba - 2, "rofs-a");
+
+    auto header = [&](uint64_t lba, uint64_t alternate, uint64_t entriesLba) {
+        std::string h(sector, '\0');
+        h.replace(0, 8, "EFI PART");
+        put(h, 8, uint32_t{0x10000});
+        put(h, 12, uint32_t{92});
+        put(h, 24, lba);
+        put(h, 32, alternate);
+        put(h, 72, entriesLba);
+        put(h, 80, entryCount);
+        put(h, 84, entrySize);
+        put(h, 88, emmc_writer::internal::crc32(entries.data(),
+                                                entries.size()));
+        put(h, 16, emmc_writer::internal::crc32(h.data(), 92));
+        return h;
+    };
+
+    std::string disk((lastLba + 1) * sector, '\xff');
+    disk.replace(sector, sector, header(1, lastLba, 2));
+    disk.replace(2 * sector, entries.size(), entries);
+    disk.replace((lastLba - 1) * sector, entries.size(), entries);
+    disk.replace(lastLba * sector, sector, header(lastLba, 1, lastLba - 1));
+    std::ofstream(diskPath, std::ios::binary) << disk;
+
+    auto boot = emmc_writer::findPartition(diskPath, "boot-a");
+    ASSERT_TRUE(boot);
+    EXPECT_EQ(boot->number, 1);
+    EXPECT_EQ(boot->offset, 8 * sector);
+    EXPECT_EQ(boot->size, 8 * sector);
+    auto rofs = emmc_writer::findPartition(diskPath, "rofs-a");
+    ASSERT_TRUE(rofs);
+    EXPECT_EQ(rofs->number, 2);
+    EXPECT_FALSE(emmc_writer::findPartition(diskPath, "rofs-b"));
+
+    std::string image(3000000, '\0');
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        image[i] = static_cast<char>((i * 7) % 251);
+    }
+    std::string compressed(ZSTD_compressBound(image.size()), '\0');
+    compressed.resize(ZSTD_compress(compressed.data(), compressed.size(),
+                                    image.data(), image.size(), 3));
+    std::ofstream(imagePath, std::ios::binary) << compressed;
+
+    // The image is padded to whole sectors
+    EXPECT_EQ(emmc_writer::writeImage(diskPath, *rofs, imagePath), 3000320);
+    std::ifstream file(diskPath, std::ios::binary);
+    std::string written(3000320, '\xff');
+    file.seekg(rofs->offset);
+    file.read(written.data(), written.size());
+    EXPECT_EQ(written.substr(0, image.size()), image);
+    EXPECT_EQ(written.substr(image.size()), std::string(320, '\0'));
+    EXPECT_EQ(fs::file_size(diskPath), disk.size());
+
+    // A resumed write keeps the verified data, and rewrites from the first
+    // block that does not match
+    std::fstream damage(diskPath,
+                        std::ios::binary | std::ios::in | std::ios::out);
+    damage.seekp(rofs->offset + 512);
+    damage.write("xx", 2);
+    damage.seekp(rofs->offset + 1048576 + 512);
+    damage.write("yy", 2);
+    damage.close();
+    std::vector<uint64_t> checkpoints;
+    EXPECT_EQ(emmc_writer::writeImage(
+                  diskPath, *rofs, imagePath, nullptr, 2 * 1048576,
+                  [&](uint64_t written) { checkpoints.push_back(written); }),
+              3000320);
+    EXPECT_EQ(checkpoints, std::vector<uint64_t>{3000320});
+    std::ifstream resumed(diskPath, std::ios::binary);
+    resumed.seekg(rofs->offset);
+    resumed.read(written.data(), written.size());
+    EXPECT_EQ(written.substr(512, 2), "xx");
+    EXPECT_EQ(written.substr(1048576, image.size() - 1048576),
+              image.substr(1048576));
+
+    // A cancelled write stops before writing anything
+    std::ofstream(_directory + "/" + "image-kernel", std::ios::binary)
+        << compressed;
+    std::atomic<bool> cancelled = true;
+    emmc_writer::Options options;
+    options.concurrent = true;
+    options.cancelled = &cancelled;
+    try
+    {
+        emmc_writer::update(diskPath, _directory, "a", options);
+        ADD_FAILURE() << "The write was not cancelled";
+    }
+    catch (const std::system_error& e)
+    {
+        EXPECT_EQ(e.code().value(), ECANCELED);
+    }
+    std::ifstream unchanged(diskPath, std::ios::binary);
+    std::string kernel(boot->size, '\0');
+    unchanged.seekg(boot->offset);
+    unchanged.read(kernel.data(), kernel.size());
+    EXPECT_EQ(kernel, std::string(kernel.size(), '\xff'));
+
+    // A write cancelled while it runs stops at its next write, the source
+    // is held half way until the cancel is requested
+    std::atomic<bool> stop = false;
+    std::promise<void> halfWay;
+    std::promise<void> resumed;
+    auto resumedFuture = resumed.get_future();
+    size_t fed = 0;
+    auto source = [&](char* data, size_t size) {
+        if (fed >= compressed.size() / 2 && resumedFuture.valid())
+        {
+            halfWay.set_value();
+            resumedFuture.get();
+        }
+        size = std::min({size, compressed.size() / 8, compressed.size() - fed});
+        std::memcpy(data, compressed.data() + fed, size);
+        fed += size;
+        return size;
+    };
+    int code = 0;
+    std::thread writer([&]() {
+        try
+        {
+            emmc_writer::writeImage(diskPath, *rofs, source, imagePath,
+                                    &stop);
+        }
+        catch (const std::system_error& e)
+        {
+            code = e.code().value();
+        }
+    });
+    halfWay.get_future().wait();
+    stop = true;
+    resumed.set_value();
+    writer.join();
+    EXPECT_EQ(code, ECANCELED);
+
+    // The image must fit the partition, and be a valid zstd stream
+    EXPECT_THROW(emmc_writer::writeImage(diskPath, *boot, imagePath),
+                 std::system_error);
+    std::ofstream(imagePath, std::ios::binary) << image;
+    EXPECT_THROW(emmc_writer::writeImage(diskPath, *rofs, imagePath),
+                 std::system_error);
+
+    // An empty image, or one that decodes to nothing, leaves the partition
+    // as it was
+    std::ofstream(imagePath, std::ios::binary);
+    EXPECT_THROW(emmc_writer::writeImage(diskPath, *rofs, imagePath),
+                 std::system_error);
+    std::string empty(ZSTD_compressBound(0), '\0');
+    empty.resize(ZSTD_compress(empty.data(), empty.size(), nullptr, 0, 3));
+    std::ofstream(imagePath, std::ios::binary) << empty;
+    EXPECT_THROW(emmc_writer::writeImage(diskPath, *rofs, imagePath),
+                 std::system_error);
+    std::ifstream kept(diskPath, std::ios::binary);
+    kept.seekg(rofs->offset);
+    kept.read(written.data(), written.size());
+    EXPECT_EQ(written.substr(1048576, image.size() - 1048576),
+              image.substr(1048576));
+
+    // Renaming updates both GPTs, and keeps them valid
+    emmc_writer::setPartitionName(diskPath, 1, "boot-b");
+    EXPECT_FALSE(emmc_writer::findPartition(diskPath, "boot-a"));
+    boot = emmc_writer::findPartition(diskPath, "boot-b");
+    ASSERT_TRUE(boot);
+    EXPECT_EQ(boot->number, 1);
+    emmc_writer::setPartitionName(diskPath, 1, "boot-b");
+    EXPECT_THROW(emmc_writer::setPartitionName(diskPath, 5, "boot-c"),
+                 std::system_error);
+
+    std::string backup(entries.size(), '\0');
+    std::ifstream renamed(diskPath, std::ios::binary);
+    renamed.seekg((lastLba - 1) * sector);
+    renamed.read(backup.data(), backup.size());
+    EXPECT_EQ(backup[56], 'b');
+    EXPECT_EQ(backup[56 + 5 * 2], 'b');
+}
+#endif
+
+/** @brief Make sure archives are extracted, or streamed, entry by entry */
+TEST_F(VersionTest, TestTarStream)
+{
+    auto sourceDir = _directory + "/" + "source";
+    auto extractDir = _directory + "/" + "extract";
+    auto tarPath = _directory + "/" + "image.tar";
+    fs::create_directories(sourceDir);
+    fs::create_directories(extractDir);
+
+    std::string longName(120, 'n');
+    std::string kernel(1000, 'k');
+    std::ofstream(sourceDir + "/" + "MANIFEST") << "version=test\n";
+    std::ofstream(sourceDir + "/" + "image-kernel") << kernel;
+    std::ofstream(sourceDir + "/" + longName) << "long";
+    std::ofstream(sourceDir + "/" + "empty");
+
+    // A leading "./" and a directory entry, as tar -C dir . writes
+    auto command = "tar -C " + sourceDir + " -cf " + tarPath + " .";
+    ASSERT_EQ(std::system(command.c_str()), 0);
+
+    std::string streamed;
+    tar_stream::extract(tarPath, extractDir,
+                        [&](const tar_stream::Entry& entry,
+                            tar_stream::Reader& reader) {
+                            if (entry.name != "image-kernel")
+                            {
+                                return false;
+                            }
+                            EXPECT_EQ(entry.size, kernel.size());
+                            // Reads stop at the end of the entry
+                            std::string buffer(4096, '\0');
+                            while (auto bytes = reader.read(buffer.data(),
+                                                            100))
+                            {
+                                streamed.append(buffer.data(), bytes);
+                            }
+                            return true;
+                        });
+
+    EXPECT_EQ(streamed, kernel);
+    EXPECT_FALSE(fs::exists(extractDir + "/" + "image-kernel"));
+    EXPECT_EQ(Version::getValue(extractDir + "/" + "MANIFEST", "version"),
+              "test");
+    EXPECT_EQ(fs::file_size(extractDir + "/" + longName), 4);
+    EXPECT_EQ(fs::file_size(extractDir + "/" + "empty"), 0);
+
+    // Entries are skipped when they are not read, and in subdirectories
+    // they are refused
+    tar_stream::Reader reader(tarPath);
+    tar_stream::Entry entry;
+    size_t files = 0;
+    while (reader.next(entry))
+    {
+        files += entry.isFile() ? 1 : 0;
+    }
+    EXPECT_EQ(files, 4);
+
+    // Archives are read once, so they may be pipes, as the Upload method
+    // reads them
+    auto pipe = popen(("cat " + tarPath).c_str(), "r");
+    ASSERT_NE(pipe, nullptr);
+    files = 0;
+    {
+        tar_stream::Reader piped("/proc/self/fd/" +
+                                 std::to_string(fileno(pipe)));
+        while (piped.next(entry))
+        {
+            files += entry.isFile() ? 1 : 0;
+        }
+    }
+    pclose(pipe);
+    EXPECT_EQ(files, 4);
+
+    // A pipe read in part can still be handed over as a whole
+    pipe = popen(("cat " + tarPath).c_str(), "r");
+    ASSERT_NE(pipe, nullptr);
+    std::ostringstream copy;
+    {
+        tar_stream::Reader piped("/proc/self/fd/" +
+                                 std::to_string(fileno(pipe)));
+        piped.keep(true);
+        ASSERT_TRUE(piped.next(entry));
+        piped.copyArchive(copy);
+    }
+    pclose(pipe);
+    std::ifstream archive(tarPath, std::ios::binary);
+    EXPECT_EQ(copy.str(), std::string(std::istreambuf_iterator<char>(archive),
+                                      std::istreambuf_iterator<char>()));
+
+    fs::create_directories(sourceDir + "/" + "sub");
+    std::ofstream(sourceDir + "/" + "sub" + "/" + "file");
+    ASSERT_EQ(std::system(command.c_str()), 0);
+    EXPECT_THROW(tar_stream::extract(tarPath, extractDir, nullptr),
+                 std::system_error);
+
+    // A truncated archive is an error
+    fs::resize_file(tarPath, 1024 + 100);
+    EXPECT_THROW(tar_stream::extract(tarPath, extractDir, nullptr),
+                 std::system_error);
+}
+
+/** @brief Make sure a slot is locked once, and its generation kept */
+TEST(SlotLockTest, TestLock)
+{
+    char dir[] = "./slotsXXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+
+    {
+        SlotLock slot("a", dir);
+        EXPECT_EQ(slot.generation(), 0);
+        EXPECT_EQ(slot.bump("1234"), 1);
+
+        // Another writer is refused rather than waited for
+        try
+        {
+            SlotLock other("a", dir);
+            ADD_FAILURE() << "The slot was locked twice";
+        }
+        catch (const std::system_error& e)
+        {
+            EXPECT_EQ(e.code().value(), EWOULDBLOCK);
+        }
+        SlotLock b("b", dir);
+        EXPECT_EQ(b.bump(), 1);
+    }
+
+    EXPECT_EQ(getOverwrittenVersions(dir), std::vector<std::string>{"1234"});
+    SlotLock slot("a", dir);
+    EXPECT_EQ(slot.generation(), 1);
+    EXPECT_EQ(slot.bump(), 2);
+    EXPECT_TRUE(getOverwrittenVersions(dir).empty());
+
+    fs::remove_all(dir);
+}
+
+/** @brief Make sure modified and replaced files change the file states */
+TEST_F(VersionTest, TestGetFileStates)
+{
+    auto imageDir = _directory + "/" + "image";
+    fs::create_directories(imageDir + "/" + "keys");
+    std::ofstream(imageDir + "/" + "image-rofs") << "rofs";
+    std::ofstream(imageDir + "/" + "keys" + "/" + "publickey") << "key";
+
+    auto states = getFileStates(imageDir);
+    ASSERT_EQ(states.size(), 2u);
+    EXPECT_EQ(states, getFileStates(imageDir));
+    EXPECT_TRUE(getFileStates(_directory + "/" + "missing").empty());
+
+    // Same size, only the change time differs
+    usleep(10000);
+    std::ofstream(imageDir + "/" + "image-rofs") << "ROFS";
+    auto modified = getFileStates(imageDir);
+    EXPECT_NE(states, modified);
+
+    std::ofstream(_directory + "/" + "replacement") << "ROFS";
+    fs::rename(_directory + "/" + "replacement", imageDir + "/" + "image-rofs");
+    EXPECT_NE(modified, getFileStates(imageDir));
+
+    fs::remove(imageDir + "/" + "keys" + "/" + "publickey");
+    EXPECT_EQ(getFileStates(imageDir).size(), 1u);
+}
+
+/** @brief Make sure images are moved, replacing the destination */
+TEST_F(VersionTest, TestMoveImage)
+{
+    auto from = fs::path(_directory) / "image-bmc";
+    auto to = fs::path(_directory) / "staged";
+    std::ofstream(from) << "bmc";
+    std::ofstream(to) << "previous image";
+
+    moveImage(from, to);
+    EXPECT_FALSE(fs::exists(from));
+    std::ifstream staged(to);
+    EXPECT_EQ(std::string(std::istreambuf_iterator<char>(staged), {}), "bmc");
+
+    EXPECT_THROW(moveImage(from, to), std::system_error);
+    EXPECT_TRUE(fs::exists(to));
+}
+
+/** @brief Make sure a streamed image is only taken from the records the
+ *         image manager writes, never from a marker planted in an archive */
+TEST_F(VersionTest, TestStreamedRecords)
+{
+    auto sourceDir = _directory + "/" + "source";
+    auto imageDir = fs::path(_directory) / "image";
+    auto recordsDir = fs::path(_directory) / "records";
+    auto tarPath = _directory + "/" + "image.tar";
+    fs::create_directories(sourceDir);
+    fs::create_directories(imageDir);
+
+    // The archive does not start with its MANIFEST, so it is extracted with
+    // tar, which writes the planted marker too
+    std::ofstream(sourceDir + "/" + "image-rofs" + streamedSuffix)
+        << "Label=a\nGeneration=1\nsha256=" << std::string(64, '0') << "\n";
+    std::ofstream(sourceDir + "/" + "MANIFEST") << "version=test\n";
+    auto command = "tar -C " + sourceDir + " -cf " + tarPath +
+                   " image-rofs.streamed MANIFEST && tar -xf " + tarPath +
+                   " -C " + imageDir.string();
+    ASSERT_EQ(std::system(command.c_str()), 0);
+    ASSERT_TRUE(fs::exists(imageDir / ("image-rofs" + streamedSuffix)));
+
+    EXPECT_FALSE(imageStreamed(imageDir / "image-rofs", recordsDir));
+    EXPECT_FALSE(imageStreamed(imageDir / "image-rofs"));
+    EXPECT_FALSE(imageExists(imageDir / "image-rofs"));
+
+    // The records are kept by image directory name, out of the directory
+    auto record = streamedRecord(imageDir / "image-rofs", recordsDir);
+    EXPECT_EQ(record, recordsDir / "image" / ("image-rofs" + streamedSuffix));
+    fs::create_directories(record.parent_path());
+    std::ofstream(record) << "Label=a\n";
+#ifdef STREAM_STAGING
+    EXPECT_TRUE(imageStreamed(imageDir / "image-rofs", recordsDir));
+#endif
+    std::ofstream(imageDir / "image-rofs") << "rofs";
+    EXPECT_FALSE(imageStreamed(imageDir / "image-rofs", recordsDir));
+    fs::remove(imageDir / "image-rofs");
+
+    // They follow the directory when it is renamed to the version id
+    auto versionDir = fs::path(_directory) / "1234abcd";
+    fs::create_directories(recordsDir / "1234abcd");
+    std::ofstream(recordsDir / "1234abcd" / "stale") << "stale";
+    fs::rename(imageDir, versionDir);
+    moveStreamedRecords(imageDir, versionDir, recordsDir);
+    EXPECT_FALSE(fs::exists(record));
+    EXPECT_FALSE(fs::exists(recordsDir / "1234abcd" / "stale"));
+    EXPECT_TRUE(
+        fs::exists(streamedRecord(versionDir / "image-rofs", recordsDir)));
+#ifdef STREAM_STAGING
+    EXPECT_TRUE(imageStreamed(versionDir / "image-rofs", recordsDir));
+#endif
+
+    removeStreamedRecords(versionDir, recordsDir);
+    EXPECT_FALSE(fs::exists(recordsDir / "1234abcd"));
+    EXPECT_FALSE(imageStreamed(versionDir / "image-rofs", recordsDir));
+}
+
+/** @brief Make sure images are handed over in order, from the io_context */
+TEST(HandoffTest, TestQueue)
+{
+    using namespace phosphor::software::handoff;
+    boost::asio::io_context io;
+    Queue queue(io);
+
+    std::vector<std::pair<std::string, Outcome>> replies;
+    auto reply = [&replies](const Image& image, Outcome outcome) {
+        replies.emplace_back(image.versionId, outcome);
+    };
+    auto makeImage = [](const std::string& id, VersionPurpose purpose) {
+        Image image;
+        image.path = "/xyz/openbmc_project/software/" + id;
+        image.versionId = id;
+        image.version = "version-" + id;
+        image.purpose = purpose;
+        return image;
+    };
+
+    // Nothing takes the images yet
+    queue.push(makeImage("a", VersionPurpose::BMC), reply);
+    EXPECT_TRUE(replies.empty());
+    io.run();
+    ASSERT_EQ(replies.size(), 1u);
+    EXPECT_EQ(replies[0], std::make_pair(std::string("a"), Outcome::rejected));
+
+    std::vector<std::string> received;
+    queue.setReceiver([&received](const Image& image) {
+        received.push_back(image.versionId);
+        return image.purpose == VersionPurpose::BMC ? Outcome::accepted
+                                                    : Outcome::rejected;
+    });
+    queue.push(makeImage("b", VersionPurpose::BMC), reply);
+    queue.push(makeImage("c", VersionPurpose::Unknown), reply);
+    EXPECT_TRUE(received.empty());
+    io.restart();
+    io.run();
+    EXPECT_EQ(received, std::vector<std::string>({"b", "c"}));
+    ASSERT_EQ(replies.size(), 3u);
+    EXPECT_EQ(replies[1], std::make_pair(std::string("b"), Outcome::accepted));
+    EXPECT_EQ(replies[2], std::make_pair(std::string("c"), Outcome::rejected));
+
+    std::vector<std::string> released;
+    queue.release("b");
+    queue.setReleaser(
+        [&released](const std::string& id) { released.push_back(id); });
+    queue.release("b");
+    EXPECT_EQ(released, std::vector<std::string>({"b"}));
+}
+
 class FileTest : public testing::Test
 {
   protected:
@@ -358,6 +1494,37 @@ TEST_F(FileTest, TestMergeFiles)
     ASSERT_EQ(ssRetFile, ssDstFile);
 }
 
+/** @brief Make sure a batch of variables is removed by one complete script */
+TEST_F(FileTest, TestWriteEnvScript)
+{
+    auto dir = fs::path(tmpDir) / "clearenv";
+    auto first = utils::writeEnvScript(dir, {"a1b2c3d4", "e5f6a7b8"});
+    auto second = utils::writeEnvScript(dir, {"c9d0e1f2"});
+    EXPECT_NE(first, second);
+    EXPECT_EQ(first.extension(), ".env");
+    EXPECT_EQ(readFile(first), "a1b2c3d4\ne5f6a7b8\n");
+    EXPECT_EQ(readFile(second), "c9d0e1f2\n");
+
+    // Scripts that are not applied yet are never replaced
+    std::map<fs::path, std::string> scripts = {
+        {first, "a1b2c3d4\ne5f6a7b8\n"}, {second, "c9d0e1f2\n"}};
+    for (int i = 0; i < 100; i++)
+    {
+        auto name = std::to_string(i);
+        auto path = utils::writeEnvScript(dir, {name});
+        EXPECT_TRUE(scripts.emplace(path, name + "\n").second) << path;
+    }
+    for (const auto& [path, content] : scripts)
+    {
+        EXPECT_EQ(readFile(path), content) << path;
+    }
+
+    // Nothing is left under a hidden name
+    EXPECT_EQ(static_cast<size_t>(std::distance(fs::directory_iterator(dir),
+                                                fs::directory_iterator())),
+              scripts.size());
+}
+
 TEST(ExecTest, TestConstructArgv)
 {
     auto name = "/bin/ls";
@@ -393,3 +1560,339 @@ TEST(ExecTest, TestConstructArgv)
     EXPECT_EQ(charArray[2], arg2);
     EXPECT_EQ(charArray[3], nullptr);
 }
+
+/** @brief Make sure files are stored once, and reclaimed once unlinked */
+TEST_F(VersionTest, TestBlobStore)
+{
+    blob_store::Store store(_directory + "/" + "blobs");
+    auto addString = [&store](const std::string& content,
+                              const fs::path& dest) {
+        size_t offset = 0;
+        return store.add(
+            [&](char* buffer, size_t size) {
+                auto bytes = std::min(size, content.size() - offset);
+                std::memcpy(buffer, content.data() + offset, bytes);
+                offset += bytes;
+                return bytes;
+            },
+            dest);
+    };
+
+    auto image1 = fs::path(_directory) / "image1";
+    auto image2 = fs::path(_directory) / "image2";
+    fs::create_directories(image1);
+    fs::create_directories(image2);
+
+    std::string kernel(100000, 'k');
+    auto kernelDigest = addString(kernel, image1 / "image-kernel");
+    EXPECT_EQ(kernelDigest.size(), 64u);
+    auto manifestDigest = addString("version=1", image1 / "MANIFEST");
+    EXPECT_EQ(addString(kernel, image2 / "image-kernel"), kernelDigest);
+    EXPECT_NE(addString("version=2", image2 / "MANIFEST"), manifestDigest);
+
+    std::ifstream stored(image2 / "image-kernel");
+    EXPECT_EQ(std::string(std::istreambuf_iterator<char>(stored), {}), kernel);
+    EXPECT_EQ(fs::hard_link_count(image1 / "image-kernel"), 3u);
+
+    auto usage = store.usage();
+    EXPECT_EQ(usage.blobs, 3u);
+    EXPECT_EQ(usage.storedBytes, kernel.size() + 18);
+    EXPECT_EQ(usage.savedBytes, kernel.size());
+
+    // A known archive is linked from the store
+    auto archive = fs::path(_directory) / "image.tar";
+    std::ofstream(archive) << "archive";
+    auto digest = blob_store::Store::archiveDigest(archive);
+    EXPECT_EQ(digest.size(), 64u);
+    EXPECT_FALSE(store.linkArchive(digest, image2));
+    store.addArchive(digest, {{"image-kernel", kernelDigest},
+                              {"MANIFEST", manifestDigest}});
+    auto image3 = fs::path(_directory) / "image3";
+    fs::create_directories(image3);
+    EXPECT_TRUE(store.linkArchive(digest, image3));
+    EXPECT_EQ(fs::hard_link_count(image3 / "MANIFEST"), 3u);
+    EXPECT_EQ(store.collect(), 0u);
+
+    // Reclaimed once no image links to the blobs
+    fs::remove_all(image1);
+    fs::remove_all(image3);
+    EXPECT_EQ(store.collect(), 9u);
+    EXPECT_FALSE(store.linkArchive(digest, image3));
+    usage = store.usage();
+    EXPECT_EQ(usage.blobs, 2u);
+    EXPECT_EQ(usage.savedBytes, 0u);
+
+    fs::remove_all(image2);
+    EXPECT_EQ(store.collect(), kernel.size() + 9);
+    EXPECT_EQ(store.usage().blobs, 0u);
+
+    // A pipe cannot be read twice
+    EXPECT_TRUE(blob_store::Store::archiveDigest("/dev/null").empty());
+}
+
+class ReclaimerTest : public testing::Test
+{
+  protected:
+    virtual void SetUp()
+    {
+        char reclaimerDir[] = "./reclaimerXXXXXX";
+        _directory = mkdtemp(reclaimerDir);
+
+        if (_directory.empty())
+        {
+            throw std::bad_alloc();
+        }
+        ASSERT_GE(sd_event_new(&loop), 0);
+    }
+
+    virtual void TearDown()
+    {
+        sd_event_unref(loop);
+        fs::remove_all(_directory);
+    }
+
+    std::string _directory;
+    sd_event* loop = nullptr;
+};
+
+/** @brief Make sure removed paths are gone at once, and freed in the
+ *  background */
+TEST_F(ReclaimerTest, TestRemove)
+{
+    auto trash = fs::path(_directory) / "trash";
+
+    // Left over from a previous run
+    fs::create_directories(trash / "old");
+    std::ofstream(trash / "old" / "file") << "old";
+
+    auto image = fs::path(_directory) / "image";
+    fs::create_directories(image / "sub");
+    std::string rofs(5 * 1024 * 1024 + 1, 'r');
+    std::ofstream(image / "image-rofs") << rofs;
+    std::ofstream(image / "sub" / "MANIFEST") << "version=1";
+    std::ofstream(image / "image-kernel") << "kernel";
+    auto blob = fs::path(_directory) / "blob";
+    fs::create_hard_link(image / "image-kernel", blob);
+
+    int notified = 0;
+    {
+        reclaimer::Reclaimer reclaimer(trash, loop,
+                                       [&notified]() { notified++; });
+        reclaimer.remove(image);
+        reclaimer.remove(fs::path(_directory) / "missing");
+        EXPECT_FALSE(fs::exists(image));
+
+        // Counted at once, the worker frees before it uncounts
+        auto pending = reclaimer.pendingBytes();
+        EXPECT_GE(pending + reclaimer.freedBytes(), rofs.size() + 9);
+
+        // Linked files keep their content
+        auto expected = 3 + rofs.size() + 9;
+        for (int i = 0;
+             i < 1000 && (reclaimer.freedBytes() < expected ||
+                          reclaimer.pendingBytes() > 0 || !fs::is_empty(trash));
+             i++)
+        {
+            sd_event_run(loop, 10000);
+        }
+        EXPECT_EQ(reclaimer.freedBytes(), expected);
+        EXPECT_EQ(reclaimer.pendingBytes(), 0u);
+    }
+    EXPECT_GT(notified, 0);
+    EXPECT_TRUE(fs::is_empty(trash));
+    std::ifstream kept(blob);
+    EXPECT_EQ(std::string(std::istreambuf_iterator<char>(kept), {}),
+              "kernel");
+}
+
+/** @brief Make sure reboots are blocked until the last guard is gone */
+TEST_F(VersionTest, TestRebootGuard)
+{
+    auto dir = fs::path(_directory) / "system";
+    auto dropIn = dir / "reboot.target.d" / "reboot-guard.conf";
+    int reloads = 0;
+    auto reload = [&reloads]() { reloads++; };
+    {
+        reboot_guard::Guard guard(dir, reload);
+        EXPECT_TRUE(fs::exists(dropIn));
+        EXPECT_TRUE(fs::exists(dir / "halt.target.d" / "reboot-guard.conf"));
+        {
+            reboot_guard::Guard other(dir, reload);
+        }
+        EXPECT_TRUE(fs::exists(dropIn));
+        EXPECT_EQ(reloads, 1);
+    }
+    EXPECT_FALSE(fs::exists(dropIn));
+    EXPECT_EQ(reloads, 2);
+
+    // Nothing is left behind if a drop-in cannot be written
+    fs::remove_all(dir / "poweroff.target.d");
+    std::ofstream(dir / "poweroff.target.d");
+    EXPECT_THROW(reboot_guard::Guard guard(dir, reload), fs::filesystem_error);
+    EXPECT_FALSE(fs::exists(dropIn));
+    EXPECT_EQ(reloads, 2);
+}
+
+/** @brief Make sure the mapper lookups are evicted and dropped */
+TEST(MapperCacheTest, TestEvictAndErase)
+{
+    mapper::Cache cache(2);
+    cache.insert("/a", "intf.A", "svc.1");
+    cache.insert("/b", "intf.B", "svc.2");
+    EXPECT_EQ(cache.find("/a", "intf.A"), "svc.1");
+
+    // /b is now the least recently used
+    cache.insert("/c", "intf.C", "svc.1");
+    EXPECT_EQ(cache.find("/b", "intf.B"), "");
+    EXPECT_EQ(cache.find("/c", "intf.C"), "svc.1");
+
+    // Nothing is watched for /b and svc.2 anymore
+    EXPECT_FALSE(cache.hasPath("/b"));
+    EXPECT_FALSE(cache.hasService("svc.2"));
+    EXPECT_TRUE(cache.hasPath("/c"));
+    EXPECT_TRUE(cache.hasService("svc.1"));
+
+    auto stats = cache.stats();
+    EXPECT_EQ(stats.hits, 2);
+    EXPECT_EQ(stats.misses, 1);
+    EXPECT_EQ(stats.entries, 2);
+
+    cache.eraseInterfaces("/a", {"intf.A", "intf.Other"});
+    EXPECT_EQ(cache.find("/a", "intf.A"), "");
+    EXPECT_EQ(cache.find("/c", "intf.C"), "svc.1");
+
+    cache.insert("/a", "intf.A", "svc.1");
+    cache.eraseService("svc.1");
+    stats = cache.stats();
+    EXPECT_EQ(stats.entries, 0);
+    EXPECT_EQ(stats.invalidations, 3);
+}
+
+/** @brief Make sure the lookups of the client are counted */
+TEST(MapperClientTest, TestStats)
+{
+    // A bus that is never connected, every lookup misses and finds nothing
+    sd_bus* raw = nullptr;
+    ASSERT_GE(sd_bus_new(&raw), 0);
+    sdbusplus::bus::bus bus(raw, std::false_type{});
+    mapper::Client client(bus, 4);
+
+    EXPECT_EQ(client.getService("/a", "intf.A"), "");
+    std::string found = "unset";
+    client.getServiceAsync("/a", "intf.A",
+                           [&found](const std::string& service) {
+                               found = service;
+                           });
+    EXPECT_EQ(found, "");
+
+    auto stats = client.stats();
+    EXPECT_EQ(stats.hits, 0);
+    EXPECT_EQ(stats.misses, 2);
+    EXPECT_EQ(stats.invalidations, 0);
+    EXPECT_EQ(stats.entries, 0);
+}
+
+/** @brief Make sure a child is reaped with its output, and killed once it
+ *         runs out of time */
+TEST(ProcessTest, TestRun)
+{
+    auto args = utils::internal::constructArgv(
+        "sh", "-c", "echo out; echo err >&2; exit 3");
+    auto result = process::run("/bin/sh", args.data());
+    EXPECT_EQ(result.exitCode, 3);
+    EXPECT_FALSE(result.succeeded());
+    EXPECT_EQ(result.output, "out\n");
+    EXPECT_EQ(result.errors, "err\n");
+
+    // Output past the limit is discarded, the child is not blocked
+    args = utils::internal::constructArgv("sh", "-c",
+                                          "head -c 100000 /dev/zero");
+    result = process::run("/bin/sh", args.data(),
+                          {std::chrono::milliseconds(0), 100});
+    EXPECT_TRUE(result.succeeded());
+    EXPECT_EQ(result.output.size(), 100);
+
+    args = utils::internal::constructArgv("sleep", "5");
+    result = process::run("/bin/sleep", args.data(),
+                          {std::chrono::milliseconds(100)});
+    EXPECT_TRUE(result.timedOut);
+    EXPECT_EQ(result.signal, SIGKILL);
+
+    EXPECT_THROW(process::run("/nonexistent", args.data()), std::system_error);
+}
+
+class CatalogueTest : public testing::Test
+{
+  protected:
+    virtual void SetUp()
+    {
+        char catalogueDir[] = "./catalogueXXXXXX";
+        _directory = mkdtemp(catalogueDir);
+
+        if (_directory.empty())
+        {
+            throw std::bad_alloc();
+        }
+    }
+
+    virtual void TearDown()
+    {
+        fs::remove_all(_directory);
+    }
+
+    std::string _directory;
+};
+
+/** @brief Make sure a stored catalogue is restored as it was written */
+TEST_F(CatalogueTest, TestStoreRestore)
+{
+    using namespace phosphor::software::updater;
+
+    Catalogue catalogue(2);
+    catalogue[0].versionId = "a1b2c3d4";
+    catalogue[0].version = "2.12.0-dev";
+    catalogue[0].extendedVersion = "extended";
+    catalogue[0].priority = 1;
+    catalogue[0].mountDir = "/media/rofs-a1b2c3d4";
+    catalogue[0].releaseModified = 1234567890123;
+    catalogue[0].releaseSize = 321;
+    catalogue[1].versionId = "e5f6a7b8";
+    catalogue[1].version = "2.11.0";
+    catalogue[1].mountDir = "/media/rofs-e5f6a7b8";
+
+    storeCatalogue(catalogue, _directory);
+    EXPECT_FALSE(fs::exists(fs::path(_directory) / "catalogue.tmp"));
+
+    Catalogue restored;
+    ASSERT_TRUE(restoreCatalogue(restored, _directory));
+    ASSERT_EQ(restored.size(), 2);
+    EXPECT_EQ(restored[0].versionId, "a1b2c3d4");
+    EXPECT_EQ(restored[0].version, "2.12.0-dev");
+    EXPECT_EQ(restored[0].extendedVersion, "extended");
+    EXPECT_EQ(restored[0].priority, 1);
+    EXPECT_EQ(restored[0].mountDir, "/media/rofs-a1b2c3d4");
+    EXPECT_EQ(restored[0].releaseModified, 1234567890123);
+    EXPECT_EQ(restored[0].releaseSize, 321);
+    EXPECT_EQ(restored[1].versionId, "e5f6a7b8");
+    EXPECT_EQ(restored[1].priority, 0);
+
+    removeCatalogue(_directory);
+    EXPECT_FALSE(restoreCatalogue(restored, _directory));
+}
+
+/** @brief Make sure a corrupt or outdated catalogue is discarded */
+TEST_F(CatalogueTest, TestInvalidate)
+{
+    using namespace phosphor::software::updater;
+
+    auto path = fs::path(_directory) / "catalogue";
+    Catalogue restored;
+
+    std::ofstream(path) << "{\"format\": 1, \"catalogue\": [";
+    EXPECT_FALSE(restoreCatalogue(restored, _directory));
+    EXPECT_FALSE(fs::exists(path));
+
+    std::ofstream(path) << "{\"format\": 0, \"catalogue\": []}";
+    EXPECT_FALSE(restoreCatalogue(restored, _directory));
+    EXPECT_FALSE(fs::exists(path));
+}
@@ -2,6 +2,13 @@
 
 #include "activation.hpp"
 
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+
+#include <filesystem>
+
+extern boost::asio::io_context& getIOContext();
+
 namespace phosphor
 {
 namespace software
@@ -13,18 +20,52 @@ namespace softwareServer = sdbusplus::xyz::openbmc_project::Software::server;
 
 void Activation::flashWrite()
 {
+    if (rwVolumeCreated && roVolumeCreated)
+    {
+        // Resumed after the volumes were written, continue once the caller
+        // has set the activation to Activating.
+        boost::asio::post(getIOContext(), [this]() { onVolumesCreated(); });
+        return;
+    }
+
+    if (!rwVolumeCreated)
+    {
+        auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
+                                          SYSTEMD_INTERFACE, "StartUnit");
+        method.append("obmc-flash-bmc-ubirw.service", "replace");
+        bus.call_noreply(method);
+    }
+
+    if (!roVolumeCreated)
+    {
+        auto roServiceFile = "obmc-flash-bmc-ubiro@" + versionId + ".service";
+        auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
+                                          SYSTEMD_INTERFACE, "StartUnit");
+        method.append(roServiceFile, "replace");
+        bus.call_noreply(method);
+    }
+
+    return;
+}
+
+void Activation::flashCancel()
+{
+    // The read-only volume service stops once its current command completes,
+    // then the remove service deletes the volumes it created. The remove
+    // service is ordered after the read-only volume service, so it starts
+    // once that has stopped.
+    auto roServiceFile = "obmc-flash-bmc-ubiro@" + versionId + ".service";
     auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    method.append("obmc-flash-bmc-ubirw.service", "replace");
+                                      SYSTEMD_INTERFACE, "StopUnit");
+    method.append(roServiceFile, "replace");
     bus.call_noreply(method);
 
-    auto roServiceFile = "obmc-flash-bmc-ubiro@" + versionId + ".service";
+    auto removeServiceFile =
+        "obmc-flash-bmc-ubiro-remove@" + versionId + ".service";
     method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
                                  SYSTEMD_INTERFACE, "StartUnit");
-    method.append(roServiceFile, "replace");
+    method.append(removeServiceFile, "replace");
     bus.call_noreply(method);
-
-    return;
 }
 
 void Activation::onStateChanges(sdbusplus::message::message& msg)
@@ -39,6 +80,7 @@ void Activation::onStateChanges(sdbusplus::message::message& msg)
 
     auto rwServiceFile = "obmc-flash-bmc-ubirw.service";
     auto roServiceFile = "obmc-flash-bmc-ubiro@" + versionId + ".service";
+    auto ubootServiceFile = "obmc-flash-bmc-ubiuboot@" + versionId + ".service";
     auto ubootVarsServiceFile =
         "obmc-flash-bmc-updateubootvars@" + versionId + ".service";
 
@@ -54,12 +96,18 @@ void Activation::onStateChanges(sdbusplus::message::message& msg)
         activationProgress->progress(activationProgress->progress() + 50);
     }
 
+    if (newStateUnit == ubootServiceFile && newStateResult == "done")
+    {
+        ubootWritten = true;
+    }
+
     if (newStateUnit == ubootVarsServiceFile && newStateResult == "done")
     {
         ubootEnvVarsUpdated = true;
     }
 
     if (newStateUnit == rwServiceFile || newStateUnit == roServiceFile ||
+        newStateUnit == ubootServiceFile ||
         newStateUnit == ubootVarsServiceFile)
     {
         if (newStateResult == "failed" || newStateResult == "dependency")
@@ -69,29 +117,68 @@ void Activation::onStateChanges(sdbusplus::message::message& msg)
         }
         else if (rwVolumeCreated && roVolumeCreated) // Volumes were created
         {
-            if (!ubootEnvVarsUpdated)
-            {
-                activationProgress->progress(90);
-
-                // Set the priority which triggers the service that updates the
-                // environment variables.
-                if (!Activation::redundancyPriority)
-                {
-                    Activation::redundancyPriority =
-                        std::make_unique<RedundancyPriority>(bus, path, *this,
-                                                             0);
-                }
-            }
-            else // Environment variables were updated
-            {
-                Activation::onFlashWriteSuccess();
-            }
+            onVolumesCreated();
         }
     }
 
     return;
 }
 
+void Activation::onVolumesCreated()
+{
+    if (softwareServer::Activation::activation() !=
+        softwareServer::Activation::Activations::Activating)
+    {
+        return;
+    }
+
+    if (!rwVolumeCreated || !roVolumeCreated)
+    {
+        return;
+    }
+
+#ifdef PIPELINED_ACTIVATION
+    if (verifyPending)
+    {
+        // Committed once the verification has passed
+        return;
+    }
+#endif
+
+    if (!ubootWritten)
+    {
+        // U-Boot is shared by both versions, so it is only written once the
+        // volumes are. Make the next mirror compare the chips again.
+        std::error_code ec;
+        std::filesystem::remove(UBOOT_MIRROR_STAMP, ec);
+
+        auto ubootServiceFile =
+            "obmc-flash-bmc-ubiuboot@" + versionId + ".service";
+        auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
+                                          SYSTEMD_INTERFACE, "StartUnit");
+        method.append(ubootServiceFile, "replace");
+        bus.call_noreply(method);
+        return;
+    }
+
+    if (!ubootEnvVarsUpdated)
+    {
+        activationProgress->progress(90);
+
+        // Set the priority which triggers the service that updates the
+        // environment variables.
+        if (!Activation::redundancyPriority)
+        {
+            Activation::redundancyPriority =
+                std::make_unique<RedundancyPriority>(bus, path, *this, 0);
+        }
+    }
+    else // Environment variables were updated
+    {
+        Activation::onFlashWriteSuccess();
+    }
+}
+
 } // namespace updater
 } // namespace software
 } // namespace phosphor
@@ -7,6 +7,9 @@
 #include <phosphor-logging/lg2.hpp>
 #include <sdbusplus/exception.hpp>
 
+#include <exception>
+#include <string>
+
 namespace phosphor
 {
 namespace software
@@ -36,6 +39,31 @@ void Helper::clearEntry(const std::string& entryId)
     bus.call_noreply(method);
 }
 
+void Helper::clearEntries(const std::vector<std::string>& entryIds)
+{
+    if (entryIds.empty())
+    {
+        return;
+    }
+
+    // All entries are cleared in a single update of the environment, by a
+    // unit the removal units are ordered before, so that it does not race
+    // with the obmc-flash-bmc commands they run.
+    try
+    {
+        utils::writeEnvScript(CLEAR_ENV_DIR, entryIds);
+        auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
+                                          SYSTEMD_INTERFACE, "StartUnit");
+        method.append("obmc-flash-bmc-clearenv.service", "replace");
+        bus.call_noreply(method);
+    }
+    catch (const std::exception& e)
+    {
+        error("Failed to clear the priorities of {COUNT} versions: {ERROR}",
+              "COUNT", entryIds.size(), "ERROR", e);
+    }
+}
+
 void Helper::cleanup()
 {
     // Remove any volumes that do not match current versions.
@@ -62,6 +90,16 @@ void Helper::removeVersion(const std::string& versionId)
     bus.call_noreply(method);
 }
 
+void Helper::removeVersions(const std::vector<std::string>& versionIds)
+{
+    // The services are queued at once, and run as soon as systemd gets to
+    // them.
+    for (const auto& versionId : versionIds)
+    {
+        removeVersion(versionId);
+    }
+}
+
 void Helper::updateUbootVersionId(const std::string& versionId)
 {
     auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
@@ -1,44 +1,39 @@
 #include "utils.hpp"
 
+#include "mapper.hpp"
+#include "process.hpp"
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include <phosphor-logging/lg2.hpp>
 
+#include <cerrno>
+#include <system_error>
+
 namespace utils
 {
 
 PHOSPHOR_LOG2_USING;
 
-std::string getService(sdbusplus::bus::bus& bus, const std::string& path,
-                       const std::string& interface)
+namespace
 {
-    auto method = bus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
-                                      MAPPER_BUSNAME, "GetObject");
 
-    method.append(path);
-    method.append(std::vector<std::string>({interface}));
+// From linux/ioprio.h
+constexpr int ioprioWhoProcess = 1;
+constexpr int ioprioClassShift = 13;
+constexpr int ioprioClassBestEffort = 2;
+constexpr int ioprioClassIdle = 3;
+constexpr int ioprioNormLevel = 4;
 
-    std::vector<std::pair<std::string, std::vector<std::string>>> response;
+} // namespace
 
-    try
-    {
-        auto reply = bus.call(method);
-        reply.read(response);
-        if (response.empty())
-        {
-            error(
-                "Empty response from mapper for getting service name: {PATH} {INTERFACE}",
-                "PATH", path, "INTERFACE", interface);
-            return std::string{};
-        }
-    }
-    catch (const sdbusplus::exception::exception& e)
-    {
-        error("Error in mapper method call for ({PATH}, {INTERFACE}: {ERROR}",
-              "ERROR", e, "PATH", path, "INTERFACE", interface);
-        return std::string{};
-    }
-    return response[0].first;
+std::string getService(sdbusplus::bus::bus& bus, const std::string& path,
+                       const std::string& interface)
+{
+    return mapper::getClient(bus).getService(path, interface);
 }
 
 void mergeFiles(std::vector<std::string>& srcFiles, std::string& dstFile)
@@ -66,6 +61,89 @@ void mergeFiles(std::vector<std::string>& srcFiles, std::string& dstFile)
     outFile.close();
 }
 
+std::filesystem::path writeEnvScript(const std::filesystem::path& dir,
+                                     const std::vector<std::string>& names)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec)
+    {
+        throw std::system_error(ec, "failed to create " + dir.string());
+    }
+
+    std::string script;
+    for (const auto& name : names)
+    {
+        script += name + "\n";
+    }
+
+    // Written under a hidden name, so that it is only read once complete.
+    // The final name is derived from the hidden one.
+    auto hiddenPath = [&dir]() { return (dir / ".XXXXXX").string(); };
+    auto envPath = [&dir](const std::string& hidden) {
+        return dir / (hidden.substr(hidden.size() - 6) + ".env");
+    };
+
+    auto tmpPath = hiddenPath();
+    auto fd = mkstemp(tmpPath.data());
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "mkstemp");
+    }
+    auto written = ::write(fd, script.data(), script.size());
+    auto err = written < 0 ? errno : EIO;
+    close(fd);
+    if (written != static_cast<ssize_t>(script.size()))
+    {
+        unlink(tmpPath.c_str());
+        throw std::system_error(err, std::generic_category(), "write");
+    }
+
+    // The hidden name is free again once a script is published, so a script
+    // that is not applied yet may hold the final name. link() never replaces
+    // it, the script moves to another hidden name instead.
+    auto path = envPath(tmpPath);
+    while (::link(tmpPath.c_str(), path.c_str()) < 0)
+    {
+        err = errno;
+        if (err == EEXIST)
+        {
+            auto newPath = hiddenPath();
+            fd = mkstemp(newPath.data());
+            if (fd >= 0)
+            {
+                close(fd);
+                if (::rename(tmpPath.c_str(), newPath.c_str()) == 0)
+                {
+                    tmpPath = std::move(newPath);
+                    path = envPath(tmpPath);
+                    continue;
+                }
+                err = errno;
+                unlink(newPath.c_str());
+            }
+            else
+            {
+                err = errno;
+            }
+        }
+        unlink(tmpPath.c_str());
+        throw std::system_error(err, std::generic_category(), "link");
+    }
+    unlink(tmpPath.c_str());
+    return path;
+}
+
+void setThreadPriority(pid_t tid, bool low)
+{
+    // Both are per thread attributes on Linux
+    setpriority(PRIO_PROCESS, tid, low ? 19 : 0);
+    syscall(SYS_ioprio_set, ioprioWhoProcess, tid,
+            low ? ioprioClassIdle << ioprioClassShift
+                : (ioprioClassBestEffort << ioprioClassShift) |
+                      ioprioNormLevel);
+}
+
 namespace internal
 {
 
@@ -83,37 +161,24 @@ static std::string buildCommandStr(const char* name, char** args)
 
 int executeCmd(const char* path, char** args)
 {
-    pid_t pid = fork();
-    if (pid == 0)
-    {
-        execv(path, args);
-
-        // execv only retruns on err
-        auto err = errno;
-        auto command = buildCommandStr(path, args);
-        error("Failed ({ERRNO}) to execute command: {COMMAND}", "ERRNO", err,
-              "COMMAND", command);
-        return -1;
-    }
-    else if (pid > 0)
+    try
     {
-        int status;
-        if (waitpid(pid, &status, 0) < 0)
-        {
-            error("Error ({ERRNO}) during waitpid.", "ERRNO", errno);
-            return -1;
-        }
-        else if (WEXITSTATUS(status) != 0)
+        auto result = process::run(path, args);
+        if (!result.succeeded())
         {
             auto command = buildCommandStr(path, args);
-            error("Error ({STATUS}) occurred when executing command: {COMMAND}",
-                  "STATUS", status, "COMMAND", command);
+            error("Error ({STATUS}, signal {SIGNAL}) occurred when executing "
+                  "command: {COMMAND}: {ERRORS}",
+                  "STATUS", result.exitCode, "SIGNAL", result.signal,
+                  "COMMAND", command, "ERRORS", result.errors);
             return -1;
         }
     }
-    else
+    catch (const std::system_error& e)
     {
-        error("Error ({ERRNO}) during fork.", "ERRNO", errno);
+        auto command = buildCommandStr(path, args);
+        error("Failed ({ERROR}) to execute command: {COMMAND}", "ERROR", e,
+              "COMMAND", command);
         return -1;
     }
 
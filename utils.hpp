@@ -1,10 +1,14 @@
 #include "config.h"
 
+#include <sys/types.h>
+
 #include <sdbusplus/server.hpp>
 
+#include <filesystem>
 #include <fstream>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace utils
 {
@@ -12,6 +16,9 @@ namespace utils
 /**
  * @brief Get the bus service
  *
+ * @details Looked up through the mapper client shared by the process, which
+ *          caches the services.
+ *
  * @return the bus service as a string
  **/
 std::string getService(sdbusplus::bus::bus& bus, const std::string& path,
@@ -26,6 +33,30 @@ std::string getService(sdbusplus::bus::bus& bus, const std::string& path,
  **/
 void mergeFiles(std::vector<std::string>& srcFiles, std::string& dstFile);
 
+/**
+ * @brief Write a fw_setenv script that removes variables, as a variable
+ *        without a value in a script is removed.
+ *
+ * @param[in] dir   - The dir to write the script to, created if needed.
+ * @param[in] names - The variables to remove.
+ *
+ * @return The path of the script, named *.env once it is complete. A
+ *         script that is not applied yet is never replaced.
+ *
+ * @throws std::system_error if it cannot be written.
+ */
+std::filesystem::path writeEnvScript(const std::filesystem::path& dir,
+                                     const std::vector<std::string>& names);
+
+/**
+ * @brief Set the CPU and I/O priority of a thread
+ *
+ * @param[in] tid - The thread id, 0 for the calling thread.
+ * @param[in] low - Whether to run it only when nothing else needs the CPU
+ *                  or the disk, otherwise at normal priority.
+ */
+void setThreadPriority(pid_t tid, bool low);
+
 namespace internal
 {
 
@@ -47,6 +78,7 @@ constexpr auto constructArgv(const char* name, Arg&&... args)
 
 /**
  * @brief Helper function to execute command in child process
+ * @details Spawned through process::run(), its stderr is logged on failure.
  * @param[in] path - Fully qualified name of the executable to run
  * @param[in] args - Optional arguments
  * @return 0 on success
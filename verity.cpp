@@ -0,0 +1,223 @@
+#include "config.h"
+
+#include "verity.hpp"
+
+#include "key_value_file.hpp"
+#include "utils.hpp"
+
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <unistd.h>
+
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace verity
+{
+
+namespace
+{
+
+/** @brief The tool that sets up dm-verity devices */
+constexpr auto veritysetup = "/usr/sbin/veritysetup";
+
+/** @brief The on-disk superblock written by veritysetup format */
+constexpr std::string_view signature{"verity\0\0", 8};
+constexpr size_t superblockSize = 512;
+constexpr size_t versionOffset = 8;
+constexpr size_t hashTypeOffset = 12;
+constexpr size_t algorithmOffset = 32;
+constexpr size_t algorithmLength = 32;
+constexpr size_t dataBlockSizeOffset = 64;
+constexpr size_t hashBlockSizeOffset = 68;
+constexpr size_t dataBlocksOffset = 72;
+constexpr size_t saltSizeOffset = 80;
+constexpr size_t saltOffset = 88;
+constexpr size_t maxSaltSize = 256;
+
+/** @brief The largest hash block size, the kernel limit is the page size */
+constexpr uint32_t maxBlockSize = 64 * 1024;
+
+[[noreturn]] void fail(int err, const std::string& what)
+{
+    throw std::system_error(err, std::generic_category(), what);
+}
+
+template <typename T>
+T getLe(const char* p)
+{
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++)
+    {
+        value |= static_cast<T>(static_cast<uint8_t>(p[i])) << (8 * i);
+    }
+    return value;
+}
+
+/** @brief Read exactly size bytes at an offset */
+void readAt(int fd, char* buffer, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        auto ret = pread(fd, buffer, size, offset);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret < 0)
+        {
+            fail(errno, "pread");
+        }
+        if (ret == 0)
+        {
+            fail(EIO, "verity image is truncated");
+        }
+        buffer += ret;
+        size -= ret;
+        offset += ret;
+    }
+}
+
+bool isPowerOfTwo(uint32_t value)
+{
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+std::string toHex(const unsigned char* data, size_t size)
+{
+    constexpr auto digits = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < size; i++)
+    {
+        hex += digits[data[i] >> 4];
+        hex += digits[data[i] & 0xf];
+    }
+    return hex;
+}
+
+} // namespace
+
+std::optional<Params> fromManifest(const std::string& manifestPath)
+{
+    phosphor::software::manager::KeyValueFile manifest(manifestPath);
+    auto rootHash = manifest.get(rootHashKey);
+    auto hashOffset = manifest.get(hashOffsetKey);
+    if (rootHash.empty() || hashOffset.empty())
+    {
+        return std::nullopt;
+    }
+
+    Params params;
+    auto [end, ec] = std::from_chars(hashOffset.data(),
+                                     hashOffset.data() + hashOffset.size(),
+                                     params.hashOffset);
+    if (ec != std::errc() || end != hashOffset.data() + hashOffset.size())
+    {
+        return std::nullopt;
+    }
+    for (auto c : rootHash)
+    {
+        if (!std::isxdigit(static_cast<unsigned char>(c)))
+        {
+            return std::nullopt;
+        }
+        params.rootHash += std::tolower(static_cast<unsigned char>(c));
+    }
+    return params;
+}
+
+bool checkRootHash(const std::string& image, const Params& params,
+                   uint64_t base)
+{
+    int fd = ::open(image.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fail(errno, "open " + image);
+    }
+    std::unique_ptr<int, void (*)(int*)> closer(&fd,
+                                                [](int* p) { ::close(*p); });
+
+    std::array<char, superblockSize> sb{};
+    readAt(fd, sb.data(), sb.size(), base + params.hashOffset);
+    if (std::string_view(sb.data(), signature.size()) != signature ||
+        getLe<uint32_t>(&sb[versionOffset]) != 1 ||
+        getLe<uint32_t>(&sb[hashTypeOffset]) != 1)
+    {
+        return false;
+    }
+
+    std::string algorithm(&sb[algorithmOffset],
+                          strnlen(&sb[algorithmOffset], algorithmLength));
+    auto dataBlockSize = getLe<uint32_t>(&sb[dataBlockSizeOffset]);
+    auto hashBlockSize = getLe<uint32_t>(&sb[hashBlockSizeOffset]);
+    auto dataBlocks = getLe<uint64_t>(&sb[dataBlocksOffset]);
+    auto saltSize = getLe<uint16_t>(&sb[saltSizeOffset]);
+
+    // The filesystem must end before the tree, so the kernel verifies every
+    // block of it.
+    auto md = EVP_get_digestbyname(algorithm.c_str());
+    if (md == nullptr || !isPowerOfTwo(dataBlockSize) ||
+        !isPowerOfTwo(hashBlockSize) || hashBlockSize > maxBlockSize ||
+        dataBlocks == 0 || saltSize > maxSaltSize ||
+        dataBlocks > params.hashOffset / dataBlockSize)
+    {
+        return false;
+    }
+
+    // The top level of the tree is one block at the start of the hash area,
+    // unless the image is a single block, which is hashed directly.
+    std::vector<char> block;
+    uint64_t offset = 0;
+    if (dataBlocks == 1)
+    {
+        block.resize(dataBlockSize);
+    }
+    else
+    {
+        block.resize(hashBlockSize);
+        offset = (params.hashOffset + superblockSize + hashBlockSize - 1) /
+                 hashBlockSize * hashBlockSize;
+    }
+    readAt(fd, block.data(), block.size(), base + offset);
+
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)> ctx(
+        EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
+    std::array<unsigned char, EVP_MAX_MD_SIZE> digest{};
+    unsigned int length = 0;
+    if (!ctx || EVP_DigestInit_ex(ctx.get(), md, nullptr) <= 0 ||
+        EVP_DigestUpdate(ctx.get(), &sb[saltOffset], saltSize) <= 0 ||
+        EVP_DigestUpdate(ctx.get(), block.data(), block.size()) <= 0 ||
+        EVP_DigestFinal_ex(ctx.get(), digest.data(), &length) <= 0)
+    {
+        fail(EINVAL, "verity digest " + algorithm);
+    }
+
+    return toHex(digest.data(), length) == params.rootHash;
+}
+
+std::string open(const std::string& device, const std::string& name,
+                 const Params& params)
+{
+    auto hashOffset = "--hash-offset=" + std::to_string(params.hashOffset);
+    if (utils::execute(veritysetup, "open", device.c_str(), name.c_str(),
+                       device.c_str(), params.rootHash.c_str(),
+                       hashOffset.c_str()) != 0)
+    {
+        return {};
+    }
+    return "/dev/mapper/" + name;
+}
+
+bool close(const std::string& name)
+{
+    return utils::execute(veritysetup, "close", name.c_str()) == 0;
+}
+
+} // namespace verity
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+namespace verity
+{
+
+/** @brief The MANIFEST key of the dm-verity root hash of image-rofs */
+constexpr auto rootHashKey = "RofsVerityRootHash";
+
+/** @brief The MANIFEST key of the offset of the dm-verity hash tree in
+ *         image-rofs, after the filesystem */
+constexpr auto hashOffsetKey = "RofsVerityHashOffset";
+
+/** @brief The dm-verity parameters of a read-only filesystem image */
+struct Params
+{
+    /** @brief The root hash, in hexadecimal */
+    std::string rootHash;
+    /** @brief The offset of the verity superblock and hash tree in the
+     *         image, in bytes */
+    uint64_t hashOffset = 0;
+};
+
+/** @brief Read the dm-verity parameters of image-rofs from a MANIFEST.
+ *
+ * @param[in] manifestPath - The path of the MANIFEST.
+ *
+ * @return The parameters, or nullopt if the MANIFEST has none or they are
+ *         malformed.
+ */
+std::optional<Params> fromManifest(const std::string& manifestPath);
+
+/** @brief Check that the hash tree of an image matches its root hash.
+ *
+ * @details Only the verity superblock and the top level of the hash tree
+ *          are read, the data blocks are verified by the kernel as they
+ *          are read once the image is opened with open(). This binds the
+ *          whole image to the root hash in a few KiB of reads.
+ *
+ * @param[in] image  - The path of the image, a file or a block device.
+ * @param[in] params - The verity parameters of the image.
+ * @param[in] base   - The offset of the image in the file or device.
+ *
+ * @return true if the tree matches the root hash.
+ *
+ * @throws std::system_error on I/O errors.
+ */
+bool checkRootHash(const std::string& image, const Params& params,
+                   uint64_t base = 0);
+
+/** @brief Open an image as a dm-verity device, which fails reads of blocks
+ *         that do not match the hash tree.
+ *
+ * @param[in] device - The block device of the image, e.g. a loop device.
+ * @param[in] name   - The name of the device mapper device.
+ * @param[in] params - The verity parameters of the image.
+ *
+ * @return The path of the verity device, or an empty string on failure.
+ */
+std::string open(const std::string& device, const std::string& name,
+                 const Params& params);
+
+/** @brief Close a dm-verity device opened with open().
+ *
+ * @param[in] name - The name of the device mapper device.
+ *
+ * @return true on success.
+ */
+bool close(const std::string& name);
+
+} // namespace verity
@@ -4,15 +4,13 @@
 
 #include "xyz/openbmc_project/Common/error.hpp"
 
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 
 #include <phosphor-logging/elog-errors.hpp>
 #include <phosphor-logging/lg2.hpp>
 
-#include <fstream>
-#include <iostream>
-#include <sstream>
-#include <stdexcept>
+#include <algorithm>
+#include <cctype>
 #include <string>
 
 namespace phosphor
@@ -27,12 +25,77 @@ using namespace phosphor::logging;
 using Argument = xyz::openbmc_project::Common::InvalidArgument;
 using namespace sdbusplus::xyz::openbmc_project::Common::Error;
 
+ParsedVersion::ParsedVersion(std::string_view version)
+{
+    size_t pos = 0;
+    while (pos < version.size())
+    {
+        auto c = static_cast<unsigned char>(version[pos]);
+        if (!std::isalnum(c))
+        {
+            ++pos;
+            continue;
+        }
+
+        bool numeric = std::isdigit(c);
+        auto start = pos;
+        while (pos < version.size())
+        {
+            auto next = static_cast<unsigned char>(version[pos]);
+            if (numeric ? !std::isdigit(next) : !std::isalpha(next))
+            {
+                break;
+            }
+            ++pos;
+        }
+
+        auto value = version.substr(start, pos - start);
+        if (numeric)
+        {
+            // Leading zeros do not change the value, drop them so that
+            // numbers can be compared by length first and digits second
+            // without overflowing for arbitrarily long runs.
+            auto nonZero = value.find_first_not_of('0');
+            value = (nonZero == std::string_view::npos) ? value.substr(0, 0)
+                                                        : value.substr(nonZero);
+        }
+        components.push_back({numeric, std::string(value)});
+    }
+}
+
+std::strong_ordering
+    ParsedVersion::operator<=>(const ParsedVersion& rhs) const
+{
+    auto count = std::min(components.size(), rhs.components.size());
+    for (size_t i = 0; i < count; i++)
+    {
+        const auto& a = components[i];
+        const auto& b = rhs.components[i];
+
+        if (a.numeric != b.numeric)
+        {
+            return a.numeric ? std::strong_ordering::greater
+                             : std::strong_ordering::less;
+        }
+
+        if (a.numeric && (a.value.size() != b.value.size()))
+        {
+            return a.value.size() <=> b.value.size();
+        }
+
+        auto rc = a.value.compare(b.value);
+        if (rc != 0)
+        {
+            return rc <=> 0;
+        }
+    }
+
+    return components.size() <=> rhs.components.size();
+}
+
 std::string Version::getValue(const std::string& manifestFilePath,
                               std::string key)
 {
-    key = key + "=";
-    auto keySize = key.length();
-
     if (manifestFilePath.empty())
     {
         error("ManifestFilePath is empty.");
@@ -42,41 +105,42 @@ std::string Version::getValue(const std::string& manifestFilePath,
     }
 
     std::string value{};
-    std::ifstream efile;
-    std::string line;
-    efile.exceptions(std::ifstream::failbit | std::ifstream::badbit |
-                     std::ifstream::eofbit);
+    std::string_view keys[] = {key};
+    readValues(manifestFilePath, keys, std::span(&value, 1));
+    return value;
+}
 
-    // Too many GCC bugs (53984, 66145) to do this the right way...
-    try
+void Version::readValues(const std::string& filePath,
+                         std::span<const std::string_view> keys,
+                         std::span<std::string> values)
+{
+    KeyValueFile file(filePath);
+    if (!file.good())
     {
-        efile.open(manifestFilePath);
-        while (getline(efile, line))
-        {
-            if (!line.empty() && line.back() == '\r')
-            {
-                // If the manifest has CRLF line terminators, e.g. is created on
-                // Windows, the line will contain \r at the end, remove it.
-                line.pop_back();
-            }
-            if (line.compare(0, keySize, key) == 0)
-            {
-                value = line.substr(keySize);
-                break;
-            }
-        }
-        efile.close();
+        error("Error occurred when reading {PATH}", "PATH", filePath);
     }
-    catch (const std::exception& e)
+
+    // One view per key without allocating, the values are copied out
+    // before the file buffer goes away.
+    constexpr size_t maxKeys = 8;
+    std::array<std::string_view, maxKeys> views{};
+    for (size_t first = 0; first < keys.size(); first += maxKeys)
     {
-        error("Error occurred when reading MANIFEST file: {ERROR}", "KEY", key,
-              "ERROR", e);
+        auto count = std::min(maxKeys, keys.size() - first);
+        file.get(keys.subspan(first, count), views);
+        for (size_t i = 0; i < count; i++)
+        {
+            values[first + i] = views[i];
+        }
     }
-
-    return value;
 }
 
 std::string Version::getId(const std::string& version)
+{
+    return getId(version, VERSION_ID_LENGTH);
+}
+
+std::string Version::getId(const std::string& version, size_t length)
 {
 
     if (version.empty())
@@ -86,40 +150,26 @@ std::string Version::getId(const std::string& version)
                               Argument::ARGUMENT_VALUE(version.c_str()));
     }
 
-    unsigned char digest[SHA512_DIGEST_LENGTH];
-    SHA512_CTX ctx;
-    SHA512_Init(&ctx);
-    SHA512_Update(&ctx, version.c_str(), strlen(version.c_str()));
-    SHA512_Final(digest, &ctx);
-    char mdString[SHA512_DIGEST_LENGTH * 2 + 1];
-    for (int i = 0; i < SHA512_DIGEST_LENGTH; i++)
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestSize = 0;
+    if (!EVP_Digest(version.data(), version.size(), digest, &digestSize,
+                    EVP_sha512(), nullptr))
     {
-        snprintf(&mdString[i * 2], 3, "%02x", (unsigned int)digest[i]);
+        error("Failed to compute the id of version {VERSION}", "VERSION",
+              version);
+        elog<InternalFailure>();
     }
 
-    // Only need 8 hex digits.
-    std::string hexId = std::string(mdString);
-    return (hexId.substr(0, 8));
+    // Only format the digits that make up the id.
+    std::string hexId(std::min<size_t>(length, digestSize * 2), '\0');
+    internal::toHex(digest, hexId.size(), hexId.data());
+    return hexId;
 }
 
 std::string Version::getBMCMachine(const std::string& releaseFilePath)
 {
-    std::string machineKey = "OPENBMC_TARGET_MACHINE=";
-    std::string machine{};
-    std::ifstream efile(releaseFilePath);
-    std::string line;
-
-    while (getline(efile, line))
-    {
-        if (line.substr(0, machineKey.size()).find(machineKey) !=
-            std::string::npos)
-        {
-            std::size_t pos = line.find_first_of('"') + 1;
-            machine = line.substr(pos, line.find_last_of('"') - pos);
-            break;
-        }
-    }
-
+    auto [machine] = getValues(releaseFilePath, {"OPENBMC_TARGET_MACHINE"});
+    machine = std::string(KeyValueFile::unquote(machine));
     if (machine.empty())
     {
         error("Unable to find OPENBMC_TARGET_MACHINE");
@@ -131,65 +181,14 @@ std::string Version::getBMCMachine(const std::string& releaseFilePath)
 
 std::string Version::getBMCExtendedVersion(const std::string& releaseFilePath)
 {
-    std::string extendedVersionKey = "EXTENDED_VERSION=";
-    std::string extendedVersionValue{};
-    std::string extendedVersion{};
-    std::ifstream efile(releaseFilePath);
-    std::string line;
-
-    while (getline(efile, line))
-    {
-        if (line.substr(0, extendedVersionKey.size())
-                .find(extendedVersionKey) != std::string::npos)
-        {
-            extendedVersionValue = line.substr(extendedVersionKey.size());
-            std::size_t pos = extendedVersionValue.find_first_of('"') + 1;
-            extendedVersion = extendedVersionValue.substr(
-                pos, extendedVersionValue.find_last_of('"') - pos);
-            break;
-        }
-    }
-
-    return extendedVersion;
+    auto [extendedVersion] = getValues(releaseFilePath, {"EXTENDED_VERSION"});
+    return std::string(KeyValueFile::unquote(extendedVersion));
 }
 
 std::string Version::getBMCVersion(const std::string& releaseFilePath)
 {
-    std::string versionKey = "VERSION_ID=";
-    std::string versionValue{};
-    std::string version{};
-    std::ifstream efile;
-    std::string line;
-    efile.open(releaseFilePath);
-
-    while (getline(efile, line))
-    {
-        if (line.substr(0, versionKey.size()).find(versionKey) !=
-            std::string::npos)
-        {
-            // Support quoted and unquoted values
-            // 1. Remove the versionKey so that we process the value only.
-            versionValue = line.substr(versionKey.size());
-
-            // 2. Look for a starting quote, then increment the position by 1 to
-            //    skip the quote character. If no quote is found,
-            //    find_first_of() returns npos (-1), which by adding +1 sets pos
-            //    to 0 (beginning of unquoted string).
-            std::size_t pos = versionValue.find_first_of('"') + 1;
-
-            // 3. Look for ending quote, then decrease the position by pos to
-            //    get the size of the string up to before the ending quote. If
-            //    no quote is found, find_last_of() returns npos (-1), and pos
-            //    is 0 for the unquoted case, so substr() is called with a len
-            //    parameter of npos (-1) which according to the documentation
-            //    indicates to use all characters until the end of the string.
-            version =
-                versionValue.substr(pos, versionValue.find_last_of('"') - pos);
-            break;
-        }
-    }
-    efile.close();
-
+    auto [version] = getValues(releaseFilePath, {"VERSION_ID"});
+    version = std::string(KeyValueFile::unquote(version));
     if (version.empty())
     {
         error("BMC current version is empty");
@@ -199,6 +198,15 @@ std::string Version::getBMCVersion(const std::string& releaseFilePath)
     return version;
 }
 
+std::pair<std::string, std::string>
+    Version::getBMCVersions(const std::string& releaseFilePath)
+{
+    auto [version, extendedVersion] =
+        getValues(releaseFilePath, {"VERSION_ID", "EXTENDED_VERSION"});
+    return {std::string(KeyValueFile::unquote(version)),
+            std::string(KeyValueFile::unquote(extendedVersion))};
+}
+
 bool Version::isFunctional()
 {
     return versionStr == getBMCVersion(OS_RELEASE_FILE);
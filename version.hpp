@@ -1,5 +1,6 @@
 #pragma once
 
+#include "key_value_file.hpp"
 #include "xyz/openbmc_project/Common/FilePath/server.hpp"
 #include "xyz/openbmc_project/Object/Delete/server.hpp"
 #include "xyz/openbmc_project/Software/ExtendedVersion/server.hpp"
@@ -7,8 +8,16 @@
 
 #include <sdbusplus/bus.hpp>
 
+#include <array>
+#include <compare>
 #include <functional>
+#include <map>
+#include <set>
+#include <span>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace phosphor
 {
@@ -29,6 +38,152 @@ using DeleteInherit = sdbusplus::server::object::object<
 class Version;
 class Delete;
 
+namespace internal
+{
+
+/**
+ * @brief Format bytes as lowercase hexadecimal digits.
+ *
+ * @param[in]  bytes  - The bytes to format.
+ * @param[in]  digits - The number of digits to produce, at most twice the
+ *                      number of bytes.
+ * @param[out] out    - The output buffer, at least digits long.
+ */
+constexpr void toHex(const unsigned char* bytes, size_t digits, char* out)
+{
+    constexpr char hexDigits[] = "0123456789abcdef";
+    for (size_t i = 0; i < digits; i++)
+    {
+        auto byte = bytes[i / 2];
+        out[i] = hexDigits[(i % 2) ? (byte & 0x0f) : (byte >> 4)];
+    }
+}
+
+} // namespace internal
+
+/** @class ParsedVersion
+ *  @brief Comparable representation of a version string.
+ *  @details The version string is split into numeric and alphabetic
+ *           components, any other character being a separator. Numeric
+ *           components compare by value and alphabetic ones lexically. When
+ *           the component types differ the numeric one is the newer, and a
+ *           version with extra trailing components is newer than its prefix,
+ *           so that 2.10.0 > 2.9.1 and 2.9.0-12-gabc > 2.9.0.
+ */
+class ParsedVersion
+{
+  public:
+    ParsedVersion() = default;
+
+    /** @brief Parse a version string
+     *
+     * @param[in] version - The version string (e.g. v1.99.10-19)
+     */
+    explicit ParsedVersion(std::string_view version);
+
+    /** @brief Order two versions, older versions compare less. */
+    std::strong_ordering operator<=>(const ParsedVersion& rhs) const;
+
+    bool operator==(const ParsedVersion& rhs) const
+    {
+        return (*this <=> rhs) == std::strong_ordering::equal;
+    }
+
+  private:
+    /** @brief A run of digits or a run of letters */
+    struct Component
+    {
+        bool numeric;
+        std::string value;
+    };
+
+    /** @brief The components in the order they appear in the string */
+    std::vector<Component> components;
+};
+
+/** @class StateIndex
+ *  @brief Version ids ordered by version, one index per state.
+ *  @details The queries and the updates are O(log N).
+ */
+template <typename State>
+class StateIndex
+{
+  public:
+    /** @brief Index a version in a state, in place of its previous state */
+    void set(const std::string& id, State state, const ParsedVersion& version)
+    {
+        erase(id);
+        auto it = index[state].emplace(version, id).first;
+        entries.emplace(id, std::make_pair(state, it));
+    }
+
+    /** @brief Drop a version from the index */
+    void erase(const std::string& id)
+    {
+        auto entry = entries.find(id);
+        if (entry == entries.end())
+        {
+            return;
+        }
+        auto versions = index.find(entry->second.first);
+        versions->second.erase(entry->second.second);
+        if (versions->second.empty())
+        {
+            index.erase(versions);
+        }
+        entries.erase(entry);
+    }
+
+    /** @brief Get the newest version in a state
+     *
+     * @return The version id, or an empty string if there is none.
+     */
+    std::string newest(State state) const
+    {
+        auto versions = index.find(state);
+        if (versions == index.end())
+        {
+            return {};
+        }
+        return versions->second.rbegin()->second;
+    }
+
+    /** @brief Get the oldest version in a state, other than one
+     *
+     * @param[in] state  - The state.
+     * @param[in] except - The id of a version to skip.
+     *
+     * @return The version id, or an empty string if there is none.
+     */
+    std::string oldest(State state, const std::string& except = {}) const
+    {
+        auto versions = index.find(state);
+        if (versions == index.end())
+        {
+            return {};
+        }
+        // The ids are unique, so at most one entry is skipped
+        for (const auto& [version, id] : versions->second)
+        {
+            if (id != except)
+            {
+                return id;
+            }
+        }
+        return {};
+    }
+
+  private:
+    using Versions = std::set<std::pair<ParsedVersion, std::string>>;
+
+    /** @brief The versions in each state */
+    std::map<State, Versions> index;
+
+    /** @brief The state and the entry of each version */
+    std::map<std::string, std::pair<State, typename Versions::iterator>>
+        entries;
+};
+
 /** @class Delete
  *  @brief OpenBMC Delete implementation.
  *  @details A concrete implementation for xyz.openbmc_project.Object.Delete
@@ -81,7 +236,8 @@ class Version : public VersionInherit
             const std::string& extVersion, const std::string& filePath,
             eraseFunc callback) :
         VersionInherit(bus, (objPath).c_str(), true),
-        eraseCallback(callback), versionStr(versionString)
+        eraseCallback(callback), versionStr(versionString),
+        parsedVersion(versionString)
     {
         // Set properties.
         extendedVersion(extVersion);
@@ -100,11 +256,32 @@ class Version : public VersionInherit
     static std::string getValue(const std::string& manifestFilePath,
                                 std::string key);
 
+    /**
+     * @brief Read a KEY=VALUE file, such as the manifest or os-release, once
+     *        to get the values of several keys.
+     *
+     * @param[in] filePath - The path of the file.
+     * @param[in] keys     - The keys to look up.
+     *
+     * @return The value of each key, in the order of the keys. A key that is
+     *         not present has an empty value.
+     **/
+    template <size_t N>
+    static std::array<std::string, N>
+        getValues(const std::string& filePath,
+                  const std::string_view (&keys)[N])
+    {
+        std::array<std::string, N> values{};
+        readValues(filePath, keys, values);
+        return values;
+    }
+
     /**
      * @brief Calculate the version id from the version string.
      *
-     * @details The version id is a unique 8 hexadecimal digit id
-     *          calculated from the version string.
+     * @details The version id is a unique hexadecimal digit id calculated
+     *          from the version string. It is 8 digits long unless the
+     *          build selects a longer id with the version-id-length option.
      *
      * @param[in] version - The image's version string (e.g. v1.99.10-19).
      *
@@ -112,6 +289,18 @@ class Version : public VersionInherit
      */
     static std::string getId(const std::string& version);
 
+    /**
+     * @brief Calculate a version id of the given length from the version
+     *        string.
+     *
+     * @param[in] version - The image's version string (e.g. v1.99.10-19).
+     * @param[in] length  - The number of hexadecimal digits in the id, at
+     *                      most twice the SHA-512 digest size.
+     *
+     * @return The id.
+     */
+    static std::string getId(const std::string& version, size_t length);
+
     /**
      * @brief Get the active BMC machine name string.
      *
@@ -143,6 +332,19 @@ class Version : public VersionInherit
      */
     static std::string getBMCVersion(const std::string& releaseFilePath);
 
+    /**
+     * @brief Get the BMC version and extended version strings with a single
+     *        read of the release file.
+     *
+     * @param[in] releaseFilePath - The path to the file which contains
+     *                              the release version strings.
+     *
+     * @return The version string, which is empty if it is not present, and
+     *         the extended version string.
+     */
+    static std::pair<std::string, std::string>
+        getBMCVersions(const std::string& releaseFilePath);
+
     /* @brief Check if this version matches the currently running version
      *
      * @return - Returns true if this version matches the currently running
@@ -150,6 +352,15 @@ class Version : public VersionInherit
      */
     bool isFunctional();
 
+    /** @brief Get the parsed form of this version's version string
+     *
+     * @return The comparable version
+     */
+    const ParsedVersion& parsed() const
+    {
+        return parsedVersion;
+    }
+
     /** @brief Persistent Delete D-Bus object */
     std::unique_ptr<Delete> deleteObject;
 
@@ -157,8 +368,22 @@ class Version : public VersionInherit
     eraseFunc eraseCallback;
 
   private:
+    /**
+     * @brief Read a KEY=VALUE file once to get the values of several keys.
+     *
+     * @param[in]  filePath - The path of the file.
+     * @param[in]  keys     - The keys to look up.
+     * @param[out] values   - The value of each key, in the order of the keys.
+     */
+    static void readValues(const std::string& filePath,
+                           std::span<const std::string_view> keys,
+                           std::span<std::string> values);
+
     /** @brief This Version's version string */
     const std::string versionStr;
+
+    /** @brief This Version's parsed version string */
+    const ParsedVersion parsedVersion;
 };
 
 } // namespace manager